@@ -0,0 +1,219 @@
+#include "adaptive.h"
+#include "global_vars.h"
+#include "utils.h"
+
+#include <math.h>
+#include <stdbool.h>
+#include <string.h>
+
+#define ADAPTIVE_MAX_METRICS 8
+#define ADAPTIVE_MAX_WINDOW 32
+
+struct TrackedMetric {
+  uint16_t metric_id;
+  // Change per second above which the interval drops to min_ms, 0 if unused
+  double rate_threshold;
+  // Standard deviation of the last window readings above which the interval
+  // drops to min_ms, 0 if unused
+  double stddev_threshold;
+  bool has_prev;
+  double prev_value;
+  int64_t prev_timestamp_ms;
+  // Ring of the last window values
+  double values[ADAPTIVE_MAX_WINDOW];
+  size_t value_count;
+  size_t value_pos;
+};
+
+struct AdaptiveScheduler {
+  bool enabled;
+  const struct ModuleInfo *info;
+  uint64_t min_ms;
+  uint64_t max_ms;
+  double relax_factor;
+  size_t window;
+  struct TrackedMetric metrics[ADAPTIVE_MAX_METRICS];
+  size_t metric_count;
+  uint64_t interval_ms;
+  // For the summary logged by adaptive_destroy()
+  uint64_t ticks;
+  uint64_t ticks_at_min;
+  uint64_t interval_sum_ms;
+};
+
+static struct AdaptiveScheduler sched = {.enabled = false};
+
+static int find_metric(const struct ModuleInfo *info, const char *name) {
+  for (size_t i = 0; i < info->metric_count; ++i)
+    if (strcmp(info->metrics[i].name, name) == 0)
+      return i;
+  return -1;
+}
+
+int adaptive_init(const json_object *config_root,
+                  const struct ModuleInfo *info) {
+  json_object *root_adaptive, *root_metrics, *json_ele;
+  sched.enabled = false;
+  sched.interval_ms = gv_collection_event_interval_ms;
+  if (!json_object_object_get_ex(config_root, "adaptive_interval",
+                                 &root_adaptive))
+    return 0;
+
+  sched.info = info;
+  sched.min_ms = gv_collection_event_interval_ms;
+  sched.max_ms = gv_collection_event_interval_ms;
+  sched.relax_factor = 1.5;
+  sched.window = 8;
+  sched.metric_count = 0;
+  sched.ticks = sched.ticks_at_min = sched.interval_sum_ms = 0;
+  if (json_object_object_get_ex(root_adaptive, "min_ms", &json_ele))
+    sched.min_ms = json_object_get_uint64(json_ele);
+  if (json_object_object_get_ex(root_adaptive, "max_ms", &json_ele))
+    sched.max_ms = json_object_get_uint64(json_ele);
+  if (json_object_object_get_ex(root_adaptive, "relax_factor", &json_ele))
+    sched.relax_factor = json_object_get_double(json_ele);
+  if (json_object_object_get_ex(root_adaptive, "window", &json_ele))
+    sched.window = json_object_get_uint64(json_ele);
+  if (sched.min_ms == 0 || sched.max_ms < sched.min_ms) {
+    SYSLOG_ERR("adaptive_interval: 0 < min_ms <= max_ms must hold");
+    return -1;
+  }
+  if (sched.relax_factor <= 1.0) {
+    SYSLOG_ERR("adaptive_interval: relax_factor must be greater than 1");
+    return -1;
+  }
+  if (sched.window < 2 || sched.window > ADAPTIVE_MAX_WINDOW) {
+    SYSLOG_ERR("adaptive_interval: window must be between 2 and %d",
+               ADAPTIVE_MAX_WINDOW);
+    return -1;
+  }
+
+  if (!json_object_object_get_ex(root_adaptive, "metrics", &root_metrics) ||
+      !json_object_is_type(root_metrics, json_type_object)) {
+    SYSLOG_ERR("adaptive_interval: metrics must be an object");
+    return -2;
+  }
+  json_object_object_foreach(root_metrics, name, root_metric) {
+    if (sched.metric_count >= ADAPTIVE_MAX_METRICS) {
+      SYSLOG_ERR("adaptive_interval: at most %d metrics can be tracked",
+                 ADAPTIVE_MAX_METRICS);
+      return -2;
+    }
+    int metric_id = find_metric(info, name);
+    if (metric_id < 0) {
+      SYSLOG_ERR("adaptive_interval: module %s has no metric [%s]", info->name,
+                 name);
+      return -2;
+    }
+    struct TrackedMetric *m = &sched.metrics[sched.metric_count];
+    memset(m, 0, sizeof(struct TrackedMetric));
+    m->metric_id = metric_id;
+    if (json_object_object_get_ex(root_metric, "rate_threshold", &json_ele))
+      m->rate_threshold = json_object_get_double(json_ele);
+    if (json_object_object_get_ex(root_metric, "stddev_threshold", &json_ele))
+      m->stddev_threshold = json_object_get_double(json_ele);
+    if (m->rate_threshold <= 0 && m->stddev_threshold <= 0) {
+      SYSLOG_ERR("adaptive_interval: [%s] needs a positive rate_threshold "
+                 "and/or stddev_threshold",
+                 name);
+      return -2;
+    }
+    ++sched.metric_count;
+  }
+  if (sched.metric_count == 0) {
+    SYSLOG_ERR("adaptive_interval: no metric to track");
+    return -2;
+  }
+
+  // Start fast: nothing is known about the signal yet
+  sched.interval_ms = sched.min_ms;
+  sched.enabled = true;
+  syslog(LOG_INFO,
+         "Adaptive collection interval between %lu and %lu ms, tracking %zu "
+         "metric(s)",
+         (unsigned long)sched.min_ms, (unsigned long)sched.max_ms,
+         sched.metric_count);
+  return 0;
+}
+
+static double window_stddev(const struct TrackedMetric *m) {
+  double mean = 0, sq = 0;
+  for (size_t i = 0; i < m->value_count; ++i)
+    mean += m->values[i];
+  mean /= m->value_count;
+  for (size_t i = 0; i < m->value_count; ++i)
+    sq += (m->values[i] - mean) * (m->values[i] - mean);
+  return sqrt(sq / m->value_count);
+}
+
+/**
+ * @return true if the reading of m in r is a transient
+ */
+static bool track(struct TrackedMetric *m, const struct ReadingRecord *r) {
+  int idx = readings_find(r, m->metric_id);
+  // Stale readings are repeats and bad ones carry no value
+  if (idx < 0 || r->qualities[idx] != READING_GOOD)
+    return false;
+  const double v = r->values[idx];
+  const int64_t t = r->timestamps_ms[idx];
+  bool transient = false;
+  if (m->has_prev && m->rate_threshold > 0 && t > m->prev_timestamp_ms &&
+      fabs(v - m->prev_value) * 1000.0 / (t - m->prev_timestamp_ms) >
+          m->rate_threshold)
+    transient = true;
+  m->prev_value = v;
+  m->prev_timestamp_ms = t;
+  m->has_prev = true;
+
+  m->values[m->value_pos] = v;
+  m->value_pos = (m->value_pos + 1) % sched.window;
+  if (m->value_count < sched.window)
+    ++m->value_count;
+  if (m->stddev_threshold > 0 && m->value_count == sched.window &&
+      window_stddev(m) > m->stddev_threshold)
+    transient = true;
+  return transient;
+}
+
+uint64_t adaptive_next_interval_ms(const struct ReadingRecord *r) {
+  if (!sched.enabled)
+    return sched.interval_ms;
+  bool transient = false;
+  // Every metric is tracked even once a transient is found, so that their
+  // windows stay complete
+  for (size_t i = 0; i < sched.metric_count; ++i)
+    transient |= track(&sched.metrics[i], r);
+  if (transient) {
+    if (sched.interval_ms > sched.min_ms)
+      syslog(LOG_INFO, "Transient detected, collection interval %lu -> %lu ms",
+             (unsigned long)sched.interval_ms, (unsigned long)sched.min_ms);
+    sched.interval_ms = sched.min_ms;
+  } else {
+    // Rounded up and by at least 1 ms, or a short interval times a small
+    // factor would truncate back to itself and never relax
+    double relaxed = ceil(sched.interval_ms * sched.relax_factor);
+    if (relaxed < sched.interval_ms + 1)
+      relaxed = sched.interval_ms + 1;
+    sched.interval_ms =
+        relaxed >= sched.max_ms ? sched.max_ms : (uint64_t)relaxed;
+  }
+  ++sched.ticks;
+  sched.interval_sum_ms += sched.interval_ms;
+  if (sched.interval_ms == sched.min_ms)
+    ++sched.ticks_at_min;
+  return sched.interval_ms;
+}
+
+uint64_t adaptive_interval_ms() { return sched.interval_ms; }
+
+void adaptive_destroy() {
+  if (!sched.enabled || sched.ticks == 0)
+    return;
+  syslog(LOG_INFO,
+         "Adaptive collection interval: %lu tick(s), mean interval %lu ms, "
+         "%lu tick(s) at min_ms",
+         (unsigned long)sched.ticks,
+         (unsigned long)(sched.interval_sum_ms / sched.ticks),
+         (unsigned long)sched.ticks_at_min);
+  sched.enabled = false;
+}
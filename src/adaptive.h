@@ -0,0 +1,34 @@
+#ifndef ADAPTIVE_H
+#define ADAPTIVE_H
+
+#include "modules/readings.h"
+
+#include <json-c/json.h>
+
+/**
+ * @brief Initialize the adaptive collection interval from the optional
+ * "adaptive_interval" object of the config root. Without it, the interval
+ * stays at gv_collection_event_interval_ms.
+ * @return 0 on success, negative number on invalid config
+ */
+int adaptive_init(const json_object *config_root,
+                  const struct ModuleInfo *info);
+
+/**
+ * @brief Feed the record of the last successful collection() and get the
+ * interval until the next one. The interval drops to min_ms as soon as a
+ * tracked metric changes faster than its rate_threshold or its recent
+ * readings spread more than its stddev_threshold, and grows by relax_factor
+ * per quiet tick back up to max_ms.
+ * @return The interval in milliseconds
+ */
+uint64_t adaptive_next_interval_ms(const struct ReadingRecord *r);
+
+/**
+ * @return The current interval, without feeding a record
+ */
+uint64_t adaptive_interval_ms();
+
+void adaptive_destroy();
+
+#endif // ADAPTIVE_H
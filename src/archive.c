@@ -0,0 +1,296 @@
+#include "archive.h"
+#include "utils.h"
+
+#include <zlib.h>
+
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define ARCHIVE_CHUNK_HEADER_LEN 16
+#define ARCHIVE_COLUMN_HEADER_LEN 8
+// Larger row counts in a chunk header are taken as corruption
+#define ARCHIVE_MAX_ROWS (1 << 24)
+
+static int write_all(int fd, const uint8_t *buf, size_t len) {
+  while (len > 0) {
+    const ssize_t n = write(fd, buf, len);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
+
+int archive_header_from_info(struct ArchiveHeader *hdr,
+                             const struct ModuleInfo *info) {
+  if (info->metric_count > SDP_READINGS_MAX)
+    return -1;
+  memset(hdr, 0, sizeof(struct ArchiveHeader));
+  strncpy(hdr->module, info->name, ARCHIVE_MODULE_MAX - 1);
+  hdr->metric_count = info->metric_count;
+  for (size_t i = 0; i < info->metric_count; ++i) {
+    strncpy(hdr->metrics[i].name, info->metrics[i].name,
+            ARCHIVE_NAME_MAX - 1);
+    strncpy(hdr->metrics[i].unit, info->metrics[i].unit,
+            ARCHIVE_UNIT_MAX - 1);
+    hdr->metrics[i].decimals = info->metrics[i].decimals;
+  }
+  return 0;
+}
+
+int archive_chunk_init(struct ArchiveChunk *chunk, size_t metric_count,
+                       size_t capacity) {
+  chunk->metric_count = metric_count;
+  chunk->rows = 0;
+  chunk->capacity = capacity;
+  chunk->timestamps_ms = malloc(sizeof(int64_t) * capacity);
+  chunk->values = malloc(sizeof(double) * metric_count * capacity);
+  chunk->qualities = malloc(metric_count * capacity);
+  if (chunk->timestamps_ms == NULL || chunk->values == NULL ||
+      chunk->qualities == NULL) {
+    archive_chunk_destroy(chunk);
+    return -1;
+  }
+  return 0;
+}
+
+void archive_chunk_destroy(struct ArchiveChunk *chunk) {
+  free(chunk->timestamps_ms);
+  free(chunk->values);
+  free(chunk->qualities);
+  chunk->timestamps_ms = NULL;
+  chunk->values = NULL;
+  chunk->qualities = NULL;
+  chunk->rows = chunk->capacity = 0;
+}
+
+void archive_chunk_append(struct ArchiveChunk *chunk,
+                          const struct ReadingRecord *r) {
+  const size_t row = chunk->rows++;
+  int64_t newest_ms = 0;
+  for (size_t m = 0; m < chunk->metric_count; ++m) {
+    chunk->values[m * chunk->capacity + row] = NAN;
+    chunk->qualities[m * chunk->capacity + row] = ARCHIVE_MISSING;
+  }
+  for (size_t i = 0; i < r->count; ++i) {
+    if (r->metric_ids[i] >= chunk->metric_count)
+      continue;
+    const size_t idx = r->metric_ids[i] * chunk->capacity + row;
+    chunk->values[idx] = r->values[i];
+    chunk->qualities[idx] = r->qualities[i];
+    if (r->timestamps_ms[i] > newest_ms)
+      newest_ms = r->timestamps_ms[i];
+  }
+  chunk->timestamps_ms[row] = newest_ms;
+}
+
+void archive_chunk_copy_row(struct ArchiveChunk *dst,
+                            const struct ArchiveChunk *src, size_t row) {
+  const size_t dst_row = dst->rows++;
+  dst->timestamps_ms[dst_row] = src->timestamps_ms[row];
+  for (size_t m = 0; m < dst->metric_count; ++m) {
+    dst->values[m * dst->capacity + dst_row] =
+        src->values[m * src->capacity + row];
+    dst->qualities[m * dst->capacity + dst_row] =
+        src->qualities[m * src->capacity + row];
+  }
+}
+
+int archive_write_header(int fd, const struct ArchiveHeader *hdr) {
+  const size_t metric_len = ARCHIVE_NAME_MAX + ARCHIVE_UNIT_MAX + 4;
+  uint8_t buf[8 + ARCHIVE_MODULE_MAX + SDP_READINGS_MAX * metric_len];
+  memset(buf, 0, sizeof(buf));
+  put_le32(buf, ARCHIVE_FILE_MAGIC);
+  put_le16(buf + 4, ARCHIVE_VERSION);
+  put_le16(buf + 6, hdr->metric_count);
+  memcpy(buf + 8, hdr->module, ARCHIVE_MODULE_MAX);
+  uint8_t *p = buf + 8 + ARCHIVE_MODULE_MAX;
+  for (size_t i = 0; i < hdr->metric_count; ++i, p += metric_len) {
+    memcpy(p, hdr->metrics[i].name, ARCHIVE_NAME_MAX);
+    memcpy(p + ARCHIVE_NAME_MAX, hdr->metrics[i].unit, ARCHIVE_UNIT_MAX);
+    put_le32(p + ARCHIVE_NAME_MAX + ARCHIVE_UNIT_MAX,
+          (uint32_t)hdr->metrics[i].decimals);
+  }
+  return write_all(fd, buf, p - buf);
+}
+
+int archive_read_header(FILE *f, struct ArchiveHeader *hdr) {
+  uint8_t buf[8 + ARCHIVE_MODULE_MAX];
+  if (fread(buf, sizeof(buf), 1, f) != 1 ||
+      get_le32(buf) != ARCHIVE_FILE_MAGIC ||
+      get_le16(buf + 4) != ARCHIVE_VERSION ||
+      get_le16(buf + 6) == 0 || get_le16(buf + 6) > SDP_READINGS_MAX)
+    return -1;
+  memset(hdr, 0, sizeof(struct ArchiveHeader));
+  hdr->metric_count = get_le16(buf + 6);
+  memcpy(hdr->module, buf + 8, ARCHIVE_MODULE_MAX);
+  hdr->module[ARCHIVE_MODULE_MAX - 1] = '\0';
+  for (size_t i = 0; i < hdr->metric_count; ++i) {
+    uint8_t metric[ARCHIVE_NAME_MAX + ARCHIVE_UNIT_MAX + 4];
+    if (fread(metric, sizeof(metric), 1, f) != 1)
+      return -1;
+    memcpy(hdr->metrics[i].name, metric, ARCHIVE_NAME_MAX);
+    hdr->metrics[i].name[ARCHIVE_NAME_MAX - 1] = '\0';
+    memcpy(hdr->metrics[i].unit, metric + ARCHIVE_NAME_MAX, ARCHIVE_UNIT_MAX);
+    hdr->metrics[i].unit[ARCHIVE_UNIT_MAX - 1] = '\0';
+    hdr->metrics[i].decimals =
+        (int32_t)get_le32(metric + ARCHIVE_NAME_MAX + ARCHIVE_UNIT_MAX);
+  }
+  return 0;
+}
+
+/**
+ * @brief Serialize column col of chunk (see archive.h) into raw.
+ * @return Length of the column
+ */
+static size_t archive_column_raw(const struct ArchiveChunk *chunk, size_t col,
+                                 uint8_t *raw) {
+  if (col == 0) {
+    int64_t prev = 0;
+    for (size_t row = 0; row < chunk->rows; ++row) {
+      put_le64(raw + row * 8, (uint64_t)(chunk->timestamps_ms[row] - prev));
+      prev = chunk->timestamps_ms[row];
+    }
+    return chunk->rows * 8;
+  }
+  const size_t m = (col - 1) / 2;
+  if (col % 2 == 0) {
+    memcpy(raw, chunk->qualities + m * chunk->capacity, chunk->rows);
+    return chunk->rows;
+  }
+  for (size_t row = 0; row < chunk->rows; ++row) {
+    uint64_t bits;
+    memcpy(&bits, &chunk->values[m * chunk->capacity + row], sizeof(bits));
+    put_le64(raw + row * 8, bits);
+  }
+  return chunk->rows * 8;
+}
+
+int archive_write_chunk(int fd, struct ArchiveChunk *chunk) {
+  if (chunk->rows == 0)
+    return 0;
+  const size_t column_count = 1 + 2 * chunk->metric_count;
+  const size_t raw_max = chunk->rows * 8;
+  const size_t stored_max = compressBound(raw_max);
+  const size_t head_len =
+      ARCHIVE_CHUNK_HEADER_LEN + column_count * ARCHIVE_COLUMN_HEADER_LEN;
+  int ret = -1;
+  uint8_t *raw = malloc(raw_max);
+  uint8_t *buf = malloc(head_len + column_count * stored_max);
+  if (raw == NULL || buf == NULL)
+    goto finally;
+
+  size_t len = head_len;
+  for (size_t col = 0; col < column_count; ++col) {
+    const size_t raw_len = archive_column_raw(chunk, col, raw);
+    uLongf stored_len = stored_max;
+    if (compress2(buf + len, &stored_len, raw, raw_len, Z_BEST_SPEED) != Z_OK)
+      goto finally;
+    uint8_t *col_hdr =
+        buf + ARCHIVE_CHUNK_HEADER_LEN + col * ARCHIVE_COLUMN_HEADER_LEN;
+    put_le32(col_hdr, raw_len);
+    put_le32(col_hdr + 4, stored_len);
+    len += stored_len;
+  }
+  put_le32(buf, ARCHIVE_CHUNK_MAGIC);
+  put_le32(buf + 4, chunk->rows);
+  put_le32(buf + 8, crc32(0, buf + head_len, len - head_len));
+  put_le32(buf + 12, column_count);
+  // One write() per chunk, so a crash leaves at most one torn chunk at the
+  // end of the file
+  if (write_all(fd, buf, len) == 0) {
+    chunk->rows = 0;
+    ret = 0;
+  }
+finally:
+  free(raw);
+  free(buf);
+  return ret;
+}
+
+static int archive_chunk_reserve(struct ArchiveChunk *chunk, size_t rows) {
+  if (rows <= chunk->capacity)
+    return 0;
+  const size_t metric_count = chunk->metric_count;
+  archive_chunk_destroy(chunk);
+  return archive_chunk_init(chunk, metric_count, rows);
+}
+
+// Inverse of archive_column_raw()
+static void archive_column_load(struct ArchiveChunk *chunk, size_t col,
+                                const uint8_t *raw) {
+  if (col == 0) {
+    int64_t prev = 0;
+    for (size_t row = 0; row < chunk->rows; ++row)
+      prev = chunk->timestamps_ms[row] =
+          prev + (int64_t)get_le64(raw + row * 8);
+    return;
+  }
+  const size_t m = (col - 1) / 2;
+  if (col % 2 == 0) {
+    memcpy(chunk->qualities + m * chunk->capacity, raw, chunk->rows);
+    return;
+  }
+  for (size_t row = 0; row < chunk->rows; ++row) {
+    const uint64_t bits = get_le64(raw + row * 8);
+    memcpy(&chunk->values[m * chunk->capacity + row], &bits, sizeof(bits));
+  }
+}
+
+int archive_read_chunk(FILE *f, struct ArchiveChunk *chunk) {
+  uint8_t head[ARCHIVE_CHUNK_HEADER_LEN];
+  const size_t n = fread(head, 1, sizeof(head), f);
+  if (n == 0 && feof(f))
+    return 0;
+  const size_t column_count = 1 + 2 * chunk->metric_count;
+  if (n != sizeof(head) || get_le32(head) != ARCHIVE_CHUNK_MAGIC ||
+      get_le32(head + 4) == 0 || get_le32(head + 4) > ARCHIVE_MAX_ROWS ||
+      get_le32(head + 12) != column_count)
+    return -1;
+  const size_t rows = get_le32(head + 4);
+  uint8_t col_hdrs[(1 + 2 * SDP_READINGS_MAX) * ARCHIVE_COLUMN_HEADER_LEN];
+  if (fread(col_hdrs, ARCHIVE_COLUMN_HEADER_LEN, column_count, f) !=
+      column_count)
+    return -1;
+  size_t data_len = 0;
+  for (size_t col = 0; col < column_count; ++col) {
+    const uint8_t *col_hdr = col_hdrs + col * ARCHIVE_COLUMN_HEADER_LEN;
+    if (get_le32(col_hdr) != (col != 0 && col % 2 == 0 ? rows : rows * 8) ||
+        get_le32(col_hdr + 4) > compressBound(rows * 8))
+      return -1;
+    data_len += get_le32(col_hdr + 4);
+  }
+
+  int ret = -1;
+  uint8_t *data = malloc(data_len);
+  uint8_t *raw = malloc(rows * 8);
+  if (data == NULL || raw == NULL || fread(data, data_len, 1, f) != 1 ||
+      crc32(0, data, data_len) != get_le32(head + 8) ||
+      archive_chunk_reserve(chunk, rows) != 0)
+    goto finally;
+  chunk->rows = rows;
+  const uint8_t *p = data;
+  for (size_t col = 0; col < column_count; ++col) {
+    const uint8_t *col_hdr = col_hdrs + col * ARCHIVE_COLUMN_HEADER_LEN;
+    uLongf raw_len = get_le32(col_hdr);
+    if (uncompress(raw, &raw_len, p, get_le32(col_hdr + 4)) != Z_OK ||
+        raw_len != get_le32(col_hdr)) {
+      chunk->rows = 0;
+      goto finally;
+    }
+    archive_column_load(chunk, col, raw);
+    p += get_le32(col_hdr + 4);
+  }
+  ret = 1;
+finally:
+  free(data);
+  free(raw);
+  return ret;
+}
@@ -0,0 +1,118 @@
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include "modules/readings.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// "SDPA" and "SDPC" as little-endian u32s
+#define ARCHIVE_FILE_MAGIC 0x41504453
+#define ARCHIVE_CHUNK_MAGIC 0x43504453
+// Bumped whenever the file layout changes
+#define ARCHIVE_VERSION 1
+#define ARCHIVE_MODULE_MAX 32
+#define ARCHIVE_NAME_MAX 48
+#define ARCHIVE_UNIT_MAX 16
+// Quality column value of a metric the record has no reading of
+#define ARCHIVE_MISSING 0xFF
+
+/*
+ * Layout of an archive file, all integers little-endian:
+ *
+ * file header: magic u32, version u16, metric_count u16,
+ *              module char[ARCHIVE_MODULE_MAX],
+ *              metric_count * {name char[ARCHIVE_NAME_MAX],
+ *                              unit char[ARCHIVE_UNIT_MAX], decimals i32}
+ * chunk*:      magic u32, row_count u32, crc32 u32 (of the column data),
+ *              column_count u32,
+ *              column_count * {raw_len u32, stored_len u32},
+ *              column data, each column deflated on its own
+ *
+ * One row per record. Column 0 holds the timestamps, the newest of each
+ * record's readings, as deltas to the previous row (the first is absolute).
+ * Column 1 + 2 * m holds the values of metric m (f64, NaN if missing) and
+ * column 2 + 2 * m their qualities (u8, ARCHIVE_MISSING if missing). Keeping
+ * every column contiguous is what makes them compress well.
+ */
+
+struct ArchiveMetric {
+  char name[ARCHIVE_NAME_MAX];
+  char unit[ARCHIVE_UNIT_MAX];
+  int32_t decimals;
+};
+
+struct ArchiveHeader {
+  char module[ARCHIVE_MODULE_MAX];
+  size_t metric_count;
+  struct ArchiveMetric metrics[SDP_READINGS_MAX];
+};
+
+/**
+ * @brief The rows of one chunk, column by column.
+ */
+struct ArchiveChunk {
+  size_t metric_count;
+  size_t rows;
+  size_t capacity;
+  int64_t *timestamps_ms;
+  // values[m * capacity + row]
+  double *values;
+  // qualities[m * capacity + row]
+  uint8_t *qualities;
+};
+
+/**
+ * @brief Fill hdr from a module's ModuleInfo.
+ * @return 0 on success, -1 if info has more metrics than a file can hold
+ */
+int archive_header_from_info(struct ArchiveHeader *hdr,
+                             const struct ModuleInfo *info);
+
+int archive_chunk_init(struct ArchiveChunk *chunk, size_t metric_count,
+                       size_t capacity);
+
+void archive_chunk_destroy(struct ArchiveChunk *chunk);
+
+/**
+ * @brief Append r as the next row. Must not be called on a full chunk.
+ */
+void archive_chunk_append(struct ArchiveChunk *chunk,
+                          const struct ReadingRecord *r);
+
+/**
+ * @brief Append a row read from another chunk.
+ */
+void archive_chunk_copy_row(struct ArchiveChunk *dst,
+                            const struct ArchiveChunk *src, size_t row);
+
+int archive_write_header(int fd, const struct ArchiveHeader *hdr);
+
+/**
+ * @brief Compress and write the rows of chunk, then empty it.
+ * @return 0 on success, -1 on failure
+ */
+int archive_write_chunk(int fd, struct ArchiveChunk *chunk);
+
+/**
+ * @return 0 on success, -1 if f isn't an archive of ARCHIVE_VERSION
+ */
+int archive_read_header(FILE *f, struct ArchiveHeader *hdr);
+
+/**
+ * @brief Read the next chunk into chunk, which grows as needed.
+ * @return 1 if a chunk was read, 0 at the end of the file, -1 if the chunk
+ * is truncated or corrupt (e.g., the writer died mid-write)
+ */
+int archive_read_chunk(FILE *f, struct ArchiveChunk *chunk);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // ARCHIVE_H
@@ -0,0 +1,149 @@
+#include "device_cache.h"
+#include "device_trace.h"
+#include "fault.h"
+#include "global_vars.h"
+#include "utils.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+// One fixed-size record per address, stored at offset address * sizeof()
+struct DeviceCacheRecord {
+  // CLOCK_MONOTONIC; 0 means the record has never been written
+  uint64_t timestamp_ms;
+  uint32_t sample_size;
+  uint32_t reserved;
+  uint8_t sample[DEVICE_CACHE_MAX_SAMPLE];
+};
+
+static uint64_t device_cache_now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000 / 1000;
+}
+
+// Open (and create if needed) the lock/cache file of a bus, e.g.,
+// /dev/i2c-1 -> <gv_device_cache_dir>/_dev_i2c-1
+static int device_cache_open(const char *bus_path) {
+  char path[PATH_MAX];
+  if (mkdir(gv_device_cache_dir, 0777) != 0 && errno != EEXIST)
+    return -1;
+  int len = snprintf(path, sizeof(path), "%s/%s", gv_device_cache_dir,
+                     bus_path);
+  if (len < 0 || (size_t)len >= sizeof(path))
+    return -1;
+  for (char *c = path + strlen(gv_device_cache_dir) + 1; *c != '\0'; ++c) {
+    if (*c == '/')
+      *c = '_';
+  }
+  return open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+}
+
+// One bus transaction, or the failure injected in its place
+static int device_transact(const char *bus_path, uint16_t address,
+                           enum DeviceTraceOp op, void *sample,
+                           size_t sample_size, device_read_fn fn, void *arg) {
+  if (fault_inject(FAULT_DEVICE) != FAULT_NONE)
+    return -1;
+  return device_trace_call(bus_path, address, op, sample, sample_size, fn,
+                           arg);
+}
+
+int device_bus_lock(const char *bus_path) {
+  int fd = device_cache_open(bus_path);
+  if (fd < 0) {
+    syslog(LOG_WARNING,
+           "Failed to open the cache of [%s]: %d(%s), reading it unserialized",
+           bus_path, errno, strerror(errno));
+    return -1;
+  }
+  // Blocks until the bus is free; this is the per-bus queue
+  if (flock(fd, LOCK_EX) != 0) {
+    syslog(LOG_WARNING, "flock() on the cache of [%s] failed: %d(%s)",
+           bus_path, errno, strerror(errno));
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+void device_bus_unlock(int lock) {
+  // Closing the fd releases the lock as well
+  if (lock >= 0)
+    close(lock);
+}
+
+static int device_read(const char *bus_path, uint16_t address,
+                       enum DeviceTraceOp op, void *sample, size_t sample_size,
+                       device_read_fn fn, void *arg, uint64_t ttl_ms) {
+  struct DeviceCacheRecord rec;
+  const off_t offset = (off_t)address * sizeof(rec);
+  int rc;
+
+  int fd = device_bus_lock(bus_path);
+  if (fd < 0)
+    return device_transact(bus_path, address, op, sample, sample_size, fn,
+                           arg);
+
+  if (ttl_ms > 0 && sample_size <= DEVICE_CACHE_MAX_SAMPLE &&
+      pread(fd, &rec, sizeof(rec), offset) == sizeof(rec) &&
+      rec.timestamp_ms != 0 && rec.sample_size == sample_size &&
+      device_cache_now_ms() - rec.timestamp_ms <= ttl_ms) {
+    memcpy(sample, rec.sample, sample_size);
+    rc = 0;
+    goto unlock;
+  }
+
+  if ((rc = device_transact(bus_path, address, op, sample, sample_size, fn,
+                            arg)) != 0)
+    goto unlock;
+  if (ttl_ms > 0 && sample_size <= DEVICE_CACHE_MAX_SAMPLE) {
+    memset(&rec, 0, sizeof(rec));
+    rec.timestamp_ms = device_cache_now_ms();
+    rec.sample_size = sample_size;
+    memcpy(rec.sample, sample, sample_size);
+    if (pwrite(fd, &rec, sizeof(rec), offset) != sizeof(rec))
+      syslog(LOG_WARNING, "Failed to cache the sample of [%s]@0x%x: %d(%s)",
+             bus_path, address, errno, strerror(errno));
+  }
+unlock:
+  device_bus_unlock(fd);
+  return rc;
+}
+
+int device_cache_read(const char *bus_path, uint16_t address, void *sample,
+                      size_t sample_size, device_read_fn fn, void *arg) {
+  return device_read(bus_path, address, DEVICE_TRACE_READ, sample,
+                     sample_size, fn, arg, gv_device_cache_ttl_ms);
+}
+
+int device_bus_read(const char *bus_path, uint16_t address, void *sample,
+                    size_t sample_size, device_read_fn fn, void *arg) {
+  return device_read(bus_path, address, DEVICE_TRACE_READ, sample,
+                     sample_size, fn, arg, 0);
+}
+
+int device_bus_read_locked(const char *bus_path, uint16_t address,
+                           void *sample, size_t sample_size, device_read_fn fn,
+                           void *arg) {
+  return device_transact(bus_path, address, DEVICE_TRACE_READ, sample,
+                         sample_size, fn, arg);
+}
+
+int device_bus_write(const char *bus_path, uint16_t address,
+                     device_read_fn fn, void *arg) {
+  return device_read(bus_path, address, DEVICE_TRACE_WRITE, NULL, 0, fn, arg,
+                     0);
+}
+
+int device_bus_open(const char *bus_path, int flags) {
+  return open(device_trace_replaying() ? "/dev/null" : bus_path, flags);
+}
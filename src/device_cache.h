@@ -0,0 +1,81 @@
+#ifndef DEVICE_CACHE_H
+#define DEVICE_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Largest sample (in bytes) device_cache_read() can cache
+#define DEVICE_CACHE_MAX_SAMPLE 48
+
+/**
+ * @brief Performs the actual bus transaction and writes its result to sample.
+ * @returns 0 on success, any other value is passed through to the caller of
+ * device_cache_read() and the result is not cached
+ */
+typedef int (*device_read_fn)(void *arg, void *sample, size_t sample_size);
+
+/**
+ * @brief Read a sample of the device at (bus_path, address) through fn.
+ * Every fn call can be recorded to or replayed from a trace file instead,
+ * see device_trace.h.
+ * @note Access to each bus is serialized with an flock()ed file under
+ * gv_device_cache_dir, so concurrent readers in this and other sdp processes
+ * queue up instead of interleaving their transactions. A sample read less
+ * than gv_device_cache_ttl_ms ago by anyone is handed out again without
+ * touching the bus at all.
+ * @param address Device address on the bus, 0 for buses with a single device
+ * (e.g., a serial port)
+ * @returns 0 on success or fn's non-zero return value on failure
+ */
+int device_cache_read(const char *bus_path, uint16_t address, void *sample,
+                      size_t sample_size, device_read_fn fn, void *arg);
+
+/**
+ * @brief Same as device_cache_read(), but the result is never served from or
+ * stored to the cache. Meant for back-to-back reads, such as burst sampling,
+ * that must hit the bus every time while still queueing with other readers.
+ */
+int device_bus_read(const char *bus_path, uint16_t address, void *sample,
+                    size_t sample_size, device_read_fn fn, void *arg);
+
+/**
+ * @brief Take the lock device_bus_read() takes around a single transaction,
+ * and hold it until device_bus_unlock(), so that a burst of transactions
+ * queues up with other readers once instead of once per transaction. Other
+ * readers of the bus wait for the whole burst meanwhile.
+ * @return A handle for device_bus_unlock(), or -1 if the lock can't be taken
+ * (logged), in which case the transactions go ahead unserialized
+ */
+int device_bus_lock(const char *bus_path);
+
+/**
+ * @brief Same as device_bus_read(), without taking the lock: only to be
+ * called between device_bus_lock() and device_bus_unlock() of the same bus.
+ * The transaction is still traced and subject to fault injection.
+ */
+int device_bus_read_locked(const char *bus_path, uint16_t address,
+                           void *sample, size_t sample_size, device_read_fn fn,
+                           void *arg);
+
+/**
+ * @brief Release a lock taken by device_bus_lock(). A -1 lock is ignored.
+ */
+void device_bus_unlock(int lock);
+
+/**
+ * @brief Same as device_bus_read(), for transactions that only write to the
+ * device (e.g., setting a register). fn is called with a NULL sample of size
+ * 0.
+ */
+int device_bus_write(const char *bus_path, uint16_t address,
+                     device_read_fn fn, void *arg);
+
+/**
+ * @brief open() bus_path for the transactions a module passes to the
+ * functions above. While a device trace is replayed (see device_trace.h),
+ * /dev/null is opened instead, since no transaction reaches the bus then and
+ * the bus may not even exist.
+ */
+int device_bus_open(const char *bus_path, int flags);
+
+#endif // DEVICE_CACHE_H
@@ -0,0 +1,375 @@
+#include "device_trace.h"
+#include "global_vars.h"
+#include "readings_json.h"
+#include "shm_layout.h"
+#include "utils.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define DEVICE_TRACE_HEADER_LEN 16
+#define DEVICE_TRACE_RECORD_LEN 25
+// Distinct (bus, address, op) triples a replay keeps a position for
+#define DEVICE_TRACE_MAX_CURSORS 16
+
+enum DeviceTraceMode { TRACE_OFF, TRACE_RECORD, TRACE_REPLAY };
+
+struct TraceRecord {
+  uint64_t offset_us;
+  uint32_t duration_us;
+  int32_t rc;
+  uint32_t bus_hash;
+  uint16_t address;
+  uint8_t op;
+  uint16_t sample_len;
+  // Offset of the sample in DeviceTrace.samples
+  size_t sample_pos;
+};
+
+// Position of the next replayed record of one (bus, address, op) triple
+struct TraceCursor {
+  uint32_t bus_hash;
+  uint16_t address;
+  uint8_t op;
+  size_t next;
+};
+
+struct DeviceTrace {
+  enum DeviceTraceMode mode;
+  pthread_mutex_t lock;
+  // CLOCK_MONOTONIC of device_trace_init(), or of the last rewind when
+  // replaying in a loop
+  uint64_t started_us;
+  const char *path;
+  // Recording
+  FILE *out;
+  bool write_failed;
+  // Replaying
+  double speed;
+  bool loop;
+  bool exhausted;
+  struct TraceRecord *records;
+  size_t record_count;
+  uint8_t *samples;
+  struct TraceCursor cursors[DEVICE_TRACE_MAX_CURSORS];
+  size_t cursor_count;
+  // For the summary logged by device_trace_destroy()
+  uint64_t transactions;
+  uint64_t rewinds;
+  uint64_t max_lag_us;
+};
+
+static struct DeviceTrace trace = {.mode = TRACE_OFF,
+                                   .lock = PTHREAD_MUTEX_INITIALIZER};
+
+static uint64_t trace_now_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 * 1000 + ts.tv_nsec / 1000;
+}
+
+static int trace_record_open() {
+  uint8_t hdr[DEVICE_TRACE_HEADER_LEN] = {0};
+  if ((trace.out = fopen(trace.path, "wbe")) == NULL) {
+    SYSLOG_ERR("fopen(%s) failed: %d(%s)", trace.path, errno,
+               strerror(errno));
+    return -1;
+  }
+  put_le32(hdr, DEVICE_TRACE_MAGIC);
+  put_le16(hdr + 4, DEVICE_TRACE_VERSION);
+  put_le64(hdr + 8, (uint64_t)readings_now_ms());
+  if (fwrite(hdr, sizeof(hdr), 1, trace.out) != 1) {
+    SYSLOG_ERR("Failed to write the header of [%s]", trace.path);
+    fclose(trace.out);
+    trace.out = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+// Read the whole trace into memory, so replaying never waits on the disk
+static int trace_replay_load() {
+  int retval = 0;
+  uint8_t hdr[DEVICE_TRACE_HEADER_LEN];
+  size_t record_cap = 0, samples_len = 0, samples_cap = 0;
+  FILE *in = fopen(trace.path, "rbe");
+  if (in == NULL) {
+    SYSLOG_ERR("fopen(%s) failed: %d(%s)", trace.path, errno,
+               strerror(errno));
+    return -1;
+  }
+  if (fread(hdr, sizeof(hdr), 1, in) != 1 ||
+      get_le32(hdr) != DEVICE_TRACE_MAGIC ||
+      get_le16(hdr + 4) != DEVICE_TRACE_VERSION) {
+    SYSLOG_ERR("[%s] is not a version %d device trace", trace.path,
+               DEVICE_TRACE_VERSION);
+    retval = -2;
+    goto err_header;
+  }
+
+  uint8_t buf[DEVICE_TRACE_RECORD_LEN];
+  long complete_len = DEVICE_TRACE_HEADER_LEN;
+  while (fread(buf, sizeof(buf), 1, in) == 1) {
+    struct TraceRecord rec = {.offset_us = get_le64(buf),
+                              .duration_us = get_le32(buf + 8),
+                              .rc = (int32_t)get_le32(buf + 12),
+                              .bus_hash = get_le32(buf + 16),
+                              .address = get_le16(buf + 20),
+                              .op = buf[22],
+                              .sample_len = get_le16(buf + 23),
+                              .sample_pos = samples_len};
+    if (trace.record_count == record_cap) {
+      record_cap = record_cap > 0 ? record_cap * 2 : 1024;
+      void *p = realloc(trace.records, record_cap * sizeof(rec));
+      if (p == NULL) {
+        SYSLOG_ERR("realloc() failed");
+        retval = -3;
+        goto err_realloc;
+      }
+      trace.records = p;
+    }
+    if (samples_len + rec.sample_len > samples_cap) {
+      samples_cap = samples_cap > 0 ? samples_cap * 2 : 64 * 1024;
+      if (samples_cap < samples_len + rec.sample_len)
+        samples_cap = samples_len + rec.sample_len;
+      void *p = realloc(trace.samples, samples_cap);
+      if (p == NULL) {
+        SYSLOG_ERR("realloc() failed");
+        retval = -3;
+        goto err_realloc;
+      }
+      trace.samples = p;
+    }
+    if (rec.sample_len > 0 &&
+        fread(trace.samples + samples_len, rec.sample_len, 1, in) != 1)
+      break;
+    samples_len += rec.sample_len;
+    trace.records[trace.record_count++] = rec;
+    complete_len += DEVICE_TRACE_RECORD_LEN + rec.sample_len;
+  }
+  if (fseek(in, 0, SEEK_END) == 0 && ftell(in) != complete_len)
+    syslog(LOG_WARNING, "[%s] ends with a truncated record, ignored",
+           trace.path);
+  fclose(in);
+  return 0;
+err_realloc:
+  free(trace.records);
+  free(trace.samples);
+  trace.records = NULL;
+  trace.samples = NULL;
+  trace.record_count = 0;
+err_header:
+  fclose(in);
+  return retval;
+}
+
+int device_trace_init(const json_object *config_root) {
+  json_object *root_trace, *json_ele;
+  trace.mode = TRACE_OFF;
+  if (!json_object_object_get_ex(config_root, "device_trace", &root_trace))
+    return 0;
+
+  const char *mode = NULL;
+  if (json_object_object_get_ex(root_trace, "mode", &json_ele))
+    mode = json_object_get_string(json_ele);
+  // The string is owned by the config root, which outlives the trace
+  trace.path = NULL;
+  if (json_object_object_get_ex(root_trace, "path", &json_ele))
+    trace.path = json_object_get_string(json_ele);
+  trace.speed = 1.0;
+  if (json_object_object_get_ex(root_trace, "speed", &json_ele))
+    trace.speed = json_object_get_double(json_ele);
+  trace.loop = false;
+  if (json_object_object_get_ex(root_trace, "loop", &json_ele))
+    trace.loop = json_object_get_boolean(json_ele);
+  if (trace.path == NULL || trace.speed < 0) {
+    SYSLOG_ERR("device_trace: path is required and speed can't be negative");
+    return -1;
+  }
+  trace.transactions = trace.rewinds = trace.max_lag_us = 0;
+  trace.write_failed = trace.exhausted = false;
+  trace.cursor_count = 0;
+
+  if (mode != NULL && strcmp(mode, "record") == 0) {
+    if (trace_record_open() != 0)
+      return -2;
+    trace.mode = TRACE_RECORD;
+  } else if (mode != NULL && strcmp(mode, "replay") == 0) {
+    if (trace_replay_load() != 0)
+      return -2;
+    trace.mode = TRACE_REPLAY;
+    syslog(LOG_INFO,
+           "Replaying %zu device transaction(s) from [%s] at speed %.2f",
+           trace.record_count, trace.path, trace.speed);
+  } else {
+    SYSLOG_ERR("device_trace: invalid mode [%s], valid values are "
+               "record/replay",
+               mode);
+    return -1;
+  }
+  trace.started_us = trace_now_us();
+  return 0;
+}
+
+bool device_trace_replaying() { return trace.mode == TRACE_REPLAY; }
+
+static int trace_record_call(uint32_t bus_hash, uint16_t address,
+                             enum DeviceTraceOp op, void *sample,
+                             size_t sample_size, device_read_fn fn,
+                             void *arg) {
+  const uint64_t start_us = trace_now_us();
+  const int rc = fn(arg, sample, sample_size);
+  const uint64_t duration_us = trace_now_us() - start_us;
+  const uint16_t sample_len =
+      op == DEVICE_TRACE_READ && rc == 0 && sample_size <= UINT16_MAX
+          ? sample_size
+          : 0;
+  uint8_t buf[DEVICE_TRACE_RECORD_LEN];
+  put_le64(buf, start_us - trace.started_us);
+  put_le32(buf + 8, duration_us > UINT32_MAX ? UINT32_MAX : duration_us);
+  put_le32(buf + 12, (uint32_t)rc);
+  put_le32(buf + 16, bus_hash);
+  put_le16(buf + 20, address);
+  buf[22] = op;
+  put_le16(buf + 23, sample_len);
+
+  pthread_mutex_lock(&trace.lock);
+  if ((fwrite(buf, sizeof(buf), 1, trace.out) != 1 ||
+       (sample_len > 0 && fwrite(sample, sample_len, 1, trace.out) != 1)) &&
+      !trace.write_failed) {
+    trace.write_failed = true;
+    SYSLOG_ERR("Failed to append to [%s], the trace is incomplete",
+               trace.path);
+  }
+  ++trace.transactions;
+  pthread_mutex_unlock(&trace.lock);
+  return rc;
+}
+
+static struct TraceCursor *trace_cursor(uint32_t bus_hash, uint16_t address,
+                                        uint8_t op) {
+  for (size_t i = 0; i < trace.cursor_count; ++i) {
+    struct TraceCursor *c = &trace.cursors[i];
+    if (c->bus_hash == bus_hash && c->address == address && c->op == op)
+      return c;
+  }
+  if (trace.cursor_count >= DEVICE_TRACE_MAX_CURSORS)
+    return NULL;
+  struct TraceCursor *c = &trace.cursors[trace.cursor_count++];
+  *c = (struct TraceCursor){
+      .bus_hash = bus_hash, .address = address, .op = op, .next = 0};
+  return c;
+}
+
+static bool trace_cursor_advance(struct TraceCursor *c,
+                                 struct TraceRecord *rec) {
+  for (size_t i = c->next; i < trace.record_count; ++i) {
+    const struct TraceRecord *r = &trace.records[i];
+    if (r->bus_hash == c->bus_hash && r->address == c->address &&
+        r->op == c->op) {
+      *rec = *r;
+      c->next = i + 1;
+      return true;
+    }
+  }
+  return false;
+}
+
+static int trace_replay_call(uint32_t bus_hash, const char *bus_path,
+                             uint16_t address, enum DeviceTraceOp op,
+                             void *sample, size_t sample_size) {
+  struct TraceRecord rec;
+  pthread_mutex_lock(&trace.lock);
+  struct TraceCursor *c = trace_cursor(bus_hash, address, op);
+  bool found = c != NULL && trace_cursor_advance(c, &rec);
+  if (!found && c != NULL && trace.loop) {
+    // Start over with every cursor, so the devices stay in step
+    for (size_t i = 0; i < trace.cursor_count; ++i)
+      trace.cursors[i].next = 0;
+    trace.started_us = trace_now_us();
+    ++trace.rewinds;
+    found = trace_cursor_advance(c, &rec);
+  }
+  if (!found) {
+    if (!trace.exhausted)
+      syslog(LOG_INFO,
+             "[%s] has no more transactions of [%s]@0x%x, sdp will exit now",
+             trace.path, bus_path, address);
+    trace.exhausted = true;
+    // The end of a replay is the end of the run it drives
+    ev_flag = 1;
+    pthread_mutex_unlock(&trace.lock);
+    return -1;
+  }
+  ++trace.transactions;
+  const uint64_t started_us = trace.started_us;
+  pthread_mutex_unlock(&trace.lock);
+
+  if (trace.speed > 0) {
+    // Not before the transaction originally started, and as long as it took
+    const uint64_t due_us = started_us + rec.offset_us / trace.speed;
+    const uint64_t now_us = trace_now_us();
+    if (now_us > due_us && now_us - due_us > trace.max_lag_us)
+      trace.max_lag_us = now_us - due_us;
+    sleep_until_us((now_us > due_us ? now_us : due_us) +
+                   rec.duration_us / trace.speed);
+  }
+  if (rec.rc == 0 && op == DEVICE_TRACE_READ) {
+    if (rec.sample_len != sample_size) {
+      SYSLOG_ERR("A %zu-byte sample of [%s]@0x%x is read, but %u bytes were "
+                 "recorded",
+                 sample_size, bus_path, address, rec.sample_len);
+      return -1;
+    }
+    memcpy(sample, trace.samples + rec.sample_pos, sample_size);
+  }
+  return rec.rc;
+}
+
+int device_trace_call(const char *bus_path, uint16_t address,
+                      enum DeviceTraceOp op, void *sample, size_t sample_size,
+                      device_read_fn fn, void *arg) {
+  switch (trace.mode) {
+  case TRACE_RECORD:
+    return trace_record_call(sdp_fnv1a32(bus_path), address, op, sample,
+                             sample_size, fn, arg);
+  case TRACE_REPLAY:
+    return trace_replay_call(sdp_fnv1a32(bus_path), bus_path, address, op,
+                             sample, sample_size);
+  case TRACE_OFF:
+  default:
+    return fn(arg, sample, sample_size);
+  }
+}
+
+void device_trace_destroy() {
+  switch (trace.mode) {
+  case TRACE_RECORD:
+    if (fclose(trace.out) != 0 && !trace.write_failed)
+      SYSLOG_ERR("Failed to flush [%s], the trace is incomplete", trace.path);
+    syslog(LOG_INFO, "Recorded %lu device transaction(s) to [%s]",
+           (unsigned long)trace.transactions, trace.path);
+    trace.out = NULL;
+    break;
+  case TRACE_REPLAY:
+    syslog(LOG_INFO,
+           "Replayed %lu of %zu device transaction(s) from [%s], %lu "
+           "rewind(s), lagged by up to %lu us",
+           (unsigned long)trace.transactions, trace.record_count, trace.path,
+           (unsigned long)trace.rewinds, (unsigned long)trace.max_lag_us);
+    free(trace.records);
+    free(trace.samples);
+    trace.records = NULL;
+    trace.samples = NULL;
+    trace.record_count = 0;
+    break;
+  case TRACE_OFF:
+  default:
+    break;
+  }
+  trace.mode = TRACE_OFF;
+}
@@ -0,0 +1,65 @@
+#ifndef DEVICE_TRACE_H
+#define DEVICE_TRACE_H
+
+#include "device_cache.h"
+
+#include <json-c/json.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// "SDPT" as a little-endian u32
+#define DEVICE_TRACE_MAGIC 0x54504453
+// Bumped whenever the file layout changes
+#define DEVICE_TRACE_VERSION 1
+
+/*
+ * Layout of a trace file, all integers little-endian:
+ *
+ * header:  magic u32, version u16, reserved u16, started_at_ms i64 (wall
+ *          clock of device_trace_init())
+ * record*: offset_us u64 (when the transaction started, since
+ *          device_trace_init()), duration_us u32, rc i32, bus_hash u32
+ *          (sdp_fnv1a32() of the bus path), address u16, op u8,
+ *          sample_len u16, sample u8[sample_len]
+ *
+ * sample_len is 0 for writes and failed reads. A truncated last record, as
+ * left by a crash, ends the trace.
+ */
+
+enum DeviceTraceOp { DEVICE_TRACE_READ = 0, DEVICE_TRACE_WRITE = 1 };
+
+/**
+ * @brief Set up the optional "device_trace" object of the config root:
+ * "mode" is "record" or "replay" and "path" the trace file. Replay takes
+ * "speed" (default 1.0, 0 for as fast as possible) and "loop" (default
+ * false). Without the object, transactions go straight to the device.
+ * @return 0 on success, negative number on invalid config or I/O error
+ */
+int device_trace_init(const json_object *config_root);
+
+/**
+ * @brief Run one bus transaction, called by device_cache.c instead of fn
+ * itself. Recording, fn is called and its result and timing appended to the
+ * trace. Replaying, fn is never called: sample and the return value come
+ * from the next recorded transaction of the same bus, address and op, once
+ * its original start time (scaled by speed) is reached and after its
+ * original duration. An exhausted trace without "loop" fails the
+ * transaction and makes sdp exit.
+ */
+int device_trace_call(const char *bus_path, uint16_t address,
+                      enum DeviceTraceOp op, void *sample, size_t sample_size,
+                      device_read_fn fn, void *arg);
+
+/**
+ * @return true if transactions are replayed, i.e., no bus is ever touched
+ */
+bool device_trace_replaying();
+
+/**
+ * @brief Flush the recording or free the replayed trace and log a summary
+ */
+void device_trace_destroy();
+
+#endif // DEVICE_TRACE_H
@@ -1,20 +1,476 @@
+#include "event_loops.h"
+#include "adaptive.h"
+#include "device_trace.h"
+#include "fault.h"
 #include "global_vars.h"
+#include "loop_metrics.h"
 #include "modules/module.h"
+#include "sinks/sinks.h"
 #include "utils.h"
 
 #include <errno.h>
 #include <fcntl.h>
 #include <linux/i2c-dev.h>
 #include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/ioctl.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
 #include <syslog.h>
 #include <unistd.h>
 
+#define EV_MAX_REACTOR_CLIENTS 8
+// epoll_event.data.u64 of the fds watched by the reactor
+#define EV_TAG_COLLECTION_TIMER 0
+#define EV_TAG_MISC_TIMER 1
+#define EV_TAG_SIGNAL 2
+#define EV_TAG_CLIENT_BASE 16
+// Records kept for post_collection() while post_collection_init() runs
+#define EV_BACKLOG_MAX 64
+
+struct ReactorSlot {
+  struct ReactorClient client;
+  // The fd currently registered with epoll, -1 if none
+  int registered_fd;
+  uint32_t registered_events;
+};
+
+static struct ReactorSlot ev_clients[EV_MAX_REACTOR_CLIENTS];
+// Clients may attach from the post_collection_init() thread while the
+// reactor runs: a slot is filled before the count that publishes it
+static _Atomic size_t ev_client_count = 0;
+static pthread_mutex_t ev_attach_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int ev_epoll_fd = -1;
+static int ev_signal_fd = -1;
+static int ev_collection_timer_fd = -1;
+static int ev_misc_timer_fd = -1;
+
+// Filled by collection(), then handed to the sinks and post_collection()
+static struct ReadingRecord ev_readings;
+
+enum PostCollectionState {
+  EV_PC_PENDING,
+  EV_PC_READY,
+  EV_PC_FAILED,
+};
+
+/**
+ * @brief post_collection_init() runs on a thread of its own so that slow
+ * steps such as TLS handshakes don't hold back the first sample. Only state
+ * and the backlog are touched by the main thread; ctx is handed over through
+ * done.
+ */
+struct PostCollectionInit {
+  pthread_t thread;
+  bool threaded;
+  _Atomic bool done;
+  void *ctx;
+  enum PostCollectionState state;
+  struct ReadingRecord backlog[EV_BACKLOG_MAX];
+  size_t backlog_head;
+  size_t backlog_count;
+};
+
+static struct PostCollectionInit ev_pc;
+
+static void *ev_post_collection_init_thread(void *arg) {
+  (void)arg;
+  ev_pc.ctx = post_collection_init(gv_config_root);
+  atomic_store(&ev_pc.done, true);
+  return NULL;
+}
+
+static void ev_post_collection_start() {
+  ev_pc.state = EV_PC_PENDING;
+  ev_pc.backlog_head = ev_pc.backlog_count = 0;
+  atomic_store(&ev_pc.done, false);
+  int rc = pthread_create(&ev_pc.thread, NULL, ev_post_collection_init_thread,
+                          NULL);
+  ev_pc.threaded = rc == 0;
+  if (!ev_pc.threaded) {
+    SYSLOG_ERR("pthread_create() failed: %d(%s), running "
+               "post_collection_init() in place",
+               rc, strerror(rc));
+    ev_post_collection_init_thread(NULL);
+  }
+}
+
+/**
+ * @brief Move from EV_PC_PENDING to EV_PC_READY or EV_PC_FAILED once
+ * post_collection_init() has returned, replaying the backlog if it succeeded.
+ * @param wait Block until post_collection_init() returns
+ */
+static void ev_post_collection_poll(bool wait) {
+  if (ev_pc.state != EV_PC_PENDING || (!wait && !atomic_load(&ev_pc.done)))
+    return;
+  if (ev_pc.threaded)
+    pthread_join(ev_pc.thread, NULL);
+  if (ev_pc.ctx == NULL) {
+    ev_pc.state = EV_PC_FAILED;
+    SYSLOG_ERR("post_collection_init() failed, post collection task will not "
+               "run (but collection() event will still run...)");
+    if (ev_pc.backlog_count > 0)
+      syslog(LOG_WARNING, "%zu record(s) kept for post_collection() dropped",
+             ev_pc.backlog_count);
+    ev_pc.backlog_count = 0;
+    return;
+  }
+  ev_pc.state = EV_PC_READY;
+  syslog(LOG_INFO,
+         "post_collection_init() returned without errors, replaying %zu "
+         "record(s) collected in the meantime",
+         ev_pc.backlog_count);
+  for (; ev_pc.backlog_count > 0; --ev_pc.backlog_count) {
+    post_collection(&ev_pc.backlog[ev_pc.backlog_head], ev_pc.ctx);
+    ev_pc.backlog_head = (ev_pc.backlog_head + 1) % EV_BACKLOG_MAX;
+  }
+}
+
+static void ev_post_collection_keep(const struct ReadingRecord *r) {
+  if (ev_pc.backlog_count == EV_BACKLOG_MAX) {
+    // Oldest first out, the newest readings matter most
+    ev_pc.backlog_head = (ev_pc.backlog_head + 1) % EV_BACKLOG_MAX;
+    --ev_pc.backlog_count;
+  }
+  ev_pc.backlog[(ev_pc.backlog_head + ev_pc.backlog_count) % EV_BACKLOG_MAX] =
+      *r;
+  ++ev_pc.backlog_count;
+}
+
+/**
+ * @returns 0 if the event loop can continue, negative number if it has to
+ * break
+ */
+static int ev_collection_tick(void *c_ctx) {
+  int ret;
+  uint64_t started_us;
+  loop_metrics_tick();
+  readings_reset(&ev_readings);
+  started_us = loop_metrics_stage_start();
+  if ((ret = collection(c_ctx, &ev_readings)) < 0) {
+    ev_flag = 1;
+    SYSLOG_ERR("collection() encounters a fatal error (ret: %d)", ret);
+    return -1;
+  }
+  loop_metrics_stage(LOOP_STAGE_COLLECTION, started_us, ret);
+  if (ret > 0)
+    syslog(LOG_WARNING,
+           "collection() encounters a recoverable error (ret: %d), "
+           "post_collection() call will be skipped (but retried in the next iteration)",
+           ret);
+  if (ret > 0)
+    goto end;
+  started_us = loop_metrics_stage_start();
+  sinks_write(&ev_readings);
+  loop_metrics_stage(LOOP_STAGE_SINKS, started_us, 0);
+  adaptive_next_interval_ms(&ev_readings);
+  ev_post_collection_poll(false);
+  if (ev_pc.state == EV_PC_PENDING) {
+    ev_post_collection_keep(&ev_readings);
+  } else if (ev_pc.state == EV_PC_READY) {
+    started_us = loop_metrics_stage_start();
+    ret = post_collection(&ev_readings, ev_pc.ctx);
+    loop_metrics_stage(LOOP_STAGE_POST_COLLECTION, started_us, ret);
+  }
+end:
+  loop_metrics_maybe_log();
+  return 0;
+}
+
+static void ev_sleep_loop(void *c_ctx) {
+  // The first sample is taken right away rather than one interval in
+  while (!ev_flag) {
+    if (ev_collection_tick(c_ctx) < 0)
+      break;
+    interruptible_sleep_us(adaptive_interval_ms() * 1000);
+  }
+}
+
+static int ev_reactor_attach(const struct ReactorClient *client) {
+  pthread_mutex_lock(&ev_attach_mutex);
+  const size_t idx = atomic_load(&ev_client_count);
+  if (idx >= EV_MAX_REACTOR_CLIENTS) {
+    pthread_mutex_unlock(&ev_attach_mutex);
+    SYSLOG_ERR("The reactor can't serve more than %d clients",
+               EV_MAX_REACTOR_CLIENTS);
+    return -1;
+  }
+  ev_clients[idx].client = *client;
+  ev_clients[idx].registered_fd = -1;
+  ev_clients[idx].registered_events = 0;
+  atomic_store(&ev_client_count, idx + 1);
+  pthread_mutex_unlock(&ev_attach_mutex);
+  return 0;
+}
+
+// Stop watching a client's socket, e.g., because its connection is lost
+static void ev_reactor_unregister(struct ReactorSlot *s) {
+  if (s->registered_fd < 0)
+    return;
+  // The socket may have been closed already, so errors are expected
+  epoll_ctl(ev_epoll_fd, EPOLL_CTL_DEL, s->registered_fd, NULL);
+  s->registered_fd = -1;
+}
+
+// Bring the epoll registration of a client in line with its current socket
+// and write interest
+static void ev_reactor_sync(size_t idx) {
+  struct ReactorSlot *s = &ev_clients[idx];
+  int fd = s->client.socket(s->client.obj);
+  uint32_t events =
+      EPOLLIN | (s->client.want_write(s->client.obj) ? EPOLLOUT : 0);
+  if (fd == s->registered_fd && events == s->registered_events)
+    return;
+  struct epoll_event ev = {.events = events,
+                           .data.u64 = EV_TAG_CLIENT_BASE + idx};
+  if (fd >= 0 && fd == s->registered_fd) {
+    if (epoll_ctl(ev_epoll_fd, EPOLL_CTL_MOD, fd, &ev) != 0)
+      SYSLOG_ERR("epoll_ctl(EPOLL_CTL_MOD) failed: %d(%s)", errno,
+                 strerror(errno));
+    else
+      s->registered_events = events;
+    return;
+  }
+  ev_reactor_unregister(s);
+  if (fd < 0)
+    return;
+  if (epoll_ctl(ev_epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+    SYSLOG_ERR("epoll_ctl(EPOLL_CTL_ADD) failed: %d(%s)", errno,
+               strerror(errno));
+    return;
+  }
+  s->registered_fd = fd;
+  s->registered_events = events;
+}
+
+static void ev_reactor_handle_client(size_t idx, uint32_t events) {
+  struct ReactorSlot *s = &ev_clients[idx];
+  int rc = 0;
+  if (events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+    rc = s->client.handle_read(s->client.obj);
+  if (rc == 0 && (events & EPOLLOUT))
+    rc = s->client.handle_write(s->client.obj);
+  if (rc != 0) {
+    syslog(LOG_WARNING, "Reactor client %zu lost its connection (rc: %d)", idx,
+           rc);
+    ev_reactor_unregister(s);
+  }
+}
+
+static void ev_reactor_handle_misc() {
+  for (size_t i = 0; i < ev_client_count; ++i) {
+    struct ReactorSlot *s = &ev_clients[i];
+    int rc;
+    if (s->registered_fd < 0) {
+      if ((rc = s->client.reconnect(s->client.obj)) != 0)
+        syslog(LOG_WARNING, "Reactor client %zu failed to reconnect (rc: %d)",
+               i, rc);
+    } else if ((rc = s->client.handle_misc(s->client.obj)) != 0) {
+      syslog(LOG_WARNING, "Reactor client %zu lost its connection (rc: %d)", i,
+             rc);
+      ev_reactor_unregister(s);
+    }
+  }
+}
+
+static int ev_reactor_watch(int fd, uint64_t tag) {
+  struct epoll_event ev = {.events = EPOLLIN, .data.u64 = tag};
+  if (epoll_ctl(ev_epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+    SYSLOG_ERR("epoll_ctl(EPOLL_CTL_ADD) failed: %d(%s)", errno,
+               strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+static int ev_reactor_arm_timer(int fd, uint64_t interval_ms, bool fire_now) {
+  struct itimerspec its;
+  its.it_interval.tv_sec = interval_ms / 1000;
+  its.it_interval.tv_nsec = (interval_ms % 1000) * 1000 * 1000;
+  its.it_value = its.it_interval;
+  // it_value == 0 would disarm the timer
+  if (fire_now) {
+    its.it_value.tv_sec = 0;
+    its.it_value.tv_nsec = 1;
+  }
+  if (timerfd_settime(fd, 0, &its, NULL) != 0) {
+    SYSLOG_ERR("timerfd_settime() failed: %d(%s)", errno, strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+static void ev_reactor_destroy() {
+  if (ev_misc_timer_fd >= 0)
+    close(ev_misc_timer_fd);
+  if (ev_collection_timer_fd >= 0)
+    close(ev_collection_timer_fd);
+  if (ev_signal_fd >= 0)
+    close(ev_signal_fd);
+  if (ev_epoll_fd >= 0)
+    close(ev_epoll_fd);
+  ev_misc_timer_fd = ev_collection_timer_fd = ev_signal_fd = ev_epoll_fd = -1;
+  ev_client_count = 0;
+  gv_reactor_attach = NULL;
+}
+
+/**
+ * @brief Create the epoll set with its timers and signalfd. Must be called
+ * before any module initialization so that (1) threads spawned by modules
+ * inherit the blocked signal mask and (2) network clients can attach.
+ */
+static int ev_reactor_init() {
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGINT);
+  sigaddset(&mask, SIGABRT);
+  sigaddset(&mask, SIGTERM);
+  // Blocked signals are no longer delivered to signal_handler() but queued
+  // for ev_signal_fd
+  if (pthread_sigmask(SIG_BLOCK, &mask, NULL) != 0) {
+    SYSLOG_ERR("pthread_sigmask() failed");
+    return -1;
+  }
+  if ((ev_epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0 ||
+      (ev_signal_fd = signalfd(-1, &mask, SFD_CLOEXEC)) < 0 ||
+      (ev_collection_timer_fd =
+           timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC)) < 0 ||
+      (ev_misc_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC)) < 0) {
+    SYSLOG_ERR("Failed to create reactor fds: %d(%s)", errno, strerror(errno));
+    goto err_reactor_init;
+  }
+  if (ev_reactor_watch(ev_signal_fd, EV_TAG_SIGNAL) != 0 ||
+      ev_reactor_watch(ev_collection_timer_fd, EV_TAG_COLLECTION_TIMER) != 0 ||
+      ev_reactor_watch(ev_misc_timer_fd, EV_TAG_MISC_TIMER) != 0)
+    goto err_reactor_init;
+  gv_reactor_attach = ev_reactor_attach;
+  return 0;
+err_reactor_init:
+  ev_reactor_destroy();
+  return -1;
+}
+
+static void ev_reactor_loop(void *c_ctx) {
+  uint64_t interval_ms = adaptive_interval_ms();
+  if (ev_reactor_arm_timer(ev_collection_timer_fd, interval_ms, true) != 0 ||
+      ev_reactor_arm_timer(ev_misc_timer_fd, 1000, false) != 0) {
+    ev_flag = 1;
+    return;
+  }
+  // Network clients attach as post_collection_init() progresses
+  syslog(LOG_INFO, "Reactor started with %zu network client(s)",
+         atomic_load(&ev_client_count));
+
+  struct epoll_event events[EV_MAX_REACTOR_CLIENTS + 3];
+  while (!ev_flag) {
+    for (size_t i = 0; i < ev_client_count; ++i)
+      ev_reactor_sync(i);
+    int n = epoll_wait(ev_epoll_fd, events,
+                       sizeof(events) / sizeof(events[0]), -1);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      SYSLOG_ERR("epoll_wait() failed: %d(%s)", errno, strerror(errno));
+      ev_flag = 1;
+      break;
+    }
+    for (int i = 0; i < n && !ev_flag; ++i) {
+      uint64_t tag = events[i].data.u64;
+      uint64_t expirations;
+      if (tag == EV_TAG_SIGNAL) {
+        struct signalfd_siginfo si;
+        if (read(ev_signal_fd, &si, sizeof(si)) == sizeof(si))
+          syslog(LOG_INFO, "Signal [%u] caught", si.ssi_signo);
+        ev_flag = 1;
+      } else if (tag == EV_TAG_COLLECTION_TIMER) {
+        if (read(ev_collection_timer_fd, &expirations, sizeof(expirations)) ==
+                sizeof(expirations) &&
+            expirations > 1)
+          syslog(LOG_WARNING, "%lu collection tick(s) missed",
+                 (unsigned long)(expirations - 1));
+        if (ev_collection_tick(c_ctx) < 0)
+          break;
+        // Re-arming restarts the period, so only do it on a change
+        if (adaptive_interval_ms() != interval_ms) {
+          interval_ms = adaptive_interval_ms();
+          if (ev_reactor_arm_timer(ev_collection_timer_fd, interval_ms,
+                                   false) != 0) {
+            ev_flag = 1;
+            break;
+          }
+        }
+      } else if (tag == EV_TAG_MISC_TIMER) {
+        read(ev_misc_timer_fd, &expirations, sizeof(expirations));
+        ev_reactor_handle_misc();
+      } else {
+        ev_reactor_handle_client(tag - EV_TAG_CLIENT_BASE, events[i].events);
+      }
+    }
+  }
+}
+
 void ev_collect_data() {
   syslog(LOG_INFO, "ev_collect_data() started");
 
+  if (gv_reactor_enabled && ev_reactor_init() != 0) {
+    ev_flag = 1;
+    SYSLOG_ERR("ev_reactor_init() failed, sdp will exit now");
+    goto err_reactor_init;
+  }
+
+  const struct ModuleInfo *info = module_info();
+  if (info->abi_version != SDP_MODULE_ABI_VERSION) {
+    ev_flag = 1;
+    SYSLOG_ERR("Module %s is built against ABI version %u, but sdp expects "
+               "%u, sdp will exit now",
+               info->name, info->abi_version, SDP_MODULE_ABI_VERSION);
+    goto err_module_info;
+  }
+  // Everything sized by metric_count (sinks, payload templates, archive
+  // chunks) relies on there being at least one metric
+  if (info->metric_count == 0) {
+    ev_flag = 1;
+    SYSLOG_ERR("Module %s reports no metrics, sdp will exit now", info->name);
+    goto err_module_info;
+  }
+  syslog(LOG_INFO, "Module %s reports %zu metric(s)", info->name,
+         info->metric_count);
+
+  if (sinks_init(gv_config_root, info) != 0) {
+    ev_flag = 1;
+    SYSLOG_ERR("sinks_init() failed, sdp will exit now");
+    goto err_sinks_init;
+  }
+  if (adaptive_init(gv_config_root, info) != 0) {
+    ev_flag = 1;
+    SYSLOG_ERR("adaptive_init() failed, sdp will exit now");
+    goto err_adaptive_init;
+  }
+  if (loop_metrics_init(gv_config_root) != 0) {
+    ev_flag = 1;
+    SYSLOG_ERR("loop_metrics_init() failed, sdp will exit now");
+    goto err_loop_metrics_init;
+  }
+  // Before either init phase, as modules may talk to their devices and
+  // brokers already
+  if (fault_init(gv_config_root) != 0) {
+    ev_flag = 1;
+    SYSLOG_ERR("fault_init() failed, sdp will exit now");
+    goto err_fault_init;
+  }
+  if (device_trace_init(gv_config_root) != 0) {
+    ev_flag = 1;
+    SYSLOG_ERR("device_trace_init() failed, sdp will exit now");
+    goto err_device_trace_init;
+  }
+
+  // Both init phases run at the same time, and sampling starts as soon as
+  // collection_init() returns
+  ev_post_collection_start();
   void *c_ctx = collection_init(gv_config_root);
   if (c_ctx == NULL) {
     ev_flag = 1;
@@ -23,36 +479,30 @@ void ev_collect_data() {
   }
   syslog(LOG_INFO, "collection_init() returned without errors");
 
-  void *pc_ctx = post_collection_init(gv_config_root);
-  if (pc_ctx == NULL) {
-    SYSLOG_ERR("post_collection_init() failed, post collection task will not "
-               "run (but collection() event will still run...)");
-  }
-  syslog(LOG_INFO, "post_collection_init() returned without errors");
+  if (gv_reactor_enabled)
+    ev_reactor_loop(c_ctx);
+  else
+    ev_sleep_loop(c_ctx);
 
-  while (!ev_flag) {
-    // You need to have sleep at the beginning so that continue branch will also
-    // trigger this
-    interruptible_sleep_us(gv_collection_event_interval_ms * 1000);
-    int ret;
-    if ((ret = collection(c_ctx)) < 0) {
-      ev_flag = 1;
-      SYSLOG_ERR("collection() encounters a fatal error (ret: %d)", ret);
-      break;
-    }
-    if (ret > 0)
-      syslog(LOG_WARNING,
-             "collection() encounters a recoverable error (ret: %d), "
-             "post_collection() call will be skipped (but retried in the next iteration)",
-             ret);
-    if (pc_ctx == NULL)
-      continue;
-
-    post_collection(c_ctx, pc_ctx);
-  }
-  if (pc_ctx != NULL)
-    post_collection_destroy(pc_ctx);
-  collection_destroy(c_ctx);
 err_collection_init:
+  ev_post_collection_poll(true);
+  if (ev_pc.state == EV_PC_READY)
+    post_collection_destroy(ev_pc.ctx);
+  if (c_ctx != NULL)
+    collection_destroy(c_ctx);
+  device_trace_destroy();
+err_device_trace_init:
+  fault_destroy();
+err_fault_init:
+  loop_metrics_destroy();
+err_loop_metrics_init:
+  adaptive_destroy();
+err_adaptive_init:
+  sinks_destroy();
+err_sinks_init:
+err_module_info:
+  if (gv_reactor_enabled)
+    ev_reactor_destroy();
+err_reactor_init:
   syslog(LOG_INFO, "ev_collect_data() exited gracefully.");
 }
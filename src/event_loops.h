@@ -1,8 +1,28 @@
 #ifndef EVENT_LOOPS_H
 #define EVENT_LOOPS_H
 
+#include <stdbool.h>
+
+/**
+ * @brief A socket-based client driven by the reactor event loop. All callbacks
+ * take obj as their only argument and, except socket() and want_write(),
+ * return 0 on success.
+ */
+struct ReactorClient {
+  void *obj;
+  // The socket currently in use, or -1 if the client is disconnected
+  int (*socket)(void *obj);
+  bool (*want_write)(void *obj);
+  int (*handle_read)(void *obj);
+  int (*handle_write)(void *obj);
+  // Periodic housekeeping such as keepalive, called about once per second
+  int (*handle_misc)(void *obj);
+  // Called about once per second for as long as the client is disconnected
+  int (*reconnect)(void *obj);
+};
+
 void *ev_post_collection_handling();
 
-void *ev_collect_data();
+void ev_collect_data();
 
 #endif // EVENT_LOOPS_H
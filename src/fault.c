@@ -0,0 +1,177 @@
+#include "fault.h"
+#include "utils.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+struct FaultConfig {
+  double latency_rate;
+  uint64_t latency_ms;
+  double hang_rate;
+  uint64_t hang_ms;
+  double error_rate;
+  double outage_rate;
+  uint64_t outage_ms;
+};
+
+struct FaultCounters {
+  uint64_t calls;
+  uint64_t delays;
+  uint64_t hangs;
+  uint64_t errors;
+  uint64_t outages;
+  // Calls failed because an outage was going on
+  uint64_t outage_calls;
+};
+
+struct FaultSiteState {
+  bool enabled;
+  struct FaultConfig config;
+  // CLOCK_MONOTONIC ms the current outage ends at, 0 if none
+  uint64_t outage_until_ms;
+  struct FaultCounters counters;
+};
+
+static const char *const site_names[FAULT_SITE_COUNT] = {
+    [FAULT_DEVICE] = "device", [FAULT_MQTT] = "mqtt"};
+
+static struct {
+  bool enabled;
+  pthread_mutex_t lock;
+  unsigned int seed;
+  struct FaultSiteState sites[FAULT_SITE_COUNT];
+} faults = {.enabled = false, .lock = PTHREAD_MUTEX_INITIALIZER};
+
+static uint64_t fault_now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Uniform in [0, 1), called with faults.lock held
+static double fault_draw() {
+  return rand_r(&faults.seed) / ((double)RAND_MAX + 1);
+}
+
+static int fault_parse_site(const json_object *root_site,
+                            struct FaultConfig *c, const char *name) {
+  json_object *json_ele;
+  if (json_object_object_get_ex(root_site, "latency_rate", &json_ele))
+    c->latency_rate = json_object_get_double(json_ele);
+  if (json_object_object_get_ex(root_site, "latency_ms", &json_ele))
+    c->latency_ms = json_object_get_uint64(json_ele);
+  if (json_object_object_get_ex(root_site, "hang_rate", &json_ele))
+    c->hang_rate = json_object_get_double(json_ele);
+  if (json_object_object_get_ex(root_site, "hang_ms", &json_ele))
+    c->hang_ms = json_object_get_uint64(json_ele);
+  if (json_object_object_get_ex(root_site, "error_rate", &json_ele))
+    c->error_rate = json_object_get_double(json_ele);
+  if (json_object_object_get_ex(root_site, "outage_rate", &json_ele))
+    c->outage_rate = json_object_get_double(json_ele);
+  if (json_object_object_get_ex(root_site, "outage_ms", &json_ele))
+    c->outage_ms = json_object_get_uint64(json_ele);
+  const double rates[] = {c->latency_rate, c->hang_rate, c->error_rate,
+                          c->outage_rate};
+  for (size_t i = 0; i < sizeof(rates) / sizeof(rates[0]); ++i) {
+    if (rates[i] < 0 || rates[i] > 1) {
+      SYSLOG_ERR("fault_injection/%s: rates must be between 0 and 1", name);
+      return -1;
+    }
+  }
+  syslog(LOG_WARNING,
+         "Injecting faults into %s calls: delay %.4f x %lu ms, hang %.4f x "
+         "%lu ms, error %.4f, outage %.4f x %lu ms",
+         name, c->latency_rate, (unsigned long)c->latency_ms, c->hang_rate,
+         (unsigned long)c->hang_ms, c->error_rate, c->outage_rate,
+         (unsigned long)c->outage_ms);
+  return 0;
+}
+
+int fault_init(const json_object *config_root) {
+  json_object *root_faults, *root_site, *json_ele;
+  faults.enabled = false;
+  if (!json_object_object_get_ex(config_root, "fault_injection", &root_faults))
+    return 0;
+
+  faults.seed = (unsigned int)time(NULL);
+  // A fixed seed makes a run's faults repeat in the next one
+  if (json_object_object_get_ex(root_faults, "seed", &json_ele))
+    faults.seed = json_object_get_int(json_ele);
+  for (size_t i = 0; i < FAULT_SITE_COUNT; ++i) {
+    struct FaultSiteState *s = &faults.sites[i];
+    *s = (struct FaultSiteState){.enabled = false};
+    if (!json_object_object_get_ex(root_faults, site_names[i], &root_site))
+      continue;
+    if (fault_parse_site(root_site, &s->config, site_names[i]) != 0)
+      return -1;
+    s->enabled = true;
+  }
+  faults.enabled = true;
+  return 0;
+}
+
+enum FaultResult fault_inject(enum FaultSite site) {
+  if (!faults.enabled || !faults.sites[site].enabled)
+    return FAULT_NONE;
+  struct FaultSiteState *s = &faults.sites[site];
+  const struct FaultConfig *c = &s->config;
+  uint64_t delay_ms = 0;
+  enum FaultResult result = FAULT_NONE;
+
+  pthread_mutex_lock(&faults.lock);
+  ++s->counters.calls;
+  const uint64_t now_ms = fault_now_ms();
+  if (now_ms < s->outage_until_ms) {
+    ++s->counters.outage_calls;
+    result = FAULT_ERROR;
+  } else if (c->outage_rate > 0 && fault_draw() < c->outage_rate) {
+    ++s->counters.outages;
+    s->outage_until_ms = now_ms + c->outage_ms;
+    result = FAULT_OUTAGE;
+  } else if (c->hang_rate > 0 && fault_draw() < c->hang_rate) {
+    ++s->counters.hangs;
+    delay_ms = c->hang_ms;
+    result = FAULT_ERROR;
+  } else if (c->error_rate > 0 && fault_draw() < c->error_rate) {
+    ++s->counters.errors;
+    result = FAULT_ERROR;
+  } else if (c->latency_rate > 0 && fault_draw() < c->latency_rate) {
+    ++s->counters.delays;
+    delay_ms = c->latency_ms;
+  }
+  pthread_mutex_unlock(&faults.lock);
+
+  if (delay_ms > 0)
+    sleep_us(delay_ms * 1000);
+  return result;
+}
+
+bool fault_in_outage(enum FaultSite site) {
+  if (!faults.enabled || !faults.sites[site].enabled)
+    return false;
+  pthread_mutex_lock(&faults.lock);
+  const bool in_outage = fault_now_ms() < faults.sites[site].outage_until_ms;
+  pthread_mutex_unlock(&faults.lock);
+  return in_outage;
+}
+
+void fault_destroy() {
+  if (!faults.enabled)
+    return;
+  for (size_t i = 0; i < FAULT_SITE_COUNT; ++i) {
+    const struct FaultSiteState *s = &faults.sites[i];
+    if (!s->enabled)
+      continue;
+    syslog(LOG_INFO,
+           "Faults injected into %lu %s call(s): %lu delay(s), %lu hang(s), "
+           "%lu error(s), %lu outage(s) failing %lu more call(s)",
+           (unsigned long)s->counters.calls, site_names[i],
+           (unsigned long)s->counters.delays, (unsigned long)s->counters.hangs,
+           (unsigned long)s->counters.errors,
+           (unsigned long)s->counters.outages,
+           (unsigned long)s->counters.outage_calls);
+  }
+  faults.enabled = false;
+}
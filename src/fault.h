@@ -0,0 +1,62 @@
+#ifndef FAULT_H
+#define FAULT_H
+
+#include <json-c/json.h>
+
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// The call paths faults can be injected into
+enum FaultSite {
+  // Every bus transaction made through device_cache.h
+  FAULT_DEVICE,
+  // mqtt_publish() and the connection attempts of libs/mqtt
+  FAULT_MQTT,
+  FAULT_SITE_COUNT
+};
+
+enum FaultResult {
+  // Go ahead with the call, possibly after an injected delay
+  FAULT_NONE = 0,
+  // Fail the call without making it
+  FAULT_ERROR = 1,
+  // Fail the call, and an outage starts with it: a site holding a
+  // connection drops it
+  FAULT_OUTAGE = 2
+};
+
+/**
+ * @brief Set up the optional "fault_injection" object of the config root,
+ * e.g., {"seed": 1, "device": {...}, "mqtt": {...}}. Each site takes
+ * latency_rate/latency_ms (delay the call), hang_rate/hang_ms (delay, then
+ * fail it), error_rate (fail it) and outage_rate/outage_ms (fail every call
+ * for outage_ms). Rates are probabilities per call. Without the object, or
+ * before this is called, nothing is ever injected.
+ * @return 0 on success, negative number on invalid config
+ */
+int fault_init(const json_object *config_root);
+
+/**
+ * @brief Draw the faults of one call at site, sleeping for an injected delay
+ * or hang. Thread-safe.
+ */
+enum FaultResult fault_inject(enum FaultSite site);
+
+/**
+ * @return true while an injected outage of site lasts. Draws nothing.
+ */
+bool fault_in_outage(enum FaultSite site);
+
+/**
+ * @brief Log what was injected and turn injection off
+ */
+void fault_destroy();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // FAULT_H
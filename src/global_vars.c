@@ -8,3 +8,10 @@ volatile sig_atomic_t ev_flag = 0;
 json_object *gv_config_root = NULL;
 
 uint64_t gv_collection_event_interval_ms = 1000;
+
+uint64_t gv_device_cache_ttl_ms = 0;
+const char *gv_device_cache_dir = "/run/sdp";
+
+bool gv_reactor_enabled = false;
+
+int (*gv_reactor_attach)(const struct ReactorClient *client) = NULL;
@@ -16,4 +16,23 @@ extern volatile sig_atomic_t ev_flag;
 
 extern uint64_t gv_collection_event_interval_ms;
 
+// See device_cache_read()
+extern uint64_t gv_device_cache_ttl_ms;
+extern const char *gv_device_cache_dir;
+
+/**
+ * @brief true if "event_loop" is "reactor", i.e., collection ticks, signals
+ * and MQTT sockets are all served by one epoll set on the main thread
+ */
+extern bool gv_reactor_enabled;
+
+struct ReactorClient;
+/**
+ * @brief Set by the reactor before post_collection_init() is called, NULL
+ * otherwise. Network clients (e.g., MQTT) hand themselves over to it instead
+ * of spawning their own network thread.
+ * @return 0 on success or -1 if the reactor can't take more clients
+ */
+extern int (*gv_reactor_attach)(const struct ReactorClient *client);
+
 #endif // GLOBAL_VARS_H
@@ -0,0 +1,294 @@
+#include "gorilla.h"
+#include "shm_layout.h"
+
+#include <endian.h>
+#include <math.h>
+#include <string.h>
+
+struct BitWriter {
+  uint8_t *buf;
+  size_t size;
+  // Bits written so far
+  size_t pos;
+  bool overflow;
+};
+
+struct BitReader {
+  const uint8_t *buf;
+  size_t size;
+  size_t pos;
+  bool overflow;
+};
+
+// Append the n (<= 64) low bits of v, most significant first
+static void bw_put(struct BitWriter *w, uint64_t v, unsigned n) {
+  if (w->pos + n > w->size * 8) {
+    w->overflow = true;
+    return;
+  }
+  while (n > 0) {
+    const unsigned free_bits = 8 - w->pos % 8;
+    const unsigned take = n < free_bits ? n : free_bits;
+    const uint8_t chunk = (v >> (n - take)) & ((1u << take) - 1);
+    w->buf[w->pos / 8] |= chunk << (free_bits - take);
+    w->pos += take;
+    n -= take;
+  }
+}
+
+static uint64_t br_get(struct BitReader *r, unsigned n) {
+  if (r->pos + n > r->size * 8) {
+    r->overflow = true;
+    return 0;
+  }
+  uint64_t v = 0;
+  while (n > 0) {
+    const unsigned avail = 8 - r->pos % 8;
+    const unsigned take = n < avail ? n : avail;
+    const uint8_t chunk =
+        (r->buf[r->pos / 8] >> (avail - take)) & ((1u << take) - 1);
+    v = v << take | chunk;
+    r->pos += take;
+    n -= take;
+  }
+  return v;
+}
+
+static int64_t sign_extend(uint64_t v, unsigned bits) {
+  const uint64_t sign = (uint64_t)1 << (bits - 1);
+  return (int64_t)((v ^ sign) - sign);
+}
+
+int gorilla_batch_init(struct GorillaBatch *b, const struct ModuleInfo *info) {
+  if (info->metric_count > SDP_READINGS_MAX)
+    return -1;
+  b->columns = info->metric_count;
+  b->rows = 0;
+  for (size_t c = 0; c < b->columns; ++c)
+    b->name_hashes[c] = sdp_fnv1a32(info->metrics[c].name);
+  return 0;
+}
+
+int gorilla_batch_append(struct GorillaBatch *b, const struct ModuleInfo *info,
+                         const struct ReadingRecord *r) {
+  if (b->rows >= GORILLA_MAX_ROWS)
+    return -1;
+  const size_t row = b->rows++;
+  int64_t newest_ms = 0;
+  for (size_t c = 0; c < b->columns; ++c) {
+    b->values[row][c] = NAN;
+    b->qualities[row][c] = READING_BAD;
+  }
+  for (size_t i = 0; i < r->count; ++i) {
+    const uint16_t c = r->metric_ids[i];
+    if (c >= b->columns)
+      continue;
+    const double scale = pow(10, info->metrics[c].decimals);
+    b->values[row][c] = round(r->values[i] * scale) / scale;
+    b->qualities[row][c] = r->qualities[i];
+    if (r->timestamps_ms[i] > newest_ms)
+      newest_ms = r->timestamps_ms[i];
+  }
+  b->timestamps_ms[row] = newest_ms;
+  return 0;
+}
+
+size_t gorilla_encoded_max(size_t columns, size_t rows) {
+  const size_t more = rows > 0 ? rows - 1 : 0;
+  const size_t bits = 64 + more * (4 + 64) +
+                      columns * (2 + more * 3 + 64 + more * (2 + 5 + 6 + 64));
+  return GORILLA_HEADER_LEN + columns * 4 + (bits + 7) / 8;
+}
+
+/*
+ * Delta-of-delta d of a timestamp:
+ *   d == 0              '0'
+ *   -64 <= d < 64       '10'   + 7 bits
+ *   -256 <= d < 256     '110'  + 9 bits
+ *   -2048 <= d < 2048   '1110' + 12 bits
+ *   otherwise           '1111' + 64 bits
+ */
+static void encode_timestamps(struct BitWriter *w,
+                              const struct GorillaBatch *b) {
+  bw_put(w, (uint64_t)b->timestamps_ms[0], 64);
+  int64_t prev_delta = 0;
+  for (size_t row = 1; row < b->rows; ++row) {
+    const int64_t delta = b->timestamps_ms[row] - b->timestamps_ms[row - 1];
+    const int64_t dod = delta - prev_delta;
+    prev_delta = delta;
+    if (dod == 0) {
+      bw_put(w, 0, 1);
+    } else if (dod >= -64 && dod < 64) {
+      bw_put(w, 0x2, 2);
+      bw_put(w, (uint64_t)dod, 7);
+    } else if (dod >= -256 && dod < 256) {
+      bw_put(w, 0x6, 3);
+      bw_put(w, (uint64_t)dod, 9);
+    } else if (dod >= -2048 && dod < 2048) {
+      bw_put(w, 0xE, 4);
+      bw_put(w, (uint64_t)dod, 12);
+    } else {
+      bw_put(w, 0xF, 4);
+      bw_put(w, (uint64_t)dod, 64);
+    }
+  }
+}
+
+static void decode_timestamps(struct BitReader *r, struct GorillaBatch *b) {
+  b->timestamps_ms[0] = (int64_t)br_get(r, 64);
+  int64_t prev_delta = 0;
+  for (size_t row = 1; row < b->rows; ++row) {
+    int64_t dod;
+    if (br_get(r, 1) == 0)
+      dod = 0;
+    else if (br_get(r, 1) == 0)
+      dod = sign_extend(br_get(r, 7), 7);
+    else if (br_get(r, 1) == 0)
+      dod = sign_extend(br_get(r, 9), 9);
+    else if (br_get(r, 1) == 0)
+      dod = sign_extend(br_get(r, 12), 12);
+    else
+      dod = (int64_t)br_get(r, 64);
+    prev_delta += dod;
+    b->timestamps_ms[row] = b->timestamps_ms[row - 1] + prev_delta;
+  }
+}
+
+/*
+ * Each value after the first is XORed with its predecessor x:
+ *   x == 0                                   '0'
+ *   x's meaningful bits fit the last window  '10' + the window's bits
+ *   otherwise                                '11' + 5 bits of leading zeros
+ *                                            + 6 bits of length - 1 + bits
+ */
+static void encode_column(struct BitWriter *w, const struct GorillaBatch *b,
+                          size_t c) {
+  bw_put(w, b->qualities[0][c], 2);
+  for (size_t row = 1; row < b->rows; ++row) {
+    if (b->qualities[row][c] == b->qualities[row - 1][c]) {
+      bw_put(w, 0, 1);
+    } else {
+      bw_put(w, 1, 1);
+      bw_put(w, b->qualities[row][c], 2);
+    }
+  }
+
+  uint64_t prev;
+  memcpy(&prev, &b->values[0][c], sizeof(prev));
+  bw_put(w, prev, 64);
+  // No window yet
+  unsigned win_lead = 65, win_trail = 0;
+  for (size_t row = 1; row < b->rows; ++row) {
+    uint64_t cur;
+    memcpy(&cur, &b->values[row][c], sizeof(cur));
+    const uint64_t x = cur ^ prev;
+    prev = cur;
+    if (x == 0) {
+      bw_put(w, 0, 1);
+      continue;
+    }
+    unsigned lead = __builtin_clzll(x);
+    const unsigned trail = __builtin_ctzll(x);
+    if (lead >= win_lead && trail >= win_trail && win_lead <= 64) {
+      bw_put(w, 0x2, 2);
+      bw_put(w, x >> win_trail, 64 - win_lead - win_trail);
+      continue;
+    }
+    if (lead > 31)
+      lead = 31;
+    const unsigned len = 64 - lead - trail;
+    bw_put(w, 0x3, 2);
+    bw_put(w, lead, 5);
+    bw_put(w, len - 1, 6);
+    bw_put(w, x >> trail, len);
+    win_lead = lead;
+    win_trail = trail;
+  }
+}
+
+static void decode_column(struct BitReader *r, struct GorillaBatch *b,
+                          size_t c) {
+  b->qualities[0][c] = br_get(r, 2);
+  for (size_t row = 1; row < b->rows; ++row)
+    b->qualities[row][c] =
+        br_get(r, 1) == 0 ? b->qualities[row - 1][c] : br_get(r, 2);
+
+  uint64_t prev = br_get(r, 64);
+  memcpy(&b->values[0][c], &prev, sizeof(prev));
+  unsigned win_lead = 65, win_trail = 0;
+  for (size_t row = 1; row < b->rows; ++row) {
+    if (br_get(r, 1) == 1) {
+      if (br_get(r, 1) == 1) {
+        win_lead = br_get(r, 5);
+        const unsigned len = br_get(r, 6) + 1;
+        if (win_lead + len > 64) {
+          r->overflow = true;
+          return;
+        }
+        win_trail = 64 - win_lead - len;
+      } else if (win_lead > 64) {
+        // A window is used before one was set
+        r->overflow = true;
+        return;
+      }
+      prev ^= br_get(r, 64 - win_lead - win_trail) << win_trail;
+    }
+    memcpy(&b->values[row][c], &prev, sizeof(prev));
+  }
+}
+
+size_t gorilla_encode(const struct GorillaBatch *b, uint8_t *buf,
+                      size_t size) {
+  const size_t head_len = GORILLA_HEADER_LEN + b->columns * 4;
+  if (b->rows == 0 || size < head_len)
+    return 0;
+  uint32_t u32 = htobe32(GORILLA_MAGIC);
+  memcpy(buf, &u32, sizeof(u32));
+  buf[4] = GORILLA_VERSION;
+  buf[5] = b->columns;
+  const uint16_t rows = htobe16(b->rows);
+  memcpy(buf + 6, &rows, sizeof(rows));
+  for (size_t c = 0; c < b->columns; ++c) {
+    u32 = htobe32(b->name_hashes[c]);
+    memcpy(buf + GORILLA_HEADER_LEN + c * 4, &u32, sizeof(u32));
+  }
+  struct BitWriter w = {
+      .buf = buf + head_len, .size = size - head_len, .pos = 0};
+  memset(w.buf, 0, w.size);
+  encode_timestamps(&w, b);
+  for (size_t c = 0; c < b->columns; ++c)
+    encode_column(&w, b, c);
+  return w.overflow ? 0 : head_len + (w.pos + 7) / 8;
+}
+
+bool gorilla_is_batch(const uint8_t *buf, size_t len) {
+  uint32_t magic;
+  if (len < GORILLA_HEADER_LEN)
+    return false;
+  memcpy(&magic, buf, sizeof(magic));
+  return be32toh(magic) == GORILLA_MAGIC;
+}
+
+int gorilla_decode(const uint8_t *buf, size_t len, struct GorillaBatch *b) {
+  if (!gorilla_is_batch(buf, len) || buf[4] != GORILLA_VERSION ||
+      buf[5] > SDP_READINGS_MAX)
+    return -1;
+  uint16_t rows;
+  memcpy(&rows, buf + 6, sizeof(rows));
+  b->columns = buf[5];
+  b->rows = be16toh(rows);
+  const size_t head_len = GORILLA_HEADER_LEN + b->columns * 4;
+  if (b->rows == 0 || b->rows > GORILLA_MAX_ROWS || len < head_len)
+    return -1;
+  for (size_t c = 0; c < b->columns; ++c) {
+    uint32_t hash;
+    memcpy(&hash, buf + GORILLA_HEADER_LEN + c * 4, sizeof(hash));
+    b->name_hashes[c] = be32toh(hash);
+  }
+  struct BitReader r = {
+      .buf = buf + head_len, .size = len - head_len, .pos = 0};
+  decode_timestamps(&r, b);
+  for (size_t c = 0; c < b->columns && !r.overflow; ++c)
+    decode_column(&r, b, c);
+  return r.overflow ? -1 : 0;
+}
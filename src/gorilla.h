@@ -0,0 +1,82 @@
+#ifndef GORILLA_H
+#define GORILLA_H
+
+#include "modules/readings.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// "SDPG"
+#define GORILLA_MAGIC 0x53445047
+// Bumped whenever the encoding changes
+#define GORILLA_VERSION 1
+#define GORILLA_MAX_ROWS 256
+// magic, version, column count, row count
+#define GORILLA_HEADER_LEN (4 + 1 + 1 + 2)
+
+/**
+ * @brief A batch of records as columns, the unit gorilla_encode() compresses.
+ * Column c holds metric id c of the producing module. A cell without a
+ * reading is NaN with quality READING_BAD.
+ */
+struct GorillaBatch {
+  size_t columns;
+  // sdp_fnv1a32() of each column's metric name, so consumers bind columns
+  // by name like they do with shm and multicast readings
+  uint32_t name_hashes[SDP_READINGS_MAX];
+  size_t rows;
+  // The newest timestamp of each row's readings
+  int64_t timestamps_ms[GORILLA_MAX_ROWS];
+  double values[GORILLA_MAX_ROWS][SDP_READINGS_MAX];
+  uint8_t qualities[GORILLA_MAX_ROWS][SDP_READINGS_MAX];
+};
+
+/**
+ * @brief Set up an empty batch with one column per metric of info.
+ * @return 0 on success, -1 if info has too many metrics
+ */
+int gorilla_batch_init(struct GorillaBatch *b, const struct ModuleInfo *info);
+
+/**
+ * @brief Append r as the next row. Values are rounded to their metric's
+ * decimals first, which is all a JSON payload would carry anyway and what
+ * makes consecutive values XOR to few bits.
+ * @return 0 on success, -1 if the batch is full
+ */
+int gorilla_batch_append(struct GorillaBatch *b, const struct ModuleInfo *info,
+                         const struct ReadingRecord *r);
+
+/**
+ * @return Size of a buffer large enough for any batch of this shape
+ */
+size_t gorilla_encoded_max(size_t columns, size_t rows);
+
+/**
+ * @brief Compress b: timestamps as delta-of-deltas, then, column by column,
+ * qualities as "same as before" bits and values XORed with the previous one,
+ * as in Facebook's Gorilla.
+ * @return Length of the encoded batch, 0 if size is too small
+ */
+size_t gorilla_encode(const struct GorillaBatch *b, uint8_t *buf,
+                      size_t size);
+
+/**
+ * @return true if buf starts like an encoded batch, i.e., isn't JSON
+ */
+bool gorilla_is_batch(const uint8_t *buf, size_t len);
+
+/**
+ * @return 0 on success, -1 if buf isn't a valid encoded batch
+ */
+int gorilla_decode(const uint8_t *buf, size_t len, struct GorillaBatch *b);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // GORILLA_H
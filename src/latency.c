@@ -0,0 +1,23 @@
+#include "latency.h"
+
+void latency_add(struct LatencyHistogram *h, uint64_t us) {
+  size_t bucket = 0;
+  while (bucket < LATENCY_BUCKETS - 1 && (us >> bucket) > 0)
+    ++bucket;
+  ++h->buckets[bucket];
+  ++h->count;
+  h->sum_us += us;
+  if (us > h->max_us)
+    h->max_us = us;
+}
+
+uint64_t latency_quantile(const struct LatencyHistogram *h, double q) {
+  if (h->count == 0)
+    return 0;
+  const uint64_t rank = (uint64_t)(q * (h->count - 1)) + 1;
+  uint64_t seen = 0;
+  for (size_t i = 0; i < LATENCY_BUCKETS; ++i)
+    if ((seen += h->buckets[i]) >= rank)
+      return i == 0 ? 1 : (uint64_t)1 << i;
+  return h->max_us;
+}
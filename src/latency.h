@@ -0,0 +1,29 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Bucket i counts latencies in [2^(i-1), 2^i) us, bucket 0 those below 1 us
+#define LATENCY_BUCKETS 32
+
+/**
+ * @brief Log2 histogram of latencies over one metrics window. Resetting it is
+ * a memset() to 0.
+ */
+struct LatencyHistogram {
+  uint64_t count;
+  uint64_t sum_us;
+  uint64_t max_us;
+  uint64_t buckets[LATENCY_BUCKETS];
+};
+
+void latency_add(struct LatencyHistogram *h, uint64_t us);
+
+/**
+ * @return Upper bound (us) of the bucket the given quantile falls into, 0 if
+ * h is empty
+ */
+uint64_t latency_quantile(const struct LatencyHistogram *h, double q);
+
+#endif // LATENCY_H
@@ -0,0 +1,150 @@
+#include "loop_metrics.h"
+#include "latency.h"
+#include "utils.h"
+
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+#define LOOP_DEFAULT_METRICS_INTERVAL_SEC 300
+
+static const char *const stage_names[LOOP_STAGE_COUNT] = {
+    [LOOP_STAGE_COLLECTION] = "collection()",
+    [LOOP_STAGE_SINKS] = "sinks_write()",
+    [LOOP_STAGE_POST_COLLECTION] = "post_collection()"};
+
+struct StageMetrics {
+  // Over the current window
+  struct LatencyHistogram duration;
+  uint64_t failed;
+  // Over the whole run
+  uint64_t failed_total;
+  // CLOCK_MONOTONIC us the current failure streak began at, 0 if none
+  uint64_t failing_since_us;
+  uint64_t streak;
+  uint64_t recoveries;
+  uint64_t recovery_sum_ms;
+  uint64_t recovery_max_ms;
+};
+
+static struct {
+  uint64_t interval_sec;
+  time_t window_start;
+  uint64_t last_tick_us;
+  // Time between the starts of consecutive ticks, over the current window
+  struct LatencyHistogram period;
+  uint64_t ticks;
+  uint64_t ticks_total;
+  struct StageMetrics stages[LOOP_STAGE_COUNT];
+} loop;
+
+static uint64_t loop_now_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 * 1000 + ts.tv_nsec / 1000;
+}
+
+int loop_metrics_init(const json_object *config_root) {
+  json_object *root_metrics, *json_ele;
+  memset(&loop, 0, sizeof(loop));
+  loop.interval_sec = LOOP_DEFAULT_METRICS_INTERVAL_SEC;
+  if (json_object_object_get_ex(config_root, "loop_metrics", &root_metrics) &&
+      json_object_object_get_ex(root_metrics, "interval_sec", &json_ele))
+    loop.interval_sec = json_object_get_uint64(json_ele);
+  loop.window_start = time(NULL);
+  return 0;
+}
+
+void loop_metrics_tick() {
+  const uint64_t now_us = loop_now_us();
+  if (loop.last_tick_us > 0)
+    latency_add(&loop.period, now_us - loop.last_tick_us);
+  loop.last_tick_us = now_us;
+  ++loop.ticks;
+  ++loop.ticks_total;
+}
+
+uint64_t loop_metrics_stage_start() { return loop_now_us(); }
+
+void loop_metrics_stage(enum LoopStage stage, uint64_t started_us, int rc) {
+  struct StageMetrics *m = &loop.stages[stage];
+  const uint64_t now_us = loop_now_us();
+  latency_add(&m->duration, now_us - started_us);
+  if (rc != 0) {
+    ++m->failed;
+    ++m->failed_total;
+    if (m->streak++ == 0)
+      m->failing_since_us = started_us;
+    return;
+  }
+  if (m->streak == 0)
+    return;
+  const uint64_t recovery_ms = (now_us - m->failing_since_us) / 1000;
+  ++m->recoveries;
+  m->recovery_sum_ms += recovery_ms;
+  if (recovery_ms > m->recovery_max_ms)
+    m->recovery_max_ms = recovery_ms;
+  syslog(LOG_INFO, "%s recovered after %lu failed call(s) in %lu ms",
+         stage_names[stage], (unsigned long)m->streak,
+         (unsigned long)recovery_ms);
+  m->streak = 0;
+  m->failing_since_us = 0;
+}
+
+static void loop_metrics_log() {
+  const time_t elapsed = time(NULL) - loop.window_start;
+  const struct LatencyHistogram *p = &loop.period;
+  syslog(LOG_INFO,
+         "loop: %lu tick(s) in %ld s (%.2f/s), period p50<=%luus, "
+         "p99<=%luus, max=%luus",
+         (unsigned long)loop.ticks, (long)elapsed,
+         elapsed > 0 ? (double)loop.ticks / elapsed : 0.0,
+         (unsigned long)latency_quantile(p, 0.5),
+         (unsigned long)latency_quantile(p, 0.99), (unsigned long)p->max_us);
+  for (size_t i = 0; i < LOOP_STAGE_COUNT; ++i) {
+    const struct StageMetrics *m = &loop.stages[i];
+    const struct LatencyHistogram *d = &m->duration;
+    if (d->count == 0)
+      continue;
+    syslog(LOG_INFO,
+           "loop: %s ran %lu time(s), failed=%lu, mean=%luus, p50<=%luus, "
+           "p99<=%luus, max=%luus",
+           stage_names[i], (unsigned long)d->count, (unsigned long)m->failed,
+           (unsigned long)(d->sum_us / d->count),
+           (unsigned long)latency_quantile(d, 0.5),
+           (unsigned long)latency_quantile(d, 0.99),
+           (unsigned long)d->max_us);
+  }
+  memset(&loop.period, 0, sizeof(loop.period));
+  loop.ticks = 0;
+  for (size_t i = 0; i < LOOP_STAGE_COUNT; ++i) {
+    memset(&loop.stages[i].duration, 0, sizeof(loop.stages[i].duration));
+    loop.stages[i].failed = 0;
+  }
+  loop.window_start = time(NULL);
+}
+
+void loop_metrics_maybe_log() {
+  if (loop.interval_sec > 0 &&
+      (uint64_t)(time(NULL) - loop.window_start) >= loop.interval_sec)
+    loop_metrics_log();
+}
+
+void loop_metrics_destroy() {
+  loop_metrics_log();
+  for (size_t i = 0; i < LOOP_STAGE_COUNT; ++i) {
+    const struct StageMetrics *m = &loop.stages[i];
+    if (m->failed_total == 0)
+      continue;
+    syslog(LOG_INFO,
+           "loop: %s failed %lu time(s) in %lu tick(s), recovered %lu "
+           "time(s), mean recovery %lu ms, max %lu ms%s",
+           stage_names[i], (unsigned long)m->failed_total,
+           (unsigned long)loop.ticks_total, (unsigned long)m->recoveries,
+           (unsigned long)(m->recoveries > 0
+                               ? m->recovery_sum_ms / m->recoveries
+                               : 0),
+           (unsigned long)m->recovery_max_ms,
+           m->streak > 0 ? ", still failing at exit" : "");
+  }
+}
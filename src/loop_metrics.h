@@ -0,0 +1,53 @@
+#ifndef LOOP_METRICS_H
+#define LOOP_METRICS_H
+
+#include <json-c/json.h>
+
+#include <stdint.h>
+
+// The steps of a collection tick that are timed
+enum LoopStage {
+  LOOP_STAGE_COLLECTION,
+  LOOP_STAGE_SINKS,
+  LOOP_STAGE_POST_COLLECTION,
+  LOOP_STAGE_COUNT
+};
+
+/**
+ * @brief Set up the timing of the collection loop. The optional
+ * "loop_metrics" object of the config root may set interval_sec (default
+ * 300, 0 to only log on exit), how often the metrics are logged.
+ * @return 0 on success, negative number on invalid config
+ */
+int loop_metrics_init(const json_object *config_root);
+
+/**
+ * @brief Mark the start of a collection tick
+ */
+void loop_metrics_tick();
+
+/**
+ * @return The CLOCK_MONOTONIC time a stage starts at, in us
+ */
+uint64_t loop_metrics_stage_start();
+
+/**
+ * @brief Account for one run of stage that started at started_us, as
+ * returned by loop_metrics_stage_start(), and returned rc. A non-zero rc
+ * starts or extends a failure streak of the stage, the next zero rc ends it:
+ * the streak's length is the stage's recovery time.
+ */
+void loop_metrics_stage(enum LoopStage stage, uint64_t started_us, int rc);
+
+/**
+ * @brief Log the metrics, if interval_sec has passed since they were last
+ * logged. Called once per tick, at its end.
+ */
+void loop_metrics_maybe_log();
+
+/**
+ * @brief Log the metrics of the last window and the recovery summary
+ */
+void loop_metrics_destroy();
+
+#endif // LOOP_METRICS_H
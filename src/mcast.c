@@ -0,0 +1,89 @@
+#include "mcast.h"
+#include "utils.h"
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+
+#include <string.h>
+
+static int mcast_mac(const uint8_t *key, size_t key_len, const uint8_t *data,
+                     size_t len, uint8_t *mac) {
+  uint8_t full[EVP_MAX_MD_SIZE];
+  unsigned int full_len = 0;
+  if (HMAC(EVP_sha256(), key, key_len, data, len, full, &full_len) == NULL ||
+      full_len < MCAST_MAC_LEN)
+    return -1;
+  memcpy(mac, full, MCAST_MAC_LEN);
+  return 0;
+}
+
+size_t mcast_encode(const struct McastDatagram *d, const uint8_t *key,
+                    size_t key_len, uint8_t *buf) {
+  if (d->count > SDP_READINGS_MAX)
+    return 0;
+  int64_t base = 0;
+  for (size_t i = 0; i < d->count; ++i)
+    if (i == 0 || d->readings[i].timestamp_ms < base)
+      base = d->readings[i].timestamp_ms;
+
+  uint8_t *p = buf;
+  put_be32(p, MCAST_MAGIC);
+  p += 4;
+  *p++ = MCAST_VERSION;
+  *p++ = (uint8_t)d->count;
+  *p++ = 0;
+  *p++ = 0;
+  put_be32(p, d->sender_id);
+  put_be64(p + 4, d->seq);
+  put_be64(p + 12, (uint64_t)base);
+  p += 20;
+  for (size_t i = 0; i < d->count; ++i) {
+    const struct McastReading *r = &d->readings[i];
+    const int64_t delta = r->timestamp_ms - base;
+    uint64_t bits;
+    memcpy(&bits, &r->value, sizeof(bits));
+    put_be32(p, r->name_hash);
+    p[4] = r->quality;
+    put_be64(p + 5, bits);
+    // Readings of one record are taken within seconds of each other
+    put_be32(p + 13, delta > UINT32_MAX ? UINT32_MAX : (uint32_t)delta);
+    p += MCAST_ENTRY_LEN;
+  }
+  if (mcast_mac(key, key_len, buf, p - buf, p) != 0)
+    return 0;
+  return p - buf + MCAST_MAC_LEN;
+}
+
+int mcast_decode(const uint8_t *buf, size_t len, const uint8_t *key,
+                 size_t key_len, struct McastDatagram *d) {
+  if (len < MCAST_HEADER_LEN + MCAST_MAC_LEN)
+    return -1;
+  const uint8_t *p = buf + 4;
+  if (get_be32(buf) != MCAST_MAGIC || p[0] != MCAST_VERSION ||
+      p[1] > SDP_READINGS_MAX ||
+      len != MCAST_HEADER_LEN + (size_t)p[1] * MCAST_ENTRY_LEN + MCAST_MAC_LEN)
+    return -1;
+  // Nothing is trusted before the MAC is verified
+  uint8_t mac[MCAST_MAC_LEN];
+  if (mcast_mac(key, key_len, buf, len - MCAST_MAC_LEN, mac) != 0 ||
+      CRYPTO_memcmp(mac, buf + len - MCAST_MAC_LEN, MCAST_MAC_LEN) != 0)
+    return -2;
+
+  d->count = p[1];
+  p += 4;
+  d->sender_id = get_be32(p);
+  d->seq = get_be64(p + 4);
+  const uint64_t base = get_be64(p + 12);
+  p += 20;
+  for (size_t i = 0; i < d->count; ++i) {
+    struct McastReading *r = &d->readings[i];
+    const uint64_t bits = get_be64(p + 5);
+    r->name_hash = get_be32(p);
+    r->quality = p[4];
+    memcpy(&r->value, &bits, sizeof(bits));
+    r->timestamp_ms = (int64_t)base + get_be32(p + 13);
+    p += MCAST_ENTRY_LEN;
+  }
+  return 0;
+}
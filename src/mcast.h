@@ -0,0 +1,68 @@
+#ifndef MCAST_H
+#define MCAST_H
+
+#include "modules/readings.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// "SDPM"
+#define MCAST_MAGIC 0x5344504D
+// Bumped whenever the datagram layout changes
+#define MCAST_VERSION 1
+// HMAC-SHA256, truncated
+#define MCAST_MAC_LEN 16
+// magic, version, count, reserved, sender_id, seq, base_timestamp_ms
+#define MCAST_HEADER_LEN (4 + 1 + 1 + 2 + 4 + 8 + 8)
+// name_hash, quality, value, timestamp_ms - base_timestamp_ms
+#define MCAST_ENTRY_LEN (4 + 1 + 8 + 4)
+#define MCAST_DATAGRAM_MAX                                                     \
+  (MCAST_HEADER_LEN + SDP_READINGS_MAX * MCAST_ENTRY_LEN + MCAST_MAC_LEN)
+// Keys shorter than this are refused
+#define MCAST_KEY_MIN 16
+
+struct McastReading {
+  // sdp_fnv1a32() of the metric name, so datagrams need no metric table
+  uint32_t name_hash;
+  uint8_t quality;
+  double value;
+  int64_t timestamp_ms;
+};
+
+/**
+ * @brief One record on the wire. seq grows by one per datagram of a sender;
+ * sender_id is random per sdp process, so a restart (seq back to 1) is told
+ * apart from a replay.
+ */
+struct McastDatagram {
+  uint32_t sender_id;
+  uint64_t seq;
+  size_t count;
+  struct McastReading readings[SDP_READINGS_MAX];
+};
+
+/**
+ * @brief Serialize d (big-endian) and append its MAC.
+ * @param buf At least MCAST_DATAGRAM_MAX bytes
+ * @return Length of the datagram, 0 on failure
+ */
+size_t mcast_encode(const struct McastDatagram *d, const uint8_t *key,
+                    size_t key_len, uint8_t *buf);
+
+/**
+ * @brief Verify the MAC of a datagram and deserialize it.
+ * @return 0 on success, -1 if the datagram is malformed, -2 if its MAC
+ * doesn't match key
+ */
+int mcast_decode(const uint8_t *buf, size_t len, const uint8_t *key,
+                 size_t key_len, struct McastDatagram *d);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // MCAST_H
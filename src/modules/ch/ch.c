@@ -1,4 +1,8 @@
+#include "../../device_cache.h"
 #include "../../global_vars.h"
+#include "../../gorilla.h"
+#include "../../payload.h"
+#include "../../readings_json.h"
 #include "../../utils.h"
 #include "../libs/7seg.h"
 #include "../libs/mqtt.h"
@@ -11,6 +15,7 @@
 #include <fcntl.h>
 #include <limits.h>
 #include <linux/i2c-dev.h>
+#include <math.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <string.h>
@@ -18,17 +23,64 @@
 #include <syslog.h>
 #include <unistd.h>
 
+enum CHMetric { METRIC_TEMP_CELSIUS = 0, METRIC_COUNT };
+
+static const struct MetricDesc metrics[METRIC_COUNT] = {
+    [METRIC_TEMP_CELSIUS] = {
+        .name = "temp_celsius", .unit = "°C", .decimals = 6}};
+
+static const struct ModuleInfo info = {.abi_version = SDP_MODULE_ABI_VERSION,
+                                       .name = "ch",
+                                       .metric_count = METRIC_COUNT,
+                                       .metrics = metrics};
+
+#define CH_PAYLOAD_MAX 128
+#define CH_STREAM_BUF_SIZE 4096
+
 struct DL11MC {
-  double temperature_celsius;
   char *device_path;
 };
 
 struct CHContext {
   struct iotctrl_7seg_disp_handle *h;
   struct mosquitto *mosq;
+  // Legacy mode: every sample on its own, not retained. NULL if unused
   const char *topic;
+  struct PayloadTemplate tpl;
+
+  // Retained, only republished when a value changes at its configured
+  // decimals or state_max_interval_ms passes, so late joiners get the
+  // current reading from the broker right away. NULL if unused
+  const char *state_topic;
+  uint64_t state_max_interval_ms;
+  int64_t state_published_at_ms;
+  struct ReadingRecord last_state;
+  bool has_state;
+
+  // History as a JSON array of samples, published every stream_batch_size
+  // samples or once the oldest is stream_batch_max_age_ms old. NULL if unused
+  const char *stream_topic;
+  size_t stream_batch_size;
+  uint64_t stream_batch_max_age_ms;
+  char stream_buf[CH_STREAM_BUF_SIZE];
+  size_t stream_len;
+  size_t stream_count;
+  int64_t stream_first_ms;
+  // Set if stream_encoding is "gorilla": samples are batched here instead
+  // and published as one gorilla_encode()d message
+  struct GorillaBatch *stream_batch;
+  uint8_t *stream_encoded;
+  size_t stream_encoded_size;
 };
 
+const struct ModuleInfo *module_info(void) { return &info; }
+
+static int dl11_read(void *arg, void *sample, size_t sample_size) {
+  return iotctrl_get_temperature((const char *)arg,
+                                 sample_size / sizeof(int16_t),
+                                 (int16_t *)sample, 0);
+}
+
 void *post_collection_init(const json_object *config) {
   const json_object *root = config;
 
@@ -37,24 +89,67 @@ void *post_collection_init(const json_object *config) {
     SYSLOG_ERR("malloc() failed");
     goto err_malloc_chctx;
   }
-  struct json_object *json_ele;
-  const char *host = NULL;
-  const char *username = NULL;
-  const char *password = NULL;
-  const char *ca_file_path = NULL;
-  json_pointer_get((json_object *)config, "/ch/mqtt/host", &json_ele);
-  host = json_object_get_string(json_ele);
-  json_pointer_get((json_object *)config, "/ch/mqtt/username", &json_ele);
-  username = json_object_get_string(json_ele);
-  json_pointer_get((json_object *)config, "/ch/mqtt/password", &json_ele);
-  password = json_object_get_string(json_ele);
-  json_pointer_get((json_object *)config, "/ch/mqtt/ca_file_path", &json_ele);
-  ca_file_path = json_object_get_string(json_ele);
-  json_pointer_get((json_object *)config, "/ch/mqtt/topic", &json_ele);
-  chctx->topic = json_object_get_string(json_ele);
-  if (host == NULL || ca_file_path == NULL || username == NULL ||
-      password == NULL || chctx->topic == NULL) {
-    SYSLOG_ERR("Invalid configs");
+  struct json_object *json_ele = NULL;
+  chctx->topic = NULL;
+  if (json_pointer_get((json_object *)config, "/ch/mqtt/topic", &json_ele) ==
+      0)
+    chctx->topic = json_object_get_string(json_ele);
+  chctx->state_topic = NULL;
+  if (json_pointer_get((json_object *)config, "/ch/mqtt/state_topic",
+                       &json_ele) == 0)
+    chctx->state_topic = json_object_get_string(json_ele);
+  chctx->state_max_interval_ms = 60000;
+  if (json_pointer_get((json_object *)config, "/ch/mqtt/state_max_interval_ms",
+                       &json_ele) == 0)
+    chctx->state_max_interval_ms = json_object_get_uint64(json_ele);
+  chctx->has_state = false;
+  chctx->state_published_at_ms = 0;
+  chctx->stream_topic = NULL;
+  if (json_pointer_get((json_object *)config, "/ch/mqtt/stream_topic",
+                       &json_ele) == 0)
+    chctx->stream_topic = json_object_get_string(json_ele);
+  chctx->stream_batch_size = 10;
+  if (json_pointer_get((json_object *)config, "/ch/mqtt/stream_batch_size",
+                       &json_ele) == 0)
+    chctx->stream_batch_size = json_object_get_uint64(json_ele);
+  chctx->stream_batch_max_age_ms = 60000;
+  if (json_pointer_get((json_object *)config,
+                       "/ch/mqtt/stream_batch_max_age_ms", &json_ele) == 0)
+    chctx->stream_batch_max_age_ms = json_object_get_uint64(json_ele);
+  chctx->stream_len = 0;
+  chctx->stream_count = 0;
+  chctx->stream_batch = NULL;
+  chctx->stream_encoded = NULL;
+  const char *stream_encoding = "json";
+  if (json_pointer_get((json_object *)config, "/ch/mqtt/stream_encoding",
+                       &json_ele) == 0)
+    stream_encoding = json_object_get_string(json_ele);
+  if (strcmp(stream_encoding, "gorilla") == 0) {
+    if (chctx->stream_batch_size == 0 ||
+        chctx->stream_batch_size > GORILLA_MAX_ROWS) {
+      SYSLOG_ERR("/ch/mqtt/stream_batch_size must be between 1 and %d",
+                 GORILLA_MAX_ROWS);
+      goto err_invalid_settings;
+    }
+    chctx->stream_encoded_size =
+        gorilla_encoded_max(METRIC_COUNT, chctx->stream_batch_size);
+    chctx->stream_batch = malloc(sizeof(struct GorillaBatch));
+    chctx->stream_encoded = malloc(chctx->stream_encoded_size);
+    if (chctx->stream_batch == NULL || chctx->stream_encoded == NULL) {
+      SYSLOG_ERR("malloc() failed");
+      goto err_malloc_stream_batch;
+    }
+    gorilla_batch_init(chctx->stream_batch, &info);
+  } else if (strcmp(stream_encoding, "json") != 0) {
+    SYSLOG_ERR("/ch/mqtt/stream_encoding must be json or gorilla, not [%s]",
+               stream_encoding);
+    goto err_invalid_settings;
+  } else if (chctx->stream_batch_size == 0 ||
+             chctx->stream_batch_size * CH_PAYLOAD_MAX + 2 >
+                 CH_STREAM_BUF_SIZE) {
+    // "[" + samples + "," between them + "]" must fit in stream_buf
+    SYSLOG_ERR("/ch/mqtt/stream_batch_size must be between 1 and %d",
+               (CH_STREAM_BUF_SIZE - 2) / CH_PAYLOAD_MAX);
     goto err_invalid_settings;
   }
 
@@ -64,88 +159,152 @@ void *post_collection_init(const json_object *config) {
     goto err_init_7seg_from_json;
   }
 
-  int rc;
+  if (payload_template_init(&chctx->tpl, &info, "timestamp") != 0) {
+    SYSLOG_ERR("payload_template_init() failed");
+    goto err_payload_template_init;
+  }
 
-  /* Required before calling other mosquitto functions */
-  if (mosquitto_lib_init() != MOSQ_ERR_SUCCESS) {
-    SYSLOG_ERR("mosquitto_lib_init() failed");
-    goto err_init_mosquitto;
+  // Without any topic, post_collection() only drives the display, and an
+  // "mqtt" sink publishes the readings from its own thread instead
+  chctx->mosq = NULL;
+  if (chctx->topic == NULL && chctx->state_topic == NULL &&
+      chctx->stream_topic == NULL) {
+    syslog(LOG_INFO, "None of /ch/mqtt/{topic,state_topic,stream_topic} "
+                     "defined, readings are only displayed");
+    return chctx;
   }
-  /* Create a new client instance.
-   * id = NULL -> ask the broker to generate a client id for us
-   * clean session = true -> the broker should remove old sessions when we
-   * connect obj = NULL -> we aren't passing any of our private data for
-   * callbacks
-   */
-  chctx->mosq = mosquitto_new(NULL, true, NULL);
+  chctx->mosq = init_mosquitto_from_json(config, "/ch/mqtt");
   if (chctx->mosq == NULL) {
-    SYSLOG_ERR("mosquitto_new() failed");
+    SYSLOG_ERR("init_mosquitto_from_json() failed");
     goto err_init_mosquitto;
   }
-  if ((rc = mosquitto_username_pw_set(chctx->mosq, username, password)) !=
-      MOSQ_ERR_SUCCESS) {
-    SYSLOG_ERR("mosquitto_username_pw_set() failed: %s",
-               mosquitto_strerror(rc));
-    goto err_mosquitto_config;
-  }
-  if ((rc = mosquitto_tls_set(chctx->mosq, ca_file_path, NULL, NULL, NULL,
-                              NULL)) != MOSQ_ERR_SUCCESS) {
-    SYSLOG_ERR("mosquitto_tls_set() failed: %s", mosquitto_strerror(rc));
-    goto err_mosquitto_config;
-  }
-  mosquitto_connect_callback_set(chctx->mosq, mosq_on_connect);
-  mosquitto_disconnect_callback_set(chctx->mosq, mosq_on_connect);
-  mosquitto_publish_callback_set(chctx->mosq, mosq_on_publish);
-  mosquitto_log_callback_set(chctx->mosq, mosq_log_callback);
-
-  /*  This call makes the socket connection only, it does not complete
-   * the MQTT CONNECT/CONNACK flow, you should use mosquitto_loop_start() or
-   * mosquitto_loop_forever() for processing net traffic. */
-  rc = mosquitto_connect(chctx->mosq, host, 8883, 60);
-  if (rc != MOSQ_ERR_SUCCESS) {
-    SYSLOG_ERR("mosquitto_connect() failed: %s", mosquitto_strerror(rc));
-    goto err_mosquitto_connect;
-  }
-
-  /* Run the network loop in a background thread, this call returns quickly. */
-  if ((mosquitto_loop_start(chctx->mosq)) != MOSQ_ERR_SUCCESS) {
-    SYSLOG_ERR("mosquitto_loop_start() failed: %s", mosquitto_strerror(rc));
-    goto err_mosquitto_connect;
-  }
 
   return chctx;
-err_mosquitto_config:
-err_mosquitto_connect:
-  mosquitto_destroy(chctx->mosq);
 err_init_mosquitto:
+  payload_template_destroy(&chctx->tpl);
+err_payload_template_init:
+  iotctrl_7seg_disp_destroy(chctx->h);
 err_init_7seg_from_json:
+err_malloc_stream_batch:
+  free(chctx->stream_batch);
+  free(chctx->stream_encoded);
 err_invalid_settings:
   free(chctx);
 err_malloc_chctx:
   return NULL;
 }
 
-int post_collection(void *c_ctx, void *pc_ctx) {
+/**
+ * @return true if r differs from the last published state once rounded to
+ * each metric's decimals, which is all a subscriber can see
+ */
+static bool state_changed(const struct CHContext *chctx,
+                          const struct ReadingRecord *r) {
+  const struct ReadingRecord *last = &chctx->last_state;
+  if (!chctx->has_state || r->count != last->count)
+    return true;
+  for (size_t i = 0; i < r->count; ++i) {
+    if (r->metric_ids[i] != last->metric_ids[i] ||
+        (r->qualities[i] == READING_BAD) != (last->qualities[i] == READING_BAD))
+      return true;
+    if (r->qualities[i] == READING_BAD || r->metric_ids[i] >= METRIC_COUNT)
+      continue;
+    const double scale = pow(10, metrics[r->metric_ids[i]].decimals);
+    if (llround(r->values[i] * scale) != llround(last->values[i] * scale))
+      return true;
+  }
+  return false;
+}
+
+static int stream_flush(struct CHContext *chctx) {
+  if (chctx->stream_count == 0)
+    return 0;
+  const void *payload = chctx->stream_buf;
+  size_t len;
+  if (chctx->stream_batch != NULL) {
+    payload = chctx->stream_encoded;
+    len = gorilla_encode(chctx->stream_batch, chctx->stream_encoded,
+                         chctx->stream_encoded_size);
+    chctx->stream_batch->rows = 0;
+  } else {
+    chctx->stream_buf[chctx->stream_len++] = ']';
+    len = chctx->stream_len;
+  }
+  int rc = len == 0 ? MOSQ_ERR_INVAL
+                    : mqtt_publish(chctx->mosq, chctx->stream_topic, payload,
+                                   len, 1, false);
+  if (rc != MOSQ_ERR_SUCCESS)
+    SYSLOG_ERR("Error publishing %zu sample(s) to %s: %s",
+               chctx->stream_count, chctx->stream_topic,
+               mosquitto_strerror(rc));
+  // A failed batch is dropped rather than retried, the state topic still
+  // carries the latest reading
+  chctx->stream_len = 0;
+  chctx->stream_count = 0;
+  return rc == MOSQ_ERR_SUCCESS ? 0 : 1;
+}
 
-  struct DL11MC *r = (struct DL11MC *)c_ctx;
+static int stream_append(struct CHContext *chctx,
+                         const struct ReadingRecord *readings,
+                         const char *payload, int len, int64_t now_ms) {
+  if (chctx->stream_count == 0)
+    chctx->stream_first_ms = now_ms;
+  if (chctx->stream_batch != NULL) {
+    gorilla_batch_append(chctx->stream_batch, &info, readings);
+  } else {
+    chctx->stream_buf[chctx->stream_len++] =
+        chctx->stream_count == 0 ? '[' : ',';
+    memcpy(chctx->stream_buf + chctx->stream_len, payload, len);
+    chctx->stream_len += len;
+  }
+  ++chctx->stream_count;
+  if (chctx->stream_count >= chctx->stream_batch_size ||
+      (uint64_t)(now_ms - chctx->stream_first_ms) >=
+          chctx->stream_batch_max_age_ms)
+    return stream_flush(chctx);
+  return 0;
+}
+
+int post_collection(const struct ReadingRecord *readings, void *pc_ctx) {
   struct CHContext *chctx = (struct CHContext *)pc_ctx;
   struct iotctrl_7seg_disp_handle *h = chctx->h;
-  iotctrl_7seg_disp_update_as_four_digit_float(h, r->temperature_celsius, 0);
-
-  time_t now;
-  struct tm *utc_time;
-  char iso_time[21];
-  time(&now);
-  utc_time = gmtime(&now);
-  strftime(iso_time, sizeof(iso_time), "%Y-%m-%dT%H:%M:%SZ", utc_time);
-
-  char payload[128];
-  snprintf(payload, sizeof(payload) - 1,
-           "{\"timestamp\": \"%s\", \"temp_celsius\":%f}", iso_time,
-           r->temperature_celsius);
-  mosquitto_publish(chctx->mosq, NULL, chctx->topic, strlen(payload), payload,
-                    1, false);
-  return 0;
+  int ret = 0;
+  int idx = readings_find(readings, METRIC_TEMP_CELSIUS);
+  if (idx >= 0)
+    iotctrl_7seg_disp_update_as_four_digit_float(h, readings->values[idx], 0);
+  if (chctx->mosq == NULL)
+    return 0;
+
+  char payload[CH_PAYLOAD_MAX];
+  const int len =
+      payload_render(&chctx->tpl, readings, NULL, payload, sizeof(payload));
+  if (len < 0) {
+    SYSLOG_ERR("payload_render() failed");
+    return 1;
+  }
+  const int64_t now_ms = readings_now_ms();
+  if (chctx->topic != NULL)
+    mqtt_publish(chctx->mosq, chctx->topic, payload, len, 1, false);
+  if (chctx->state_topic != NULL &&
+      (state_changed(chctx, readings) ||
+       (uint64_t)(now_ms - chctx->state_published_at_ms) >=
+           chctx->state_max_interval_ms)) {
+    int rc = mqtt_publish(chctx->mosq, chctx->state_topic, payload, len, 1,
+                          true);
+    if (rc == MOSQ_ERR_SUCCESS) {
+      chctx->last_state = *readings;
+      chctx->has_state = true;
+      chctx->state_published_at_ms = now_ms;
+    } else {
+      SYSLOG_ERR("Error publishing to %s: %s", chctx->state_topic,
+                 mosquitto_strerror(rc));
+      ret = 1;
+    }
+  }
+  if (chctx->stream_topic != NULL &&
+      stream_append(chctx, readings, payload, len, now_ms) != 0)
+    ret = 1;
+  return ret;
 }
 
 void post_collection_destroy(void *ctx) {
@@ -153,8 +312,15 @@ void post_collection_destroy(void *ctx) {
     return;
   struct CHContext *chctx = (struct CHContext *)ctx;
   iotctrl_7seg_disp_destroy(chctx->h);
-  mosquitto_destroy(chctx->mosq);
-  mosquitto_lib_cleanup();
+  if (chctx->stream_topic != NULL)
+    stream_flush(chctx);
+  if (chctx->mosq != NULL) {
+    mqtt_destroy(chctx->mosq);
+    mosquitto_lib_cleanup();
+  }
+  payload_template_destroy(&chctx->tpl);
+  free(chctx->stream_batch);
+  free(chctx->stream_encoded);
   free(chctx);
 }
 
@@ -177,8 +343,6 @@ void *collection_init(const json_object *config) {
     goto err_malloc_device_path;
   }
   strcpy(d->device_path, device_path);
-
-  d->temperature_celsius = 888.8;
   return d;
 err_malloc_device_path:
   free(d);
@@ -186,14 +350,14 @@ err_malloc_handle:
   return NULL;
 }
 
-int collection(void *ctx) {
+int collection(void *ctx, struct ReadingRecord *readings) {
   struct DL11MC *dl11 = (struct DL11MC *)ctx;
   int res;
   const uint8_t sensor_count = 1;
   int16_t temps[sensor_count];
   int16_t temp;
-  if ((res = iotctrl_get_temperature(dl11->device_path, sensor_count, temps,
-                                     0)) != 0) {
+  if ((res = device_cache_read(dl11->device_path, 0, temps, sizeof(temps),
+                               dl11_read, dl11->device_path)) != 0) {
     temp = 999;
     SYSLOG_ERR("iotctrl_get_temperature() failed, returned %d", res);
     return 1;
@@ -201,9 +365,9 @@ int collection(void *ctx) {
     temp = temps[0];
   }
 
-  dl11->temperature_celsius = temp / 10.0;
-  syslog(LOG_INFO, "Readings changed to temp: %.1f°C",
-         dl11->temperature_celsius);
+  readings_add(readings, METRIC_TEMP_CELSIUS, temp / 10.0, readings_now_ms(),
+               READING_GOOD);
+  syslog(LOG_INFO, "Readings changed to temp: %.1f°C", temp / 10.0);
   return 0;
 }
 
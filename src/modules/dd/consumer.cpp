@@ -1,7 +1,12 @@
 #define FMT_HEADER_ONLY
 
 #include "../libs/7seg.h"
+#include "../libs/mqtt.h"
 #include "../module.h"
+#include "layout.h"
+#include "mailbox.h"
+#include "mcast_receiver.h"
+#include "shm_reader.h"
 
 #include <cxxopts.hpp>
 #include <fmt/core.h>
@@ -12,6 +17,7 @@
 #include <nlohmann/json.hpp>
 #include <spdlog/spdlog.h>
 
+#include <algorithm>
 #include <errno.h>
 #include <fcntl.h>
 #include <fstream>
@@ -19,79 +25,94 @@
 #include <iostream>
 #include <limits.h>
 #include <linux/i2c-dev.h>
+#include <poll.h>
 #include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <string.h>
 #include <string>
 #include <sys/ioctl.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
 #include <syslog.h>
+#include <time.h>
 #include <unistd.h>
+#include <vector>
 
 using namespace std;
 using json = nlohmann::json;
-volatile sig_atomic_t ev_flag;
 
-struct Readings {
-  double temp_outdoor_celsius;
-  double temp_indoor_celsius;
-  double rh_outdoor;
-};
-
-struct ConnectionInfo {
-  struct Readings readings;
-  char *dht31_device_path;
-  char *dl11_device_path;
-};
-
-struct iotctrl_7seg_disp_handle *h0;
-struct iotctrl_7seg_disp_handle *h1;
+// Both are only touched by the main thread; the mosquitto callback thread
+// only posts raw payloads to mailboxes
+DisplayLayout layout;
 json settings;
-chrono::system_clock::time_point update_time_utc;
+MailboxSet mailboxes;
+// Only used if /dd/shm is configured
+ShmReader shm_reader;
+// Only used if /dd/multicast is configured
+McastReceiver mcast_receiver;
+
+// timerfd armed (CLOCK_REALTIME, absolute) at the next staleness deadline
+int watchdog_fd = -1;
 
-mutex update_time_mtx;
-mutex readings_mtx;
+/**
+ * @brief Arm watchdog_fd at the earliest deadline of the layout.
+ */
+void watchdog_rearm() {
+  const int64_t deadline = layout_next_deadline(layout);
+  struct itimerspec its = {};
+  // it_value == 0 disarms the timer, so a deadline at (or before) the epoch
+  // is clamped to 1 to make it fire right away instead
+  if (deadline != INT64_MAX)
+    its.it_value.tv_sec = max<int64_t>(deadline, 1);
+  if (timerfd_settime(watchdog_fd, TFD_TIMER_ABSTIME, &its, NULL) != 0)
+    spdlog::error("timerfd_settime() failed: {}({})", errno, strerror(errno));
+}
 
-void signal_handler(int signum) {
-  signum %= 100;
-  char msg[] = "Signal [  ] caught\n";
-  msg[8] = '0' + (char)(signum / 10);
-  msg[9] = '0' + (char)(signum % 10);
-  write(STDERR_FILENO, msg, strlen(msg));
-  ev_flag = 1;
+int64_t parse_iso8601_utc(const string &iso8601) {
+  struct tm tm = {};
+  const char *end = strptime(iso8601.c_str(), "%Y-%m-%dT%H:%M:%SZ", &tm);
+  if (end == NULL || *end != '\0')
+    return -1;
+  return timegm(&tm);
 }
 
-/* Callback called when the client receives a CONNACK message from the broker.
- */
+/* Callback called when the client receives a CONNACK message from the broker,
+ * after every (re)connection made by libs/mqtt. */
 void mosquitto_on_connect(struct mosquitto *mosq, void *obj, int reason_code) {
   (void)obj;
   int rc;
   spdlog::info("mosquitto_on_connect(): {}",
                mosquitto_connack_string(reason_code));
+  if (reason_code != 0)
+    return;
 
   /* Making subscriptions in the mosquitto_on_connect() callback means that if
    * the connection drops and is automatically resumed by the client, then the
    * subscriptions will be recreated when the client reconnects. */
-  rc = mosquitto_subscribe(
-      mosq, NULL,
-      settings.value("/dd/mqtt/topic"_json_pointer, "topic").c_str(), 1);
-  if (rc != MOSQ_ERR_SUCCESS) {
-    spdlog::error("mosquitto_subscribe() failed: {}", mosquitto_strerror(rc));
-    /* We might as well disconnect if we were unable to subscribe */
-    mosquitto_disconnect(mosq);
+  for (const string &sub : layout.subscriptions) {
+    rc = mosquitto_subscribe(mosq, NULL, sub.c_str(), 1);
+    if (rc != MOSQ_ERR_SUCCESS) {
+      spdlog::error("mosquitto_subscribe({}) failed: {}", sub,
+                    mosquitto_strerror(rc));
+      /* We might as well disconnect if we were unable to subscribe */
+      mosquitto_disconnect(mosq);
+      return;
+    }
+    spdlog::info("Subscribing to [{}]", sub);
   }
 }
 
 /* Callback called when the broker sends a SUBACK in response to a SUBSCRIBE. */
 void mosquitto_on_subscribe(struct mosquitto *mosq, void *obj, int mid,
                             int qos_count, const int *granted_qos) {
+  (void)mosq;
   (void)obj;
-  (void)mid;
   int i;
   bool have_subscription = false;
 
-  /* In this example we only subscribe to a single topic at once, but a
-   * SUBSCRIBE can contain many topics at once, so this is one way to check
-   * them all. */
+  /* Every filter is sent in a SUBSCRIBE of its own, so each SUBACK carries a
+   * single granted QoS. */
   for (i = 0; i < qos_count; i++) {
     spdlog::info("mosquitto_on_subscribe: {}:granted qos = {}", i,
                  granted_qos[i]);
@@ -100,53 +121,102 @@ void mosquitto_on_subscribe(struct mosquitto *mosq, void *obj, int mid,
     }
   }
   if (have_subscription == false) {
-    /* The broker rejected all of our subscriptions, we know we only sent
-     * the one SUBSCRIBE, so there is no point remaining connected. */
-    spdlog::error("Error: All subscriptions rejected.");
-    mosquitto_disconnect(mosq);
+    /* Other filters may still be granted, so only the displays behind this
+     * one stay on their placeholders. */
+    spdlog::error("Error: subscription (mid {}) rejected.", mid);
   }
 }
 
-/* Callback called when the client receives a message. */
+/* Callback called when the client receives a message. It runs on
+ * libs/mqtt's network thread, so it only hands the payload over to the main
+ * thread and returns. */
 void mosquitto_on_message(struct mosquitto *mosq, void *obj,
                           const struct mosquitto_message *msg) {
   (void)mosq;
   (void)obj;
+  mailbox_post(mailboxes, msg->topic, msg->payload, msg->payloadlen);
+}
+
+/**
+ * @brief A gorilla_encode()d batch, as sent to e.g. ch's stream_topic
+ */
+void handle_batch(TopicRoute &route, const string &topic, const string &raw) {
+  // Too large for the stack, and only used by the main thread
+  static GorillaBatch batch;
+  if (gorilla_decode((const uint8_t *)raw.data(), raw.size(), &batch) != 0) {
+    spdlog::error("[{}] invalid gorilla batch of {} byte(s)", topic,
+                  raw.size());
+    ++route.rejected;
+    return;
+  }
+  const int64_t timestamp = batch.timestamps_ms[batch.rows - 1] / 1000;
+  if (timestamp < route.last_timestamp) {
+    spdlog::warn("[{}] batch ending at {} is older than the last payload "
+                 "({}), dropped",
+                 topic, timestamp, route.last_timestamp);
+    ++route.rejected;
+    return;
+  }
+  route.last_timestamp = timestamp;
+  ++route.accepted;
+  layout_apply_batch(layout, route, batch);
+}
+
+/**
+ * @brief Parse and render the newest payload of a topic, on the main thread.
+ */
+void handle_payload(const string &topic, const string &raw) {
+  TopicRoute &route = layout_route(layout, topic);
+  if (route.slots.empty()) {
+    spdlog::debug("No slot is fed by [{}], message ignored", topic);
+    return;
+  }
+  if (gorilla_is_batch((const uint8_t *)raw.data(), raw.size())) {
+    handle_batch(route, topic, raw);
+    return;
+  }
   json payload;
   try {
-    payload = json::parse((char *)msg->payload);
+    payload = json::parse(raw);
   } catch (const json::parse_error &e) {
-    spdlog::error("Incoming message is invalid json: {}\n{}", e.what(),
-                  (char *)msg->payload);
+    spdlog::error("Incoming message is invalid json: {}\n{}", e.what(), raw);
+    ++route.rejected;
+    return;
+  }
+  spdlog::debug("{} {}", topic, payload.dump());
+  if (!payload.is_object()) {
+    spdlog::error("Incoming message is not a json object");
+    ++route.rejected;
     return;
   }
-  spdlog::info("{} {} {}", msg->topic, msg->qos, payload.dump());
-  iotctrl_7seg_disp_update_as_four_digit_float(
-      h0, payload.value("/temp_outdoor_celsius"_json_pointer, 888.8), 0);
-  iotctrl_7seg_disp_update_as_four_digit_float(
-      h0, payload.value("/rh_outdoor"_json_pointer, 888.8), 1);
-  iotctrl_7seg_disp_update_as_four_digit_float(
-      h1, payload.value("/temp_outdoor_celsius"_json_pointer, 888.8), 0);
-  iotctrl_7seg_disp_update_as_four_digit_float(
-      h1, payload.value("/temp_indoor_celsius"_json_pointer, 888.8), 1);
-
-  auto parseISO8601 = [](const string &iso8601String) {
-    tm tm = {};
-    istringstream ss(iso8601String);
-    ss >> get_time(&tm, "%Y-%m-%dT%H:%M:%SZ");
-    return chrono::system_clock::from_time_t(std::mktime(&tm));
-  };
 
-  {
-    lock_guard<mutex> lock(update_time_mtx);
-    update_time_utc =
-        parseISO8601(payload.value("/timestamp_utc"_json_pointer, ""));
+  int64_t timestamp = parse_iso8601_utc(payload.value("timestamp_utc", ""));
+  if (timestamp < 0) {
+    spdlog::warn("timestamp_utc missing or invalid, using current time");
+    timestamp = time(NULL);
   }
+  // QoS 1 redelivery and retained messages may replay older payloads
+  if (timestamp < route.last_timestamp) {
+    spdlog::warn("[{}] payload at {} is older than the last one ({}), "
+                 "dropped",
+                 topic, timestamp, route.last_timestamp);
+    ++route.rejected;
+    return;
+  }
+  route.last_timestamp = timestamp;
+  ++route.accepted;
+  layout_apply(layout, route, payload, timestamp);
 }
 
 int main(int argc, char **argv) {
   struct mosquitto *mosq;
-  ev_flag = 0;
+  struct MqttStats mqtt_stats;
+  vector<string> hosts;
+  vector<const char *> host_ptrs;
+  string username, password, ca_file_path;
+  struct MqttOptions mqtt_opts = {};
+  sigset_t mask;
+  int sfd;
   cxxopts::Options options(argv[0], PROGRAM_NAME);
   string config_path;
   spdlog::set_pattern("%Y-%m-%d %T.%e | %7l | %5t | %v");
@@ -160,123 +230,177 @@ int main(int argc, char **argv) {
     std::cout << options.help() << "\n";
     return 0;
   }
-  signal(SIGINT, signal_handler);
-  signal(SIGTERM, signal_handler);
   config_path = result["config-path"].as<std::string>();
   ifstream f(config_path);
   settings = json::parse(f);
 
-  // clang-format off
-    struct iotctrl_7seg_disp_connection conn0, conn1;
-    conn0.data_pin_num = settings.value("/dd/7seg_display0/data_pin_num"_json_pointer, 22);
-    conn0.clock_pin_num = settings.value("/dd/7seg_display0/clock_pin_num"_json_pointer, 11);
-    conn0.latch_pin_num = settings.value("/dd/7seg_display0/latch_pin_num"_json_pointer, 18);
-    conn0.chain_num = settings.value("/dd/7seg_display0/chain_num"_json_pointer, 2);
-    conn0.refresh_rate_hz = settings.value("/dd/7seg_display0/refresh_rate_hz"_json_pointer, 2000);
-    strcpy(conn0.gpiochip_path,
-    settings.value("/dd/7seg_display0/gpiochip_path"_json_pointer, "/dev/gpiochip0").c_str());
-  // clang-format on
-  if ((h0 = iotctrl_7seg_disp_init(conn0)) == NULL) {
-    spdlog::error("iotctrl_7seg_disp_init(conn0) failed. Check stderr for "
-                  "possible internal error messages");
-    goto err_h0_error;
+  // Signals are consumed synchronously through signalfd. They must be blocked
+  // before init_mosquitto_with_options() so that its thread inherits the mask.
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGINT);
+  sigaddset(&mask, SIGTERM);
+  if (pthread_sigmask(SIG_BLOCK, &mask, NULL) != 0 ||
+      (sfd = signalfd(-1, &mask, SFD_CLOEXEC)) < 0) {
+    spdlog::error("signalfd() failed: {}({})", errno, strerror(errno));
+    goto err_signalfd;
   }
-  // clang-format off
-    conn1.data_pin_num = settings.value("/dd/7seg_display1/data_pin_num"_json_pointer, 22);
-    conn1.clock_pin_num = settings.value("/dd/7seg_display1/clock_pin_num"_json_pointer, 11);
-    conn1.latch_pin_num = settings.value("/dd/7seg_display1/latch_pin_num"_json_pointer, 18);
-    conn1.chain_num = settings.value("/dd/7seg_display1/chain_num"_json_pointer, 2);
-    conn1.refresh_rate_hz = settings.value("/dd/7seg_display1/refresh_rate_hz"_json_pointer, 2000);
-    strcpy(conn1.gpiochip_path, settings.value("/dd/7seg_display1/gpiochip_path"_json_pointer,
-    "/dev/gpiochip0").c_str());
-  // clang-format on
-  if ((h1 = iotctrl_7seg_disp_init(conn1)) == NULL) {
-    spdlog::error("iotctrl_7seg_disp_init(conn1) failed. Check stderr for "
-                  "possible internal error messages");
-
-    goto err_h1_error;
+  if ((watchdog_fd = timerfd_create(CLOCK_REALTIME, TFD_CLOEXEC)) < 0) {
+    spdlog::error("timerfd_create() failed: {}({})", errno, strerror(errno));
+    goto err_timerfd;
   }
-  int rc;
-  mosquitto_lib_init();
-  mosq = mosquitto_new(NULL, true, NULL);
-  if (mosq == NULL) {
-    spdlog::error("mosquitto_new() error");
-    goto err_mosquitto_alloc;
+  if (mailbox_set_init(mailboxes) != 0) {
+    spdlog::error("mailbox_set_init() failed");
+    goto err_mailbox_set_init;
   }
-  if ((rc = mosquitto_username_pw_set(
-           mosq,
-           settings.value("/dd/mqtt/username"_json_pointer, "test").c_str(),
-           settings.value("/dd/mqtt/password"_json_pointer, "test").c_str())) !=
-      MOSQ_ERR_SUCCESS) {
-    spdlog::error("mosquitto_username_pw_set() error: {}",
-                  mosquitto_strerror(rc));
-    goto err_mosquitto_init;
+
+  if (layout_load(layout, settings) != 0) {
+    spdlog::error("layout_load() failed");
+    goto err_layout_load;
   }
-  if ((rc = mosquitto_tls_set(
-           mosq,
-           settings.value("/dd/mqtt/ca_file_path"_json_pointer, "/tmp/ca.crt")
-               .c_str(),
-           NULL, NULL, NULL, NULL)) != MOSQ_ERR_SUCCESS) {
-    spdlog::error("mosquitto_tls_set() error: {}", mosquitto_strerror(rc));
-    goto err_mosquitto_init;
+  watchdog_rearm();
+  // On a host that also runs sdp, the shm sink skips the broker round trip
+  if (settings.contains("/dd/shm"_json_pointer) &&
+      shm_reader_init(
+          shm_reader, settings.value("/dd/shm/name"_json_pointer, "/sdp-dd"),
+          settings.value("/dd/shm/topic"_json_pointer,
+                         settings.value("/dd/mqtt/topic"_json_pointer, ""))) !=
+          0) {
+    spdlog::error("shm_reader_init() failed");
+    goto err_shm_reader_init;
   }
-  mosquitto_connect_callback_set(mosq, mosquitto_on_connect);
-  mosquitto_subscribe_callback_set(mosq, mosquitto_on_subscribe);
-  mosquitto_message_callback_set(mosq, mosquitto_on_message);
-
-  rc = mosquitto_connect(
-      mosq, settings.value("/dd/mqtt/host"_json_pointer, "localhost").c_str(),
-      8883, 60);
-  if (rc != MOSQ_ERR_SUCCESS) {
-    spdlog::error("mosquitto_connect() error: {}", mosquitto_strerror(rc));
-    goto err_mosquitto_init;
-    return 1;
+  // On the LAN of a host running sdp, its multicast sink does the same
+  if (settings.contains("/dd/multicast"_json_pointer) &&
+      mcast_receiver_init(
+          mcast_receiver, layout,
+          settings.value("/dd/multicast/group"_json_pointer, "239.255.83.68"),
+          settings.value("/dd/multicast/port"_json_pointer, 5683),
+          settings.value("/dd/multicast/interface"_json_pointer, ""),
+          settings.value("/dd/multicast/key"_json_pointer, ""),
+          settings.value("/dd/multicast/topic"_json_pointer,
+                         settings.value("/dd/mqtt/topic"_json_pointer, ""))) !=
+          0) {
+    spdlog::error("mcast_receiver_init() failed");
+    goto err_mcast_receiver_init;
   }
+  // Same keys as the MqttOptions of the C modules (see libs/mqtt.h)
+  if (settings.contains("/dd/mqtt/hosts"_json_pointer))
+    hosts = settings.at("/dd/mqtt/hosts"_json_pointer).get<vector<string>>();
+  else
+    hosts.push_back(
+        settings.value("/dd/mqtt/host"_json_pointer, "localhost"));
+  for (const string &host : hosts)
+    host_ptrs.push_back(host.c_str());
+  username = settings.value("/dd/mqtt/username"_json_pointer, "test");
+  password = settings.value("/dd/mqtt/password"_json_pointer, "test");
+  ca_file_path =
+      settings.value("/dd/mqtt/ca_file_path"_json_pointer, "/tmp/ca.crt");
+  mqtt_opts.hosts = host_ptrs.data();
+  mqtt_opts.host_count = host_ptrs.size();
+  mqtt_opts.username = username.c_str();
+  mqtt_opts.password = password.c_str();
+  mqtt_opts.ca_file_path = ca_file_path.c_str();
+  mqtt_opts.port =
+      settings.value("/dd/mqtt/port"_json_pointer, MQTT_DEFAULT_PORT);
+  mqtt_opts.keepalive_sec =
+      settings.value("/dd/mqtt/keepalive_sec"_json_pointer,
+                     MQTT_DEFAULT_KEEPALIVE_SEC);
+  mqtt_opts.reconnect_delay_min_ms =
+      settings.value("/dd/mqtt/reconnect_delay_min_ms"_json_pointer,
+                     MQTT_DEFAULT_RECONNECT_DELAY_MIN_MS);
+  mqtt_opts.reconnect_delay_max_ms =
+      settings.value("/dd/mqtt/reconnect_delay_max_ms"_json_pointer,
+                     MQTT_DEFAULT_RECONNECT_DELAY_MAX_MS);
+  mqtt_opts.protocol_version =
+      settings.value("/dd/mqtt/protocol_version"_json_pointer, 5);
+  mqtt_opts.on_connect = mosquitto_on_connect;
+  mqtt_opts.on_subscribe = mosquitto_on_subscribe;
+  mqtt_opts.on_message = mosquitto_on_message;
 
-  spdlog::info("mosquitto_loop_forever()...");
-  if ((rc = mosquitto_loop_start(mosq)) != MOSQ_ERR_SUCCESS) {
-    spdlog::error("mosquitto_loop_start() error: {}", mosquitto_strerror(rc));
-    goto err_mosquitto_loop_start;
+  spdlog::info("init_mosquitto_with_options()...");
+  // Connects, and keeps reconnecting, in a network thread of its own
+  if ((mosq = init_mosquitto_with_options(&mqtt_opts)) == NULL) {
+    spdlog::error("init_mosquitto_with_options() failed");
+    goto err_mosquitto_init;
   }
-  while (!ev_flag) {
-    sleep(6);
-    auto timePointToISO8601 = [](const chrono::system_clock::time_point &tp) {
-      auto tt = chrono::system_clock::to_time_t(tp);
-      tm tm = *gmtime(&tt); // Using gmtime instead of localtime for UTC
-      stringstream ss;
-      ss << put_time(&tm, "%Y-%m-%dT%H:%M:%SZ");
-      ss << "Z"; // Append UTC indicator
-      return ss.str();
-    };
-    auto max_tolerance_sec = 3600;
-    {
-      lock_guard<mutex> lock(update_time_mtx);
-      auto diff = chrono::duration<double>(chrono::system_clock::now() -
-                                           update_time_utc);
-      spdlog::info("update_time: {} ({:.1f} sec ago)",
-                   timePointToISO8601(update_time_utc), diff.count());
-      if (diff.count() > max_tolerance_sec) {
-        spdlog::info(
-            "update_time older than max_tolerance_sec ({}), resetting display",
-            max_tolerance_sec);
-        iotctrl_7seg_disp_update_as_four_digit_float(h0, 888.8, 0);
-        iotctrl_7seg_disp_update_as_four_digit_float(h0, 888.8, 1);
-        iotctrl_7seg_disp_update_as_four_digit_float(h1, 888.8, 0);
-        iotctrl_7seg_disp_update_as_four_digit_float(h1, 888.8, 1);
-      }
+  while (true) {
+    struct pollfd fds[] = {{watchdog_fd, POLLIN, 0},
+                           {sfd, POLLIN, 0},
+                           {mailboxes.event_fd, POLLIN, 0},
+                           // Ignored by poll() while it is -1
+                           {shm_reader.event_fd, POLLIN, 0},
+                           {mcast_receiver.fd, POLLIN, 0}};
+    if (poll(fds, sizeof(fds) / sizeof(fds[0]), -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      spdlog::error("poll() failed: {}({})", errno, strerror(errno));
+      break;
+    }
+    if (fds[1].revents & POLLIN) {
+      struct signalfd_siginfo si;
+      if (read(sfd, &si, sizeof(si)) == sizeof(si))
+        spdlog::info("Signal [{}] caught", si.ssi_signo);
+      break;
     }
+    if (fds[0].revents & POLLIN) {
+      uint64_t expirations;
+      if (read(watchdog_fd, &expirations, sizeof(expirations)) < 0 &&
+          errno != EAGAIN)
+        spdlog::error("read(watchdog_fd) failed: {}({})", errno,
+                      strerror(errno));
+      layout_reset_stale(layout, time(NULL));
+      watchdog_rearm();
+    }
+    if (fds[2].revents & POLLIN) {
+      // Messages that arrived while the last batch was rendered are coalesced
+      // into the newest one per topic
+      if (mailbox_drain(mailboxes, handle_payload) > 0)
+        watchdog_rearm();
+    }
+    if (fds[3].revents & POLLIN) {
+      if (shm_reader_apply(shm_reader, layout) > 0)
+        watchdog_rearm();
+    }
+    if (fds[4].revents & POLLIN) {
+      if (mcast_receiver_apply(mcast_receiver, layout) > 0)
+        watchdog_rearm();
+    }
+  }
+  mqtt_get_stats(mosq, &mqtt_stats);
+  spdlog::info("MQTT: {} connection attempt(s), {} failure(s), {} "
+               "connect(s), {} ms offline",
+               mqtt_stats.attempts, mqtt_stats.failures, mqtt_stats.connects,
+               mqtt_stats.downtime_ms);
+  mqtt_destroy(mosq);
+  for (const auto &[topic, route] : layout.routes) {
+    auto it = mailboxes.by_topic.find(topic);
+    const uint64_t received =
+        it == mailboxes.by_topic.end() ? 0 : it->second->written.load();
+    spdlog::info("[{}]: {} payload(s) received, {} accepted, {} rejected",
+                 topic, received, route.accepted, route.rejected);
   }
-  mosquitto_loop_stop(mosq, 0);
-err_mosquitto_loop_start:
-  mosquitto_destroy(mosq);
-  mosquitto_lib_cleanup();
+  if (mcast_receiver.fd >= 0)
+    mcast_receiver_destroy(mcast_receiver);
+  if (shm_reader.event_fd >= 0)
+    shm_reader_destroy(shm_reader);
+  layout_destroy(layout);
+  mailbox_set_destroy(mailboxes);
+  close(watchdog_fd);
+  close(sfd);
   return 0;
 err_mosquitto_init:
-  mosquitto_destroy(mosq);
-err_mosquitto_alloc:
-  iotctrl_7seg_disp_destroy(h1);
-err_h1_error:
-  iotctrl_7seg_disp_destroy(h0);
-err_h0_error:
+  if (mcast_receiver.fd >= 0)
+    mcast_receiver_destroy(mcast_receiver);
+err_mcast_receiver_init:
+  if (shm_reader.event_fd >= 0)
+    shm_reader_destroy(shm_reader);
+err_shm_reader_init:
+  layout_destroy(layout);
+err_layout_load:
+  mailbox_set_destroy(mailboxes);
+err_mailbox_set_init:
+  close(watchdog_fd);
+err_timerfd:
+  close(sfd);
+err_signalfd:
   return 0;
 }
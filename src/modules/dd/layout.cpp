@@ -0,0 +1,249 @@
+#include "layout.h"
+#include "../../shm_layout.h"
+#include "metrics.h"
+
+#include <mosquitto.h>
+#include <spdlog/spdlog.h>
+
+#include <algorithm>
+#include <cmath>
+#include <string.h>
+
+using namespace std;
+using json = nlohmann::json;
+
+static void format_float(struct iotctrl_7seg_disp_handle *h, int position,
+                         double value) {
+  iotctrl_7seg_disp_update_as_four_digit_float(h, value, position);
+}
+
+static void format_round(struct iotctrl_7seg_disp_handle *h, int position,
+                         double value) {
+  iotctrl_7seg_disp_update_as_four_digit_float(h, round(value), position);
+}
+
+static void format_fahrenheit(struct iotctrl_7seg_disp_handle *h, int position,
+                              double value) {
+  iotctrl_7seg_disp_update_as_four_digit_float(h, value * 9 / 5 + 32,
+                                               position);
+}
+
+static slot_formatter formatter_from_name(const string &name) {
+  if (name == "float")
+    return format_float;
+  if (name == "round")
+    return format_round;
+  if (name == "fahrenheit")
+    return format_fahrenheit;
+  return NULL;
+}
+
+static struct iotctrl_7seg_disp_handle *init_display(const json &j) {
+  struct iotctrl_7seg_disp_connection conn;
+  conn.data_pin_num = j.value("data_pin_num", 22);
+  conn.clock_pin_num = j.value("clock_pin_num", 11);
+  conn.latch_pin_num = j.value("latch_pin_num", 18);
+  conn.chain_num = j.value("chain_num", 2);
+  conn.refresh_rate_hz = j.value("refresh_rate_hz", 2000);
+  strncpy(conn.gpiochip_path,
+          j.value("gpiochip_path", "/dev/gpiochip0").c_str(),
+          sizeof(conn.gpiochip_path) - 1);
+  conn.gpiochip_path[sizeof(conn.gpiochip_path) - 1] = '\0';
+  return iotctrl_7seg_disp_init(conn);
+}
+
+// The layout dd-consumer had before /dd/displays existed
+static json legacy_displays(const json &settings) {
+  json displays = json::array();
+  displays.push_back(
+      {{"7seg_display",
+        settings.value("/dd/7seg_display0"_json_pointer, json::object())},
+       {"slots",
+        {{{"field", dd_metrics[DD_TEMP_OUTDOOR_CELSIUS].name},
+          {"position", 0}},
+         {{"field", dd_metrics[DD_RH_OUTDOOR].name}, {"position", 1}}}}});
+  displays.push_back(
+      {{"7seg_display",
+        settings.value("/dd/7seg_display1"_json_pointer, json::object())},
+       {"slots",
+        {{{"field", dd_metrics[DD_TEMP_OUTDOOR_CELSIUS].name},
+          {"position", 0}},
+         {{"field", dd_metrics[DD_TEMP_INDOOR_CELSIUS].name},
+          {"position", 1}}}}});
+  return displays;
+}
+
+int layout_load(DisplayLayout &layout, const json &settings) {
+  json displays = settings.value("/dd/displays"_json_pointer, json());
+  if (displays.is_null()) {
+    spdlog::info("/dd/displays not defined, using the legacy two-display "
+                 "layout");
+    displays = legacy_displays(settings);
+  }
+  if (!displays.is_array()) {
+    spdlog::error("/dd/displays must be an array");
+    return -1;
+  }
+  const int64_t default_tolerance_sec =
+      settings.value("/dd/max_tolerance_sec"_json_pointer, 3600);
+  const string default_topic =
+      settings.value("/dd/mqtt/topic"_json_pointer, "");
+
+  for (size_t i = 0; i < displays.size(); ++i) {
+    const json &d = displays[i];
+    struct iotctrl_7seg_disp_handle *h =
+        init_display(d.value("7seg_display", json::object()));
+    if (h == NULL) {
+      spdlog::error("iotctrl_7seg_disp_init() failed for display {}. Check "
+                    "stderr for possible internal error messages",
+                    i);
+      goto err_layout;
+    }
+    layout.displays.push_back(h);
+    const string display_topic = d.value("topic", default_topic);
+
+    for (const json &s : d.value("slots", json::array())) {
+      Slot slot;
+      slot.topic = s.value("topic", display_topic);
+      slot.h = h;
+      slot.position = s.value("position", 0);
+      slot.field = s.value("field", "");
+      slot.formatter = formatter_from_name(s.value("format", "float"));
+      slot.placeholder = s.value("placeholder", 888.8);
+      slot.max_tolerance_sec =
+          s.value("max_tolerance_sec", default_tolerance_sec);
+      if (slot.field.empty() || slot.formatter == NULL ||
+          mosquitto_sub_topic_check(slot.topic.c_str()) != MOSQ_ERR_SUCCESS) {
+        spdlog::error("Invalid slot in display {}: {}", i, s.dump());
+        goto err_layout;
+      }
+      spdlog::info("display {}, position {} <- {} of [{}]", i, slot.position,
+                   slot.field, slot.topic);
+      if (find(layout.subscriptions.begin(), layout.subscriptions.end(),
+               slot.topic) == layout.subscriptions.end())
+        layout.subscriptions.push_back(slot.topic);
+      layout.slots.push_back(std::move(slot));
+    }
+  }
+  layout.states = make_unique<SlotState[]>(layout.slots.size());
+  for (size_t i = 0; i < layout.slots.size(); ++i) {
+    // Epoch, so that every slot shows its placeholder until the first message
+    layout.states[i].updated_at = 0;
+    layout.states[i].value = layout.slots[i].placeholder;
+  }
+  // Filters without wildcards are concrete topics already
+  for (const string &sub : layout.subscriptions)
+    if (sub.find_first_of("+#") == string::npos)
+      layout_route(layout, sub);
+  return 0;
+err_layout:
+  layout_destroy(layout);
+  return -2;
+}
+
+TopicRoute &layout_route(DisplayLayout &layout, const string &topic) {
+  auto it = layout.routes.find(topic);
+  if (it != layout.routes.end())
+    return it->second;
+  vector<size_t> slots;
+  for (size_t i = 0; i < layout.slots.size(); ++i) {
+    bool matched = false;
+    if (mosquitto_topic_matches_sub(layout.slots[i].topic.c_str(),
+                                    topic.c_str(), &matched) ==
+            MOSQ_ERR_SUCCESS &&
+        matched)
+      slots.push_back(i);
+  }
+  if (slots.empty()) {
+    layout.unrouted = TopicRoute();
+    return layout.unrouted;
+  }
+  TopicRoute &route = layout.routes[topic];
+  route.slots = std::move(slots);
+  spdlog::info("Topic [{}] routed to {} slot(s)", topic, route.slots.size());
+  return route;
+}
+
+void layout_set(DisplayLayout &layout, size_t slot_idx, double value,
+                int64_t timestamp) {
+  const Slot &slot = layout.slots[slot_idx];
+  layout.states[slot_idx].value = value;
+  layout.states[slot_idx].updated_at = timestamp;
+  slot.formatter(slot.h, slot.position, value);
+}
+
+void layout_apply(DisplayLayout &layout, const TopicRoute &route,
+                  const json &payload, int64_t timestamp) {
+  for (size_t i : route.slots) {
+    auto it = payload.find(layout.slots[i].field);
+    if (it == payload.end() || !it->is_number())
+      continue;
+    layout_set(layout, i, it->get<double>(), timestamp);
+  }
+}
+
+int layout_apply_batch(DisplayLayout &layout, const TopicRoute &route,
+                       const GorillaBatch &batch) {
+  int updated = 0;
+  for (size_t i : route.slots) {
+    const uint32_t hash = sdp_fnv1a32(layout.slots[i].field.c_str());
+    for (size_t c = 0; c < batch.columns; ++c) {
+      if (batch.name_hashes[c] != hash)
+        continue;
+      // Rows are oldest first
+      for (size_t row = batch.rows; row-- > 0;) {
+        if (batch.qualities[row][c] == READING_BAD ||
+            isnan(batch.values[row][c]))
+          continue;
+        layout_set(layout, i, batch.values[row][c],
+                   batch.timestamps_ms[row] / 1000);
+        ++updated;
+        break;
+      }
+      break;
+    }
+  }
+  return updated;
+}
+
+void layout_reset_stale(DisplayLayout &layout, int64_t now) {
+  for (size_t i = 0; i < layout.slots.size(); ++i) {
+    const Slot &slot = layout.slots[i];
+    SlotState &state = layout.states[i];
+    int64_t updated_at = state.updated_at;
+    if (updated_at == SLOT_STALE || now < updated_at + slot.max_tolerance_sec)
+      continue;
+    // Fails only if layout_apply() refreshed the slot in the meantime
+    if (!state.updated_at.compare_exchange_strong(updated_at, SLOT_STALE))
+      continue;
+    spdlog::info("{} older than max_tolerance_sec ({}), resetting display",
+                 slot.field, slot.max_tolerance_sec);
+    iotctrl_7seg_disp_update_as_four_digit_float(slot.h, slot.placeholder,
+                                                 slot.position);
+    // A message may have landed between the exchange and the placeholder
+    // render above, in which case its value must win.
+    if (state.updated_at != SLOT_STALE)
+      slot.formatter(slot.h, slot.position, state.value);
+  }
+}
+
+int64_t layout_next_deadline(const DisplayLayout &layout) {
+  int64_t deadline = INT64_MAX;
+  for (size_t i = 0; i < layout.slots.size(); ++i) {
+    const int64_t updated_at = layout.states[i].updated_at;
+    if (updated_at == SLOT_STALE)
+      continue;
+    deadline = min(deadline, updated_at + layout.slots[i].max_tolerance_sec);
+  }
+  return deadline;
+}
+
+void layout_destroy(DisplayLayout &layout) {
+  for (auto h : layout.displays)
+    iotctrl_7seg_disp_destroy(h);
+  layout.displays.clear();
+  layout.slots.clear();
+  layout.states.reset();
+  layout.subscriptions.clear();
+  layout.routes.clear();
+}
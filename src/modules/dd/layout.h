@@ -0,0 +1,133 @@
+#ifndef DD_LAYOUT_H
+#define DD_LAYOUT_H
+
+#include "../../gorilla.h"
+
+#include <iotctrl/7segment-display.h>
+#include <nlohmann/json.hpp>
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// SlotState::updated_at of a slot whose placeholder is being shown
+#define SLOT_STALE INT64_MIN
+
+/**
+ * @brief Render one value onto digit group `position` of display `h`
+ */
+typedef void (*slot_formatter)(struct iotctrl_7seg_disp_handle *h,
+                               int position, double value);
+
+/**
+ * @brief One entry of the flat dispatch table: a payload field bound to a
+ * digit group of a display, plus how to render it and when it goes stale.
+ */
+struct Slot {
+  // MQTT topic filter (may contain + and # wildcards) the field is taken from
+  std::string topic;
+  struct iotctrl_7seg_disp_handle *h;
+  int position;
+  std::string field;
+  slot_formatter formatter;
+  double placeholder;
+  int64_t max_tolerance_sec;
+};
+
+/**
+ * @brief The mutable part of a Slot. Atomic so that layout_apply() and
+ * layout_reset_stale() may run on different threads without a lock.
+ */
+struct SlotState {
+  // Unix time (sec) of the payload that last updated this slot, or SLOT_STALE
+  std::atomic<int64_t> updated_at;
+  std::atomic<double> value;
+};
+
+/**
+ * @brief Per-topic routing entry and parse state. Only touched by the thread
+ * that receives messages.
+ */
+struct TopicRoute {
+  // Indices into DisplayLayout::slots fed by this topic
+  std::vector<size_t> slots;
+  // Unix time (sec) of the newest payload accepted, older ones are dropped
+  int64_t last_timestamp = INT64_MIN;
+  uint64_t accepted = 0;
+  uint64_t rejected = 0;
+};
+
+struct DisplayLayout {
+  std::vector<struct iotctrl_7seg_disp_handle *> displays;
+  std::vector<Slot> slots;
+  // states[i] belongs to slots[i]
+  std::unique_ptr<SlotState[]> states;
+  // Unique topic filters of all slots, i.e., what to subscribe to
+  std::vector<std::string> subscriptions;
+  // Concrete topic -> route. Topics without wildcard filters are routed at
+  // load time, the rest when their first message arrives. Only topics that
+  // feed at least one slot are kept.
+  std::unordered_map<std::string, TopicRoute> routes;
+  // Handed out for every topic that feeds no slot
+  TopicRoute unrouted;
+};
+
+/**
+ * @brief Initialize all displays and compile their slots into a flat dispatch
+ * table. Reads the /dd/displays array; if it is absent, the legacy
+ * /dd/7seg_display0 and /dd/7seg_display1 layout is used. A display's "topic"
+ * defaults to /dd/mqtt/topic and can be overridden per slot.
+ * @return 0 on success, negative number on failure (in which case all
+ * displays initialized so far are destroyed)
+ */
+int layout_load(DisplayLayout &layout, const nlohmann::json &settings);
+
+/**
+ * @brief Find the route of a concrete topic, matching it against the topic
+ * filter of every slot the first time it is seen. A topic that matches no
+ * slot isn't remembered, so that the topics a wildcard subscription brings in
+ * don't grow the routes without bound: it gets DisplayLayout::unrouted,
+ * with no slots and reset counters, instead.
+ */
+TopicRoute &layout_route(DisplayLayout &layout, const std::string &topic);
+
+/**
+ * @brief Render value on slot slot_idx and mark it fresh as of timestamp.
+ * @param timestamp Unix time (sec) of the value
+ */
+void layout_set(DisplayLayout &layout, size_t slot_idx, double value,
+                int64_t timestamp);
+
+/**
+ * @brief Render every slot of route whose field is present in payload.
+ * @param timestamp Unix time (sec) of the payload
+ */
+void layout_apply(DisplayLayout &layout, const TopicRoute &route,
+                  const nlohmann::json &payload, int64_t timestamp);
+
+/**
+ * @brief Render every slot of route whose field is a column of batch, with
+ * the column's newest usable value.
+ * @return Number of slots updated
+ */
+int layout_apply_batch(DisplayLayout &layout, const TopicRoute &route,
+                       const GorillaBatch &batch);
+
+/**
+ * @brief Render the placeholder on every slot not updated for longer than its
+ * max_tolerance_sec. Safe to call concurrently with layout_apply().
+ */
+void layout_reset_stale(DisplayLayout &layout, int64_t now);
+
+/**
+ * @brief Unix time (sec) at which the next slot goes stale, or INT64_MAX if
+ * every slot is already showing its placeholder.
+ */
+int64_t layout_next_deadline(const DisplayLayout &layout);
+
+void layout_destroy(DisplayLayout &layout);
+
+#endif // DD_LAYOUT_H
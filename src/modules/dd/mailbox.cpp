@@ -0,0 +1,72 @@
+#include "mailbox.h"
+
+#include <spdlog/spdlog.h>
+
+#include <errno.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#define MAILBOX_FRESH 0x80
+#define MAILBOX_INDEX 0x03
+
+using namespace std;
+
+int mailbox_set_init(MailboxSet &set) {
+  if ((set.event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0) {
+    spdlog::error("eventfd() failed: {}({})", errno, strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+void mailbox_set_destroy(MailboxSet &set) {
+  set.dirty = nullptr;
+  set.by_topic.clear();
+  if (set.event_fd >= 0)
+    close(set.event_fd);
+  set.event_fd = -1;
+}
+
+void mailbox_post(MailboxSet &set, const char *topic, const void *payload,
+                  size_t len) {
+  auto it = set.by_topic.find(topic);
+  if (it == set.by_topic.end()) {
+    auto mb = make_unique<Mailbox>();
+    mb->topic = topic;
+    it = set.by_topic.emplace(topic, std::move(mb)).first;
+  }
+  Mailbox &mb = *it->second;
+
+  // assign() reuses the buffer's capacity, so steady state doesn't allocate
+  mb.bufs[mb.back].assign((const char *)payload, len);
+  mb.back = mb.middle.exchange(mb.back | MAILBOX_FRESH,
+                               memory_order_acq_rel) &
+            MAILBOX_INDEX;
+  ++mb.written;
+
+  if (mb.queued.exchange(true, memory_order_acq_rel))
+    return;
+  Mailbox *head = set.dirty.load(memory_order_relaxed);
+  do {
+    mb.next = head;
+  } while (!set.dirty.compare_exchange_weak(head, &mb, memory_order_release,
+                                            memory_order_relaxed));
+  const uint64_t one = 1;
+  if (write(set.event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+    spdlog::error("write(event_fd) failed: {}({})", errno, strerror(errno));
+}
+
+void mailbox_ack_event(MailboxSet &set) {
+  uint64_t count;
+  // EAGAIN only means another drain consumed the event already
+  if (read(set.event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+    spdlog::error("read(event_fd) failed: {}({})", errno, strerror(errno));
+}
+
+bool mailbox_take(Mailbox &mb) {
+  if (!(mb.middle.load(memory_order_relaxed) & MAILBOX_FRESH))
+    return false;
+  mb.front = mb.middle.exchange(mb.front, memory_order_acq_rel) & MAILBOX_INDEX;
+  return true;
+}
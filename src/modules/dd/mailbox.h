@@ -0,0 +1,86 @@
+#ifndef DD_MAILBOX_H
+#define DD_MAILBOX_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+/**
+ * @brief Latest-value slot of one topic: a triple buffer written by the
+ * mosquitto callback thread and read by the display thread without a lock.
+ * A write never waits for the reader, and the reader always gets the newest
+ * complete payload; payloads written in between are dropped (coalesced).
+ */
+struct Mailbox {
+  std::string topic;
+  std::string bufs[3];
+  // Index of the buffer exchanged between writer and reader, plus
+  // MAILBOX_FRESH if it holds a payload the reader hasn't taken yet
+  std::atomic<uint8_t> middle{1};
+  // Owned by the writer
+  uint8_t back = 0;
+  // Owned by the reader
+  uint8_t front = 2;
+  // true while the mailbox is on MailboxSet::dirty
+  std::atomic<bool> queued{false};
+  Mailbox *next = nullptr;
+  std::atomic<uint64_t> written{0};
+};
+
+/**
+ * @brief All mailboxes plus a lock-free stack of those with unread payloads.
+ * The writer pushes a mailbox at most once until the reader drains it and
+ * signals event_fd, so the reader can sleep in poll().
+ */
+struct MailboxSet {
+  // Only touched by the writer thread
+  std::unordered_map<std::string, std::unique_ptr<Mailbox>> by_topic;
+  std::atomic<Mailbox *> dirty{nullptr};
+  // eventfd, readable whenever dirty may be non-empty
+  int event_fd = -1;
+};
+
+/**
+ * @return 0 on success, -1 if the eventfd can't be created
+ */
+int mailbox_set_init(MailboxSet &set);
+
+void mailbox_set_destroy(MailboxSet &set);
+
+/**
+ * @brief Called by the (single) writer thread; never blocks on the reader.
+ */
+void mailbox_post(MailboxSet &set, const char *topic, const void *payload,
+                  size_t len);
+
+// Implementation details of mailbox_drain()
+void mailbox_ack_event(MailboxSet &set);
+bool mailbox_take(Mailbox &mb);
+
+/**
+ * @brief Called by the reader thread once event_fd is readable. Invokes
+ * handler once per topic with the newest payload posted since the last drain.
+ * @return Number of payloads handed to handler
+ */
+template <typename Handler>
+size_t mailbox_drain(MailboxSet &set, Handler handler) {
+  size_t handled = 0;
+  mailbox_ack_event(set);
+  Mailbox *mb = set.dirty.exchange(nullptr, std::memory_order_acquire);
+  while (mb != nullptr) {
+    // next must be read before queued is cleared, after which the writer may
+    // push mb again and overwrite it
+    Mailbox *next = mb->next;
+    mb->queued.store(false, std::memory_order_release);
+    if (mailbox_take(*mb)) {
+      handler(mb->topic, mb->bufs[mb->front]);
+      ++handled;
+    }
+    mb = next;
+  }
+  return handled;
+}
+
+#endif // DD_MAILBOX_H
@@ -0,0 +1,184 @@
+#include "mcast_receiver.h"
+#include "../../shm_layout.h"
+
+#include <spdlog/spdlog.h>
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+using namespace std;
+
+int mcast_receiver_init(McastReceiver &receiver, DisplayLayout &layout,
+                        const string &group, int port, const string &interface,
+                        const string &key, const string &topic) {
+  struct sockaddr_in addr = {};
+  struct ip_mreq mreq = {};
+  const int reuse = 1;
+  receiver.group = fmt::format("{}:{}", group, port);
+  receiver.topic = topic;
+  receiver.key.assign(key.begin(), key.end());
+  if (key.size() < MCAST_KEY_MIN) {
+    spdlog::error("/dd/multicast/key must be at least {} characters long",
+                  MCAST_KEY_MIN);
+    return -1;
+  }
+  if (inet_pton(AF_INET, group.c_str(), &mreq.imr_multiaddr) != 1 ||
+      !IN_MULTICAST(ntohl(mreq.imr_multiaddr.s_addr)) || port <= 0 ||
+      port > 65535) {
+    spdlog::error("[{}] is not an IPv4 multicast group and port",
+                  receiver.group);
+    return -1;
+  }
+  mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+  if (!interface.empty() &&
+      inet_pton(AF_INET, interface.c_str(), &mreq.imr_interface) != 1) {
+    spdlog::error("/dd/multicast/interface must be an IPv4 address, not [{}]",
+                  interface);
+    return -1;
+  }
+
+  receiver.fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+  if (receiver.fd < 0) {
+    spdlog::error("socket() failed: {}({})", errno, strerror(errno));
+    return -1;
+  }
+  // Binding to the group rather than INADDR_ANY keeps unicast traffic to the
+  // same port out
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr = mreq.imr_multiaddr;
+  if (setsockopt(receiver.fd, SOL_SOCKET, SO_REUSEADDR, &reuse,
+                 sizeof(reuse)) != 0 ||
+      bind(receiver.fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+      setsockopt(receiver.fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq,
+                 sizeof(mreq)) != 0) {
+    spdlog::error("Joining {} failed: {}({})", receiver.group, errno,
+                  strerror(errno));
+    close(receiver.fd);
+    receiver.fd = -1;
+    return -1;
+  }
+
+  TopicRoute &route = layout_route(layout, topic);
+  for (size_t slot_idx : route.slots) {
+    const string &field = layout.slots[slot_idx].field;
+    receiver.bindings[sdp_fnv1a32(field.c_str())].push_back(slot_idx);
+  }
+  spdlog::info("Receiving readings for {} slot(s) of [{}] from {}",
+               route.slots.size(), topic, receiver.group);
+  return 0;
+}
+
+static int64_t mcast_receiver_now_ms(clockid_t clock) {
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Rejects replays and counts the datagrams skipped since the last one
+static bool mcast_receiver_in_order(McastReceiver &receiver,
+                                    const McastDatagram &d) {
+  // seq alone can't tell a replay from a new sender, e.g., after this
+  // process restarted, so a datagram must also be recent
+  int64_t newest_ms = 0;
+  for (size_t i = 0; i < d.count; ++i)
+    newest_ms = max(newest_ms, d.readings[i].timestamp_ms);
+  if (mcast_receiver_now_ms(CLOCK_REALTIME) - newest_ms >
+      MCAST_RECEIVER_MAX_AGE_MS) {
+    ++receiver.replayed;
+    return false;
+  }
+  const int64_t now_ms = mcast_receiver_now_ms(CLOCK_MONOTONIC);
+  auto it = receiver.senders.find(d.sender_id);
+  if (it == receiver.senders.end()) {
+    // A new sender, or sdp restarted with a fresh sender_id
+    if (receiver.senders.size() >= MCAST_RECEIVER_MAX_SENDERS) {
+      auto oldest = receiver.senders.begin();
+      for (auto s = receiver.senders.begin(); s != receiver.senders.end(); ++s)
+        if (s->second.heard_at_ms < oldest->second.heard_at_ms)
+          oldest = s;
+      receiver.senders.erase(oldest);
+    }
+    receiver.senders[d.sender_id] = {d.seq, now_ms};
+    return true;
+  }
+  if (d.seq <= it->second.seq) {
+    ++receiver.replayed;
+    return false;
+  }
+  receiver.lost += d.seq - it->second.seq - 1;
+  it->second = {d.seq, now_ms};
+  return true;
+}
+
+static int mcast_receiver_render(McastReceiver &receiver,
+                                 DisplayLayout &layout,
+                                 const McastDatagram &d) {
+  TopicRoute &route = layout_route(layout, receiver.topic);
+  int64_t newest_ms = 0;
+  for (size_t i = 0; i < d.count; ++i)
+    newest_ms = max(newest_ms, d.readings[i].timestamp_ms);
+  const int64_t timestamp = newest_ms / 1000;
+  // The same record usually arrives over MQTT too, only older ones are
+  // dropped
+  if (d.count == 0 || timestamp < route.last_timestamp)
+    return 0;
+  route.last_timestamp = timestamp;
+  int updated = 0;
+  for (size_t i = 0; i < d.count; ++i) {
+    if (d.readings[i].quality == READING_BAD)
+      continue;
+    auto it = receiver.bindings.find(d.readings[i].name_hash);
+    if (it == receiver.bindings.end())
+      continue;
+    for (size_t slot_idx : it->second) {
+      layout_set(layout, slot_idx, d.readings[i].value, timestamp);
+      ++updated;
+    }
+  }
+  return updated;
+}
+
+int mcast_receiver_apply(McastReceiver &receiver, DisplayLayout &layout) {
+  uint8_t buf[MCAST_DATAGRAM_MAX + 1];
+  McastDatagram d;
+  int updated = 0;
+  while (true) {
+    const ssize_t len = recv(receiver.fd, buf, sizeof(buf), 0);
+    if (len < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        spdlog::error("recv() failed: {}({})", errno, strerror(errno));
+      break;
+    }
+    ++receiver.received;
+    const int ret = mcast_decode(buf, len, receiver.key.data(),
+                                 receiver.key.size(), &d);
+    if (ret == -2) {
+      ++receiver.unauthenticated;
+      continue;
+    }
+    if (ret != 0) {
+      ++receiver.malformed;
+      continue;
+    }
+    if (mcast_receiver_in_order(receiver, d))
+      updated += mcast_receiver_render(receiver, layout, d);
+  }
+  return updated;
+}
+
+void mcast_receiver_destroy(McastReceiver &receiver) {
+  if (receiver.fd >= 0)
+    close(receiver.fd);
+  receiver.fd = -1;
+  spdlog::info("{}: {} datagram(s) received, {} lost, {} replayed, {} "
+               "malformed, {} failed authentication",
+               receiver.group, receiver.received, receiver.lost,
+               receiver.replayed, receiver.malformed,
+               receiver.unauthenticated);
+}
@@ -0,0 +1,69 @@
+#ifndef DD_MCAST_RECEIVER_H
+#define DD_MCAST_RECEIVER_H
+
+#include "../../mcast.h"
+#include "layout.h"
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Datagrams whose newest reading is older than this, by the local wall
+// clock, are rejected as replays, whatever their seq
+#define MCAST_RECEIVER_MAX_AGE_MS 10000
+// Senders whose seq is tracked; the one heard from least recently is
+// forgotten to make room for a new one
+#define MCAST_RECEIVER_MAX_SENDERS 16
+
+struct McastSender {
+  // seq of the newest datagram accepted from the sender
+  uint64_t seq;
+  // CLOCK_MONOTONIC ms that datagram was received at
+  int64_t heard_at_ms;
+};
+
+/**
+ * @brief Receives the datagrams sdp's multicast sink sends to a LAN group,
+ * as a broker-independent shortcut for the slots of one topic. The socket is
+ * non-blocking and polled by the main thread, so no thread of its own.
+ */
+struct McastReceiver {
+  int fd = -1;
+  std::string group;
+  // Slots routed from this topic are fed from the datagrams
+  std::string topic;
+  std::vector<uint8_t> key;
+  // Metric name hash -> slots (indices into DisplayLayout::slots) it feeds
+  std::unordered_map<uint32_t, std::vector<size_t>> bindings;
+  // sender_id -> the newest datagram accepted from it, at most
+  // MCAST_RECEIVER_MAX_SENDERS, as every sdp restart brings a new sender_id
+  std::unordered_map<uint32_t, McastSender> senders;
+
+  uint64_t received = 0;
+  uint64_t lost = 0;
+  uint64_t replayed = 0;
+  uint64_t malformed = 0;
+  uint64_t unauthenticated = 0;
+};
+
+/**
+ * @brief Join group on interface (an IPv4 address, empty for the default)
+ * and bind the slots routed from topic by their field names.
+ * @return 0 on success, -1 on failure
+ */
+int mcast_receiver_init(McastReceiver &receiver, DisplayLayout &layout,
+                        const std::string &group, int port,
+                        const std::string &interface, const std::string &key,
+                        const std::string &topic);
+
+/**
+ * @brief Called by the main thread once fd is readable: drain the socket and
+ * render every authentic, in-order datagram onto the bound slots.
+ * @return Number of slots updated
+ */
+int mcast_receiver_apply(McastReceiver &receiver, DisplayLayout &layout);
+
+void mcast_receiver_destroy(McastReceiver &receiver);
+
+#endif // DD_MCAST_RECEIVER_H
@@ -0,0 +1,21 @@
+#ifndef DD_METRICS_H
+#define DD_METRICS_H
+
+#include "../readings.h"
+
+// Metrics published by the dd producer. The names double as the JSON keys of
+// the MQTT payload that dd-consumer renders.
+enum DDMetric {
+  DD_TEMP_OUTDOOR_CELSIUS = 0,
+  DD_TEMP_INDOOR_CELSIUS,
+  DD_RH_OUTDOOR,
+  DD_METRIC_COUNT
+};
+
+static const struct MetricDesc dd_metrics[DD_METRIC_COUNT] = {
+    {"temp_outdoor_celsius", "°C", 1},
+    {"temp_indoor_celsius", "°C", 1},
+    {"rh_outdoor", "%", 1},
+};
+
+#endif // DD_METRICS_H
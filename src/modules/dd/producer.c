@@ -1,6 +1,10 @@
+#include "../../device_cache.h"
+#include "../../payload.h"
+#include "../../readings_json.h"
 #include "../../utils.h"
 #include "../libs/mqtt.h"
 #include "../module.h"
+#include "metrics.h"
 
 #include <iotctrl/dht31.h>
 #include <iotctrl/temp-sensor.h>
@@ -13,144 +17,105 @@
 #include <syslog.h>
 #include <time.h>
 
+#define DHT31_I2C_ADDR 0x44
+
 struct PostCollectionCtx {
   struct mosquitto *mosq;
   bool is_mqtt_connected;
   const char *topic;
+  struct PayloadTemplate tpl;
 };
 
-struct Readings {
-  double temp_outdoor_celsius;
-  double temp_indoor_celsius;
-  double rh_outdoor;
-};
+static const struct ModuleInfo info = {.abi_version = SDP_MODULE_ABI_VERSION,
+                                       .name = "dd",
+                                       .metric_count = DD_METRIC_COUNT,
+                                       .metrics = dd_metrics};
 
 struct ConnectionInfo {
-  struct Readings readings;
   char *dht31_device_path;
   char *dl11_device_path;
 };
 
+struct DHT31Sample {
+  float temp_celsius;
+  float relative_humidity;
+};
+
+const struct ModuleInfo *module_info(void) { return &info; }
+
+static int dht31_read(void *arg, void *sample,
+                      __attribute__((unused)) size_t sample_size) {
+  struct DHT31Sample *s = (struct DHT31Sample *)sample;
+  int fd = iotctrl_dht31_init((const char *)arg);
+  int ret = iotctrl_dht31_read(fd, &s->temp_celsius, &s->relative_humidity);
+  iotctrl_dht31_destroy(fd);
+  return ret;
+}
+
+static int dl11_read(void *arg, void *sample, size_t sample_size) {
+  return iotctrl_get_temperature((const char *)arg,
+                                 sample_size / sizeof(int16_t),
+                                 (int16_t *)sample, 0);
+}
+
 void *post_collection_init(const json_object *config) {
   struct PostCollectionCtx *ctx = malloc(sizeof(struct PostCollectionCtx));
   if (ctx == NULL)
     goto err_ctx_malloc;
   ctx->is_mqtt_connected = false;
 
-  json_object *json_ele;
-  const char *host = NULL;
-  const char *username = NULL;
-  const char *password = NULL;
-  const char *ca_file_path = NULL;
-  json_pointer_get((json_object *)config, "/dd/mqtt/host", &json_ele);
-  host = json_object_get_string(json_ele);
-  json_pointer_get((json_object *)config, "/dd/mqtt/username", &json_ele);
-  username = json_object_get_string(json_ele);
-  json_pointer_get((json_object *)config, "/dd/mqtt/password", &json_ele);
-  password = json_object_get_string(json_ele);
-  json_pointer_get((json_object *)config, "/dd/mqtt/ca_file_path", &json_ele);
-  ca_file_path = json_object_get_string(json_ele);
+  json_object *json_ele = NULL;
   json_pointer_get((json_object *)config, "/dd/mqtt/topic", &json_ele);
   ctx->topic = json_object_get_string(json_ele);
-  if (ca_file_path == NULL || username == NULL || password == NULL ||
-      host == NULL || ctx->topic == NULL) {
-    SYSLOG_ERR(
-        "ca_file_path/username/password/host not defined in config files");
+  if (ctx->topic == NULL) {
+    SYSLOG_ERR("/dd/mqtt/topic not defined in config files");
     goto err_json_key_not_found;
   }
 
-  int rc;
-
-  /* Required before calling other mosquitto functions */
-  if (mosquitto_lib_init() != MOSQ_ERR_SUCCESS) {
-    SYSLOG_ERR("mosquitto_lib_init() failed");
-    goto err_init_mosquitto;
+  if (payload_template_init(&ctx->tpl, &info, "timestamp_utc") != 0) {
+    SYSLOG_ERR("payload_template_init() failed");
+    goto err_payload_template_init;
   }
-  /* Create a new client instance.
-   * id = NULL -> ask the broker to generate a client id for us
-   * clean session = true -> the broker should remove old sessions when we
-   * connect obj = NULL -> we aren't passing any of our private data for
-   * callbacks
-   */
-  ctx->mosq = mosquitto_new(NULL, true, NULL);
+
+  ctx->mosq = init_mosquitto_from_json(config, "/dd/mqtt");
   if (ctx->mosq == NULL) {
-    SYSLOG_ERR("mosquitto_new() failed");
+    SYSLOG_ERR("init_mosquitto_from_json() failed");
     goto err_init_mosquitto;
   }
-  if ((rc = mosquitto_username_pw_set(ctx->mosq, username, password)) !=
-      MOSQ_ERR_SUCCESS) {
-    SYSLOG_ERR("mosquitto_username_pw_set() failed: %s",
-               mosquitto_strerror(rc));
-    goto err_mosquitto_config;
-  }
-  if ((rc = mosquitto_tls_set(ctx->mosq, ca_file_path, NULL, NULL, NULL,
-                              NULL)) != MOSQ_ERR_SUCCESS) {
-    SYSLOG_ERR("mosquitto_tls_set() failed: %s", mosquitto_strerror(rc));
-    goto err_mosquitto_config;
-  }
-  mosquitto_connect_callback_set(ctx->mosq, mosq_on_connect);
-  mosquitto_disconnect_callback_set(ctx->mosq, mosq_on_connect);
-  mosquitto_publish_callback_set(ctx->mosq, mosq_on_publish);
-  mosquitto_log_callback_set(ctx->mosq, mosq_log_callback);
-
-  /*  This call makes the socket connection only, it does not complete
-   * the MQTT CONNECT/CONNACK flow, you should use mosquitto_loop_start() or
-   * mosquitto_loop_forever() for processing net traffic. */
-  rc = mosquitto_connect(ctx->mosq, host, 8883, 60);
-  if (rc != MOSQ_ERR_SUCCESS) {
-    SYSLOG_ERR("mosquitto_connect() failed: %s", mosquitto_strerror(rc));
-    goto err_mosquitto_connect;
-  }
-
-  /* Run the network loop in a background thread, this call returns quickly. */
-  if ((mosquitto_loop_start(ctx->mosq)) != MOSQ_ERR_SUCCESS) {
-    SYSLOG_ERR("mosquitto_loop_start() failed: %s", mosquitto_strerror(rc));
-    goto err_mosquitto_connect;
-  }
 
   return ctx;
-err_mosquitto_config:
-err_mosquitto_connect:
-  mosquitto_destroy(ctx->mosq);
 err_init_mosquitto:
+  payload_template_destroy(&ctx->tpl);
+err_payload_template_init:
+err_json_key_not_found:
   free(ctx);
   ctx = NULL;
-err_json_key_not_found:
 err_ctx_malloc:
   return NULL;
 }
 
-int post_collection(void *c_ctx, void *pc_ctx) {
-  struct Readings *_readings = (struct Readings *)c_ctx;
+int post_collection(const struct ReadingRecord *readings, void *pc_ctx) {
   struct PostCollectionCtx *_pc_ctx = (struct PostCollectionCtx *)pc_ctx;
   char payload[128];
   int rc;
 
-  time_t now;
-  struct tm *utc_time;
-  char iso_time[21];
-  time(&now);
-  utc_time = gmtime(&now);
-  strftime(iso_time, sizeof(iso_time), "%Y-%m-%dT%H:%M:%SZ", utc_time);
-
-  snprintf(payload, sizeof(payload),
-           "{\"timestamp_utc\": \"%s\", \"temp_outdoor_celsius\": %.1f, "
-           "\"temp_indoor_celsius\": %.1f, "
-           "\"rh_outdoor\": %.1f}",
-           iso_time, _readings->temp_outdoor_celsius,
-           _readings->temp_indoor_celsius, _readings->rh_outdoor);
+  const int len = payload_render(&_pc_ctx->tpl, readings, NULL, payload,
+                                 sizeof(payload));
+  if (len < 0) {
+    SYSLOG_ERR("payload_render() failed");
+    return 1;
+  }
 
   /* Publish the message
    * mosq - our client instance
    * *mid = NULL - we don't want to know what the message id for this message
    * is topic = "example/temperature" - the topic on which this message will
-   * be published payloadlen = strlen(payload) - the length of our payload in
+   * be published payloadlen = len - the length of our payload in
    * bytes payload - the actual payload qos = 2 - publish with QoS 2 for this
    * example retain = false - do not use the retained message feature for this
    * message
    */
-  rc = mosquitto_publish(_pc_ctx->mosq, NULL, _pc_ctx->topic, strlen(payload),
-                         payload, 1, false);
+  rc = mqtt_publish(_pc_ctx->mosq, _pc_ctx->topic, payload, len, 1, false);
   if (rc != MOSQ_ERR_SUCCESS) {
     SYSLOG_ERR("Error publishing: %s", mosquitto_strerror(rc));
     return 1;
@@ -164,7 +129,8 @@ int post_collection(void *c_ctx, void *pc_ctx) {
 void post_collection_destroy(void *ctx) {
   struct PostCollectionCtx *_ctx = (struct PostCollectionCtx *)ctx;
   if (_ctx != NULL) {
-    mosquitto_destroy(_ctx->mosq);
+    mqtt_destroy(_ctx->mosq);
+    payload_template_destroy(&_ctx->tpl);
     free(_ctx);
   }
   mosquitto_lib_cleanup();
@@ -214,9 +180,6 @@ void *collection_init(const json_object *config) {
   }
   strcpy(conn->dl11_device_path, device_path);
 
-  conn->readings.temp_outdoor_celsius = 888.8;
-  conn->readings.temp_indoor_celsius = 888.8;
-  conn->readings.rh_outdoor = 888.8;
   syslog(LOG_INFO,
          "collection_init() success, dht31_device_path: %s, "
          "dl11_device_path: %s",
@@ -233,39 +196,40 @@ err_malloc_conn:
   return NULL;
 }
 
-int collection(void *ctx) {
+int collection(void *ctx, struct ReadingRecord *out) {
   struct ConnectionInfo *conn = (struct ConnectionInfo *)ctx;
-  float temp_celsius_t;
-  float relative_humidity_t;
+  struct DHT31Sample dht31;
   int ret = 0;
   const uint8_t sensor_count = 1;
   int16_t readings[sensor_count];
-  int fd = iotctrl_dht31_init(conn->dht31_device_path);
 
-  if ((ret = iotctrl_dht31_read(fd, &temp_celsius_t, &relative_humidity_t)) !=
-      0) {
+  if ((ret = device_cache_read(conn->dht31_device_path, DHT31_I2C_ADDR,
+                               &dht31, sizeof(dht31), dht31_read,
+                               conn->dht31_device_path)) != 0) {
     syslog(LOG_INFO, "iotctrl_dht31_read() failed: %d", ret);
     ret = 1;
     goto err_dht31_read;
   }
-  conn->readings.temp_outdoor_celsius = temp_celsius_t;
-  conn->readings.rh_outdoor = relative_humidity_t;
+  const int64_t dht31_read_at = readings_now_ms();
 
-  if (iotctrl_get_temperature(conn->dl11_device_path, sensor_count, readings,
-                              0) != 0) {
+  if (device_cache_read(conn->dl11_device_path, 0, readings, sizeof(readings),
+                        dl11_read, conn->dl11_device_path) != 0) {
     ret = 2;
     syslog(LOG_INFO, "iotctrl_get_temperature() failed: %d", ret);
     goto err_dl11_read;
   }
-  conn->readings.temp_indoor_celsius = readings[0] / 10.0;
+  readings_add(out, DD_TEMP_OUTDOOR_CELSIUS, dht31.temp_celsius, dht31_read_at,
+               READING_GOOD);
+  readings_add(out, DD_TEMP_INDOOR_CELSIUS, readings[0] / 10.0,
+               readings_now_ms(), READING_GOOD);
+  readings_add(out, DD_RH_OUTDOOR, dht31.relative_humidity, dht31_read_at,
+               READING_GOOD);
 
   syslog(LOG_INFO,
          "Readings changed to temp0: %.1f°C, temp1: %.1f°C, RH: %.1f%%",
-         conn->readings.temp_outdoor_celsius,
-         conn->readings.temp_indoor_celsius, conn->readings.rh_outdoor);
+         dht31.temp_celsius, readings[0] / 10.0, dht31.relative_humidity);
 err_dl11_read:
 err_dht31_read:
-  iotctrl_dht31_destroy(fd);
   return ret;
 }
 
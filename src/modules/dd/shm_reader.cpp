@@ -0,0 +1,186 @@
+#include "shm_reader.h"
+
+#include <spdlog/spdlog.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+// A snapshot taken while the writer is busy is retried at most this often
+#define SHM_READ_ATTEMPTS 64
+
+using namespace std;
+
+static bool shm_reader_open(ShmReader &reader) {
+  int fd = shm_open(reader.name.c_str(), O_RDONLY | O_CLOEXEC, 0);
+  if (fd < 0)
+    return false;
+  /* sdp creates the object before ftruncate()ing it, and a leftover object
+   * may be from a smaller layout: mmap() succeeds on either, but touching the
+   * pages past the object's end raises SIGBUS. Wait for the full size. */
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(ShmSegment)) {
+    close(fd);
+    return false;
+  }
+  void *addr = mmap(NULL, sizeof(ShmSegment), PROT_READ, MAP_SHARED, fd, 0);
+  if (addr == MAP_FAILED) {
+    spdlog::error("mmap({}) failed: {}({})", reader.name, errno,
+                  strerror(errno));
+    close(fd);
+    return false;
+  }
+  const ShmSegment *seg = (const ShmSegment *)addr;
+  if (__atomic_load_n(&seg->magic, __ATOMIC_ACQUIRE) != SDP_SHM_MAGIC ||
+      seg->version != SDP_SHM_VERSION) {
+    spdlog::warn("{} is not an sdp shm segment of version {}", reader.name,
+                 SDP_SHM_VERSION);
+    munmap(addr, sizeof(ShmSegment));
+    close(fd);
+    return false;
+  }
+  reader.fd = fd;
+  reader.seg = seg;
+  spdlog::info("Reading the latest record from shm object {}", reader.name);
+  return true;
+}
+
+static void shm_reader_watch(ShmReader *reader) {
+  uint32_t seen = 0;
+  while (!reader->stop) {
+    const ShmSegment *seg = reader->seg;
+    if (seg == nullptr && !shm_reader_open(*reader)) {
+      usleep(1000 * 1000);
+      continue;
+    }
+    seg = reader->seg;
+    const uint32_t seq = __atomic_load_n(&seg->seq, __ATOMIC_ACQUIRE);
+    if (seq != seen && !(seq & 1)) {
+      seen = seq;
+      const uint64_t one = 1;
+      if (write(reader->event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        spdlog::error("write(event_fd) failed: {}({})", errno,
+                      strerror(errno));
+    }
+    // Returns as soon as the writer bumps seq, or after 1 sec to check stop
+    struct timespec timeout = {1, 0};
+    syscall(SYS_futex, &seg->seq, FUTEX_WAIT, seq, &timeout, NULL, 0);
+  }
+}
+
+int shm_reader_init(ShmReader &reader, const string &name,
+                    const string &topic) {
+  reader.name = name;
+  reader.topic = topic;
+  if ((reader.event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0) {
+    spdlog::error("eventfd() failed: {}({})", errno, strerror(errno));
+    return -1;
+  }
+  reader.watcher = thread(shm_reader_watch, &reader);
+  return 0;
+}
+
+// Seqlock read of the whole segment into reader.snapshot
+static bool shm_reader_snapshot(ShmReader &reader) {
+  const ShmSegment *seg = reader.seg;
+  if (seg == nullptr)
+    return false;
+  for (int i = 0; i < SHM_READ_ATTEMPTS; ++i) {
+    const uint32_t before = __atomic_load_n(&seg->seq, __ATOMIC_ACQUIRE);
+    if (!(before & 1)) {
+      memcpy(&reader.snapshot, seg, sizeof(ShmSegment));
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if (__atomic_load_n(&seg->seq, __ATOMIC_RELAXED) == before)
+        return reader.snapshot.magic == SDP_SHM_MAGIC &&
+               reader.snapshot.metric_count <= SDP_READINGS_MAX &&
+               reader.snapshot.record.count <= SDP_READINGS_MAX;
+    }
+    ++reader.retries;
+  }
+  return false;
+}
+
+// Resolve slot fields to metric ids, matching FNV-1a hashes first
+static void shm_reader_bind(ShmReader &reader, DisplayLayout &layout,
+                            const TopicRoute &route) {
+  const ShmSegment &snap = reader.snapshot;
+  uint64_t bound_to = 0;
+  for (uint32_t i = 0; i < snap.metric_count; ++i)
+    bound_to += snap.metrics[i].name_hash;
+  if (bound_to == reader.bound_to && !reader.bindings.empty())
+    return;
+  reader.bindings.clear();
+  reader.bound_to = bound_to;
+  for (size_t slot_idx : route.slots) {
+    const string &field = layout.slots[slot_idx].field;
+    const uint32_t hash = sdp_fnv1a32(field.c_str());
+    for (uint32_t i = 0; i < snap.metric_count; ++i) {
+      if (snap.metrics[i].name_hash != hash ||
+          strncmp(snap.metrics[i].name, field.c_str(), SDP_SHM_NAME_MAX) != 0)
+        continue;
+      reader.bindings[i].push_back(slot_idx);
+      spdlog::info("[{}] fed from {} metric {}", field, reader.name, i);
+      break;
+    }
+  }
+}
+
+int shm_reader_apply(ShmReader &reader, DisplayLayout &layout) {
+  uint64_t count;
+  if (read(reader.event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+    spdlog::error("read(event_fd) failed: {}({})", errno, strerror(errno));
+  if (!shm_reader_snapshot(reader))
+    return -1;
+  TopicRoute &route = layout_route(layout, reader.topic);
+  shm_reader_bind(reader, layout, route);
+
+  const ReadingRecord &r = reader.snapshot.record;
+  int64_t newest_ms = 0;
+  for (size_t i = 0; i < r.count; ++i)
+    newest_ms = max(newest_ms, r.timestamps_ms[i]);
+  const int64_t timestamp = newest_ms / 1000;
+  // The same record usually arrives over MQTT too, only older ones are
+  // dropped
+  if (r.count == 0 || timestamp < route.last_timestamp)
+    return 0;
+  route.last_timestamp = timestamp;
+  ++reader.records;
+  int updated = 0;
+  for (size_t i = 0; i < r.count; ++i) {
+    if (r.qualities[i] == READING_BAD)
+      continue;
+    auto it = reader.bindings.find(r.metric_ids[i]);
+    if (it == reader.bindings.end())
+      continue;
+    for (size_t slot_idx : it->second) {
+      layout_set(layout, slot_idx, r.values[i], timestamp);
+      ++updated;
+    }
+  }
+  return updated;
+}
+
+void shm_reader_destroy(ShmReader &reader) {
+  reader.stop = true;
+  if (reader.watcher.joinable())
+    reader.watcher.join();
+  const ShmSegment *seg = reader.seg;
+  if (seg != nullptr)
+    munmap((void *)seg, sizeof(ShmSegment));
+  if (reader.fd >= 0)
+    close(reader.fd);
+  if (reader.event_fd >= 0)
+    close(reader.event_fd);
+  reader.seg = nullptr;
+  reader.fd = reader.event_fd = -1;
+  spdlog::info("{}: {} record(s) applied, {} seqlock retries", reader.name,
+               reader.records, reader.retries);
+}
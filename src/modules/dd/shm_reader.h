@@ -0,0 +1,59 @@
+#ifndef DD_SHM_READER_H
+#define DD_SHM_READER_H
+
+#include "../../shm_layout.h"
+#include "layout.h"
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * @brief Reads the latest record sdp publishes through its shm sink on the
+ * same host, as a broker-independent shortcut for the slots of one topic.
+ * A watcher thread sleeps on the segment's futex and signals event_fd on
+ * every new record; the snapshot itself is taken by the main thread.
+ */
+struct ShmReader {
+  std::string name;
+  // Slots routed from this topic are fed from the segment
+  std::string topic;
+  // Set by the watcher thread once the segment exists
+  std::atomic<const ShmSegment *> seg{nullptr};
+  int fd = -1;
+  // eventfd, readable whenever a new record may be available
+  int event_fd = -1;
+  std::thread watcher;
+  std::atomic<bool> stop{false};
+
+  // Owned by the main thread
+  ShmSegment snapshot;
+  // Sum of the metric name hashes the bindings were resolved against
+  uint64_t bound_to = 0;
+  // Metric id -> slots (indices into DisplayLayout::slots) it feeds
+  std::unordered_map<uint16_t, std::vector<size_t>> bindings;
+  uint64_t records = 0;
+  uint64_t retries = 0;
+};
+
+/**
+ * @brief Create event_fd and start watching shm object name. The object may
+ * not exist yet, the watcher keeps trying to open it.
+ * @return 0 on success, -1 on failure
+ */
+int shm_reader_init(ShmReader &reader, const std::string &name,
+                    const std::string &topic);
+
+/**
+ * @brief Called by the main thread once event_fd is readable: take a
+ * consistent snapshot and render the readings onto the bound slots.
+ * @return Number of slots updated, -1 if no consistent snapshot was taken
+ */
+int shm_reader_apply(ShmReader &reader, DisplayLayout &layout);
+
+void shm_reader_destroy(ShmReader &reader);
+
+#endif // DD_SHM_READER_H
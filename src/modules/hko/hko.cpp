@@ -1,3 +1,4 @@
+#include "../../readings_json.h"
 #include "../../utils.h"
 #include "../libs/mqtt.h"
 #include "../module.h"
@@ -9,52 +10,60 @@
 #include <mosquitto.h>
 #include <nlohmann/json.hpp>
 
-#include <chrono>
 #include <sstream>
 #include <stdbool.h>
 #include <stdio.h>
 #include <sys/syslog.h>
 #include <thread>
+#include <time.h>
 
 using json = nlohmann::json;
 using namespace curlpp::options;
 
+enum HKOMetric { METRIC_TEMP_CELSIUS = 0, METRIC_COUNT };
+
+static const struct MetricDesc metrics[METRIC_COUNT] = {
+    {"temp_celsius", "°C", 1}};
+
+static const struct ModuleInfo info = {SDP_MODULE_ABI_VERSION, "hko",
+                                       METRIC_COUNT, metrics};
+
 struct PostCollectionCtx {
   struct mosquitto *mosq;
   const char *topic;
 };
 struct CollectionCtx {
-  json payload;
+  std::string place;
 };
 
+const struct ModuleInfo *module_info(void) { return &info; }
+
+// recordTime looks like 2024-01-01T12:00:00+08:00
+static int64_t parse_record_time_ms(const std::string &record_time) {
+  struct tm tm = {};
+  const char *end = strptime(record_time.c_str(), "%Y-%m-%dT%H:%M:%S%z", &tm);
+  if (end == NULL || *end != '\0')
+    throw std::invalid_argument(
+        fmt::format("Unexpected recordTime: {}", record_time));
+  return ((int64_t)timegm(&tm) - tm.tm_gmtoff) * 1000;
+}
+
 void *post_collection_init(const json_object *config) {
 
   auto ctx = new struct PostCollectionCtx();
-  struct json_object *json_ele;
-  const char *host = NULL;
-  const char *username = NULL;
-  const char *password = NULL;
-  const char *ca_file_path = NULL;
-  json_pointer_get((json_object *)config, "/hko/host", &json_ele);
-  host = json_object_get_string(json_ele);
-  json_pointer_get((json_object *)config, "/hko/username", &json_ele);
-  username = json_object_get_string(json_ele);
-  json_pointer_get((json_object *)config, "/hko/password", &json_ele);
-  password = json_object_get_string(json_ele);
-  json_pointer_get((json_object *)config, "/hko/ca_file_path", &json_ele);
-  ca_file_path = json_object_get_string(json_ele);
+  struct json_object *json_ele = NULL;
   json_pointer_get((json_object *)config, "/hko/topic", &json_ele);
   ctx->topic = json_object_get_string(json_ele);
-  if (host == NULL || ca_file_path == NULL || username == NULL ||
-      password == NULL || ctx->topic == NULL) {
+  if (ctx->topic == NULL) {
     SYSLOG_ERR("Invalid configs");
     delete ctx;
     ctx = NULL;
     return NULL;
   }
-  ctx->mosq = init_mosquitto(host, ca_file_path, username, password);
+  // hko keeps its MQTT settings directly under /hko
+  ctx->mosq = init_mosquitto_from_json(config, "/hko");
   if (ctx->mosq == NULL) {
-    SYSLOG_ERR("init_mosquitto() failed");
+    SYSLOG_ERR("init_mosquitto_from_json() failed");
     delete ctx;
     ctx = NULL;
     return NULL;
@@ -62,13 +71,29 @@ void *post_collection_init(const json_object *config) {
   return ctx;
 }
 
-int post_collection(void *c_ctx, void *pc_ctx) {
-  struct CollectionCtx *_c_ctx = (struct CollectionCtx *)c_ctx;
+int post_collection(const struct ReadingRecord *readings, void *pc_ctx) {
   struct PostCollectionCtx *_pc_ctx = (struct PostCollectionCtx *)pc_ctx;
-
-  mosquitto_publish(_pc_ctx->mosq, NULL, _pc_ctx->topic,
-                    _c_ctx->payload.dump().length(),
-                    _c_ctx->payload.dump().c_str(), 2, false);
+  char fh_timestamp[sizeof("1970-01-01T00:00:00Z")];
+  char hko_timestamp[sizeof("1970-01-01T00:00:00Z")];
+  char extra[96];
+  char payload[256];
+  if (readings->count == 0)
+    return 1;
+  readings_format_iso8601(readings_now_ms(), fh_timestamp,
+                          sizeof(fh_timestamp));
+  // The reading is timestamped with HKO's recordTime
+  readings_format_iso8601(readings->timestamps_ms[0], hko_timestamp,
+                          sizeof(hko_timestamp));
+  snprintf(extra, sizeof(extra),
+           "\"fh_timestamp\": \"%s\", \"hko_timestamp\": \"%s\"",
+           fh_timestamp, hko_timestamp);
+  int len = readings_to_json(&info, readings, NULL, extra, payload,
+                             sizeof(payload));
+  if (len < 0) {
+    SYSLOG_ERR("readings_to_json() failed");
+    return 1;
+  }
+  mqtt_publish(_pc_ctx->mosq, _pc_ctx->topic, payload, len, 2, false);
   return 0;
 }
 
@@ -76,7 +101,7 @@ void post_collection_destroy(void *ctx) {
   auto _ctx = (struct PostCollectionCtx *)ctx;
   if (ctx == NULL)
     return;
-  mosquitto_destroy(_ctx->mosq);
+  mqtt_destroy(_ctx->mosq);
   mosquitto_lib_cleanup();
   // free(_ctx);
   delete _ctx;
@@ -85,13 +110,13 @@ void post_collection_destroy(void *ctx) {
 void *collection_init(const json_object *config) {
   (void)config;
   auto ctx = new struct CollectionCtx();
-  // ctx->payload = json::parse(R"({ })");
   if (ctx == NULL)
     return NULL;
+  ctx->place = "Happy Valley";
   return ctx;
 }
 
-int collection(void *ctx) {
+int collection(void *ctx, struct ReadingRecord *readings) {
   auto _ctx = (struct CollectionCtx *)ctx;
   std::ostringstream os;
   try {
@@ -99,7 +124,7 @@ int collection(void *ctx) {
                                "opendata/weather.php?dataType=rhrread&lang=en");
     auto j = json::parse(os.str());
     json data;
-    auto place = "Happy Valley";
+    const auto &place = _ctx->place;
     for (const auto &_data : j["temperature"]["data"]) {
       if (_data.value("/place"_json_pointer, "") == place) {
         data = _data;
@@ -116,13 +141,10 @@ int collection(void *ctx) {
     syslog(LOG_INFO, "Data from HK gov: recordTime: %s, air temp: %f°C",
            j["temperature"]["recordTime"].get<std::string>().c_str(),
            data["value"].get<float>());
-    auto now = std::chrono::system_clock::now();
-    auto itt = std::chrono::system_clock::to_time_t(now);
-    std::ostringstream ss;
-    ss << std::put_time(std::gmtime(&itt), "%Y-%m-%dT%H:%M:%SZ");
-    _ctx->payload["fh_timestamp"] = ss.str();
-    _ctx->payload["hko_timestamp"] = j["temperature"]["recordTime"];
-    _ctx->payload["temp_celsius"] = data["value"];
+    readings_add(readings, METRIC_TEMP_CELSIUS, data["value"].get<double>(),
+                 parse_record_time_ms(
+                     j["temperature"]["recordTime"].get<std::string>()),
+                 READING_GOOD);
     return 0;
   } catch (const std::exception &e) {
     SYSLOG_ERR("C++ exception: %s", e.what());
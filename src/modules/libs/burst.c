@@ -0,0 +1,109 @@
+#include "burst.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Number of independent accumulators, covers 256-bit SIMD registers of floats
+#define LANES 8
+#define ALIGNMENT 32
+
+static float *alloc_floats(size_t count) {
+  // aligned_alloc() requires the size to be a multiple of the alignment
+  size_t size = (count * sizeof(float) + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+  return aligned_alloc(ALIGNMENT, size == 0 ? ALIGNMENT : size);
+}
+
+int burst_buffer_init(struct BurstBuffer *b, size_t capacity, const float *taps,
+                      size_t tap_count) {
+  memset(b, 0, sizeof(struct BurstBuffer));
+  b->capacity = capacity;
+  if ((b->samples = alloc_floats(capacity)) == NULL ||
+      (b->filtered = alloc_floats(capacity)) == NULL)
+    goto err_alloc;
+  if (taps != NULL && tap_count > 0) {
+    if ((b->taps = alloc_floats(tap_count)) == NULL)
+      goto err_alloc;
+    memcpy(b->taps, taps, tap_count * sizeof(float));
+    b->tap_count = tap_count;
+  }
+  return 0;
+err_alloc:
+  burst_buffer_destroy(b);
+  return -1;
+}
+
+void burst_buffer_destroy(struct BurstBuffer *b) {
+  free(b->samples);
+  free(b->filtered);
+  free(b->taps);
+  memset(b, 0, sizeof(struct BurstBuffer));
+}
+
+// "valid" convolution: y[i] = sum(taps[k] * x[i + k]), one axpy per tap so the
+// inner loop is a plain vectorizable multiply-add over contiguous memory
+static size_t fir(const float *restrict x, size_t n, const float *restrict taps,
+                  size_t tap_count, float *restrict y) {
+  if (tap_count == 0 || tap_count > n) {
+    memcpy(y, x, n * sizeof(float));
+    return n;
+  }
+  const size_t m = n - tap_count + 1;
+  memset(y, 0, m * sizeof(float));
+  for (size_t k = 0; k < tap_count; ++k) {
+    const float t = taps[k];
+    const float *restrict xk = x + k;
+    for (size_t i = 0; i < m; ++i)
+      y[i] += t * xk[i];
+  }
+  return m;
+}
+
+int burst_reduce(struct BurstBuffer *b, struct BurstStats *stats) {
+  const size_t n = b->count;
+  if (n == 0)
+    return -1;
+  const float *restrict x = b->samples;
+  float sum[LANES] = {0}, peak[LANES] = {0}, lo[LANES], hi[LANES];
+
+  size_t i = 0;
+  for (; i + LANES <= n; i += LANES) {
+    for (size_t l = 0; l < LANES; ++l) {
+      sum[l] += x[i + l];
+      peak[l] = fmaxf(peak[l], fabsf(x[i + l]));
+    }
+  }
+  for (; i < n; ++i) {
+    sum[0] += x[i];
+    peak[0] = fmaxf(peak[0], fabsf(x[i]));
+  }
+
+  const size_t m = fir(x, n, b->taps, b->tap_count, b->filtered);
+  const float *restrict y = b->filtered;
+  for (size_t l = 0; l < LANES; ++l)
+    lo[l] = hi[l] = y[0];
+  for (i = 0; i + LANES <= m; i += LANES) {
+    for (size_t l = 0; l < LANES; ++l) {
+      lo[l] = fminf(lo[l], y[i + l]);
+      hi[l] = fmaxf(hi[l], y[i + l]);
+    }
+  }
+  for (; i < m; ++i) {
+    lo[0] = fminf(lo[0], y[i]);
+    hi[0] = fmaxf(hi[0], y[i]);
+  }
+
+  stats->count = n;
+  stats->mean = 0;
+  stats->peak = peak[0];
+  stats->min = lo[0];
+  stats->max = hi[0];
+  for (size_t l = 0; l < LANES; ++l) {
+    stats->mean += sum[l];
+    stats->peak = fmaxf(stats->peak, peak[l]);
+    stats->min = fminf(stats->min, lo[l]);
+    stats->max = fmaxf(stats->max, hi[l]);
+  }
+  stats->mean /= n;
+  return 0;
+}
@@ -0,0 +1,59 @@
+#ifndef BURST_H
+#define BURST_H
+
+#include <stddef.h>
+
+#define BURST_MAX_TAPS 64
+
+/**
+ * @brief A preallocated array filled by a module with many reads per
+ * collection() tick, reduced to a few statistics by burst_reduce().
+ */
+struct BurstBuffer {
+  float *samples;
+  size_t capacity;
+  size_t count;
+  // FIR filter applied before min/max, NULL if tap_count == 0
+  float *taps;
+  size_t tap_count;
+  // Scratch space for the filtered signal
+  float *filtered;
+};
+
+struct BurstStats {
+  size_t count;
+  // Mean of the raw samples
+  float mean;
+  // Extremes of the FIR-filtered samples, i.e., with noise suppressed
+  float min;
+  float max;
+  // Largest absolute raw sample, catches transients the filter smooths out
+  float peak;
+};
+
+/**
+ * @brief Allocate a buffer of capacity samples.
+ * @param taps FIR coefficients, copied; NULL/0 disables filtering
+ * @return 0 on success, negative number on failure
+ */
+int burst_buffer_init(struct BurstBuffer *b, size_t capacity, const float *taps,
+                      size_t tap_count);
+
+void burst_buffer_destroy(struct BurstBuffer *b);
+
+static inline void burst_buffer_reset(struct BurstBuffer *b) { b->count = 0; }
+
+static inline void burst_buffer_push(struct BurstBuffer *b, float sample) {
+  if (b->count < b->capacity)
+    b->samples[b->count++] = sample;
+}
+
+/**
+ * @brief Reduce the samples collected since the last reset. The loops are
+ * written with independent accumulator lanes so that they vectorize without
+ * -ffast-math.
+ * @return 0 on success, -1 if the buffer is empty
+ */
+int burst_reduce(struct BurstBuffer *b, struct BurstStats *stats);
+
+#endif // BURST_H
@@ -1,7 +1,106 @@
+#include "../../event_loops.h"
+#include "../../fault.h"
+#include "../../global_vars.h"
 #include "../../utils.h"
+#include "mqtt.h"
 
+#include <errno.h>
 #include <mosquitto.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
 #include <sys/syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MQTT_MAX_TOPIC_ALIASES 16
+#define MQTT_MAX_HOSTS 8
+// Messages kept while the first connection is being established
+#define MQTT_BACKLOG_MAX 32
+
+// Same fields as struct MqttStats, written by the network thread
+struct MqttAtomicStats {
+  _Atomic uint64_t attempts;
+  _Atomic uint64_t failures;
+  _Atomic uint64_t connects;
+  _Atomic uint64_t last_connect_ms;
+  _Atomic uint64_t downtime_ms;
+  _Atomic uint64_t disconnected_at_ms;
+};
+
+struct MqttBacklogEntry {
+  char *topic;
+  void *payload;
+  int payloadlen;
+  int qos;
+  bool retain;
+};
+
+struct MqttTopicAlias {
+  char *topic;
+  // connect_generation the alias was registered in, 0 if never
+  uint32_t generation;
+};
+
+/**
+ * @brief Per-client state, stored as the mosquitto userdata. The alias table
+ * is only touched by the thread calling mqtt_publish(); alias_max,
+ * connect_generation and the connection bookkeeping are written by the
+ * network thread (or the reactor). alias_lock keeps a (re)connection from
+ * changing alias_max or connect_generation while a message is published.
+ */
+struct MqttClientCtx {
+  char *hosts[MQTT_MAX_HOSTS];
+  size_t host_count;
+  // Index into hosts of the current/next connection attempt
+  size_t host_idx;
+  int port;
+  int keepalive_sec;
+  uint64_t reconnect_delay_min_ms;
+  uint64_t reconnect_delay_max_ms;
+  // Failed attempts since the last CONNACK, drives the backoff
+  uint32_t failed_attempts;
+  // CLOCK_MONOTONIC ms before which no reconnect may be attempted
+  _Atomic uint64_t next_attempt_at_ms;
+  uint64_t attempt_started_at_ms;
+  unsigned int rand_seed;
+  struct MqttAtomicStats stats;
+  _Atomic bool connected;
+  // The thread running mosquitto_loop() if the reactor isn't used
+  pthread_t network_thread;
+  bool network_thread_started;
+  _Atomic bool stop;
+
+  void (*on_connect)(struct mosquitto *mosq, void *obj, int reason_code);
+  void (*on_message)(struct mosquitto *mosq, void *obj,
+                     const struct mosquitto_message *msg);
+  void (*on_subscribe)(struct mosquitto *mosq, void *obj, int mid,
+                       int qos_count, const int *granted_qos);
+  void *userdata;
+
+  // Ring of messages published before the first CONNACK, only touched by
+  // the thread calling mqtt_publish()
+  struct MqttBacklogEntry backlog[MQTT_BACKLOG_MAX];
+  size_t backlog_head;
+  size_t backlog_count;
+
+  int protocol_version;
+  uint32_t message_expiry_sec;
+  char *content_type;
+  bool topic_aliases;
+  // Topic Alias Maximum granted by the broker in the last CONNACK
+  _Atomic uint16_t alias_max;
+  // Bumped on every successful CONNACK and lost connection; aliases don't
+  // survive a reconnect
+  _Atomic uint32_t connect_generation;
+  struct MqttTopicAlias aliases[MQTT_MAX_TOPIC_ALIASES];
+  // Recursive, as libmosquitto may call the disconnect callback from within
+  // mosquitto_publish_v5() on the publishing thread
+  pthread_mutex_t alias_lock;
+};
 
 void mosq_log_callback(struct mosquitto *mosq, void *userdata, int level,
                        const char *str) {
@@ -25,6 +124,62 @@ void mosq_log_callback(struct mosquitto *mosq, void *userdata, int level,
   }
 }
 
+static uint64_t mqtt_now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * @brief Schedule the next connection attempt with "full jitter" exponential
+ * backoff: a uniformly random delay between reconnect_delay_min_ms and
+ * min(reconnect_delay_max_ms, reconnect_delay_min_ms * 2^failed_attempts).
+ * Clients dropped by the same broker restart thus spread their reconnects
+ * over the whole window instead of retrying in lockstep.
+ */
+static void mqtt_schedule_reconnect(struct MqttClientCtx *ctx) {
+  uint64_t cap = ctx->reconnect_delay_min_ms;
+  for (uint32_t i = 0;
+       i < ctx->failed_attempts && cap < ctx->reconnect_delay_max_ms; ++i)
+    cap *= 2;
+  if (cap > ctx->reconnect_delay_max_ms)
+    cap = ctx->reconnect_delay_max_ms;
+  uint64_t delay = ctx->reconnect_delay_min_ms;
+  if (cap > delay)
+    delay += (uint64_t)rand_r(&ctx->rand_seed) % (cap - delay + 1);
+  atomic_store(&ctx->next_attempt_at_ms, mqtt_now_ms() + delay);
+  syslog(LOG_INFO, "Next MQTT connection attempt (%s:%d) in %lu ms",
+         ctx->hosts[ctx->host_idx], ctx->port, (unsigned long)delay);
+}
+
+/**
+ * @brief One connection attempt to the current host. On failure the next host
+ * is picked and a reconnect is scheduled. The attempt is asynchronous: the
+ * TCP and TLS handshakes complete in the network loop, so only name
+ * resolution blocks the caller.
+ * @return A MOSQ_ERR_* value of mosquitto_connect_async()
+ */
+static int mqtt_try_connect(struct mosquitto *mosq,
+                            struct MqttClientCtx *ctx) {
+  const char *host = ctx->hosts[ctx->host_idx];
+  ctx->attempt_started_at_ms = mqtt_now_ms();
+  atomic_fetch_add(&ctx->stats.attempts, 1);
+  // The broker stays unreachable until an injected outage is over
+  int rc = fault_in_outage(FAULT_MQTT)
+               ? MOSQ_ERR_NO_CONN
+               : mosquitto_connect_async(mosq, host, ctx->port,
+                                         ctx->keepalive_sec);
+  if (rc == MOSQ_ERR_SUCCESS)
+    return rc;
+  atomic_fetch_add(&ctx->stats.failures, 1);
+  SYSLOG_ERR("mosquitto_connect_async(%s:%d) failed: %s", host, ctx->port,
+             rc == MOSQ_ERR_ERRNO ? strerror(errno) : mosquitto_strerror(rc));
+  ++ctx->failed_attempts;
+  ctx->host_idx = (ctx->host_idx + 1) % ctx->host_count;
+  mqtt_schedule_reconnect(ctx);
+  return rc;
+}
+
 void mosq_on_connect(struct mosquitto *mosq, void *obj, int reason_code) {
   (void)mosq;
   (void)obj;
@@ -32,11 +187,85 @@ void mosq_on_connect(struct mosquitto *mosq, void *obj, int reason_code) {
          mosquitto_connack_string(reason_code));
 }
 
+static void mosq_on_connect_v5(struct mosquitto *mosq, void *obj,
+                               int reason_code, int flags,
+                               const mosquitto_property *props) {
+  (void)flags;
+  struct MqttClientCtx *ctx = (struct MqttClientCtx *)obj;
+  mosq_on_connect(mosq, obj, reason_code);
+  if (ctx == NULL)
+    return;
+  if (reason_code != 0) {
+    // Refused by the broker, which then closes the connection
+    atomic_fetch_add(&ctx->stats.failures, 1);
+    ++ctx->failed_attempts;
+    ctx->host_idx = (ctx->host_idx + 1) % ctx->host_count;
+    if (ctx->on_connect != NULL)
+      ctx->on_connect(mosq, ctx->userdata, reason_code);
+    return;
+  }
+  const uint64_t now = mqtt_now_ms();
+  const uint64_t connect_ms = now - ctx->attempt_started_at_ms;
+  const uint64_t down_at = atomic_load(&ctx->stats.disconnected_at_ms);
+  atomic_store(&ctx->stats.last_connect_ms, connect_ms);
+  if (down_at > 0)
+    atomic_fetch_add(&ctx->stats.downtime_ms, now - down_at);
+  atomic_fetch_add(&ctx->stats.connects, 1);
+  atomic_store(&ctx->connected, true);
+  syslog(LOG_INFO,
+         "Connected to %s:%d after %u failed attempt(s), CONNACK in %lu ms, "
+         "%lu ms offline",
+         ctx->hosts[ctx->host_idx], ctx->port, ctx->failed_attempts,
+         (unsigned long)connect_ms,
+         (unsigned long)(down_at > 0 ? now - down_at : 0));
+  ctx->failed_attempts = 0;
+  uint16_t alias_max = 0;
+  if (ctx->topic_aliases)
+    mosquitto_property_read_int16(props, MQTT_PROP_TOPIC_ALIAS_MAXIMUM,
+                                  &alias_max, false);
+  if (alias_max > MQTT_MAX_TOPIC_ALIASES)
+    alias_max = MQTT_MAX_TOPIC_ALIASES;
+  pthread_mutex_lock(&ctx->alias_lock);
+  atomic_store(&ctx->alias_max, alias_max);
+  atomic_fetch_add(&ctx->connect_generation, 1);
+  pthread_mutex_unlock(&ctx->alias_lock);
+  syslog(LOG_INFO, "MQTT v%d session, %u topic alias(es) usable",
+         ctx->protocol_version, alias_max);
+  if (ctx->on_connect != NULL)
+    ctx->on_connect(mosq, ctx->userdata, reason_code);
+}
+
 void mosq_on_disconnect(struct mosquitto *mosq, void *obj, int reason_code) {
   (void)mosq;
-  (void)obj;
+  struct MqttClientCtx *ctx = (struct MqttClientCtx *)obj;
+  // 0 means the disconnect was requested by mosquitto_disconnect()
   syslog(LOG_INFO, "mosq_on_disconnect(): %s",
-         mosquitto_connack_string(reason_code));
+         reason_code == 0 ? "requested" : mosquitto_strerror(reason_code));
+  if (ctx == NULL)
+    return;
+  // Until the next CONNACK, messages carry their topic and no alias
+  pthread_mutex_lock(&ctx->alias_lock);
+  atomic_store(&ctx->alias_max, 0);
+  atomic_fetch_add(&ctx->connect_generation, 1);
+  pthread_mutex_unlock(&ctx->alias_lock);
+  if (atomic_exchange(&ctx->connected, false))
+    atomic_store(&ctx->stats.disconnected_at_ms, mqtt_now_ms());
+  if (!atomic_load(&ctx->stop))
+    mqtt_schedule_reconnect(ctx);
+}
+
+static void mosq_on_message(struct mosquitto *mosq, void *obj,
+                            const struct mosquitto_message *msg) {
+  struct MqttClientCtx *ctx = (struct MqttClientCtx *)obj;
+  if (ctx->on_message != NULL)
+    ctx->on_message(mosq, ctx->userdata, msg);
+}
+
+static void mosq_on_subscribe(struct mosquitto *mosq, void *obj, int mid,
+                              int qos_count, const int *granted_qos) {
+  struct MqttClientCtx *ctx = (struct MqttClientCtx *)obj;
+  if (ctx->on_subscribe != NULL)
+    ctx->on_subscribe(mosq, ctx->userdata, mid, qos_count, granted_qos);
 }
 
 void mosq_on_publish(struct mosquitto *mosq, void *obj, int msg_id) {
@@ -46,52 +275,475 @@ void mosq_on_publish(struct mosquitto *mosq, void *obj, int msg_id) {
          "mosq_on_publish(): Message (msg_id: %d) has been published.", msg_id);
 }
 
-struct mosquitto *init_mosquitto(const char *host, const char *ca_file_path,
-                                const char *username, const char *password) {
+static int mosq_reactor_socket(void *obj) { return mosquitto_socket(obj); }
+
+static bool mosq_reactor_want_write(void *obj) {
+  return mosquitto_want_write(obj);
+}
+
+static int mosq_reactor_read(void *obj) { return mosquitto_loop_read(obj, 1); }
+
+static int mosq_reactor_write(void *obj) {
+  return mosquitto_loop_write(obj, 1);
+}
+
+static int mosq_reactor_misc(void *obj) { return mosquitto_loop_misc(obj); }
+
+static int mosq_reactor_reconnect(void *obj) {
+  struct MqttClientCtx *ctx =
+      (struct MqttClientCtx *)mosquitto_userdata((struct mosquitto *)obj);
+  // mosquitto_loop_read()/write() don't call the disconnect callback, so the
+  // first reconnect request may be the first sign of a lost connection
+  if (atomic_load(&ctx->connected)) {
+    mosq_on_disconnect(obj, ctx, MOSQ_ERR_CONN_LOST);
+    return 0;
+  }
+  // The reactor asks once per second, the backoff decides
+  if (mqtt_now_ms() < atomic_load(&ctx->next_attempt_at_ms))
+    return 0;
+  return mqtt_try_connect(obj, ctx);
+}
+
+/**
+ * @brief Used instead of mosquitto_loop_start(), whose reconnects use the
+ * same host and have no jitter.
+ */
+static void *mqtt_network_thread(void *arg) {
+  struct mosquitto *mosq = (struct mosquitto *)arg;
+  struct MqttClientCtx *ctx = (struct MqttClientCtx *)mosquitto_userdata(mosq);
+  while (!atomic_load(&ctx->stop)) {
+    if (mosquitto_socket(mosq) >= 0) {
+      // Returns when there is traffic or after at most 1 sec
+      if (mosquitto_loop(mosq, 1000, 1) == MOSQ_ERR_SUCCESS)
+        continue;
+      if (mosquitto_socket(mosq) >= 0)
+        continue;
+    }
+    const uint64_t now = mqtt_now_ms();
+    const uint64_t next_attempt_at = atomic_load(&ctx->next_attempt_at_ms);
+    if (now < next_attempt_at) {
+      // Sleep in short slices so that mqtt_destroy() doesn't wait long
+      uint64_t wait_ms = next_attempt_at - now;
+      if (wait_ms > 100)
+        wait_ms = 100;
+      usleep(wait_ms * 1000);
+      continue;
+    }
+    if (!atomic_load(&ctx->stop))
+      mqtt_try_connect(mosq, ctx);
+  }
+  return NULL;
+}
+
+static void mqtt_client_ctx_free(struct MqttClientCtx *ctx) {
+  if (ctx == NULL)
+    return;
+  for (size_t i = 0; i < ctx->host_count; ++i)
+    free(ctx->hosts[i]);
+  for (size_t i = 0; i < ctx->backlog_count; ++i) {
+    struct MqttBacklogEntry *e =
+        &ctx->backlog[(ctx->backlog_head + i) % MQTT_BACKLOG_MAX];
+    free(e->topic);
+    free(e->payload);
+  }
+  for (size_t i = 0; i < MQTT_MAX_TOPIC_ALIASES; ++i)
+    free(ctx->aliases[i].topic);
+  free(ctx->content_type);
+  pthread_mutex_destroy(&ctx->alias_lock);
+  free(ctx);
+}
+
+static struct mosquitto *mqtt_init(const struct MqttOptions *opts) {
   int rc;
   struct mosquitto *mosq;
+  struct MqttClientCtx *ctx = calloc(1, sizeof(struct MqttClientCtx));
+  if (ctx == NULL) {
+    SYSLOG_ERR("calloc() failed");
+    goto err_calloc_ctx;
+  }
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&ctx->alias_lock, &attr);
+  pthread_mutexattr_destroy(&attr);
+  const char *const *hosts = opts->host_count > 0 ? opts->hosts : &opts->host;
+  const size_t host_count = opts->host_count > 0 ? opts->host_count : 1;
+  if (host_count > MQTT_MAX_HOSTS) {
+    SYSLOG_ERR("At most %d MQTT hosts are supported", MQTT_MAX_HOSTS);
+    goto err_strdup;
+  }
+  for (; ctx->host_count < host_count; ++ctx->host_count) {
+    if (hosts[ctx->host_count] == NULL) {
+      SYSLOG_ERR("MQTT host not defined");
+      goto err_strdup;
+    }
+    if ((ctx->hosts[ctx->host_count] = strdup(hosts[ctx->host_count])) ==
+        NULL) {
+      SYSLOG_ERR("strdup() failed");
+      goto err_strdup;
+    }
+  }
+  ctx->port = opts->port > 0 ? opts->port : MQTT_DEFAULT_PORT;
+  ctx->keepalive_sec = opts->keepalive_sec > 0 ? opts->keepalive_sec
+                                               : MQTT_DEFAULT_KEEPALIVE_SEC;
+  ctx->reconnect_delay_min_ms = opts->reconnect_delay_min_ms > 0
+                                    ? opts->reconnect_delay_min_ms
+                                    : MQTT_DEFAULT_RECONNECT_DELAY_MIN_MS;
+  ctx->reconnect_delay_max_ms = opts->reconnect_delay_max_ms > 0
+                                    ? opts->reconnect_delay_max_ms
+                                    : MQTT_DEFAULT_RECONNECT_DELAY_MAX_MS;
+  if (ctx->reconnect_delay_max_ms < ctx->reconnect_delay_min_ms)
+    ctx->reconnect_delay_max_ms = ctx->reconnect_delay_min_ms;
+  // Differs between processes started at the same time
+  ctx->rand_seed = (unsigned int)(time(NULL) ^ getpid());
+  ctx->on_connect = opts->on_connect;
+  ctx->on_message = opts->on_message;
+  ctx->on_subscribe = opts->on_subscribe;
+  ctx->userdata = opts->userdata;
+  ctx->protocol_version = opts->protocol_version;
+  ctx->message_expiry_sec = opts->message_expiry_sec;
+  ctx->topic_aliases = opts->topic_aliases;
+  if (opts->content_type != NULL &&
+      (ctx->content_type = strdup(opts->content_type)) == NULL) {
+    SYSLOG_ERR("strdup() failed");
+    goto err_strdup;
+  }
+
   /* Required before calling other mosquitto functions */
   if ((rc = mosquitto_lib_init()) != MOSQ_ERR_SUCCESS) {
     SYSLOG_ERR("mosquitto_lib_init() failed: %s", mosquitto_strerror(rc));
     goto err_init_mosquitto;
   }
 
-  mosq = mosquitto_new(NULL, true, NULL);
+  mosq = mosquitto_new(NULL, true, ctx);
   if (mosq == NULL) {
     SYSLOG_ERR("mosquitto_new() failed");
     goto err_init_mosquitto;
   }
-  if ((rc = mosquitto_username_pw_set(mosq, username, password)) !=
+  if ((rc = mosquitto_int_option(mosq, MOSQ_OPT_PROTOCOL_VERSION,
+                                 opts->protocol_version == 5
+                                     ? MQTT_PROTOCOL_V5
+                                     : MQTT_PROTOCOL_V311)) !=
+      MOSQ_ERR_SUCCESS) {
+    SYSLOG_ERR("mosquitto_int_option() failed: %s", mosquitto_strerror(rc));
+    goto err_mosquitto_config;
+  }
+  if ((rc = mosquitto_username_pw_set(mosq, opts->username, opts->password)) !=
       MOSQ_ERR_SUCCESS) {
     SYSLOG_ERR("mosquitto_username_pw_set() failed: %s",
                mosquitto_strerror(rc));
     goto err_mosquitto_config;
   }
-  if ((rc = mosquitto_tls_set(mosq, ca_file_path, NULL, NULL, NULL, NULL)) !=
-      MOSQ_ERR_SUCCESS) {
+  if ((rc = mosquitto_tls_set(mosq, opts->ca_file_path, NULL, NULL, NULL,
+                              NULL)) != MOSQ_ERR_SUCCESS) {
     SYSLOG_ERR("mosquitto_tls_set() failed: %s", mosquitto_strerror(rc));
     goto err_mosquitto_config;
   }
-  mosquitto_connect_callback_set(mosq, mosq_on_connect);
-  mosquitto_disconnect_callback_set(mosq, mosq_on_connect);
+  mosquitto_connect_v5_callback_set(mosq, mosq_on_connect_v5);
+  mosquitto_disconnect_callback_set(mosq, mosq_on_disconnect);
   mosquitto_publish_callback_set(mosq, mosq_on_publish);
   mosquitto_log_callback_set(mosq, mosq_log_callback);
+  mosquitto_message_callback_set(mosq, mosq_on_message);
+  mosquitto_subscribe_callback_set(mosq, mosq_on_subscribe);
 
-  if ((rc = mosquitto_connect(mosq, host, 8883, 60)) != MOSQ_ERR_SUCCESS) {
-    SYSLOG_ERR("mosquitto_connect() failed: %s", mosquitto_strerror(rc));
-    goto err_mosquitto_connect;
+  // Nothing here waits for the broker: messages published before the first
+  // CONNACK go to the backlog, and a broker that is down at startup is
+  // retried with the usual backoff
+  if (gv_reactor_attach != NULL) {
+    /* The reactor drives the network loop from the main thread, while
+     * mqtt_publish() may be called from another one, e.g., by the mqtt sink.
+     * Threaded mode makes libmosquitto lock its state and leave the writing
+     * of queued packets to mosquitto_loop_write(), i.e., to the reactor. */
+    mosquitto_threaded_set(mosq, true);
+    mqtt_try_connect(mosq, ctx);
+    struct ReactorClient client = {.obj = mosq,
+                                   .socket = mosq_reactor_socket,
+                                   .want_write = mosq_reactor_want_write,
+                                   .handle_read = mosq_reactor_read,
+                                   .handle_write = mosq_reactor_write,
+                                   .handle_misc = mosq_reactor_misc,
+                                   .reconnect = mosq_reactor_reconnect};
+    if (gv_reactor_attach(&client) != 0) {
+      SYSLOG_ERR("gv_reactor_attach() failed");
+      goto err_mosquitto_connect;
+    }
+    return mosq;
   }
 
-  /* Run the network loop in a background thread, this call returns quickly. */
-  if ((rc = mosquitto_loop_start(mosq)) != MOSQ_ERR_SUCCESS) {
-    SYSLOG_ERR("mosquitto_loop_start() failed: %s", mosquitto_strerror(rc));
+  /* Run the network loop in a background thread, this call returns quickly.
+   * next_attempt_at_ms is 0, so the thread connects right away. */
+  mosquitto_threaded_set(mosq, true);
+  if ((rc = pthread_create(&ctx->network_thread, NULL, mqtt_network_thread,
+                           mosq)) != 0) {
+    SYSLOG_ERR("pthread_create() failed: %d(%s)", rc, strerror(rc));
     goto err_mosquitto_connect;
   }
+  ctx->network_thread_started = true;
   return mosq;
 
 err_mosquitto_config:
 err_mosquitto_connect:
   mosquitto_destroy(mosq);
 err_init_mosquitto:
+err_strdup:
+  mqtt_client_ctx_free(ctx);
+err_calloc_ctx:
   return NULL;
 }
+
+struct mosquitto *init_mosquitto_with_options(const struct MqttOptions *opts) {
+  return mqtt_init(opts);
+}
+
+struct mosquitto *init_mosquitto(const char *host, const char *ca_file_path,
+                                 const char *username, const char *password) {
+  struct MqttOptions opts = {.host = host,
+                             .ca_file_path = ca_file_path,
+                             .username = username,
+                             .password = password,
+                             .protocol_version = 5,
+                             .message_expiry_sec = 0,
+                             .content_type = "application/json",
+                             .topic_aliases = true};
+  return mqtt_init(&opts);
+}
+
+// json_pointer_get() of section + "/" + key, NULL if absent
+static json_object *mqtt_json_get(const json_object *config,
+                                  const char *section, const char *key) {
+  char pointer[128];
+  json_object *json_ele;
+  if (snprintf(pointer, sizeof(pointer), "%s/%s", section, key) >=
+          (int)sizeof(pointer) ||
+      json_pointer_get((json_object *)config, pointer, &json_ele) != 0)
+    return NULL;
+  return json_ele;
+}
+
+struct mosquitto *init_mosquitto_from_json(const json_object *config,
+                                           const char *section) {
+  json_object *json_ele;
+  struct MqttOptions opts = {.protocol_version = 5,
+                             .message_expiry_sec = 0,
+                             .content_type = "application/json",
+                             .topic_aliases = true};
+#define MQTT_JSON_GET(key)                                                     \
+  ((json_ele = mqtt_json_get(config, section, key)) != NULL)
+  const char *hosts[MQTT_MAX_HOSTS];
+  if (MQTT_JSON_GET("hosts")) {
+    if (!json_object_is_type(json_ele, json_type_array) ||
+        json_object_array_length(json_ele) == 0 ||
+        json_object_array_length(json_ele) > MQTT_MAX_HOSTS) {
+      SYSLOG_ERR("%s/hosts must be an array of 1 to %d hosts", section,
+                 MQTT_MAX_HOSTS);
+      return NULL;
+    }
+    opts.host_count = json_object_array_length(json_ele);
+    for (size_t i = 0; i < opts.host_count; ++i)
+      hosts[i] = json_object_get_string(json_object_array_get_idx(json_ele, i));
+    opts.hosts = hosts;
+  } else if (MQTT_JSON_GET("host")) {
+    opts.host = json_object_get_string(json_ele);
+  }
+  if (MQTT_JSON_GET("port"))
+    opts.port = json_object_get_int(json_ele);
+  if (MQTT_JSON_GET("keepalive_sec"))
+    opts.keepalive_sec = json_object_get_int(json_ele);
+  if (MQTT_JSON_GET("reconnect_delay_min_ms"))
+    opts.reconnect_delay_min_ms = json_object_get_uint64(json_ele);
+  if (MQTT_JSON_GET("reconnect_delay_max_ms"))
+    opts.reconnect_delay_max_ms = json_object_get_uint64(json_ele);
+  if (MQTT_JSON_GET("username"))
+    opts.username = json_object_get_string(json_ele);
+  if (MQTT_JSON_GET("password"))
+    opts.password = json_object_get_string(json_ele);
+  if (MQTT_JSON_GET("ca_file_path"))
+    opts.ca_file_path = json_object_get_string(json_ele);
+  if (MQTT_JSON_GET("protocol_version"))
+    opts.protocol_version = json_object_get_int(json_ele);
+  if (MQTT_JSON_GET("message_expiry_sec"))
+    opts.message_expiry_sec = json_object_get_uint64(json_ele);
+  if (MQTT_JSON_GET("content_type"))
+    opts.content_type = json_object_get_string(json_ele);
+  if (MQTT_JSON_GET("topic_aliases"))
+    opts.topic_aliases = json_object_get_boolean(json_ele);
+#undef MQTT_JSON_GET
+  if ((opts.host == NULL && opts.host_count == 0) ||
+      opts.ca_file_path == NULL ||
+      opts.username == NULL || opts.password == NULL) {
+    SYSLOG_ERR("host/username/password/ca_file_path not defined in %s",
+               section);
+    return NULL;
+  }
+  if (opts.protocol_version != 4 && opts.protocol_version != 5) {
+    SYSLOG_ERR("%s/protocol_version must be 4 (MQTT 3.1.1) or 5", section);
+    return NULL;
+  }
+  if (opts.port < 0 || opts.port > 65535 || opts.keepalive_sec < 0) {
+    SYSLOG_ERR("%s/port or %s/keepalive_sec out of range", section, section);
+    return NULL;
+  }
+  return mqtt_init(&opts);
+}
+
+/**
+ * @return The alias to send with topic, 0 for none. *registered tells whether
+ * the broker already knows it in this session, i.e., whether the topic itself
+ * can be omitted.
+ */
+static uint16_t mqtt_topic_alias(struct MqttClientCtx *ctx, const char *topic,
+                                 uint32_t generation, bool *registered) {
+  const uint16_t alias_max = atomic_load(&ctx->alias_max);
+  *registered = false;
+  for (uint16_t i = 0; i < alias_max; ++i) {
+    struct MqttTopicAlias *a = &ctx->aliases[i];
+    if (a->topic == NULL) {
+      if ((a->topic = strdup(topic)) == NULL)
+        return 0;
+    } else if (strcmp(a->topic, topic) != 0) {
+      continue;
+    }
+    *registered = a->generation == generation;
+    return i + 1;
+  }
+  // More topics than aliases, the rest are sent in full
+  return 0;
+}
+
+static int mqtt_publish_now(struct mosquitto *mosq, struct MqttClientCtx *ctx,
+                            const char *topic, const void *payload,
+                            int payloadlen, int qos, bool retain) {
+  if (ctx->protocol_version != 5)
+    return mosquitto_publish(mosq, NULL, topic, payloadlen, payload, qos,
+                             retain);
+
+  mosquitto_property *props = NULL;
+  int rc = MOSQ_ERR_SUCCESS;
+  if (ctx->content_type != NULL)
+    rc = mosquitto_property_add_string(&props, MQTT_PROP_CONTENT_TYPE,
+                                       ctx->content_type);
+  if (rc == MOSQ_ERR_SUCCESS && ctx->message_expiry_sec > 0)
+    rc = mosquitto_property_add_int32(&props, MQTT_PROP_MESSAGE_EXPIRY_INTERVAL,
+                                      ctx->message_expiry_sec);
+  // Held until the message is queued, so that it can't go out on a newer
+  // connection than the one its alias was chosen for
+  pthread_mutex_lock(&ctx->alias_lock);
+  const uint32_t generation = atomic_load(&ctx->connect_generation);
+  bool registered = false;
+  uint16_t alias = 0;
+  // A QoS > 0 message may be resent by libmosquitto after a reconnect, by
+  // when the broker has forgotten the alias, so it always carries its topic
+  if (rc == MOSQ_ERR_SUCCESS && ctx->topic_aliases && qos == 0)
+    alias = mqtt_topic_alias(ctx, topic, generation, &registered);
+  if (rc == MOSQ_ERR_SUCCESS && alias > 0)
+    rc = mosquitto_property_add_int16(&props, MQTT_PROP_TOPIC_ALIAS, alias);
+  if (rc == MOSQ_ERR_SUCCESS)
+    rc = mosquitto_publish_v5(mosq, NULL, registered ? NULL : topic,
+                              payloadlen, payload, qos, retain, props);
+  // Only a message that carried the topic registers the alias, and only if
+  // the connection didn't drop meanwhile (see the disconnect callback)
+  if (rc == MOSQ_ERR_SUCCESS && alias > 0 &&
+      atomic_load(&ctx->connect_generation) == generation)
+    ctx->aliases[alias - 1].generation = generation;
+  pthread_mutex_unlock(&ctx->alias_lock);
+  mosquitto_property_free_all(&props);
+  return rc;
+}
+
+// Keep a copy of a message until the first connection is up, dropping the
+// oldest one if the backlog is full
+static int mqtt_backlog_push(struct MqttClientCtx *ctx, const char *topic,
+                             const void *payload, int payloadlen, int qos,
+                             bool retain) {
+  struct MqttBacklogEntry e = {.payloadlen = payloadlen,
+                               .qos = qos,
+                               .retain = retain};
+  if ((e.topic = strdup(topic)) == NULL ||
+      (e.payload = malloc(payloadlen > 0 ? payloadlen : 1)) == NULL) {
+    free(e.topic);
+    return MOSQ_ERR_NOMEM;
+  }
+  memcpy(e.payload, payload, payloadlen);
+  if (ctx->backlog_count == MQTT_BACKLOG_MAX) {
+    struct MqttBacklogEntry *oldest = &ctx->backlog[ctx->backlog_head];
+    free(oldest->topic);
+    free(oldest->payload);
+    ctx->backlog_head = (ctx->backlog_head + 1) % MQTT_BACKLOG_MAX;
+    --ctx->backlog_count;
+    syslog(LOG_WARNING, "MQTT backlog full, oldest message dropped");
+  }
+  ctx->backlog[(ctx->backlog_head + ctx->backlog_count) % MQTT_BACKLOG_MAX] =
+      e;
+  ++ctx->backlog_count;
+  return MOSQ_ERR_SUCCESS;
+}
+
+static void mqtt_backlog_flush(struct mosquitto *mosq,
+                               struct MqttClientCtx *ctx) {
+  syslog(LOG_INFO, "Publishing %zu message(s) kept while connecting",
+         ctx->backlog_count);
+  for (; ctx->backlog_count > 0; --ctx->backlog_count) {
+    struct MqttBacklogEntry *e = &ctx->backlog[ctx->backlog_head];
+    int rc = mqtt_publish_now(mosq, ctx, e->topic, e->payload, e->payloadlen,
+                              e->qos, e->retain);
+    if (rc != MOSQ_ERR_SUCCESS)
+      SYSLOG_ERR("Publishing a kept message to %s failed: %s", e->topic,
+                 mosquitto_strerror(rc));
+    free(e->topic);
+    free(e->payload);
+    ctx->backlog_head = (ctx->backlog_head + 1) % MQTT_BACKLOG_MAX;
+  }
+}
+
+int mqtt_publish(struct mosquitto *mosq, const char *topic,
+                 const void *payload, int payloadlen, int qos, bool retain) {
+  struct MqttClientCtx *ctx = (struct MqttClientCtx *)mosquitto_userdata(mosq);
+  switch (fault_inject(FAULT_MQTT)) {
+  case FAULT_OUTAGE:
+    // Drop the connection as a broker going away would; the network thread
+    // (or the reactor) notices and goes through the usual reconnects
+    syslog(LOG_WARNING, "Injected MQTT outage, dropping the connection");
+    if (mosquitto_socket(mosq) >= 0)
+      shutdown(mosquitto_socket(mosq), SHUT_RDWR);
+    return MOSQ_ERR_NO_CONN;
+  case FAULT_ERROR:
+    return MOSQ_ERR_NO_CONN;
+  case FAULT_NONE:
+  default:
+    break;
+  }
+  if (atomic_load(&ctx->stats.connects) == 0)
+    return mqtt_backlog_push(ctx, topic, payload, payloadlen, qos, retain);
+  if (ctx->backlog_count > 0)
+    mqtt_backlog_flush(mosq, ctx);
+  return mqtt_publish_now(mosq, ctx, topic, payload, payloadlen, qos, retain);
+}
+
+void mqtt_destroy(struct mosquitto *mosq) {
+  if (mosq == NULL)
+    return;
+  struct MqttClientCtx *ctx = (struct MqttClientCtx *)mosquitto_userdata(mosq);
+  atomic_store(&ctx->stop, true);
+  mosquitto_disconnect(mosq);
+  if (ctx->network_thread_started)
+    pthread_join(ctx->network_thread, NULL);
+  mosquitto_destroy(mosq);
+  syslog(LOG_INFO,
+         "MQTT connection stats: %lu attempt(s), %lu failure(s), %lu "
+         "connect(s), %lu ms offline",
+         (unsigned long)atomic_load(&ctx->stats.attempts),
+         (unsigned long)atomic_load(&ctx->stats.failures),
+         (unsigned long)atomic_load(&ctx->stats.connects),
+         (unsigned long)atomic_load(&ctx->stats.downtime_ms));
+  mqtt_client_ctx_free(ctx);
+}
+
+void mqtt_get_stats(struct mosquitto *mosq, struct MqttStats *stats) {
+  struct MqttClientCtx *ctx = (struct MqttClientCtx *)mosquitto_userdata(mosq);
+  stats->attempts = atomic_load(&ctx->stats.attempts);
+  stats->failures = atomic_load(&ctx->stats.failures);
+  stats->connects = atomic_load(&ctx->stats.connects);
+  stats->last_connect_ms = atomic_load(&ctx->stats.last_connect_ms);
+  stats->downtime_ms = atomic_load(&ctx->stats.downtime_ms);
+  stats->disconnected_at_ms = atomic_load(&ctx->stats.disconnected_at_ms);
+}
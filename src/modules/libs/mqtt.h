@@ -1,11 +1,74 @@
 #ifndef MQTT_H
 #define MQTT_H
 
+#include <json-c/json.h>
 #include <mosquitto.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+#define MQTT_DEFAULT_PORT 8883
+#define MQTT_DEFAULT_KEEPALIVE_SEC 60
+#define MQTT_DEFAULT_RECONNECT_DELAY_MIN_MS 1000
+#define MQTT_DEFAULT_RECONNECT_DELAY_MAX_MS 60000
+
+struct MqttOptions {
+  // Used if host_count is 0
+  const char *host;
+  // Brokers tried in turn: every failed attempt moves on to the next one
+  const char *const *hosts;
+  size_t host_count;
+  int port;
+  int keepalive_sec;
+  // Reconnects wait a random delay between min and
+  // min(max, min * 2^failed_attempts)
+  uint64_t reconnect_delay_min_ms;
+  uint64_t reconnect_delay_max_ms;
+  const char *ca_file_path;
+  const char *username;
+  const char *password;
+  // 5 for MQTT v5 (default), 4 for MQTT 3.1.1
+  int protocol_version;
+  // MQTT v5 only: the broker drops undelivered messages older than this, 0
+  // to keep them indefinitely
+  uint32_t message_expiry_sec;
+  // MQTT v5 only: Content Type property of every message, NULL for none
+  const char *content_type;
+  // MQTT v5 only: replace the topic of QoS 0 messages with an alias after
+  // the first message, up to the Topic Alias Maximum granted by the broker
+  bool topic_aliases;
+
+  // Optional, called from the network thread (or the reactor) with userdata.
+  // on_connect is called on every CONNACK, i.e., also after a reconnect,
+  // which makes it the place to (re)subscribe.
+  void (*on_connect)(struct mosquitto *mosq, void *userdata, int reason_code);
+  void (*on_message)(struct mosquitto *mosq, void *userdata,
+                     const struct mosquitto_message *msg);
+  void (*on_subscribe)(struct mosquitto *mosq, void *userdata, int mid,
+                       int qos_count, const int *granted_qos);
+  void *userdata;
+};
+
+// Snapshot of the connection metrics of a client
+struct MqttStats {
+  // Calls to mosquitto_connect(), including the first one
+  uint64_t attempts;
+  // Attempts that failed, either locally or with a refused CONNACK
+  uint64_t failures;
+  // Successful CONNACKs
+  uint64_t connects;
+  // Time from mosquitto_connect() to the CONNACK of the last connection
+  uint64_t last_connect_ms;
+  // Sum of the time between a lost connection and the next CONNACK
+  uint64_t downtime_ms;
+  // CLOCK_MONOTONIC ms of the last lost connection, 0 if never
+  uint64_t disconnected_at_ms;
+};
+
 void mosq_log_callback(struct mosquitto *mosq, void *userdata, int level,
                        const char *str);
 
@@ -15,9 +78,56 @@ void mosq_on_disconnect(struct mosquitto *mosq, void *obj, int reason_code);
 
 void mosq_on_publish(struct mosquitto *mosq, void *obj, int msg_id);
 
+/**
+ * @brief Create a client with MQTT v5 defaults (content type
+ * application/json, topic aliases on, no message expiry) and connect it.
+ * A failed connection is not fatal, the client keeps retrying in the
+ * background.
+ */
 struct mosquitto *init_mosquitto(const char *host, const char *ca_file_path,
-                                const char *username, const char *password);
-                                
+                                 const char *username, const char *password);
+
+/**
+ * @brief Same as init_mosquitto(), but the MqttOptions are read from the
+ * object at JSON pointer section, e.g., "/ups/mqtt", which must contain
+ * host (or a hosts array)/username/password/ca_file_path and may contain
+ * port, keepalive_sec, reconnect_delay_min_ms, reconnect_delay_max_ms,
+ * protocol_version, message_expiry_sec, content_type and topic_aliases.
+ * @return NULL on failure
+ */
+struct mosquitto *init_mosquitto_from_json(const json_object *config,
+                                           const char *section);
+
+/**
+ * @brief Fully configurable variant of init_mosquitto(). Fields left 0 take
+ * the MQTT_DEFAULT_* values.
+ * @return NULL on failure
+ */
+struct mosquitto *init_mosquitto_with_options(const struct MqttOptions *opts);
+
+/**
+ * @brief Copy the connection metrics of a client created by init_mosquitto*()
+ * to *stats. Safe to call from any thread.
+ */
+void mqtt_get_stats(struct mosquitto *mosq, struct MqttStats *stats);
+
+/**
+ * @brief mosquitto_publish() plus the MQTT v5 properties configured for mosq.
+ * Must not be called concurrently for the same client, but may be called
+ * from any one thread. With the reactor, a message published from another
+ * thread than the main one goes out when the reactor next wakes up, within
+ * a second. Until the first connection is up, messages are kept (up to 32,
+ * oldest dropped first) and published by the first call made after it.
+ * @return A MOSQ_ERR_* value, same as mosquitto_publish()
+ */
+int mqtt_publish(struct mosquitto *mosq, const char *topic,
+                 const void *payload, int payloadlen, int qos, bool retain);
+
+/**
+ * @brief Disconnect and release a client created by init_mosquitto*()
+ */
+void mqtt_destroy(struct mosquitto *mosq);
+
 #ifdef __cplusplus
 }
 #endif
@@ -5,21 +5,35 @@
 extern "C" {
 #endif
 
+#include "readings.h"
+
 #include <json-c/json.h>
 
+/**
+ * @brief Describe the module and the metrics it reports. The framework
+ * refuses to start if abi_version != SDP_MODULE_ABI_VERSION.
+ * @return A pointer to a static object, valid for the lifetime of the process
+ */
+const struct ModuleInfo *module_info(void);
+
 /**
  * @brief Initialize a context object to be used by post_collection()
+ * @note Runs on a thread of its own, concurrently with collection_init() and
+ * the first collection() calls, whose records are kept and replayed once it
+ * returns. It must not share unsynchronized state with the collection side,
+ * and should not wait for remote peers (e.g., an MQTT broker) to answer.
  * @return NULL on failure or a valid context object pointer
  */
 void *post_collection_init(const json_object *config);
 
 /**
- * @brief
- * @param ctx The CollectionContext pointer.
+ * @brief Publish/display the readings of the last successful collection().
+ * @param readings The record filled by collection(). Metric ids index
+ * module_info()->metrics.
  * @param pc_ctx The PostCollectionContext pointer.
  * @returns the return value is not used for the time being...
  */
-int post_collection(void *ctx, void *pc_ctx);
+int post_collection(const struct ReadingRecord *readings, void *pc_ctx);
 
 /**
  * @brief Release the resources allocated to/managed by the context object.
@@ -36,13 +50,17 @@ void post_collection_destroy(void *pc_ctx);
 void *collection_init(const json_object *config);
 
 /**
- * @brief
+ * @brief Take one sample and report it as readings.
  * @param ctx The context pointer initialized by collection_init().
+ * @param readings An empty record to be filled. It is handed to the sinks and
+ * post_collection() only if 0 is returned.
  * @returns 0 on success; positive number on recoverable error (i.e., the event
  * loop can continue); negative number on fatal error (i.e., need to break the
  * data collection event loop)
+ * @note A call may take many reads and reduce them to one snapshot (see
+ * libs/burst.h), as long as it returns well within the collection interval.
  */
-int collection(void *ctx);
+int collection(void *ctx, struct ReadingRecord *readings);
 
 /**
  * @brief Release the resources allocated to/managed by the context object.
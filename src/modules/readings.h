@@ -0,0 +1,97 @@
+#ifndef READINGS_H
+#define READINGS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Bumped whenever module.h, ModuleInfo or ReadingRecord change incompatibly
+#define SDP_MODULE_ABI_VERSION 2
+
+// Maximum number of readings a module can report per collection() call
+#define SDP_READINGS_MAX 16
+
+enum ReadingQuality {
+  READING_GOOD = 0,
+  // Valid but not refreshed by this collection() call, e.g., served from a
+  // cache or carried over from an earlier sample
+  READING_STALE = 1,
+  // Not available, e.g., an estimate that has not converged yet
+  READING_BAD = 2,
+};
+
+/**
+ * @brief Static description of one metric a module reports. A metric id is
+ * the index of its MetricDesc in ModuleInfo::metrics.
+ */
+struct MetricDesc {
+  // Also used as the key when readings are serialized
+  const char *name;
+  const char *unit;
+  // Digits after the decimal point when formatted as text
+  int decimals;
+};
+
+/**
+ * @brief What a module reports about itself through module_info()
+ */
+struct ModuleInfo {
+  // Must be SDP_MODULE_ABI_VERSION
+  uint32_t abi_version;
+  const char *name;
+  size_t metric_count;
+  const struct MetricDesc *metrics;
+};
+
+/**
+ * @brief The readings of one collection() call, stored column by column so
+ * that stages scanning one field (e.g., all values) touch contiguous memory.
+ * The i-th reading is (metric_ids[i], values[i], timestamps_ms[i],
+ * qualities[i]) for i < count.
+ */
+struct ReadingRecord {
+  size_t count;
+  uint16_t metric_ids[SDP_READINGS_MAX];
+  uint8_t qualities[SDP_READINGS_MAX];
+  double values[SDP_READINGS_MAX];
+  // Unix time in milliseconds
+  int64_t timestamps_ms[SDP_READINGS_MAX];
+};
+
+static inline void readings_reset(struct ReadingRecord *r) { r->count = 0; }
+
+/**
+ * @return 0 on success, -1 if the record is full
+ */
+static inline int readings_add(struct ReadingRecord *r, uint16_t metric_id,
+                               double value, int64_t timestamp_ms,
+                               uint8_t quality) {
+  if (r->count >= SDP_READINGS_MAX)
+    return -1;
+  r->metric_ids[r->count] = metric_id;
+  r->values[r->count] = value;
+  r->timestamps_ms[r->count] = timestamp_ms;
+  r->qualities[r->count] = quality;
+  ++r->count;
+  return 0;
+}
+
+/**
+ * @return Index of the first reading of metric_id, -1 if there is none
+ */
+static inline int readings_find(const struct ReadingRecord *r,
+                                uint16_t metric_id) {
+  for (size_t i = 0; i < r->count; ++i)
+    if (r->metric_ids[i] == metric_id)
+      return (int)i;
+  return -1;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // READINGS_H
@@ -1,29 +1,177 @@
+#include "../../global_vars.h"
+#include "../../payload.h"
+#include "../../readings_json.h"
+#include "../../utils.h"
+#include "../libs/mqtt.h"
 #include "../module.h"
 
+#include <math.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * A synthetic load generator: emits metric_count waveforms per tick with
+ * configurable latency and failure rates, and optionally publishes every
+ * record, so the framework's overhead and queues can be measured on the
+ * target hardware without any sensor attached. See README.md.
+ */
+
+#define SAMPLE_DEFAULT_METRIC_COUNT 4
+
+enum SampleWaveform {
+  WAVE_SINE,
+  WAVE_SQUARE,
+  WAVE_SAWTOOTH,
+  WAVE_RANDOM_WALK,
+  WAVE_COUNTER,
+  WAVE_COUNT
+};
+
+static const char *const waveform_names[WAVE_COUNT] = {
+    [WAVE_SINE] = "sine",
+    [WAVE_SQUARE] = "square",
+    [WAVE_SAWTOOTH] = "sawtooth",
+    [WAVE_RANDOM_WALK] = "random_walk",
+    [WAVE_COUNTER] = "counter"};
+
+static const struct MetricDesc metrics[SDP_READINGS_MAX] = {
+    {.name = "synthetic_00", .unit = "", .decimals = 3},
+    {.name = "synthetic_01", .unit = "", .decimals = 3},
+    {.name = "synthetic_02", .unit = "", .decimals = 3},
+    {.name = "synthetic_03", .unit = "", .decimals = 3},
+    {.name = "synthetic_04", .unit = "", .decimals = 3},
+    {.name = "synthetic_05", .unit = "", .decimals = 3},
+    {.name = "synthetic_06", .unit = "", .decimals = 3},
+    {.name = "synthetic_07", .unit = "", .decimals = 3},
+    {.name = "synthetic_08", .unit = "", .decimals = 3},
+    {.name = "synthetic_09", .unit = "", .decimals = 3},
+    {.name = "synthetic_10", .unit = "", .decimals = 3},
+    {.name = "synthetic_11", .unit = "", .decimals = 3},
+    {.name = "synthetic_12", .unit = "", .decimals = 3},
+    {.name = "synthetic_13", .unit = "", .decimals = 3},
+    {.name = "synthetic_14", .unit = "", .decimals = 3},
+    {.name = "synthetic_15", .unit = "", .decimals = 3}};
+
+// metric_count is filled from /sample/metric_count on the first call to
+// module_info(), which happens before either init function
+static struct ModuleInfo info = {.abi_version = SDP_MODULE_ABI_VERSION,
+                                 .name = "sample",
+                                 .metric_count = SAMPLE_DEFAULT_METRIC_COUNT,
+                                 .metrics = metrics};
 
 struct PostCollectionCtx {
-  uint32_t payload;
+  // NULL unless /sample/mqtt/topic is set
+  struct mosquitto *mosq;
+  const char *topic;
+  int qos;
+  struct PayloadTemplate tpl;
+  uint64_t post_latency_us;
+  uint64_t records;
+  uint64_t published;
+  uint64_t publish_failures;
 };
+
 struct CollectionCtx {
-  uint32_t payload;
+  enum SampleWaveform waveforms[SDP_READINGS_MAX];
+  double amplitude;
+  double offset;
+  double noise;
+  uint64_t period_ms;
+  // Extra time every collection() takes, as a slow sensor would
+  uint64_t latency_us;
+  uint64_t latency_jitter_us;
+  // Probability of a recoverable error (return 1) per collection()
+  double error_rate;
+  // Probability of a reading being READING_BAD
+  double bad_rate;
+  unsigned int seed;
+  double walk[SDP_READINGS_MAX];
+  uint64_t ticks;
+  uint64_t errors;
+  uint64_t bad_readings;
+  int64_t started_at_ms;
 };
 
+const struct ModuleInfo *module_info(void) {
+  static bool resolved = false;
+  json_object *json_ele;
+  if (!resolved && gv_config_root != NULL &&
+      json_pointer_get(gv_config_root, "/sample/metric_count", &json_ele) ==
+          0) {
+    const int count = json_object_get_int(json_ele);
+    if (count >= 1 && count <= SDP_READINGS_MAX)
+      info.metric_count = count;
+    else
+      SYSLOG_ERR("/sample/metric_count must be between 1 and %d, using %zu",
+                 SDP_READINGS_MAX, info.metric_count);
+  }
+  resolved = true;
+  return &info;
+}
+
+// Uniform in [0, 1)
+static double uniform(unsigned int *seed) {
+  return rand_r(seed) / ((double)RAND_MAX + 1);
+}
+
 void *post_collection_init(const json_object *config) {
+  struct PostCollectionCtx *ctx = calloc(1, sizeof(struct PostCollectionCtx));
+  if (ctx == NULL) {
+    SYSLOG_ERR("calloc() failed");
+    goto err_calloc_ctx;
+  }
+  json_object *json_ele;
+  if (json_pointer_get((json_object *)config, "/sample/post_latency_us",
+                       &json_ele) == 0)
+    ctx->post_latency_us = json_object_get_uint64(json_ele);
+  if (json_pointer_get((json_object *)config, "/sample/mqtt/topic",
+                       &json_ele) != 0)
+    return ctx;
 
-  struct PostCollectionCtx *ctx = malloc(sizeof(struct PostCollectionCtx));
-  if (ctx == NULL)
-    return NULL;
-  printf("post_collection_init() called\n");
+  ctx->topic = json_object_get_string(json_ele);
+  if (json_pointer_get((json_object *)config, "/sample/mqtt/qos",
+                       &json_ele) == 0)
+    ctx->qos = json_object_get_int(json_ele);
+  if (payload_template_init(&ctx->tpl, &info, "timestamp") != 0) {
+    SYSLOG_ERR("payload_template_init() failed");
+    goto err_payload_template_init;
+  }
+  if ((ctx->mosq = init_mosquitto_from_json(config, "/sample/mqtt")) ==
+      NULL) {
+    SYSLOG_ERR("init_mosquitto_from_json() failed");
+    goto err_init_mosquitto;
+  }
   return ctx;
+err_init_mosquitto:
+  payload_template_destroy(&ctx->tpl);
+err_payload_template_init:
+  free(ctx);
+err_calloc_ctx:
+  return NULL;
 }
 
-int post_collection(void *c_ctx, void *pc_ctx) {
-  struct CollectionCtx *_c_ctx = (struct CollectionCtx *)c_ctx;
-  struct PostCollectionCtx *_pc_ctx = (struct PostCollectionCtx *)pc_ctx;
-  _pc_ctx->payload = _c_ctx->payload * 2;
-  printf("post_collection() called, payload: %u\n", _pc_ctx->payload);
+int post_collection(const struct ReadingRecord *readings, void *pc_ctx) {
+  struct PostCollectionCtx *ctx = (struct PostCollectionCtx *)pc_ctx;
+  ++ctx->records;
+  sleep_us(ctx->post_latency_us);
+  if (ctx->mosq == NULL)
+    return 0;
+  char payload[SDP_READINGS_MAX * 48 + 64];
+  const int len =
+      payload_render(&ctx->tpl, readings, NULL, payload, sizeof(payload));
+  if (len < 0) {
+    SYSLOG_ERR("payload_render() failed");
+    return 1;
+  }
+  if (mqtt_publish(ctx->mosq, ctx->topic, payload, len, ctx->qos, false) !=
+      MOSQ_ERR_SUCCESS) {
+    ++ctx->publish_failures;
+    return 1;
+  }
+  ++ctx->published;
   return 0;
 }
 
@@ -32,22 +180,144 @@ int post_collection(void *c_ctx, void *pc_ctx) {
 // implementers are still advised to check for NULL before dereferencing it.
 void post_collection_destroy(void *ctx) {
   struct PostCollectionCtx *_ctx = (struct PostCollectionCtx *)ctx;
+  if (_ctx == NULL)
+    return;
+  syslog(LOG_INFO,
+         "sample: post_collection() saw %lu record(s), %lu published, %lu "
+         "publish failure(s)",
+         (unsigned long)_ctx->records, (unsigned long)_ctx->published,
+         (unsigned long)_ctx->publish_failures);
+  if (_ctx->mosq != NULL) {
+    mqtt_destroy(_ctx->mosq);
+    mosquitto_lib_cleanup();
+    payload_template_destroy(&_ctx->tpl);
+  }
   free(_ctx);
 }
 
 void *collection_init(const json_object *config) {
-  struct CollectionCtx *ctx = malloc(sizeof(struct CollectionCtx));
-  if (ctx == NULL)
-    return NULL;
-  ctx->payload = 0;
-  printf("collection_init() called\n");
+  struct CollectionCtx *ctx = calloc(1, sizeof(struct CollectionCtx));
+  if (ctx == NULL) {
+    SYSLOG_ERR("calloc() failed");
+    goto err_calloc_ctx;
+  }
+  ctx->amplitude = 10;
+  ctx->offset = 20;
+  ctx->noise = 0.1;
+  ctx->period_ms = 60000;
+  ctx->seed = (unsigned int)time(NULL);
+  json_object *json_ele;
+  if (json_pointer_get((json_object *)config, "/sample/amplitude",
+                       &json_ele) == 0)
+    ctx->amplitude = json_object_get_double(json_ele);
+  if (json_pointer_get((json_object *)config, "/sample/offset", &json_ele) ==
+      0)
+    ctx->offset = json_object_get_double(json_ele);
+  if (json_pointer_get((json_object *)config, "/sample/noise", &json_ele) ==
+      0)
+    ctx->noise = json_object_get_double(json_ele);
+  if (json_pointer_get((json_object *)config, "/sample/period_ms",
+                       &json_ele) == 0)
+    ctx->period_ms = json_object_get_uint64(json_ele);
+  if (json_pointer_get((json_object *)config, "/sample/latency_us",
+                       &json_ele) == 0)
+    ctx->latency_us = json_object_get_uint64(json_ele);
+  if (json_pointer_get((json_object *)config, "/sample/latency_jitter_us",
+                       &json_ele) == 0)
+    ctx->latency_jitter_us = json_object_get_uint64(json_ele);
+  if (json_pointer_get((json_object *)config, "/sample/error_rate",
+                       &json_ele) == 0)
+    ctx->error_rate = json_object_get_double(json_ele);
+  if (json_pointer_get((json_object *)config, "/sample/bad_rate",
+                       &json_ele) == 0)
+    ctx->bad_rate = json_object_get_double(json_ele);
+  // A fixed seed makes the errors, noise and walks repeat across runs
+  if (json_pointer_get((json_object *)config, "/sample/seed", &json_ele) == 0)
+    ctx->seed = json_object_get_int(json_ele);
+  if (ctx->period_ms == 0 || ctx->error_rate < 0 || ctx->error_rate > 1 ||
+      ctx->bad_rate < 0 || ctx->bad_rate > 1) {
+    SYSLOG_ERR("/sample/period_ms must be positive, /sample/error_rate and "
+               "/sample/bad_rate between 0 and 1");
+    goto err_invalid_config;
+  }
+
+  // Metrics cycle through every waveform unless one is given for all
+  for (size_t i = 0; i < SDP_READINGS_MAX; ++i)
+    ctx->waveforms[i] = i % WAVE_COUNT;
+  if (json_pointer_get((json_object *)config, "/sample/waveform",
+                       &json_ele) == 0) {
+    const char *name = json_object_get_string(json_ele);
+    size_t w = 0;
+    while (w < WAVE_COUNT && strcmp(waveform_names[w], name) != 0)
+      ++w;
+    if (w == WAVE_COUNT) {
+      SYSLOG_ERR("/sample/waveform [%s] is unknown", name);
+      goto err_invalid_config;
+    }
+    for (size_t i = 0; i < SDP_READINGS_MAX; ++i)
+      ctx->waveforms[i] = w;
+  }
+  for (size_t i = 0; i < SDP_READINGS_MAX; ++i)
+    ctx->walk[i] = ctx->offset;
+  ctx->started_at_ms = readings_now_ms();
+  syslog(LOG_INFO,
+         "sample: %zu metric(s) every %lu ms, latency %lu+%lu us, "
+         "error_rate %.3f, bad_rate %.3f",
+         info.metric_count, (unsigned long)gv_collection_event_interval_ms,
+         (unsigned long)ctx->latency_us,
+         (unsigned long)ctx->latency_jitter_us, ctx->error_rate,
+         ctx->bad_rate);
   return ctx;
+err_invalid_config:
+  free(ctx);
+err_calloc_ctx:
+  return NULL;
+}
+
+static double waveform_value(struct CollectionCtx *ctx, size_t i,
+                             int64_t now_ms) {
+  // Metrics are phase-shifted so they don't all peak together
+  const double phase =
+      fmod((double)now_ms / ctx->period_ms + (double)i / info.metric_count,
+           1.0);
+  const double noise = ctx->noise * (2 * uniform(&ctx->seed) - 1);
+  switch (ctx->waveforms[i]) {
+  case WAVE_SINE:
+    return ctx->offset + ctx->amplitude * sin(2 * M_PI * phase) + noise;
+  case WAVE_SQUARE:
+    return ctx->offset + (phase < 0.5 ? ctx->amplitude : -ctx->amplitude) +
+           noise;
+  case WAVE_SAWTOOTH:
+    return ctx->offset + ctx->amplitude * (2 * phase - 1) + noise;
+  case WAVE_RANDOM_WALK:
+    ctx->walk[i] += ctx->amplitude / 100 * (2 * uniform(&ctx->seed) - 1);
+    return ctx->walk[i];
+  case WAVE_COUNTER:
+  default:
+    return (double)ctx->ticks;
+  }
 }
 
-int collection(void *ctx) {
+int collection(void *ctx, struct ReadingRecord *readings) {
   struct CollectionCtx *_ctx = (struct CollectionCtx *)ctx;
-  ++(_ctx->payload);
-  printf("collection() called\n");
+  ++_ctx->ticks;
+  uint64_t latency_us = _ctx->latency_us;
+  if (_ctx->latency_jitter_us > 0)
+    latency_us += (uint64_t)(uniform(&_ctx->seed) * _ctx->latency_jitter_us);
+  sleep_us(latency_us);
+  if (_ctx->error_rate > 0 && uniform(&_ctx->seed) < _ctx->error_rate) {
+    ++_ctx->errors;
+    return 1;
+  }
+  const int64_t now_ms = readings_now_ms();
+  for (size_t i = 0; i < info.metric_count; ++i) {
+    const bool bad =
+        _ctx->bad_rate > 0 && uniform(&_ctx->seed) < _ctx->bad_rate;
+    if (bad)
+      ++_ctx->bad_readings;
+    readings_add(readings, i, bad ? NAN : waveform_value(_ctx, i, now_ms),
+                 now_ms, bad ? READING_BAD : READING_GOOD);
+  }
   return 0;
 }
 
@@ -58,5 +328,12 @@ void collection_destroy(void *ctx) {
   if (ctx == NULL)
     return;
   struct CollectionCtx *_ctx = (struct CollectionCtx *)ctx;
+  const int64_t elapsed_ms = readings_now_ms() - _ctx->started_at_ms;
+  syslog(LOG_INFO,
+         "sample: %lu tick(s) in %ld ms (%.1f/s), %lu injected error(s), "
+         "%lu bad reading(s)",
+         (unsigned long)_ctx->ticks, (long)elapsed_ms,
+         elapsed_ms > 0 ? _ctx->ticks * 1000.0 / elapsed_ms : 0.0,
+         (unsigned long)_ctx->errors, (unsigned long)_ctx->bad_readings);
   free(_ctx);
 }
@@ -0,0 +1,167 @@
+#include "battery.h"
+#include "../../utils.h"
+
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <syslog.h>
+#include <time.h>
+
+// Below this magnitude the current is treated as zero for ETA purposes
+#define IDLE_CURRENT_MA 5.0
+
+static const struct BatteryParams default_params = {
+    .capacity_mah = 4000,
+    .empty_voltage_v = 6.0,
+    .full_voltage_v = 8.4,
+    .process_noise = 0.01,
+    .measurement_noise = 100,
+    .current_ema_tau_sec = 60};
+
+static double clamp_soc(double soc) {
+  return soc > 100 ? 100 : (soc < 0 ? 0 : soc);
+}
+
+static double voltage_soc(const struct BatteryParams *p, double bus_voltage_v) {
+  return clamp_soc((bus_voltage_v - p->empty_voltage_v) /
+                   (p->full_voltage_v - p->empty_voltage_v) * 100);
+}
+
+// Override *value with key of config or state, in this order of precedence
+static void load_param(const json_object *config, const json_object *state,
+                       const char *key, double *value) {
+  json_object *json_ele;
+  if (config != NULL && json_object_object_get_ex(config, key, &json_ele))
+    *value = json_object_get_double(json_ele);
+  else if (state != NULL && json_object_object_get_ex(state, key, &json_ele))
+    *value = json_object_get_double(json_ele);
+}
+
+void battery_estimator_init(struct BatteryEstimator *e,
+                            const json_object *config, const char *state_path) {
+  json_object *root_battery = NULL;
+  json_pointer_get((json_object *)config, "/ups/battery", &root_battery);
+  json_object *state = json_object_from_file(state_path);
+  if (state == NULL)
+    syslog(LOG_INFO, "No battery state loaded from [%s]: %s", state_path,
+           json_util_get_last_err());
+
+  e->params = default_params;
+  load_param(root_battery, state, "capacity_mah", &e->params.capacity_mah);
+  load_param(root_battery, state, "empty_voltage_v",
+             &e->params.empty_voltage_v);
+  load_param(root_battery, state, "full_voltage_v", &e->params.full_voltage_v);
+  load_param(root_battery, state, "process_noise", &e->params.process_noise);
+  load_param(root_battery, state, "measurement_noise",
+             &e->params.measurement_noise);
+  load_param(root_battery, state, "current_ema_tau_sec",
+             &e->params.current_ema_tau_sec);
+
+  e->initialized = false;
+  e->current_ema_ma = 0;
+  json_object *json_soc, *json_variance, *json_saved_at;
+  if (state != NULL && json_object_object_get_ex(state, "soc", &json_soc) &&
+      json_object_object_get_ex(state, "soc_variance", &json_variance) &&
+      json_object_object_get_ex(state, "saved_at", &json_saved_at)) {
+    // The SoC drifted while we were not running, so its uncertainty grows with
+    // the downtime, letting the first voltage measurements pull it back
+    double downtime_sec =
+        difftime(time(NULL), json_object_get_int64(json_saved_at));
+    e->soc = clamp_soc(json_object_get_double(json_soc));
+    e->soc_variance = json_object_get_double(json_variance) +
+                      e->params.process_noise * fabs(downtime_sec);
+    e->initialized = true;
+    e->last_update_sec = NAN;
+    syslog(LOG_INFO, "Battery state restored, soc: %.1f%% (variance: %.1f)",
+           e->soc, e->soc_variance);
+  }
+  json_object_put(state);
+}
+
+void battery_estimator_update(struct BatteryEstimator *e, double bus_voltage_v,
+                              double current_ma, double now_sec) {
+  const struct BatteryParams *p = &e->params;
+  const double z = voltage_soc(p, bus_voltage_v);
+  if (!e->initialized) {
+    e->soc = z;
+    e->soc_variance = p->measurement_noise;
+    e->current_ema_ma = current_ma;
+    e->last_update_sec = now_sec;
+    e->initialized = true;
+    return;
+  }
+  if (isnan(e->last_update_sec)) {
+    // First update after a restored state: no interval to integrate over yet
+    e->current_ema_ma = current_ma;
+    e->last_update_sec = now_sec;
+  }
+  const double dt = now_sec - e->last_update_sec;
+  e->last_update_sec = now_sec;
+
+  // Predict: coulomb counting
+  e->soc += current_ma * dt / 3600.0 / p->capacity_mah * 100;
+  e->soc_variance += p->process_noise * dt;
+  // Update: voltage-based SoC
+  const double k = e->soc_variance / (e->soc_variance + p->measurement_noise);
+  e->soc = clamp_soc(e->soc + k * (z - e->soc));
+  e->soc_variance *= 1 - k;
+
+  const double alpha = 1 - exp(-dt / p->current_ema_tau_sec);
+  e->current_ema_ma += alpha * (current_ma - e->current_ema_ma);
+}
+
+double battery_estimator_remaining_hrs(const struct BatteryEstimator *e) {
+  const double capacity = e->params.capacity_mah;
+  if (e->current_ema_ma > IDLE_CURRENT_MA)
+    return (100 - e->soc) / 100 * capacity / e->current_ema_ma;
+  if (e->current_ema_ma < -IDLE_CURRENT_MA)
+    return e->soc / 100 * capacity / -e->current_ema_ma;
+  return -1;
+}
+
+double battery_estimator_hourly_use(const struct BatteryEstimator *e) {
+  return -e->current_ema_ma / e->params.capacity_mah * 100;
+}
+
+int battery_estimator_save(const struct BatteryEstimator *e,
+                           const char *state_path) {
+  int retval = 0;
+  char tmp_path[PATH_MAX];
+  if (!e->initialized)
+    return 0;
+  if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", state_path) >=
+      (int)sizeof(tmp_path))
+    return -1;
+  json_object *state = json_object_new_object();
+  if (state == NULL)
+    return -2;
+  json_object_object_add(state, "soc", json_object_new_double(e->soc));
+  json_object_object_add(state, "soc_variance",
+                         json_object_new_double(e->soc_variance));
+  json_object_object_add(state, "saved_at", json_object_new_int64(time(NULL)));
+  json_object_object_add(state, "capacity_mah",
+                         json_object_new_double(e->params.capacity_mah));
+  json_object_object_add(state, "empty_voltage_v",
+                         json_object_new_double(e->params.empty_voltage_v));
+  json_object_object_add(state, "full_voltage_v",
+                         json_object_new_double(e->params.full_voltage_v));
+  json_object_object_add(state, "process_noise",
+                         json_object_new_double(e->params.process_noise));
+  json_object_object_add(state, "measurement_noise",
+                         json_object_new_double(e->params.measurement_noise));
+  json_object_object_add(state, "current_ema_tau_sec",
+                         json_object_new_double(e->params.current_ema_tau_sec));
+  if (json_object_to_file(tmp_path, state) != 0) {
+    SYSLOG_ERR("json_object_to_file(%s) failed: %s", tmp_path,
+               json_util_get_last_err());
+    retval = -3;
+    goto err_write;
+  }
+  if (rename(tmp_path, state_path) != 0) {
+    SYSLOG_ERR("rename(%s, %s) failed", tmp_path, state_path);
+    retval = -4;
+  }
+err_write:
+  json_object_put(state);
+  return retval;
+}
@@ -0,0 +1,70 @@
+#ifndef UPS_BATTERY_H
+#define UPS_BATTERY_H
+
+#include <json-c/json.h>
+
+#include <stdbool.h>
+
+struct BatteryParams {
+  double capacity_mah;
+  // Bus voltages mapped to 0% and 100% by the voltage-based SoC measurement
+  double empty_voltage_v;
+  double full_voltage_v;
+  // Kalman filter process noise (%^2 per second), i.e., how fast the coulomb
+  // counted SoC is allowed to drift
+  double process_noise;
+  // Kalman filter measurement noise (%^2) of the voltage-based SoC, which is
+  // large as the voltage sags under load
+  double measurement_noise;
+  // Time constant of the current EMA used for the ETA
+  double current_ema_tau_sec;
+};
+
+/**
+ * @brief Incremental state-of-charge (SoC) estimator: coulomb counting of the
+ * measured current is the prediction step of a 1-D Kalman filter whose
+ * measurement is the voltage-based SoC. Each update is O(1).
+ */
+struct BatteryEstimator {
+  struct BatteryParams params;
+  bool initialized;
+  // CLOCK_MONOTONIC of the last update
+  double last_update_sec;
+  // State of charge (%) and its variance (%^2)
+  double soc;
+  double soc_variance;
+  // Positive when charging, negative when discharging
+  double current_ema_ma;
+};
+
+/**
+ * @brief Initialize the estimator from /ups/battery of config. Parameters
+ * missing there are taken from the state file written by
+ * battery_estimator_save(), then from built-in defaults; the SoC saved in the
+ * state file is used as the initial estimate.
+ */
+void battery_estimator_init(struct BatteryEstimator *e,
+                            const json_object *config, const char *state_path);
+
+void battery_estimator_update(struct BatteryEstimator *e, double bus_voltage_v,
+                              double current_ma, double now_sec);
+
+/**
+ * @brief Hours until the battery is fully charged (if charging) or depleted
+ * (if discharging), or a negative number if the current is too small to tell.
+ */
+double battery_estimator_remaining_hrs(const struct BatteryEstimator *e);
+
+/**
+ * @brief Percentage of the capacity used per hour, negative when charging
+ */
+double battery_estimator_hourly_use(const struct BatteryEstimator *e);
+
+/**
+ * @brief Persist the parameters and the SoC atomically (write + rename).
+ * @return 0 on success, negative number on failure
+ */
+int battery_estimator_save(const struct BatteryEstimator *e,
+                           const char *state_path);
+
+#endif // UPS_BATTERY_H
@@ -0,0 +1,524 @@
+#include "../../device_cache.h"
+#include "../../payload.h"
+#include "../../readings_json.h"
+#include "../../utils.h"
+#include "../libs/burst.h"
+#include "../libs/mqtt.h"
+#include "../module.h"
+#include "battery.h"
+
+// The UPS HAT interaction code is translated from its Python version from:
+// https://files.waveshare.com/wiki/UPS-HAT-D/UPS_HAT_D.7z
+// (https://www.waveshare.com/wiki/UPS_HAT_(D))
+// with the assistance of some helpful LLM models 🙇🙇🙇
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/i2c-dev.h>
+#include <linux/i2c.h>
+#include <mosquitto.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#define _REG_CONFIG 0x00
+#define _REG_SHUNTVOLTAGE 0x01
+#define _REG_BUSVOLTAGE 0x02
+#define _REG_POWER 0x03
+#define _REG_CURRENT 0x04
+#define _REG_CALIBRATION 0x05
+
+#define RANGE_16V 0x00
+#define RANGE_32V 0x01
+
+#define DIV_1_40MV 0x00
+#define DIV_2_80MV 0x01
+#define DIV_4_160MV 0x02
+#define DIV_8_320MV 0x03
+
+#define ADCRES_9BIT_1S 0x00
+#define ADCRES_10BIT_1S 0x01
+#define ADCRES_11BIT_1S 0x02
+#define ADCRES_12BIT_1S 0x03
+#define ADCRES_12BIT_2S 0x09
+#define ADCRES_12BIT_4S 0x0A
+#define ADCRES_12BIT_8S 0x0B
+#define ADCRES_12BIT_16S 0x0C
+#define ADCRES_12BIT_32S 0x0D
+#define ADCRES_12BIT_64S 0x0E
+#define ADCRES_12BIT_128S 0x0F
+
+#define POWERDOW 0x00
+#define SVOLT_TRIGGERED 0x01
+#define BVOLT_TRIGGERED 0x02
+#define SANDBVOLT_TRIGGERED 0x03
+#define ADCOFF 0x04
+#define SVOLT_CONTINUOUS 0x05
+#define BVOLT_CONTINUOUS 0x06
+#define SANDBVOLT_CONTINUOUS 0x07
+
+#define INA219_I2C_ADDR 0x42
+
+#define CALIBRATION_VALUE 4096u
+
+// Registers read by ina219_read_batch(), in the order of INA219Sample::regs
+static const uint8_t ina219_batch_regs[] = {_REG_BUSVOLTAGE, _REG_SHUNTVOLTAGE,
+                                            _REG_CURRENT, _REG_POWER,
+                                            _REG_CALIBRATION};
+#define INA219_BATCH_SIZE                                                      \
+  (sizeof(ina219_batch_regs) / sizeof(ina219_batch_regs[0]))
+
+struct INA219Sample {
+  uint16_t regs[INA219_BATCH_SIZE];
+};
+
+enum UPSMetric {
+  METRIC_BUS_VOLTAGE_V = 0,
+  METRIC_SHUNT_VOLTAGE_V,
+  METRIC_CURRENT_MA,
+  METRIC_POWER_W,
+  METRIC_BATT_PERCENTAGE,
+  METRIC_HOURLY_USE_PERCENTAGE,
+  METRIC_REMAINING_HRS,
+  METRIC_CURRENT_MA_MIN,
+  METRIC_CURRENT_MA_MAX,
+  METRIC_CURRENT_MA_PEAK,
+  METRIC_COUNT
+};
+
+static const struct MetricDesc metrics[METRIC_COUNT] = {
+    [METRIC_BUS_VOLTAGE_V] = {"bus_voltage_v", "V", 3},
+    [METRIC_SHUNT_VOLTAGE_V] = {"shunt_voltage_v", "V", 5},
+    [METRIC_CURRENT_MA] = {"current_ma", "mA", 1},
+    [METRIC_POWER_W] = {"power_w", "W", 3},
+    [METRIC_BATT_PERCENTAGE] = {"batt_percentage", "%", 1},
+    [METRIC_HOURLY_USE_PERCENTAGE] = {"hourly_use_percentage", "%", 1},
+    // If the battery is charging, it is the time until fully charged
+    // If the battery is discharging, it is the time until fully depleted.
+    [METRIC_REMAINING_HRS] = {"remaining_hrs", "h", 2},
+    // Only reported in burst mode
+    [METRIC_CURRENT_MA_MIN] = {"current_ma_min", "mA", 1},
+    [METRIC_CURRENT_MA_MAX] = {"current_ma_max", "mA", 1},
+    [METRIC_CURRENT_MA_PEAK] = {"current_ma_peak", "mA", 1},
+};
+
+static const struct ModuleInfo info = {.abi_version = SDP_MODULE_ABI_VERSION,
+                                       .name = "ups",
+                                       .metric_count = METRIC_COUNT,
+                                       .metrics = metrics};
+
+struct INA219_Context {
+  int fd;
+  char *i2c_device_path;
+  uint16_t i2c_address;
+  // Burst mode: capacity > 0 if enabled, current is then the burst mean
+  struct BurstBuffer burst;
+  uint64_t burst_interval_us;
+  struct BatteryEstimator battery;
+  char *battery_state_path;
+  uint64_t battery_save_interval_sec;
+  time_t battery_saved_at;
+};
+
+struct PostCollectionCtx {
+  struct mosquitto *mosq;
+  const char *topic;
+  int qos;
+  struct PayloadTemplate tpl;
+};
+
+const struct ModuleInfo *module_info(void) { return &info; }
+
+struct INA219Write {
+  const struct INA219_Context *ctx;
+  uint8_t reg_addr;
+  uint16_t data;
+};
+
+static int ina219_write_reg(void *arg, __attribute__((unused)) void *sample,
+                            __attribute__((unused)) size_t sample_size) {
+  const struct INA219Write *w = (const struct INA219Write *)arg;
+  // The implementation of write() is tricky, LLMs can't get it right
+  // The current implementation takes reference from here:
+  // https://github.com/flav1972/ArduinoINA219/blob/5194f33ae9edc0e99e0cb1a6ed62e41818886fa9/INA219.cpp#L272-L296
+  // But unfortunately Arduino still uses layers of layers of abstraction
+  uint8_t buf[3];
+  buf[0] = w->reg_addr;
+  buf[1] = (w->data >> 8) & 0xFF;
+  buf[2] = w->data & 0xFF;
+  struct i2c_msg msg = {
+      .addr = w->ctx->i2c_address, .flags = 0, .len = sizeof(buf), .buf = buf};
+  struct i2c_rdwr_ioctl_data xfer = {.msgs = &msg, .nmsgs = 1};
+  return ioctl(w->ctx->fd, I2C_RDWR, &xfer) < 0 ? -1 : 0;
+}
+
+static int ina219_write(const struct INA219_Context *ctx, uint8_t reg_addr,
+                        uint16_t data) {
+  struct INA219Write w = {.ctx = ctx, .reg_addr = reg_addr, .data = data};
+  return device_bus_write(ctx->i2c_device_path, ctx->i2c_address,
+                          ina219_write_reg, &w) != 0
+             ? -1
+             : 0;
+}
+
+/**
+ * @brief Read all registers of ina219_batch_regs in one I2C_RDWR ioctl(). Each
+ * register is a combined (repeated-start) pointer write + 2-byte read, so the
+ * whole sample costs a single syscall and no other master can sneak in between.
+ */
+static int ina219_read_batch(void *arg, void *sample,
+                             __attribute__((unused)) size_t sample_size) {
+  const struct INA219_Context *ctx = (const struct INA219_Context *)arg;
+  struct INA219Sample *s = (struct INA219Sample *)sample;
+  uint8_t regs[INA219_BATCH_SIZE];
+  uint8_t bufs[INA219_BATCH_SIZE][2];
+  struct i2c_msg msgs[INA219_BATCH_SIZE * 2];
+  for (size_t i = 0; i < INA219_BATCH_SIZE; ++i) {
+    regs[i] = ina219_batch_regs[i];
+    msgs[i * 2] = (struct i2c_msg){
+        .addr = ctx->i2c_address, .flags = 0, .len = 1, .buf = &regs[i]};
+    msgs[i * 2 + 1] = (struct i2c_msg){.addr = ctx->i2c_address,
+                                       .flags = I2C_M_RD,
+                                       .len = 2,
+                                       .buf = bufs[i]};
+  }
+  struct i2c_rdwr_ioctl_data xfer = {.msgs = msgs,
+                                     .nmsgs = INA219_BATCH_SIZE * 2};
+  if (ioctl(ctx->fd, I2C_RDWR, &xfer) < 0)
+    return -1;
+  for (size_t i = 0; i < INA219_BATCH_SIZE; ++i)
+    s->regs[i] = (bufs[i][0] << 8) | bufs[i][1];
+  return 0;
+}
+
+/**
+ * @brief Read only the current register, used for burst sampling
+ */
+static int ina219_read_current(void *arg, void *sample,
+                               __attribute__((unused)) size_t sample_size) {
+  const struct INA219_Context *ctx = (const struct INA219_Context *)arg;
+  uint8_t reg = _REG_CURRENT;
+  uint8_t buf[2];
+  struct i2c_msg msgs[2] = {
+      {.addr = ctx->i2c_address, .flags = 0, .len = 1, .buf = &reg},
+      {.addr = ctx->i2c_address, .flags = I2C_M_RD, .len = 2, .buf = buf}};
+  struct i2c_rdwr_ioctl_data xfer = {.msgs = msgs, .nmsgs = 2};
+  if (ioctl(ctx->fd, I2C_RDWR, &xfer) < 0)
+    return -1;
+  *(uint16_t *)sample = (buf[0] << 8) | buf[1];
+  return 0;
+}
+
+/**
+ * @brief Fill ctx->burst with current readings taken every burst_interval_us.
+ * The ticks are absolute so that the time spent on the bus does not
+ * accumulate as drift. The bus stays locked for the whole burst, so each
+ * sample costs a single I2C_RDWR.
+ */
+static int ina219_burst(struct INA219_Context *ctx, struct BurstStats *stats) {
+  struct timespec next;
+  int ret = -1;
+  const int lock = device_bus_lock(ctx->i2c_device_path);
+  clock_gettime(CLOCK_MONOTONIC, &next);
+  burst_buffer_reset(&ctx->burst);
+  for (size_t i = 0; i < ctx->burst.capacity; ++i) {
+    uint16_t raw;
+    if (device_bus_read_locked(ctx->i2c_device_path, ctx->i2c_address, &raw,
+                               sizeof(raw), ina219_read_current, ctx) != 0)
+      goto unlock;
+    // LSB: 0.1mA
+    burst_buffer_push(&ctx->burst, (int16_t)raw * 0.1f);
+    next.tv_nsec += ctx->burst_interval_us * 1000;
+    while (next.tv_nsec >= 1000000000) {
+      next.tv_nsec -= 1000000000;
+      ++next.tv_sec;
+    }
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+  }
+  ret = 0;
+unlock:
+  device_bus_unlock(lock);
+  return ret == 0 ? burst_reduce(&ctx->burst, stats) : ret;
+}
+
+static int ina219_init(struct INA219_Context *ctx) {
+  ctx->fd = device_bus_open(ctx->i2c_device_path, O_RDWR | O_CLOEXEC);
+  if (ctx->fd < 0) {
+    SYSLOG_ERR("Failed to open I2C device [%s]: %d(%s)", ctx->i2c_device_path,
+               errno, strerror(errno));
+    return -1;
+  }
+
+  // Calibration is written once here and only rewritten if the chip loses it
+  // (e.g., after a brownout), see collection()
+  if (ina219_write(ctx, _REG_CALIBRATION, CALIBRATION_VALUE) < 0) {
+    SYSLOG_ERR("Failed to set CALIBRATION_VALUE");
+    goto err_whatever;
+  }
+
+  // 32-sample averaging takes ~17ms per conversion, far too slow for burst
+  // mode, which averages in burst_reduce() instead
+  uint16_t adcres = ctx->burst.capacity > 0 ? ADCRES_12BIT_1S : ADCRES_12BIT_32S;
+  uint16_t config = RANGE_32V << 13 | DIV_8_320MV << 11 | adcres << 7 |
+                    adcres << 3 | SANDBVOLT_CONTINUOUS;
+  if (ina219_write(ctx, _REG_CONFIG, config) < 0) {
+    SYSLOG_ERR("Failed to set config");
+    goto err_whatever;
+  }
+  return 0;
+err_whatever:
+  close(ctx->fd);
+  return -1;
+}
+
+void *post_collection_init(const json_object *config) {
+  struct PostCollectionCtx *ctx = malloc(sizeof(struct PostCollectionCtx));
+  if (ctx == NULL) {
+    SYSLOG_ERR("malloc() failed");
+    goto err_malloc_ctx;
+  }
+  json_object *json_ele;
+  json_pointer_get((json_object *)config, "/ups/mqtt/topic", &json_ele);
+  ctx->topic = json_object_get_string(json_ele);
+  // Telemetry is sampled at up to 10 Hz, losing one sample is fine
+  ctx->qos = 0;
+  if (json_pointer_get((json_object *)config, "/ups/mqtt/qos", &json_ele) == 0)
+    ctx->qos = json_object_get_int(json_ele);
+  if (ctx->topic == NULL) {
+    SYSLOG_ERR("Invalid configs");
+    goto err_invalid_settings;
+  }
+  if (payload_template_init(&ctx->tpl, &info, "timestamp_utc") != 0) {
+    SYSLOG_ERR("payload_template_init() failed");
+    goto err_payload_template_init;
+  }
+  ctx->mosq = init_mosquitto_from_json(config, "/ups/mqtt");
+  if (ctx->mosq == NULL) {
+    SYSLOG_ERR("init_mosquitto_from_json() failed");
+    goto err_init_mosquitto;
+  }
+  return ctx;
+err_init_mosquitto:
+  payload_template_destroy(&ctx->tpl);
+err_payload_template_init:
+err_invalid_settings:
+  free(ctx);
+err_malloc_ctx:
+  return NULL;
+}
+
+int post_collection(const struct ReadingRecord *readings, void *pc_ctx) {
+  struct PostCollectionCtx *_pc_ctx = (struct PostCollectionCtx *)pc_ctx;
+  char dt_eta_str[sizeof("1970-01-01T00:00:00Z")];
+  char extra[96];
+  char payload[512];
+  int rc;
+  int idx = readings_find(readings, METRIC_REMAINING_HRS);
+  const bool has_eta = idx >= 0 && readings->qualities[idx] != READING_BAD;
+  if (has_eta)
+    readings_format_iso8601(readings_now_ms() + readings->values[idx] * 3600000,
+                            dt_eta_str, sizeof(dt_eta_str));
+  idx = readings_find(readings, METRIC_CURRENT_MA);
+  snprintf(extra, sizeof(extra), "\"charging\": %s, \"eta_utc\": %s%s%s",
+           idx >= 0 && readings->values[idx] > 0 ? "true" : "false",
+           has_eta ? "\"" : "", has_eta ? dt_eta_str : "null",
+           has_eta ? "\"" : "");
+
+  const int len = payload_render(&_pc_ctx->tpl, readings, extra, payload,
+                                 sizeof(payload));
+  if (len < 0) {
+    SYSLOG_ERR("payload_render() failed");
+    return 1;
+  }
+  rc = mqtt_publish(_pc_ctx->mosq, _pc_ctx->topic, payload, len, _pc_ctx->qos,
+                    false);
+  if (rc != MOSQ_ERR_SUCCESS) {
+    SYSLOG_ERR("Error publishing: %s", mosquitto_strerror(rc));
+    return 1;
+  }
+  return 0;
+}
+
+void post_collection_destroy(void *pc_ctx) {
+  struct PostCollectionCtx *ctx = (struct PostCollectionCtx *)pc_ctx;
+  if (ctx == NULL)
+    return;
+  mqtt_destroy(ctx->mosq);
+  mosquitto_lib_cleanup();
+  payload_template_destroy(&ctx->tpl);
+  free(ctx);
+}
+
+void *collection_init(const json_object *config) {
+  struct INA219_Context *ctx =
+      (struct INA219_Context *)malloc(sizeof(struct INA219_Context));
+  if (ctx == NULL) {
+    SYSLOG_ERR("malloc() failed");
+    goto err_malloc_ctx;
+  }
+  json_object *json_ele;
+  const char *i2c_device_path = "/dev/i2c-1";
+  if (json_pointer_get((json_object *)config, "/ups/i2c_device_path",
+                       &json_ele) == 0 &&
+      json_object_get_string(json_ele) != NULL)
+    i2c_device_path = json_object_get_string(json_ele);
+  ctx->i2c_device_path = strdup(i2c_device_path);
+  if (ctx->i2c_device_path == NULL) {
+    SYSLOG_ERR("strdup() failed");
+    goto err_strdup_path;
+  }
+  ctx->i2c_address = INA219_I2C_ADDR;
+  if (json_pointer_get((json_object *)config, "/ups/i2c_address", &json_ele) ==
+      0)
+    ctx->i2c_address = json_object_get_int(json_ele);
+
+  const char *battery_state_path = "/var/lib/sdp/ups-battery.json";
+  if (json_pointer_get((json_object *)config, "/ups/battery/state_path",
+                       &json_ele) == 0 &&
+      json_object_get_string(json_ele) != NULL)
+    battery_state_path = json_object_get_string(json_ele);
+  ctx->battery_state_path = strdup(battery_state_path);
+  if (ctx->battery_state_path == NULL) {
+    SYSLOG_ERR("strdup() failed");
+    goto err_strdup_state_path;
+  }
+  ctx->battery_save_interval_sec = 60;
+  if (json_pointer_get((json_object *)config, "/ups/battery/save_interval_sec",
+                       &json_ele) == 0)
+    ctx->battery_save_interval_sec = json_object_get_uint64(json_ele);
+  battery_estimator_init(&ctx->battery, config, ctx->battery_state_path);
+  ctx->battery_saved_at = time(NULL);
+
+  size_t burst_samples = 0;
+  if (json_pointer_get((json_object *)config, "/ups/burst/samples",
+                       &json_ele) == 0)
+    burst_samples = json_object_get_uint64(json_ele);
+  ctx->burst_interval_us = 1000;
+  if (json_pointer_get((json_object *)config, "/ups/burst/interval_us",
+                       &json_ele) == 0)
+    ctx->burst_interval_us = json_object_get_uint64(json_ele);
+  float taps[BURST_MAX_TAPS];
+  size_t tap_count = 0;
+  if (json_pointer_get((json_object *)config, "/ups/burst/fir_taps",
+                       &json_ele) == 0 &&
+      json_object_is_type(json_ele, json_type_array)) {
+    tap_count = json_object_array_length(json_ele);
+    if (tap_count > BURST_MAX_TAPS) {
+      SYSLOG_ERR("/ups/burst/fir_taps has more than %d taps", BURST_MAX_TAPS);
+      goto err_burst_init;
+    }
+    for (size_t i = 0; i < tap_count; ++i)
+      taps[i] = json_object_get_double(json_object_array_get_idx(json_ele, i));
+  }
+  memset(&ctx->burst, 0, sizeof(ctx->burst));
+  if (burst_samples > 0 &&
+      burst_buffer_init(&ctx->burst, burst_samples, taps, tap_count) != 0) {
+    SYSLOG_ERR("burst_buffer_init() failed");
+    goto err_burst_init;
+  }
+
+  if (ina219_init(ctx) != 0) {
+    SYSLOG_ERR("ina219_init() failed");
+    goto err_ina219_init;
+  }
+  syslog(LOG_INFO,
+         "collection_init() success, INA219 at [%s]@0x%x, burst samples: %zu",
+         ctx->i2c_device_path, ctx->i2c_address, ctx->burst.capacity);
+  return ctx;
+err_ina219_init:
+  burst_buffer_destroy(&ctx->burst);
+err_burst_init:
+  free(ctx->battery_state_path);
+err_strdup_state_path:
+  free(ctx->i2c_device_path);
+err_strdup_path:
+  free(ctx);
+err_malloc_ctx:
+  return NULL;
+}
+
+int collection(void *ctx, struct ReadingRecord *readings) {
+  struct INA219_Context *dat = (struct INA219_Context *)ctx;
+  struct INA219Sample sample;
+  struct BurstStats current_stats;
+  if (device_cache_read(dat->i2c_device_path, dat->i2c_address, &sample,
+                        sizeof(sample), ina219_read_batch, dat) != 0) {
+    SYSLOG_ERR("ina219_read_batch() failed");
+    return 1;
+  }
+  if (sample.regs[4] != CALIBRATION_VALUE) {
+    // Current and power registers read 0 without calibration, so this sample
+    // is discarded
+    syslog(LOG_WARNING, "INA219 lost its calibration (0x%04x), rewriting it",
+           sample.regs[4]);
+    if (ina219_write(dat, _REG_CALIBRATION, CALIBRATION_VALUE) < 0)
+      SYSLOG_ERR("Failed to set CALIBRATION_VALUE");
+    return 1;
+  }
+  const int64_t read_at = readings_now_ms();
+  const float bus_voltage = (float)(sample.regs[0] >> 3) * 0.004;
+  // LSB: 10uV
+  const float shunt_voltage = (int16_t)sample.regs[1] * 0.01 / 1000.0;
+  // LSB: 0.1mA
+  float current = (int16_t)sample.regs[2] * 0.1;
+  // LSB: 2mW
+  const float power = (int16_t)sample.regs[3] * 0.002;
+  if (dat->burst.capacity > 0) {
+    if (ina219_burst(dat, &current_stats) != 0) {
+      SYSLOG_ERR("ina219_burst() failed");
+      return 1;
+    }
+    current = current_stats.mean;
+  }
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  battery_estimator_update(&dat->battery, bus_voltage, current,
+                           now.tv_sec + now.tv_nsec / 1e9);
+  if (dat->battery_save_interval_sec > 0 &&
+      time(NULL) - dat->battery_saved_at >=
+          (time_t)dat->battery_save_interval_sec) {
+    battery_estimator_save(&dat->battery, dat->battery_state_path);
+    dat->battery_saved_at = time(NULL);
+  }
+
+  const double remaining_hrs = battery_estimator_remaining_hrs(&dat->battery);
+  readings_add(readings, METRIC_BUS_VOLTAGE_V, bus_voltage, read_at,
+               READING_GOOD);
+  readings_add(readings, METRIC_SHUNT_VOLTAGE_V, shunt_voltage, read_at,
+               READING_GOOD);
+  readings_add(readings, METRIC_CURRENT_MA, current, read_at, READING_GOOD);
+  readings_add(readings, METRIC_POWER_W, power, read_at, READING_GOOD);
+  readings_add(readings, METRIC_BATT_PERCENTAGE, dat->battery.soc, read_at,
+               READING_GOOD);
+  readings_add(readings, METRIC_HOURLY_USE_PERCENTAGE,
+               battery_estimator_hourly_use(&dat->battery), read_at,
+               READING_GOOD);
+  readings_add(readings, METRIC_REMAINING_HRS, remaining_hrs, read_at,
+               remaining_hrs >= 0 ? READING_GOOD : READING_BAD);
+  if (dat->burst.capacity > 0) {
+    readings_add(readings, METRIC_CURRENT_MA_MIN, current_stats.min, read_at,
+                 READING_GOOD);
+    readings_add(readings, METRIC_CURRENT_MA_MAX, current_stats.max, read_at,
+                 READING_GOOD);
+    readings_add(readings, METRIC_CURRENT_MA_PEAK, current_stats.peak, read_at,
+                 READING_GOOD);
+  }
+  return 0;
+}
+
+void collection_destroy(void *ctx) {
+  if (ctx == NULL)
+    return;
+  struct INA219_Context *dat = (struct INA219_Context *)ctx;
+  battery_estimator_save(&dat->battery, dat->battery_state_path);
+  close(dat->fd);
+  burst_buffer_destroy(&dat->burst);
+  free(dat->battery_state_path);
+  free(dat->i2c_device_path);
+  free(dat);
+}
@@ -0,0 +1,218 @@
+#include "payload.h"
+#include "readings_json.h"
+#include "utils.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static const char digit_pairs[201] = "00010203040506070809"
+                                     "10111213141516171819"
+                                     "20212223242526272829"
+                                     "30313233343536373839"
+                                     "40414243444546474849"
+                                     "50515253545556575859"
+                                     "60616263646566676869"
+                                     "70717273747576777879"
+                                     "80818283848586878889"
+                                     "90919293949596979899";
+
+static const uint64_t pow10_u64[PAYLOAD_MAX_DECIMALS + 1] = {
+    1,      10,      100,      1000,      10000,
+    100000, 1000000, 10000000, 100000000, 1000000000};
+
+// |value * 10^decimals| must stay below this to fit in an int64_t
+#define PAYLOAD_FIXED_LIMIT 9.0e18
+
+// Writes v with exactly width digits, zero-padded, two digits at a time
+static void write_digits(uint64_t v, size_t width, char *buf) {
+  char *p = buf + width;
+  while (p - buf >= 2) {
+    p -= 2;
+    memcpy(p, &digit_pairs[(v % 100) * 2], 2);
+    v /= 100;
+  }
+  if (p > buf)
+    *--p = (char)('0' + v % 10);
+}
+
+static size_t count_digits(uint64_t v) {
+  size_t n = 1;
+  while (v >= 10) {
+    v /= 10;
+    ++n;
+  }
+  return n;
+}
+
+size_t payload_format_fixed(double value, int decimals, char *buf) {
+  if (!isfinite(value)) {
+    memcpy(buf, "null", 4);
+    return 4;
+  }
+  if (decimals < 0)
+    decimals = 0;
+  if (decimals > PAYLOAD_MAX_DECIMALS)
+    decimals = PAYLOAD_MAX_DECIMALS;
+  if (fabs(value) * (double)pow10_u64[decimals] >= PAYLOAD_FIXED_LIMIT) {
+    // Rare enough that the slow path doesn't matter; %.17g needs at most 24
+    // characters
+    int n = snprintf(buf, PAYLOAD_NUMBER_MAX, "%.17g", value);
+    return n < 0 ? 0 : (size_t)n;
+  }
+  const int64_t scaled = llround(value * (double)pow10_u64[decimals]);
+  char *p = buf;
+  uint64_t u = (uint64_t)scaled;
+  if (scaled < 0) {
+    *p++ = '-';
+    u = -(uint64_t)scaled;
+  }
+  const uint64_t int_part = u / pow10_u64[decimals];
+  const size_t int_digits = count_digits(int_part);
+  write_digits(int_part, int_digits, p);
+  p += int_digits;
+  if (decimals > 0) {
+    *p++ = '.';
+    write_digits(u % pow10_u64[decimals], decimals, p);
+    p += decimals;
+  }
+  return p - buf;
+}
+
+struct Iso8601Cache {
+  int64_t sec;
+  bool valid;
+  char text[PAYLOAD_ISO8601_LEN];
+};
+
+void payload_format_iso8601(int64_t timestamp_ms, char *buf) {
+  static _Thread_local struct Iso8601Cache cache;
+  const int64_t sec = timestamp_ms / 1000;
+  if (!cache.valid || cache.sec != sec) {
+    struct tm tm;
+    const time_t t = sec;
+    gmtime_r(&t, &tm);
+    char *p = cache.text;
+    write_digits(tm.tm_year + 1900, 4, p);
+    p[4] = '-';
+    write_digits(tm.tm_mon + 1, 2, p + 5);
+    p[7] = '-';
+    write_digits(tm.tm_mday, 2, p + 8);
+    p[10] = 'T';
+    write_digits(tm.tm_hour, 2, p + 11);
+    p[13] = ':';
+    write_digits(tm.tm_min, 2, p + 14);
+    p[16] = ':';
+    write_digits(tm.tm_sec, 2, p + 17);
+    p[19] = 'Z';
+    cache.sec = sec;
+    cache.valid = true;
+  }
+  memcpy(buf, cache.text, PAYLOAD_ISO8601_LEN);
+}
+
+int payload_template_init(struct PayloadTemplate *tpl,
+                          const struct ModuleInfo *info,
+                          const char *timestamp_key) {
+  tpl->info = info;
+  tpl->has_timestamp = timestamp_key != NULL;
+  size_t text_size = 1;
+  if (timestamp_key != NULL)
+    text_size += strlen("{\"\": \"") + strlen(timestamp_key);
+  for (size_t i = 0; i < info->metric_count; ++i)
+    text_size += strlen("\"\": ") + strlen(info->metrics[i].name) + 1;
+  tpl->keys = malloc(sizeof(struct PayloadFragment) * info->metric_count);
+  if (tpl->keys == NULL) {
+    SYSLOG_ERR("malloc() failed");
+    goto err_malloc_keys;
+  }
+  if ((tpl->text = malloc(text_size)) == NULL) {
+    SYSLOG_ERR("malloc() failed");
+    goto err_malloc_text;
+  }
+
+  char *p = tpl->text;
+  int n = timestamp_key != NULL ? sprintf(p, "{\"%s\": \"", timestamp_key)
+                                : sprintf(p, "{");
+  tpl->head.text = p;
+  tpl->head.len = n;
+  p += n + 1;
+  for (size_t i = 0; i < info->metric_count; ++i) {
+    n = sprintf(p, "\"%s\": ", info->metrics[i].name);
+    tpl->keys[i].text = p;
+    tpl->keys[i].len = n;
+    p += n + 1;
+  }
+  return 0;
+err_malloc_text:
+  free(tpl->keys);
+err_malloc_keys:
+  return -1;
+}
+
+void payload_template_destroy(struct PayloadTemplate *tpl) {
+  free(tpl->keys);
+  free(tpl->text);
+  tpl->keys = NULL;
+  tpl->text = NULL;
+}
+
+// memcpy() that accumulates into *len and reports truncation once at the end
+static void append(char *buf, size_t size, int *len, const char *src,
+                   size_t n) {
+  if (*len < 0)
+    return;
+  if (n >= size - *len) {
+    *len = -1;
+    return;
+  }
+  memcpy(buf + *len, src, n);
+  *len += n;
+}
+
+int payload_render(const struct PayloadTemplate *tpl,
+                   const struct ReadingRecord *r, const char *extra, char *buf,
+                   size_t size) {
+  int len = 0;
+  bool first = true;
+  char text[PAYLOAD_NUMBER_MAX];
+  if (size == 0)
+    return -1;
+  append(buf, size, &len, tpl->head.text, tpl->head.len);
+  if (tpl->has_timestamp) {
+    int64_t newest = 0;
+    for (size_t i = 0; i < r->count; ++i)
+      if (r->timestamps_ms[i] > newest)
+        newest = r->timestamps_ms[i];
+    payload_format_iso8601(r->count > 0 ? newest : readings_now_ms(), text);
+    append(buf, size, &len, text, PAYLOAD_ISO8601_LEN);
+    append(buf, size, &len, "\"", 1);
+    first = false;
+  }
+  for (size_t i = 0; i < r->count; ++i) {
+    const uint16_t id = r->metric_ids[i];
+    if (id >= tpl->info->metric_count)
+      continue;
+    if (!first)
+      append(buf, size, &len, ", ", 2);
+    first = false;
+    append(buf, size, &len, tpl->keys[id].text, tpl->keys[id].len);
+    if (r->qualities[i] == READING_BAD)
+      append(buf, size, &len, "null", 4);
+    else
+      append(buf, size, &len, text,
+             payload_format_fixed(r->values[i],
+                                  tpl->info->metrics[id].decimals, text));
+  }
+  if (extra != NULL) {
+    if (!first)
+      append(buf, size, &len, ", ", 2);
+    append(buf, size, &len, extra, strlen(extra));
+  }
+  append(buf, size, &len, "}", 1);
+  if (len >= 0)
+    buf[len] = '\0';
+  return len;
+}
@@ -0,0 +1,84 @@
+#ifndef PAYLOAD_H
+#define PAYLOAD_H
+
+#include "modules/readings.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Buffer size payload_format_fixed() needs
+#define PAYLOAD_NUMBER_MAX 32
+// Length of "1970-01-01T00:00:00Z"
+#define PAYLOAD_ISO8601_LEN 20
+// Larger MetricDesc::decimals are clamped to this
+#define PAYLOAD_MAX_DECIMALS 9
+
+struct PayloadFragment {
+  const char *text;
+  size_t len;
+};
+
+/**
+ * @brief The JSON layout of a module's readings, split into constant
+ * fragments once at startup. Read-only afterwards, so one template can be
+ * rendered by any number of threads at the same time.
+ */
+struct PayloadTemplate {
+  const struct ModuleInfo *info;
+  // "{" or "{\"<timestamp_key>\": \""
+  struct PayloadFragment head;
+  bool has_timestamp;
+  // keys[i] is "\"<metrics[i].name>\": "
+  struct PayloadFragment *keys;
+  // Backing store of all fragments
+  char *text;
+};
+
+/**
+ * @brief Split the JSON that readings_to_json() would produce for info with
+ * timestamp_key into its constant fragments.
+ * @return 0 on success or -1 on failure
+ */
+int payload_template_init(struct PayloadTemplate *tpl,
+                          const struct ModuleInfo *info,
+                          const char *timestamp_key);
+
+void payload_template_destroy(struct PayloadTemplate *tpl);
+
+/**
+ * @brief Render a record through tpl. Neither allocates nor calls into the
+ * C library's locale-aware formatting, so it is cheap enough to run on every
+ * sample.
+ * @param extra Same as readings_to_json()'s
+ * @return Length of the JSON string, or -1 if buf is too small
+ */
+int payload_render(const struct PayloadTemplate *tpl,
+                   const struct ReadingRecord *r, const char *extra, char *buf,
+                   size_t size);
+
+/**
+ * @brief Write value with the given digits after the decimal point, e.g.,
+ * 23.4 with 2 decimals as "23.40", using integer arithmetic only (values
+ * too large for an int64_t once scaled fall back to snprintf()). NaN and
+ * infinities, which JSON can't represent, are written as null.
+ * @param buf At least PAYLOAD_NUMBER_MAX bytes, not NUL-terminated
+ * @return Number of characters written
+ */
+size_t payload_format_fixed(double value, int decimals, char *buf);
+
+/**
+ * @brief Write timestamp_ms as "%Y-%m-%dT%H:%M:%SZ". The text is cached per
+ * thread and only regenerated when the second changes.
+ * @param buf At least PAYLOAD_ISO8601_LEN bytes, not NUL-terminated
+ */
+void payload_format_iso8601(int64_t timestamp_ms, char *buf);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // PAYLOAD_H
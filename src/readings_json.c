@@ -0,0 +1,63 @@
+#include "readings_json.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <time.h>
+
+int64_t readings_now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void readings_format_iso8601(int64_t timestamp_ms, char *buf, size_t size) {
+  struct tm tm;
+  time_t t = timestamp_ms / 1000;
+  gmtime_r(&t, &tm);
+  strftime(buf, size, "%Y-%m-%dT%H:%M:%SZ", &tm);
+}
+
+// snprintf() that accumulates into *len and reports truncation once at the end
+static void append(char *buf, size_t size, int *len, const char *format, ...) {
+  if (*len < 0)
+    return;
+  va_list args;
+  va_start(args, format);
+  int n = vsnprintf(buf + *len, size - *len, format, args);
+  va_end(args);
+  *len = (n < 0 || (size_t)n >= size - *len) ? -1 : *len + n;
+}
+
+int readings_to_json(const struct ModuleInfo *info,
+                     const struct ReadingRecord *r, const char *timestamp_key,
+                     const char *extra, char *buf, size_t size) {
+  int len = 0;
+  const char *sep = "";
+  append(buf, size, &len, "{");
+  if (timestamp_key != NULL) {
+    int64_t newest = 0;
+    for (size_t i = 0; i < r->count; ++i)
+      if (r->timestamps_ms[i] > newest)
+        newest = r->timestamps_ms[i];
+    char iso_time[sizeof("1970-01-01T00:00:00Z")];
+    readings_format_iso8601(r->count > 0 ? newest : readings_now_ms(),
+                            iso_time, sizeof(iso_time));
+    append(buf, size, &len, "\"%s\": \"%s\"", timestamp_key, iso_time);
+    sep = ", ";
+  }
+  for (size_t i = 0; i < r->count; ++i) {
+    if (r->metric_ids[i] >= info->metric_count)
+      continue;
+    const struct MetricDesc *m = &info->metrics[r->metric_ids[i]];
+    if (r->qualities[i] == READING_BAD)
+      append(buf, size, &len, "%s\"%s\": null", sep, m->name);
+    else
+      append(buf, size, &len, "%s\"%s\": %.*f", sep, m->name, m->decimals,
+             r->values[i]);
+    sep = ", ";
+  }
+  if (extra != NULL)
+    append(buf, size, &len, "%s%s", sep, extra);
+  append(buf, size, &len, "}");
+  return len;
+}
@@ -0,0 +1,43 @@
+#ifndef READINGS_JSON_H
+#define READINGS_JSON_H
+
+#include "modules/readings.h"
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Serialize a record as a flat JSON object, e.g.,
+ * {"timestamp_utc": "2024-01-01T00:00:00Z", "temp_celsius": 23.4}. Each
+ * reading is keyed by its MetricDesc::name and formatted with its decimals;
+ * READING_BAD readings are written as null. Per-sample publishers should
+ * prefer a PayloadTemplate (payload.h), which produces the same layout
+ * without vsnprintf().
+ * @param timestamp_key Key of the ISO 8601 time of the newest reading, NULL
+ * to omit it
+ * @param extra Preformatted members, e.g. "\"charging\": true", appended
+ * before the closing brace, NULL if none
+ * @return Length of the JSON string, or -1 if buf is too small
+ */
+int readings_to_json(const struct ModuleInfo *info,
+                     const struct ReadingRecord *r, const char *timestamp_key,
+                     const char *extra, char *buf, size_t size);
+
+/**
+ * @brief Format a Unix time in milliseconds as "%Y-%m-%dT%H:%M:%SZ"
+ */
+void readings_format_iso8601(int64_t timestamp_ms, char *buf, size_t size);
+
+/**
+ * @return The current Unix time in milliseconds
+ */
+int64_t readings_now_ms(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // READINGS_JSON_H
@@ -0,0 +1,65 @@
+#ifndef SHM_LAYOUT_H
+#define SHM_LAYOUT_H
+
+#include "modules/readings.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// "SDPS"
+#define SDP_SHM_MAGIC 0x53504453
+// Bumped whenever struct ShmSegment changes
+#define SDP_SHM_VERSION 1
+#define SDP_SHM_NAME_MAX 48
+#define SDP_SHM_UNIT_MAX 16
+
+struct ShmMetric {
+  char name[SDP_SHM_NAME_MAX];
+  char unit[SDP_SHM_UNIT_MAX];
+  int32_t decimals;
+  // sdp_fnv1a32(name), so readers can resolve names without strcmp()ing
+  // every entry
+  uint32_t name_hash;
+};
+
+/**
+ * @brief Layout of the POSIX shared memory object written by the shm sink and
+ * read by co-located consumers (e.g., dd-consumer). Everything but seq is
+ * guarded by seq, a seqlock: the writer makes it odd before and even after
+ * every update, and readers retry until they see the same even value on both
+ * sides of their copy. seq is also the futex word readers sleep on.
+ *
+ * Both sides access seq through the __atomic builtins, so the struct is the
+ * same in C and C++.
+ */
+struct ShmSegment {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t seq;
+  uint32_t metric_count;
+  struct ShmMetric metrics[SDP_READINGS_MAX];
+  // The record of the last successful collection()
+  struct ReadingRecord record;
+};
+
+/**
+ * @brief 32-bit FNV-1a
+ */
+static inline uint32_t sdp_fnv1a32(const char *str) {
+  uint32_t hash = 2166136261u;
+  for (; *str != '\0'; ++str) {
+    hash ^= (uint8_t)*str;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // SHM_LAYOUT_H
@@ -0,0 +1,184 @@
+#include "../archive.h"
+#include "../utils.h"
+#include "sinks.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ARCHIVE_DEFAULT_DIR "/var/lib/sdp/archive"
+#define ARCHIVE_DEFAULT_CHUNK_ROWS 360
+// Files of the same hour, e.g., after restarts, get suffixes up to this
+#define ARCHIVE_MAX_SUFFIX 1000
+
+/**
+ * @brief Write every record into hourly archive files (see archive.h), one
+ * row per record, for cheap backfills and offline analytics. Rows are
+ * buffered column by column and written as one compressed chunk once
+ * chunk_rows are buffered; a file is fsync()ed and closed when the hour
+ * changes. sdp-archive reads, merges and exports the files.
+ */
+struct ArchiveSink {
+  char dir[PATH_MAX / 2];
+  char path[PATH_MAX];
+  struct ArchiveHeader hdr;
+  struct ArchiveChunk chunk;
+  int fd;
+  // Hour (Unix time / 3600) of the open file
+  int64_t hour;
+  uint64_t rows;
+  uint64_t files;
+};
+
+static int archive_sink_close(struct ArchiveSink *s) {
+  if (s->fd < 0)
+    return 0;
+  int ret = 0;
+  if (archive_write_chunk(s->fd, &s->chunk) != 0) {
+    SYSLOG_ERR("archive_write_chunk(%s) failed: %d(%s)", s->path, errno,
+               strerror(errno));
+    ret = -1;
+  }
+  if (fsync(s->fd) != 0) {
+    SYSLOG_ERR("fsync(%s) failed: %d(%s)", s->path, errno, strerror(errno));
+    ret = -1;
+  }
+  close(s->fd);
+  s->fd = -1;
+  // Makes the new directory entry durable too
+  int dir_fd = open(s->dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dir_fd >= 0) {
+    fsync(dir_fd);
+    close(dir_fd);
+  }
+  s->chunk.rows = 0;
+  return ret;
+}
+
+static int archive_sink_open(struct ArchiveSink *s, int64_t hour) {
+  const time_t t = hour * 3600;
+  struct tm tm;
+  char stamp[sizeof("19700101T00Z")];
+  gmtime_r(&t, &tm);
+  strftime(stamp, sizeof(stamp), "%Y%m%dT%HZ", &tm);
+  for (int suffix = 0; suffix < ARCHIVE_MAX_SUFFIX; ++suffix) {
+    if (suffix == 0)
+      snprintf(s->path, sizeof(s->path), "%s/%s-%s.sdpa", s->dir,
+               s->hdr.module, stamp);
+    else
+      snprintf(s->path, sizeof(s->path), "%s/%s-%s.%d.sdpa", s->dir,
+               s->hdr.module, stamp, suffix);
+    // An existing file is never appended to: its last chunk may be torn
+    s->fd = open(s->path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (s->fd >= 0 || errno != EEXIST)
+      break;
+  }
+  if (s->fd < 0) {
+    SYSLOG_ERR("open(%s) failed: %d(%s)", s->path, errno, strerror(errno));
+    return -1;
+  }
+  if (archive_write_header(s->fd, &s->hdr) != 0) {
+    SYSLOG_ERR("archive_write_header(%s) failed: %d(%s)", s->path, errno,
+               strerror(errno));
+    close(s->fd);
+    s->fd = -1;
+    return -1;
+  }
+  s->hour = hour;
+  ++s->files;
+  syslog(LOG_INFO, "Archiving readings to %s", s->path);
+  return 0;
+}
+
+static void *archive_init(const json_object *config,
+                          const struct ModuleInfo *info) {
+  struct ArchiveSink *s = calloc(1, sizeof(struct ArchiveSink));
+  if (s == NULL) {
+    SYSLOG_ERR("calloc() failed");
+    goto err_calloc_sink;
+  }
+  s->fd = -1;
+  size_t chunk_rows = ARCHIVE_DEFAULT_CHUNK_ROWS;
+  json_object *json_ele;
+  snprintf(s->dir, sizeof(s->dir), "%s", ARCHIVE_DEFAULT_DIR);
+  if (json_object_object_get_ex(config, "dir", &json_ele))
+    snprintf(s->dir, sizeof(s->dir), "%s", json_object_get_string(json_ele));
+  if (json_object_object_get_ex(config, "chunk_rows", &json_ele))
+    chunk_rows = json_object_get_uint64(json_ele);
+  if (chunk_rows == 0) {
+    SYSLOG_ERR("chunk_rows must be positive");
+    goto err_invalid_config;
+  }
+  if (archive_header_from_info(&s->hdr, info) != 0) {
+    SYSLOG_ERR("At most %d metrics fit in an archive, %s has %zu",
+               SDP_READINGS_MAX, info->name, info->metric_count);
+    goto err_invalid_config;
+  }
+  if (access(s->dir, W_OK) != 0) {
+    SYSLOG_ERR("%s is not a writable directory: %d(%s)", s->dir, errno,
+               strerror(errno));
+    goto err_invalid_config;
+  }
+  if (archive_chunk_init(&s->chunk, info->metric_count, chunk_rows) != 0) {
+    SYSLOG_ERR("archive_chunk_init() failed");
+    goto err_chunk_init;
+  }
+  return s;
+err_chunk_init:
+err_invalid_config:
+  free(s);
+err_calloc_sink:
+  return NULL;
+}
+
+static int archive_write(void *ctx, const struct ReadingRecord *r) {
+  struct ArchiveSink *s = (struct ArchiveSink *)ctx;
+  int64_t newest_ms = 0;
+  for (size_t i = 0; i < r->count; ++i)
+    if (r->timestamps_ms[i] > newest_ms)
+      newest_ms = r->timestamps_ms[i];
+  const int64_t hour =
+      (newest_ms > 0 ? newest_ms / 1000 : (int64_t)time(NULL)) / 3600;
+  int ret = 0;
+  // archive_sink_close() logs its failures and closes the file either way,
+  // so r still goes to the new hour's file
+  if (s->fd >= 0 && hour != s->hour && archive_sink_close(s) != 0)
+    ret = -1;
+  if (s->fd < 0 && archive_sink_open(s, hour) != 0)
+    return -1;
+  archive_chunk_append(&s->chunk, r);
+  ++s->rows;
+  if (s->chunk.rows == s->chunk.capacity &&
+      archive_write_chunk(s->fd, &s->chunk) != 0) {
+    SYSLOG_ERR("archive_write_chunk(%s) failed: %d(%s)", s->path, errno,
+               strerror(errno));
+    // The rows are lost either way. A partial write leaves a torn chunk
+    // behind, which ends the reading of the file, so later chunks go to a
+    // fresh one
+    s->chunk.rows = 0;
+    archive_sink_close(s);
+    return -1;
+  }
+  return ret;
+}
+
+static void archive_destroy(void *ctx) {
+  struct ArchiveSink *s = (struct ArchiveSink *)ctx;
+  if (s == NULL)
+    return;
+  archive_sink_close(s);
+  syslog(LOG_INFO, "archive: %lu row(s) written to %lu file(s)",
+         (unsigned long)s->rows, (unsigned long)s->files);
+  archive_chunk_destroy(&s->chunk);
+  free(s);
+}
+
+const struct Sink archive_sink = {.type = "archive",
+                                  .init = archive_init,
+                                  .write = archive_write,
+                                  .destroy = archive_destroy};
@@ -0,0 +1,502 @@
+#include "../payload.h"
+#include "../utils.h"
+#include "sinks.h"
+
+#include <curl/curl.h>
+#include <zlib.h>
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Every document is indexed into the index of the request URL
+#define ES_ACTION "{\"index\":{}}\n"
+#define ES_ACTION_LEN (sizeof(ES_ACTION) - 1)
+// Upper bound of one rendered document, "\n" included
+#define ES_DOC_MAX 2048
+// Documents kept for retries beyond this many batches drop the oldest
+#define ES_BACKLOG_BATCHES 4
+
+// Where a document lives in EsSink::body, action line included
+struct EsDoc {
+  size_t offset;
+  size_t len;
+  // Requests that reported this document as throttled or failed
+  int attempts;
+};
+
+/**
+ * @brief Index every record as one document through the Elasticsearch _bulk
+ * API. Records are buffered as NDJSON and sent, optionally gzipped, once
+ * batch_docs documents or batch_bytes bytes are buffered or the oldest one
+ * is max_age_ms old. The curl handle is reused, so the connection is kept
+ * alive across requests. Items the bulk response reports as throttled or
+ * failed on the server side stay buffered for the next request; other item
+ * errors are dropped. After a failed request, flushes are held back with an
+ * exponential backoff, while the backlog cap bounds what is buffered.
+ */
+struct EsSink {
+  struct PayloadTemplate tpl;
+  CURL *curl;
+  struct curl_slist *headers;
+  char *url;
+  char curl_err[CURL_ERROR_SIZE];
+  size_t batch_docs;
+  size_t batch_bytes;
+  uint64_t max_age_ms;
+  int max_retries;
+  uint64_t retry_delay_min_ms;
+  uint64_t retry_delay_max_ms;
+  bool gzip;
+
+  char *body;
+  size_t body_len;
+  size_t body_cap;
+  struct EsDoc *docs;
+  size_t doc_count;
+  size_t doc_cap;
+  // CLOCK_MONOTONIC ms at which docs[0] was buffered
+  uint64_t oldest_ms;
+  // Delay before the next request after the last one failed, 0 if it didn't
+  uint64_t retry_delay_ms;
+  // CLOCK_MONOTONIC ms before which no request is made
+  uint64_t retry_at_ms;
+
+  z_stream zs;
+  unsigned char *gz;
+  size_t gz_cap;
+  char *resp;
+  size_t resp_len;
+  size_t resp_cap;
+
+  uint64_t requests;
+  uint64_t indexed;
+  uint64_t retried;
+  uint64_t dropped;
+};
+
+static uint64_t monotonic_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int grow(void **buf, size_t *cap, size_t needed, size_t elem_size) {
+  if (needed <= *cap)
+    return 0;
+  size_t new_cap = *cap == 0 ? 16 : *cap;
+  while (new_cap < needed)
+    new_cap *= 2;
+  void *p = realloc(*buf, new_cap * elem_size);
+  if (p == NULL)
+    return -1;
+  *buf = p;
+  *cap = new_cap;
+  return 0;
+}
+
+static size_t es_on_response(char *ptr, size_t size, size_t nmemb,
+                             void *userdata) {
+  struct EsSink *s = (struct EsSink *)userdata;
+  const size_t len = size * nmemb;
+  // + 1 for the NUL json_tokener_parse() needs
+  if (grow((void **)&s->resp, &s->resp_cap, s->resp_len + len + 1, 1) != 0)
+    return 0;
+  memcpy(s->resp + s->resp_len, ptr, len);
+  s->resp_len += len;
+  s->resp[s->resp_len] = '\0';
+  return len;
+}
+
+/**
+ * @brief Drop the documents whose keep[] is false, moving the others to the
+ * front of body in their original order.
+ */
+static void es_compact(struct EsSink *s, const bool *keep) {
+  size_t kept = 0;
+  size_t body_len = 0;
+  for (size_t i = 0; i < s->doc_count; ++i) {
+    if (!keep[i])
+      continue;
+    struct EsDoc doc = s->docs[i];
+    memmove(s->body + body_len, s->body + doc.offset, doc.len);
+    doc.offset = body_len;
+    body_len += doc.len;
+    s->docs[kept++] = doc;
+  }
+  s->doc_count = kept;
+  s->body_len = body_len;
+  if (kept > 0)
+    s->oldest_ms = monotonic_ms();
+}
+
+/**
+ * @brief Keep every document for the next request. Used when the request as
+ * a whole failed, e.g., while Elasticsearch is down: that uses up none of
+ * the documents' retries, the backoff spaces the attempts out and the
+ * backlog cap in es_write() bounds what is kept meanwhile.
+ */
+static void es_retry_all(struct EsSink *s, bool *keep) {
+  memset(keep, 1, sizeof(bool) * s->doc_count);
+  s->retried += s->doc_count;
+}
+
+/**
+ * @brief Hold the next request back by a delay doubling with every
+ * consecutive request that leaves documents to resend, or clear the delay
+ * once one doesn't.
+ */
+static void es_schedule_retry(struct EsSink *s) {
+  if (s->doc_count == 0) {
+    s->retry_delay_ms = 0;
+    s->retry_at_ms = 0;
+    return;
+  }
+  s->retry_delay_ms = s->retry_delay_ms == 0 ? s->retry_delay_min_ms
+                                             : s->retry_delay_ms * 2;
+  if (s->retry_delay_ms > s->retry_delay_max_ms)
+    s->retry_delay_ms = s->retry_delay_max_ms;
+  s->retry_at_ms = monotonic_ms() + s->retry_delay_ms;
+}
+
+static const char *es_body(struct EsSink *s, size_t *len) {
+  if (!s->gzip) {
+    *len = s->body_len;
+    return s->body;
+  }
+  const size_t bound = deflateBound(&s->zs, s->body_len);
+  if (grow((void **)&s->gz, &s->gz_cap, bound, 1) != 0) {
+    SYSLOG_ERR("realloc() failed");
+    return NULL;
+  }
+  deflateReset(&s->zs);
+  s->zs.next_in = (unsigned char *)s->body;
+  s->zs.avail_in = s->body_len;
+  s->zs.next_out = s->gz;
+  s->zs.avail_out = s->gz_cap;
+  if (deflate(&s->zs, Z_FINISH) != Z_STREAM_END) {
+    SYSLOG_ERR("deflate() failed: %s", s->zs.msg);
+    return NULL;
+  }
+  *len = s->gz_cap - s->zs.avail_out;
+  return (const char *)s->gz;
+}
+
+// The "status" of the i-th item of a bulk response, -1 if it has none
+static int es_item_status(json_object *items, size_t i,
+                          json_object **result) {
+  json_object *status = NULL;
+  *result = NULL;
+  json_object_object_get_ex(json_object_array_get_idx(items, i), "index",
+                            result);
+  if (*result == NULL ||
+      !json_object_object_get_ex(*result, "status", &status))
+    return -1;
+  return json_object_get_int(status);
+}
+
+/**
+ * @brief Walk the items of a bulk response, which are in request order. The
+ * whole response is checked before any document gets its verdict, so that a
+ * malformed one leaves every document untouched for es_retry_all().
+ * @return 0 if every document got a verdict, -1 if the response doesn't
+ * describe this request
+ */
+static int es_apply_items(struct EsSink *s, json_object *resp, bool *keep) {
+  json_object *items;
+  json_object *result;
+  if (!json_object_object_get_ex(resp, "items", &items) ||
+      !json_object_is_type(items, json_type_array) ||
+      json_object_array_length(items) != s->doc_count)
+    return -1;
+  for (size_t i = 0; i < s->doc_count; ++i)
+    if (es_item_status(items, i, &result) < 0)
+      return -1;
+  size_t logged = 0;
+  for (size_t i = 0; i < s->doc_count; ++i) {
+    const int code = es_item_status(items, i, &result);
+    if (code >= 200 && code < 300) {
+      keep[i] = false;
+      ++s->indexed;
+    } else if (code == 429 || code >= 500) {
+      if (!(keep[i] = ++s->docs[i].attempts <= s->max_retries))
+        ++s->dropped;
+      ++s->retried;
+    } else {
+      // E.g., a mapping conflict, which no retry fixes
+      json_object *error = NULL;
+      json_object_object_get_ex(result, "error", &error);
+      if (logged++ == 0)
+        SYSLOG_ERR("Document rejected (%d): %s", code,
+                   json_object_to_json_string(error));
+      keep[i] = false;
+      ++s->dropped;
+    }
+  }
+  return 0;
+}
+
+static int es_flush(struct EsSink *s) {
+  if (s->doc_count == 0)
+    return 0;
+  int ret = -1;
+  bool *keep = malloc(sizeof(bool) * s->doc_count);
+  if (keep == NULL) {
+    SYSLOG_ERR("malloc() failed");
+    return -1;
+  }
+  size_t len;
+  const char *body = es_body(s, &len);
+  if (body == NULL) {
+    es_retry_all(s, keep);
+    goto finally;
+  }
+  s->resp_len = 0;
+  curl_easy_setopt(s->curl, CURLOPT_POSTFIELDS, body);
+  curl_easy_setopt(s->curl, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)len);
+  ++s->requests;
+  const CURLcode res = curl_easy_perform(s->curl);
+  long http_code = 0;
+  curl_easy_getinfo(s->curl, CURLINFO_RESPONSE_CODE, &http_code);
+  if (res != CURLE_OK || http_code == 429 || http_code >= 500) {
+    SYSLOG_ERR("POST %s failed: %s (HTTP %ld), retrying %zu document(s)",
+               s->url, res != CURLE_OK ? s->curl_err : "", http_code,
+               s->doc_count);
+    es_retry_all(s, keep);
+    goto finally;
+  }
+  if (http_code != 200) {
+    SYSLOG_ERR("POST %s rejected (HTTP %ld): %.*s", s->url, http_code,
+               (int)(s->resp_len > 256 ? 256 : s->resp_len), s->resp);
+    memset(keep, 0, sizeof(bool) * s->doc_count);
+    s->dropped += s->doc_count;
+    goto finally;
+  }
+  json_object *resp = s->resp_len == 0 ? NULL : json_tokener_parse(s->resp);
+  json_object *errors;
+  if (resp != NULL && json_object_object_get_ex(resp, "errors", &errors) &&
+      !json_object_get_boolean(errors)) {
+    // The common case, no need to look at every item
+    s->indexed += s->doc_count;
+    memset(keep, 0, sizeof(bool) * s->doc_count);
+    ret = 0;
+  } else if (resp == NULL || es_apply_items(s, resp, keep) != 0) {
+    SYSLOG_ERR("Unexpected bulk response from %s", s->url);
+    es_retry_all(s, keep);
+  } else {
+    ret = 0;
+  }
+  json_object_put(resp);
+finally:
+  es_compact(s, keep);
+  es_schedule_retry(s);
+  free(keep);
+  return ret;
+}
+
+static void *es_init(const json_object *config,
+                     const struct ModuleInfo *info) {
+  struct EsSink *s = calloc(1, sizeof(struct EsSink));
+  if (s == NULL) {
+    SYSLOG_ERR("calloc() failed");
+    goto err_calloc_sink;
+  }
+  json_object *json_ele;
+  const char *url = "http://localhost:9200";
+  char index[128];
+  snprintf(index, sizeof(index), "sdp-%s", info->name);
+  const char *username = NULL;
+  const char *password = NULL;
+  long timeout_ms = 10000;
+  s->batch_docs = 500;
+  s->batch_bytes = 1024 * 1024;
+  s->max_age_ms = 10000;
+  s->max_retries = 3;
+  s->retry_delay_min_ms = 1000;
+  s->retry_delay_max_ms = 60000;
+  s->gzip = true;
+  if (json_object_object_get_ex(config, "url", &json_ele))
+    url = json_object_get_string(json_ele);
+  if (json_object_object_get_ex(config, "index", &json_ele))
+    snprintf(index, sizeof(index), "%s", json_object_get_string(json_ele));
+  if (json_object_object_get_ex(config, "username", &json_ele))
+    username = json_object_get_string(json_ele);
+  if (json_object_object_get_ex(config, "password", &json_ele))
+    password = json_object_get_string(json_ele);
+  if (json_object_object_get_ex(config, "timeout_ms", &json_ele))
+    timeout_ms = json_object_get_int(json_ele);
+  if (json_object_object_get_ex(config, "batch_docs", &json_ele))
+    s->batch_docs = json_object_get_uint64(json_ele);
+  if (json_object_object_get_ex(config, "batch_bytes", &json_ele))
+    s->batch_bytes = json_object_get_uint64(json_ele);
+  if (json_object_object_get_ex(config, "max_age_ms", &json_ele))
+    s->max_age_ms = json_object_get_uint64(json_ele);
+  if (json_object_object_get_ex(config, "max_retries", &json_ele))
+    s->max_retries = json_object_get_int(json_ele);
+  if (json_object_object_get_ex(config, "retry_delay_min_ms", &json_ele))
+    s->retry_delay_min_ms = json_object_get_uint64(json_ele);
+  if (json_object_object_get_ex(config, "retry_delay_max_ms", &json_ele))
+    s->retry_delay_max_ms = json_object_get_uint64(json_ele);
+  if (json_object_object_get_ex(config, "gzip", &json_ele))
+    s->gzip = json_object_get_boolean(json_ele);
+  if (s->batch_docs == 0 || s->batch_bytes == 0 || s->max_retries < 0 ||
+      timeout_ms <= 0) {
+    SYSLOG_ERR("batch_docs, batch_bytes and timeout_ms must be positive, "
+               "max_retries can't be negative");
+    goto err_invalid_config;
+  }
+  if (s->retry_delay_min_ms == 0 ||
+      s->retry_delay_max_ms < s->retry_delay_min_ms) {
+    SYSLOG_ERR("retry_delay_min_ms must be positive and no greater than "
+               "retry_delay_max_ms");
+    goto err_invalid_config;
+  }
+
+  if (payload_template_init(&s->tpl, info, "@timestamp") != 0) {
+    SYSLOG_ERR("payload_template_init() failed");
+    goto err_payload_template_init;
+  }
+  const size_t url_size = strlen(url) + strlen(index) + sizeof("//_bulk");
+  if ((s->url = malloc(url_size)) == NULL) {
+    SYSLOG_ERR("malloc() failed");
+    goto err_malloc_url;
+  }
+  snprintf(s->url, url_size, "%s/%s/_bulk", url, index);
+  // windowBits + 16 makes zlib write a gzip rather than a zlib wrapper
+  if (s->gzip && deflateInit2(&s->zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                              15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+    SYSLOG_ERR("deflateInit2() failed");
+    goto err_deflate_init;
+  }
+
+  if (curl_global_init(CURL_GLOBAL_DEFAULT) != CURLE_OK) {
+    SYSLOG_ERR("curl_global_init() failed");
+    goto err_curl_global_init;
+  }
+  if ((s->curl = curl_easy_init()) == NULL) {
+    SYSLOG_ERR("curl_easy_init() failed");
+    goto err_curl_easy_init;
+  }
+  s->headers = curl_slist_append(NULL, "Content-Type: application/x-ndjson");
+  if (s->gzip && s->headers != NULL)
+    s->headers = curl_slist_append(s->headers, "Content-Encoding: gzip");
+  if (s->headers == NULL) {
+    SYSLOG_ERR("curl_slist_append() failed");
+    goto err_curl_slist_append;
+  }
+  curl_easy_setopt(s->curl, CURLOPT_URL, s->url);
+  curl_easy_setopt(s->curl, CURLOPT_POST, 1L);
+  curl_easy_setopt(s->curl, CURLOPT_HTTPHEADER, s->headers);
+  curl_easy_setopt(s->curl, CURLOPT_WRITEFUNCTION, es_on_response);
+  curl_easy_setopt(s->curl, CURLOPT_WRITEDATA, s);
+  curl_easy_setopt(s->curl, CURLOPT_ERRORBUFFER, s->curl_err);
+  curl_easy_setopt(s->curl, CURLOPT_TIMEOUT_MS, timeout_ms);
+  curl_easy_setopt(s->curl, CURLOPT_TCP_KEEPALIVE, 1L);
+  // Timeouts must not raise SIGALRM in a multi-threaded sdp
+  curl_easy_setopt(s->curl, CURLOPT_NOSIGNAL, 1L);
+  if (username != NULL)
+    curl_easy_setopt(s->curl, CURLOPT_USERNAME, username);
+  if (password != NULL)
+    curl_easy_setopt(s->curl, CURLOPT_PASSWORD, password);
+  syslog(LOG_INFO,
+         "Readings are bulk-indexed to %s in batches of up to %zu "
+         "document(s)/%zu byte(s)/%lu ms%s",
+         s->url, s->batch_docs, s->batch_bytes, (unsigned long)s->max_age_ms,
+         s->gzip ? ", gzipped" : "");
+  return s;
+err_curl_slist_append:
+  curl_easy_cleanup(s->curl);
+err_curl_easy_init:
+  curl_global_cleanup();
+err_curl_global_init:
+  if (s->gzip)
+    deflateEnd(&s->zs);
+err_deflate_init:
+  free(s->url);
+err_malloc_url:
+  payload_template_destroy(&s->tpl);
+err_payload_template_init:
+err_invalid_config:
+  free(s);
+err_calloc_sink:
+  return NULL;
+}
+
+static int es_write(void *ctx, const struct ReadingRecord *r) {
+  struct EsSink *s = (struct EsSink *)ctx;
+  // Documents kept from failed requests stop piling up here
+  if (s->doc_count >= s->batch_docs * ES_BACKLOG_BATCHES) {
+    bool *keep = calloc(s->doc_count, sizeof(bool));
+    if (keep == NULL) {
+      SYSLOG_ERR("calloc() failed");
+      return -1;
+    }
+    memset(keep + 1, 1, sizeof(bool) * (s->doc_count - 1));
+    es_compact(s, keep);
+    ++s->dropped;
+    free(keep);
+  }
+  if (grow((void **)&s->body, &s->body_cap,
+           s->body_len + ES_ACTION_LEN + ES_DOC_MAX, 1) != 0 ||
+      grow((void **)&s->docs, &s->doc_cap, s->doc_count + 1,
+           sizeof(struct EsDoc)) != 0) {
+    SYSLOG_ERR("realloc() failed");
+    return -1;
+  }
+  char *doc = s->body + s->body_len;
+  memcpy(doc, ES_ACTION, ES_ACTION_LEN);
+  const int len = payload_render(&s->tpl, r, NULL, doc + ES_ACTION_LEN,
+                                 ES_DOC_MAX - 1);
+  if (len < 0) {
+    SYSLOG_ERR("payload_render() failed");
+    return -1;
+  }
+  doc[ES_ACTION_LEN + len] = '\n';
+  if (s->doc_count == 0)
+    s->oldest_ms = monotonic_ms();
+  s->docs[s->doc_count].offset = s->body_len;
+  s->docs[s->doc_count].len = ES_ACTION_LEN + len + 1;
+  s->docs[s->doc_count].attempts = 0;
+  s->body_len += s->docs[s->doc_count].len;
+  ++s->doc_count;
+
+  const uint64_t now_ms = monotonic_ms();
+  // Backing off: the documents kept are resent once, when the delay is over
+  if (s->retry_at_ms > 0)
+    return now_ms >= s->retry_at_ms ? es_flush(s) : 0;
+  if (s->doc_count >= s->batch_docs || s->body_len >= s->batch_bytes ||
+      now_ms - s->oldest_ms >= s->max_age_ms)
+    return es_flush(s);
+  return 0;
+}
+
+static void es_destroy(void *ctx) {
+  struct EsSink *s = (struct EsSink *)ctx;
+  if (s == NULL)
+    return;
+  es_flush(s);
+  syslog(LOG_INFO,
+         "elasticsearch: %lu request(s), %lu document(s) indexed, %lu "
+         "retried, %lu dropped",
+         (unsigned long)s->requests, (unsigned long)s->indexed,
+         (unsigned long)s->retried, (unsigned long)s->dropped);
+  curl_slist_free_all(s->headers);
+  curl_easy_cleanup(s->curl);
+  curl_global_cleanup();
+  if (s->gzip)
+    deflateEnd(&s->zs);
+  free(s->url);
+  payload_template_destroy(&s->tpl);
+  free(s->body);
+  free(s->docs);
+  free(s->gz);
+  free(s->resp);
+  free(s);
+}
+
+const struct Sink elasticsearch_sink = {.type = "elasticsearch",
+                                        .init = es_init,
+                                        .write = es_write,
+                                        .destroy = es_destroy};
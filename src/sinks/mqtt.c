@@ -0,0 +1,106 @@
+#include "../modules/libs/mqtt.h"
+#include "../payload.h"
+#include "../utils.h"
+#include "sinks.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define MQTT_SINK_PAYLOAD_MAX 4096
+
+/**
+ * @brief Publish every record as one JSON message, rendered through a
+ * payload template, over its own libs/mqtt client. The publish runs on the
+ * sink's thread, so a slow broker holds back neither the collection loop nor
+ * a module driving a display from post_collection().
+ */
+struct MqttSink {
+  struct mosquitto *mosq;
+  struct PayloadTemplate tpl;
+  const char *topic;
+  int qos;
+  bool retain;
+  // Preformatted members appended to every payload, NULL for none
+  const char *extra;
+  char payload[MQTT_SINK_PAYLOAD_MAX];
+};
+
+static void *mqtt_sink_init(const json_object *config,
+                            const struct ModuleInfo *info) {
+  struct MqttSink *s = calloc(1, sizeof(struct MqttSink));
+  if (s == NULL) {
+    SYSLOG_ERR("calloc() failed");
+    goto err_calloc_sink;
+  }
+  json_object *json_ele;
+  const char *timestamp_key = "timestamp";
+  s->qos = 1;
+  s->retain = false;
+  if (json_object_object_get_ex(config, "topic", &json_ele))
+    s->topic = json_object_get_string(json_ele);
+  if (json_object_object_get_ex(config, "qos", &json_ele))
+    s->qos = json_object_get_int(json_ele);
+  if (json_object_object_get_ex(config, "retain", &json_ele))
+    s->retain = json_object_get_boolean(json_ele);
+  if (json_object_object_get_ex(config, "timestamp_key", &json_ele))
+    timestamp_key = json_object_get_string(json_ele);
+  if (json_object_object_get_ex(config, "extra", &json_ele))
+    s->extra = json_object_get_string(json_ele);
+  if (s->topic == NULL || s->qos < 0 || s->qos > 2) {
+    SYSLOG_ERR("topic must be defined and qos must be 0, 1 or 2");
+    goto err_invalid_config;
+  }
+
+  if (payload_template_init(&s->tpl, info, timestamp_key) != 0) {
+    SYSLOG_ERR("payload_template_init() failed");
+    goto err_payload_template_init;
+  }
+  // The connection options sit next to "type", e.g., {"type": "mqtt",
+  // "host": ..., "topic": ...}
+  s->mosq = init_mosquitto_from_json(config, "");
+  if (s->mosq == NULL) {
+    SYSLOG_ERR("init_mosquitto_from_json() failed");
+    goto err_init_mosquitto;
+  }
+  syslog(LOG_INFO, "Readings are published to MQTT topic %s (qos: %d)",
+         s->topic, s->qos);
+  return s;
+err_init_mosquitto:
+  payload_template_destroy(&s->tpl);
+err_payload_template_init:
+err_invalid_config:
+  free(s);
+err_calloc_sink:
+  return NULL;
+}
+
+static int mqtt_sink_write(void *ctx, const struct ReadingRecord *r) {
+  struct MqttSink *s = (struct MqttSink *)ctx;
+  const int len =
+      payload_render(&s->tpl, r, s->extra, s->payload, sizeof(s->payload));
+  if (len < 0) {
+    SYSLOG_ERR("payload_render() failed");
+    return -1;
+  }
+  const int rc =
+      mqtt_publish(s->mosq, s->topic, s->payload, len, s->qos, s->retain);
+  if (rc != MOSQ_ERR_SUCCESS) {
+    SYSLOG_ERR("Error publishing to %s: %s", s->topic, mosquitto_strerror(rc));
+    return -1;
+  }
+  return 0;
+}
+
+static void mqtt_sink_destroy(void *ctx) {
+  struct MqttSink *s = (struct MqttSink *)ctx;
+  if (s == NULL)
+    return;
+  mqtt_destroy(s->mosq);
+  payload_template_destroy(&s->tpl);
+  free(s);
+}
+
+const struct Sink mqtt_sink = {.type = "mqtt",
+                               .init = mqtt_sink_init,
+                               .write = mqtt_sink_write,
+                               .destroy = mqtt_sink_destroy};
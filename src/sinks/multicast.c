@@ -0,0 +1,185 @@
+#include "../mcast.h"
+#include "../shm_layout.h"
+#include "../utils.h"
+#include "sinks.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define MCAST_DEFAULT_GROUP "239.255.83.68"
+#define MCAST_DEFAULT_PORT 5683
+#define MCAST_DEFAULT_TTL 1
+
+/**
+ * @brief Send every record as one authenticated UDP datagram to an IPv4
+ * multicast group, so that consumers on the LAN get it without a broker
+ * round trip. Delivery is best-effort: receivers detect gaps through seq and
+ * fall back on MQTT for anything lost. See mcast.h for the wire format.
+ */
+struct MulticastSink {
+  int fd;
+  struct sockaddr_in group;
+  uint8_t *key;
+  size_t key_len;
+  size_t metric_count;
+  // Metric id -> sdp_fnv1a32() of its name
+  uint32_t name_hashes[SDP_READINGS_MAX];
+  struct McastDatagram datagram;
+  uint8_t buf[MCAST_DATAGRAM_MAX];
+  uint64_t dropped;
+};
+
+static void *multicast_init(const json_object *config,
+                            const struct ModuleInfo *info) {
+  struct MulticastSink *s = calloc(1, sizeof(struct MulticastSink));
+  if (s == NULL) {
+    SYSLOG_ERR("calloc() failed");
+    goto err_calloc_sink;
+  }
+  json_object *json_ele;
+  const char *group = MCAST_DEFAULT_GROUP;
+  const char *interface = NULL;
+  const char *key = NULL;
+  int port = MCAST_DEFAULT_PORT;
+  int ttl = MCAST_DEFAULT_TTL;
+  int loopback = 1;
+  if (json_object_object_get_ex(config, "group", &json_ele))
+    group = json_object_get_string(json_ele);
+  if (json_object_object_get_ex(config, "port", &json_ele))
+    port = json_object_get_int(json_ele);
+  if (json_object_object_get_ex(config, "interface", &json_ele))
+    interface = json_object_get_string(json_ele);
+  if (json_object_object_get_ex(config, "ttl", &json_ele))
+    ttl = json_object_get_int(json_ele);
+  if (json_object_object_get_ex(config, "loopback", &json_ele))
+    loopback = json_object_get_boolean(json_ele);
+  if (json_object_object_get_ex(config, "key", &json_ele))
+    key = json_object_get_string(json_ele);
+
+  s->group.sin_family = AF_INET;
+  s->group.sin_port = htons(port);
+  if (inet_pton(AF_INET, group, &s->group.sin_addr) != 1 ||
+      !IN_MULTICAST(ntohl(s->group.sin_addr.s_addr)) || port <= 0 ||
+      port > 65535) {
+    SYSLOG_ERR("[%s:%d] is not an IPv4 multicast group and port", group,
+               port);
+    goto err_invalid_config;
+  }
+  if (key == NULL || strlen(key) < MCAST_KEY_MIN) {
+    SYSLOG_ERR("key must be at least %d characters long", MCAST_KEY_MIN);
+    goto err_invalid_config;
+  }
+  if (info->metric_count > SDP_READINGS_MAX) {
+    SYSLOG_ERR("At most %d metrics fit in a datagram, %s has %zu",
+               SDP_READINGS_MAX, info->name, info->metric_count);
+    goto err_invalid_config;
+  }
+  if ((s->key = (uint8_t *)strdup(key)) == NULL) {
+    SYSLOG_ERR("strdup() failed");
+    goto err_strdup_key;
+  }
+  s->key_len = strlen(key);
+  s->metric_count = info->metric_count;
+  for (size_t i = 0; i < info->metric_count; ++i)
+    s->name_hashes[i] = sdp_fnv1a32(info->metrics[i].name);
+  if (getrandom(&s->datagram.sender_id, sizeof(s->datagram.sender_id), 0) !=
+      sizeof(s->datagram.sender_id)) {
+    SYSLOG_ERR("getrandom() failed: %d(%s)", errno, strerror(errno));
+    goto err_getrandom;
+  }
+
+  if ((s->fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0) {
+    SYSLOG_ERR("socket() failed: %d(%s)", errno, strerror(errno));
+    goto err_socket;
+  }
+  const unsigned char ttl_byte = ttl;
+  const unsigned char loopback_byte = loopback;
+  if (setsockopt(s->fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl_byte,
+                 sizeof(ttl_byte)) != 0 ||
+      setsockopt(s->fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loopback_byte,
+                 sizeof(loopback_byte)) != 0) {
+    SYSLOG_ERR("setsockopt() failed: %d(%s)", errno, strerror(errno));
+    goto err_setsockopt;
+  }
+  if (interface != NULL) {
+    struct in_addr if_addr;
+    if (inet_pton(AF_INET, interface, &if_addr) != 1) {
+      SYSLOG_ERR("interface must be an IPv4 address, not [%s]", interface);
+      goto err_setsockopt;
+    }
+    if (setsockopt(s->fd, IPPROTO_IP, IP_MULTICAST_IF, &if_addr,
+                   sizeof(if_addr)) != 0) {
+      SYSLOG_ERR("setsockopt(IP_MULTICAST_IF) failed: %d(%s)", errno,
+                 strerror(errno));
+      goto err_setsockopt;
+    }
+  }
+  syslog(LOG_INFO, "Readings are multicast to %s:%d (sender_id: %08x)",
+         group, port, s->datagram.sender_id);
+  return s;
+err_setsockopt:
+  close(s->fd);
+err_socket:
+err_getrandom:
+  free(s->key);
+err_strdup_key:
+err_invalid_config:
+  free(s);
+err_calloc_sink:
+  return NULL;
+}
+
+static int multicast_write(void *ctx, const struct ReadingRecord *r) {
+  struct MulticastSink *s = (struct MulticastSink *)ctx;
+  struct McastDatagram *d = &s->datagram;
+  ++d->seq;
+  size_t count = 0;
+  for (size_t i = 0; i < r->count; ++i) {
+    if (r->metric_ids[i] >= s->metric_count)
+      continue;
+    d->readings[count].name_hash = s->name_hashes[r->metric_ids[i]];
+    d->readings[count].quality = r->qualities[i];
+    d->readings[count].value = r->values[i];
+    d->readings[count].timestamp_ms = r->timestamps_ms[i];
+    ++count;
+  }
+  d->count = count;
+  const size_t len = mcast_encode(d, s->key, s->key_len, s->buf);
+  if (len == 0) {
+    SYSLOG_ERR("mcast_encode() failed");
+    return -1;
+  }
+  // Never blocks the collection loop; a datagram the kernel can't take now
+  // is as lost as one dropped on the wire, and counted as such by receivers
+  if (sendto(s->fd, s->buf, len, MSG_DONTWAIT, (struct sockaddr *)&s->group,
+             sizeof(s->group)) < 0) {
+    ++s->dropped;
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      SYSLOG_ERR("sendto() failed: %d(%s)", errno, strerror(errno));
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static void multicast_destroy(void *ctx) {
+  struct MulticastSink *s = (struct MulticastSink *)ctx;
+  if (s == NULL)
+    return;
+  syslog(LOG_INFO, "multicast: %lu datagram(s) sent, %lu dropped",
+         (unsigned long)s->datagram.seq, (unsigned long)s->dropped);
+  close(s->fd);
+  free(s->key);
+  free(s);
+}
+
+const struct Sink multicast_sink = {.type = "multicast",
+                                    .init = multicast_init,
+                                    .write = multicast_write,
+                                    .destroy = multicast_destroy};
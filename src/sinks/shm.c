@@ -0,0 +1,141 @@
+#include "../shm_layout.h"
+#include "../utils.h"
+#include "sinks.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/**
+ * @brief Publish the latest record to a POSIX shared memory object, so that
+ * consumers on the same host read it in microseconds and without a broker.
+ * See struct ShmSegment for the protocol.
+ */
+struct ShmSink {
+  char name[NAME_MAX];
+  int fd;
+  struct ShmSegment *seg;
+};
+
+static void shm_seq_begin(struct ShmSegment *seg) {
+  uint32_t seq = __atomic_load_n(&seg->seq, __ATOMIC_RELAXED);
+  // An odd value left by a writer that crashed mid-update is reused
+  __atomic_store_n(&seg->seq, seq | 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void shm_seq_end(struct ShmSegment *seg) {
+  uint32_t seq = __atomic_load_n(&seg->seq, __ATOMIC_RELAXED);
+  __atomic_store_n(&seg->seq, seq + 1, __ATOMIC_RELEASE);
+  // One syscall per record, cheap next to a collection() and it saves
+  // readers from tracking waiters in memory they may only read
+  syscall(SYS_futex, &seg->seq, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+static void *shm_init(const json_object *config,
+                      const struct ModuleInfo *info) {
+  struct ShmSink *s = malloc(sizeof(struct ShmSink));
+  if (s == NULL) {
+    SYSLOG_ERR("malloc() failed");
+    goto err_malloc_sink;
+  }
+  json_object *json_ele;
+  if (json_object_object_get_ex(config, "name", &json_ele))
+    snprintf(s->name, sizeof(s->name), "%s", json_object_get_string(json_ele));
+  else
+    snprintf(s->name, sizeof(s->name), "/sdp-%s", info->name);
+  if (s->name[0] != '/' || strchr(s->name + 1, '/') != NULL) {
+    SYSLOG_ERR("name must be of the form /somename, not [%s]", s->name);
+    goto err_invalid_config;
+  }
+  if (info->metric_count > SDP_READINGS_MAX) {
+    SYSLOG_ERR("At most %d metrics fit in a shm segment, %s has %zu",
+               SDP_READINGS_MAX, info->name, info->metric_count);
+    goto err_invalid_config;
+  }
+
+  // The object outlives sdp on purpose: readers keep their mapping across
+  // restarts and simply see the next record
+  if ((s->fd = shm_open(s->name, O_CREAT | O_RDWR | O_CLOEXEC, 0644)) < 0) {
+    SYSLOG_ERR("shm_open(%s) failed: %d(%s)", s->name, errno,
+               strerror(errno));
+    goto err_shm_open;
+  }
+  if (ftruncate(s->fd, sizeof(struct ShmSegment)) != 0) {
+    SYSLOG_ERR("ftruncate(%s) failed: %d(%s)", s->name, errno,
+               strerror(errno));
+    goto err_ftruncate;
+  }
+  s->seg = mmap(NULL, sizeof(struct ShmSegment), PROT_READ | PROT_WRITE,
+                MAP_SHARED, s->fd, 0);
+  if (s->seg == MAP_FAILED) {
+    SYSLOG_ERR("mmap(%s) failed: %d(%s)", s->name, errno, strerror(errno));
+    goto err_mmap;
+  }
+
+  // The header is rewritten under the seqlock as well, another module may
+  // have used this name before
+  shm_seq_begin(s->seg);
+  s->seg->magic = SDP_SHM_MAGIC;
+  s->seg->version = SDP_SHM_VERSION;
+  s->seg->metric_count = info->metric_count;
+  memset(s->seg->metrics, 0, sizeof(s->seg->metrics));
+  for (size_t i = 0; i < info->metric_count; ++i) {
+    struct ShmMetric *m = &s->seg->metrics[i];
+    snprintf(m->name, sizeof(m->name), "%s", info->metrics[i].name);
+    snprintf(m->unit, sizeof(m->unit), "%s", info->metrics[i].unit);
+    m->decimals = info->metrics[i].decimals;
+    m->name_hash = sdp_fnv1a32(m->name);
+  }
+  readings_reset(&s->seg->record);
+  shm_seq_end(s->seg);
+  syslog(LOG_INFO, "Latest readings are published to shm object %s",
+         s->name);
+  return s;
+err_mmap:
+err_ftruncate:
+  close(s->fd);
+err_shm_open:
+err_invalid_config:
+  free(s);
+err_malloc_sink:
+  return NULL;
+}
+
+static int shm_write(void *ctx, const struct ReadingRecord *r) {
+  struct ShmSink *s = (struct ShmSink *)ctx;
+  shm_seq_begin(s->seg);
+  // Only the used part of each column, the rest keeps stale data that
+  // readers ignore because of count
+  s->seg->record.count = r->count;
+  memcpy(s->seg->record.metric_ids, r->metric_ids,
+         sizeof(r->metric_ids[0]) * r->count);
+  memcpy(s->seg->record.qualities, r->qualities,
+         sizeof(r->qualities[0]) * r->count);
+  memcpy(s->seg->record.values, r->values, sizeof(r->values[0]) * r->count);
+  memcpy(s->seg->record.timestamps_ms, r->timestamps_ms,
+         sizeof(r->timestamps_ms[0]) * r->count);
+  shm_seq_end(s->seg);
+  return 0;
+}
+
+static void shm_destroy(void *ctx) {
+  struct ShmSink *s = (struct ShmSink *)ctx;
+  if (s == NULL)
+    return;
+  munmap(s->seg, sizeof(struct ShmSegment));
+  close(s->fd);
+  free(s);
+}
+
+const struct Sink shm_sink = {.type = "shm",
+                              .init = shm_init,
+                              .write = shm_write,
+                              .destroy = shm_destroy};
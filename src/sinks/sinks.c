@@ -0,0 +1,306 @@
+#include "sinks.h"
+#include "../latency.h"
+#include "../utils.h"
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define MAX_SINKS 8
+#define SINK_DEFAULT_QUEUE_SIZE 32
+#define SINK_DEFAULT_METRICS_INTERVAL_SEC 300
+
+extern const struct Sink stats_sink;
+extern const struct Sink shm_sink;
+extern const struct Sink multicast_sink;
+extern const struct Sink elasticsearch_sink;
+extern const struct Sink archive_sink;
+extern const struct Sink mqtt_sink;
+
+static const struct Sink *const available_sinks[] = {
+    &stats_sink, &shm_sink, &multicast_sink, &elasticsearch_sink,
+    &archive_sink, &mqtt_sink};
+
+enum SinkOverflow {
+  // A full queue makes room by discarding its oldest record
+  SINK_DROP_OLDEST,
+  // A full queue refuses the new record
+  SINK_DROP_NEWEST,
+};
+
+struct SinkQueueItem {
+  struct ReadingRecord r;
+  // CLOCK_MONOTONIC
+  uint64_t enqueued_us;
+};
+
+/**
+ * @brief Every sink consumes its own bounded queue on its own thread, so a
+ * slow or failing sink neither delays the collection loop nor the other
+ * sinks; when it can't keep up, only its queue overflows.
+ */
+struct SinkInstance {
+  const struct Sink *sink;
+  void *ctx;
+  size_t idx;
+  pthread_t thread;
+
+  // Guards the queue, stop and overflowed
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  struct SinkQueueItem *queue;
+  size_t capacity;
+  size_t head;
+  size_t count;
+  bool stop;
+  enum SinkOverflow overflow;
+  uint64_t overflowed;
+
+  // Only touched by the sink's thread (and by sinks_destroy() once joined)
+  uint64_t written;
+  uint64_t failed;
+  uint64_t consecutive_failures;
+  uint64_t metrics_interval_sec;
+  time_t window_start;
+  // Time from sinks_write() until the sink's write() returned, i.e.,
+  // queueing included, over one metrics window
+  struct LatencyHistogram latency;
+};
+
+static struct SinkInstance sinks[MAX_SINKS];
+static size_t sink_count = 0;
+
+static uint64_t monotonic_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static const struct Sink *find_sink(const char *type) {
+  for (size_t i = 0; i < sizeof(available_sinks) / sizeof(available_sinks[0]);
+       ++i)
+    if (strcmp(available_sinks[i]->type, type) == 0)
+      return available_sinks[i];
+  return NULL;
+}
+
+static void sink_log_metrics(struct SinkInstance *s) {
+  pthread_mutex_lock(&s->mutex);
+  const size_t queued = s->count;
+  const uint64_t overflowed = s->overflowed;
+  pthread_mutex_unlock(&s->mutex);
+  const struct LatencyHistogram *l = &s->latency;
+  if (l->count == 0)
+    syslog(LOG_INFO,
+           "sinks[%zu] (%s): written=%lu, failed=%lu, dropped=%lu, "
+           "queued=%zu/%zu",
+           s->idx, s->sink->type, (unsigned long)s->written,
+           (unsigned long)s->failed, (unsigned long)overflowed, queued,
+           s->capacity);
+  else
+    syslog(LOG_INFO,
+           "sinks[%zu] (%s): written=%lu, failed=%lu, dropped=%lu, "
+           "queued=%zu/%zu, latency over the last %lu record(s): "
+           "mean=%luus, p50<=%luus, p99<=%luus, max=%luus",
+           s->idx, s->sink->type, (unsigned long)s->written,
+           (unsigned long)s->failed, (unsigned long)overflowed, queued,
+           s->capacity, (unsigned long)l->count,
+           (unsigned long)(l->sum_us / l->count),
+           (unsigned long)latency_quantile(l, 0.5),
+           (unsigned long)latency_quantile(l, 0.99),
+           (unsigned long)l->max_us);
+  memset(&s->latency, 0, sizeof(s->latency));
+  s->window_start = time(NULL);
+}
+
+static void sink_consume(struct SinkInstance *s,
+                         const struct SinkQueueItem *item) {
+  const int rc = s->sink->write(s->ctx, &item->r);
+  latency_add(&s->latency, monotonic_us() - item->enqueued_us);
+  if (rc == 0) {
+    ++s->written;
+    if (s->consecutive_failures > 0)
+      syslog(LOG_INFO, "sinks[%zu] (%s) recovered after %lu failed write(s)",
+             s->idx, s->sink->type, (unsigned long)s->consecutive_failures);
+    s->consecutive_failures = 0;
+  } else {
+    ++s->failed;
+    // Only the first failure of a streak is logged, a sink whose backend is
+    // down would otherwise flood syslog on every record
+    if (s->consecutive_failures++ == 0)
+      syslog(LOG_WARNING, "sinks[%zu] (%s) failed to write a record (rc: %d)",
+             s->idx, s->sink->type, rc);
+  }
+  if (s->metrics_interval_sec > 0 &&
+      (uint64_t)(time(NULL) - s->window_start) >= s->metrics_interval_sec)
+    sink_log_metrics(s);
+}
+
+static void *sink_thread(void *arg) {
+  struct SinkInstance *s = (struct SinkInstance *)arg;
+  struct SinkQueueItem item;
+  pthread_mutex_lock(&s->mutex);
+  while (true) {
+    while (s->count == 0 && !s->stop)
+      pthread_cond_wait(&s->cond, &s->mutex);
+    // Records still queued at stop are written before the thread exits
+    if (s->count == 0)
+      break;
+    item = s->queue[s->head];
+    s->head = (s->head + 1) % s->capacity;
+    --s->count;
+    pthread_mutex_unlock(&s->mutex);
+    sink_consume(s, &item);
+    pthread_mutex_lock(&s->mutex);
+  }
+  pthread_mutex_unlock(&s->mutex);
+  return NULL;
+}
+
+static int sink_start(struct SinkInstance *s, const json_object *config) {
+  json_object *json_ele;
+  s->capacity = SINK_DEFAULT_QUEUE_SIZE;
+  s->overflow = SINK_DROP_OLDEST;
+  s->metrics_interval_sec = SINK_DEFAULT_METRICS_INTERVAL_SEC;
+  if (json_object_object_get_ex(config, "queue_size", &json_ele))
+    s->capacity = json_object_get_uint64(json_ele);
+  if (json_object_object_get_ex(config, "metrics_interval_sec", &json_ele))
+    s->metrics_interval_sec = json_object_get_uint64(json_ele);
+  if (json_object_object_get_ex(config, "overflow", &json_ele)) {
+    const char *overflow = json_object_get_string(json_ele);
+    if (strcmp(overflow, "drop_newest") == 0) {
+      s->overflow = SINK_DROP_NEWEST;
+    } else if (strcmp(overflow, "drop_oldest") != 0) {
+      SYSLOG_ERR("overflow must be drop_oldest or drop_newest, not [%s]",
+                 overflow);
+      return -1;
+    }
+  }
+  if (s->capacity == 0) {
+    SYSLOG_ERR("queue_size must be positive");
+    return -1;
+  }
+  if ((s->queue = malloc(sizeof(struct SinkQueueItem) * s->capacity)) ==
+      NULL) {
+    SYSLOG_ERR("malloc() failed");
+    return -1;
+  }
+  pthread_mutex_init(&s->mutex, NULL);
+  pthread_cond_init(&s->cond, NULL);
+  s->head = s->count = 0;
+  s->stop = false;
+  s->window_start = time(NULL);
+
+  // Signals are left to the threads that wait for them
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  const int rc = pthread_create(&s->thread, NULL, sink_thread, s);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  if (rc != 0) {
+    SYSLOG_ERR("pthread_create() failed: %d(%s)", rc, strerror(rc));
+    pthread_cond_destroy(&s->cond);
+    pthread_mutex_destroy(&s->mutex);
+    free(s->queue);
+    return -1;
+  }
+  return 0;
+}
+
+int sinks_init(const json_object *config_root, const struct ModuleInfo *info) {
+  json_object *root_sinks;
+  if (!json_object_object_get_ex(config_root, "sinks", &root_sinks))
+    return 0;
+  if (!json_object_is_type(root_sinks, json_type_array)) {
+    SYSLOG_ERR("sinks must be an array");
+    return -1;
+  }
+  size_t len = json_object_array_length(root_sinks);
+  if (len > MAX_SINKS) {
+    SYSLOG_ERR("At most %d sinks are supported, %zu configured", MAX_SINKS,
+               len);
+    return -2;
+  }
+  for (size_t i = 0; i < len; ++i) {
+    json_object *root_sink = json_object_array_get_idx(root_sinks, i);
+    json_object *json_ele;
+    const char *type = NULL;
+    if (json_object_object_get_ex(root_sink, "type", &json_ele))
+      type = json_object_get_string(json_ele);
+    if (type == NULL) {
+      SYSLOG_ERR("sinks[%zu] has no type", i);
+      goto err_sink_init;
+    }
+    const struct Sink *sink = find_sink(type);
+    if (sink == NULL) {
+      SYSLOG_ERR("sinks[%zu] has an unknown type [%s]", i, type);
+      goto err_sink_init;
+    }
+    void *ctx = sink->init(root_sink, info);
+    if (ctx == NULL) {
+      SYSLOG_ERR("Failed to initialize sinks[%zu] (%s)", i, type);
+      goto err_sink_init;
+    }
+    struct SinkInstance *s = &sinks[sink_count];
+    memset(s, 0, sizeof(struct SinkInstance));
+    s->sink = sink;
+    s->ctx = ctx;
+    s->idx = i;
+    if (sink_start(s, root_sink) != 0) {
+      SYSLOG_ERR("Failed to start sinks[%zu] (%s)", i, type);
+      sink->destroy(ctx);
+      goto err_sink_init;
+    }
+    ++sink_count;
+    syslog(LOG_INFO, "sinks[%zu] (%s) initialized, queue_size: %zu", i, type,
+           s->capacity);
+  }
+  return 0;
+err_sink_init:
+  sinks_destroy();
+  return -3;
+}
+
+void sinks_write(const struct ReadingRecord *r) {
+  const uint64_t now_us = monotonic_us();
+  for (size_t i = 0; i < sink_count; ++i) {
+    struct SinkInstance *s = &sinks[i];
+    pthread_mutex_lock(&s->mutex);
+    if (s->count == s->capacity) {
+      ++s->overflowed;
+      if (s->overflow == SINK_DROP_NEWEST) {
+        pthread_mutex_unlock(&s->mutex);
+        continue;
+      }
+      s->head = (s->head + 1) % s->capacity;
+      --s->count;
+    }
+    struct SinkQueueItem *item =
+        &s->queue[(s->head + s->count) % s->capacity];
+    item->r = *r;
+    item->enqueued_us = now_us;
+    ++s->count;
+    pthread_cond_signal(&s->cond);
+    pthread_mutex_unlock(&s->mutex);
+  }
+}
+
+void sinks_destroy() {
+  while (sink_count > 0) {
+    struct SinkInstance *s = &sinks[--sink_count];
+    pthread_mutex_lock(&s->mutex);
+    s->stop = true;
+    pthread_cond_signal(&s->cond);
+    pthread_mutex_unlock(&s->mutex);
+    pthread_join(s->thread, NULL);
+    sink_log_metrics(s);
+    s->sink->destroy(s->ctx);
+    pthread_cond_destroy(&s->cond);
+    pthread_mutex_destroy(&s->mutex);
+    free(s->queue);
+  }
+}
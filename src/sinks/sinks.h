@@ -0,0 +1,49 @@
+#ifndef SINKS_H
+#define SINKS_H
+
+#include "../modules/readings.h"
+
+#include <json-c/json.h>
+
+/**
+ * @brief A module-agnostic consumer of ReadingRecords, fed by the framework
+ * after every successful collection(). init() and destroy() are called by the
+ * main thread, write() by a thread dedicated to the instance, so an instance
+ * needs no locking of its own.
+ */
+struct Sink {
+  // Value of "type" in the "sinks" config array that selects this sink
+  const char *type;
+  /**
+   * @param config The element of the "sinks" array that configures this
+   * instance
+   * @return NULL on failure or a valid context object pointer
+   */
+  void *(*init)(const json_object *config, const struct ModuleInfo *info);
+  /**
+   * @return 0 on success, any other value is logged and otherwise ignored
+   */
+  int (*write)(void *ctx, const struct ReadingRecord *r);
+  void (*destroy)(void *ctx);
+};
+
+/**
+ * @brief Initialize every sink listed in the optional "sinks" array of the
+ * config root.
+ * @return 0 on success, negative number if any listed sink can't be
+ * initialized (in which case none is left initialized)
+ */
+int sinks_init(const json_object *config_root, const struct ModuleInfo *info);
+
+/**
+ * @brief Queue a copy of r for every sink. Never blocks on a sink: a sink
+ * whose queue is full drops a record as configured by its "overflow".
+ */
+void sinks_write(const struct ReadingRecord *r);
+
+/**
+ * @brief Let every sink drain its queue, then stop and destroy it.
+ */
+void sinks_destroy();
+
+#endif // SINKS_H
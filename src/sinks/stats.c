@@ -0,0 +1,124 @@
+#include "../utils.h"
+#include "sinks.h"
+
+#include <float.h>
+#include <stdlib.h>
+#include <time.h>
+
+struct MetricStats {
+  uint64_t count;
+  uint64_t bad_count;
+  double sum;
+  double min;
+  double max;
+};
+
+/**
+ * @brief Aggregate every metric over a window and log count/mean/min/max
+ * when the window closes. Works on any module as it only relies on
+ * ModuleInfo.
+ */
+struct StatsSink {
+  const struct ModuleInfo *info;
+  uint64_t interval_sec;
+  time_t window_start;
+  // One per metric, indexed by metric id
+  struct MetricStats *stats;
+};
+
+static void stats_reset(struct StatsSink *s) {
+  for (size_t i = 0; i < s->info->metric_count; ++i) {
+    s->stats[i].count = 0;
+    s->stats[i].bad_count = 0;
+    s->stats[i].sum = 0;
+    s->stats[i].min = DBL_MAX;
+    s->stats[i].max = -DBL_MAX;
+  }
+  s->window_start = time(NULL);
+}
+
+static void stats_flush(struct StatsSink *s) {
+  for (size_t i = 0; i < s->info->metric_count; ++i) {
+    const struct MetricStats *m = &s->stats[i];
+    if (m->count == 0 && m->bad_count == 0)
+      continue;
+    const int d = s->info->metrics[i].decimals;
+    if (m->count == 0)
+      syslog(LOG_INFO, "[stats] %s: n=0, bad=%lu", s->info->metrics[i].name,
+             (unsigned long)m->bad_count);
+    else
+      syslog(LOG_INFO, "[stats] %s: n=%lu, bad=%lu, mean=%.*f, min=%.*f, "
+             "max=%.*f %s",
+             s->info->metrics[i].name, (unsigned long)m->count,
+             (unsigned long)m->bad_count, d, m->sum / m->count, d, m->min, d,
+             m->max, s->info->metrics[i].unit);
+  }
+  stats_reset(s);
+}
+
+static void *stats_init(const json_object *config,
+                        const struct ModuleInfo *info) {
+  struct StatsSink *s = malloc(sizeof(struct StatsSink));
+  if (s == NULL) {
+    SYSLOG_ERR("malloc() failed");
+    goto err_malloc_sink;
+  }
+  s->info = info;
+  s->interval_sec = 60;
+  json_object *json_ele;
+  if (json_object_object_get_ex(config, "interval_sec", &json_ele))
+    s->interval_sec = json_object_get_uint64(json_ele);
+  if (s->interval_sec == 0) {
+    SYSLOG_ERR("interval_sec must be positive");
+    goto err_invalid_config;
+  }
+  s->stats = malloc(sizeof(struct MetricStats) * info->metric_count);
+  if (s->stats == NULL) {
+    SYSLOG_ERR("malloc() failed");
+    goto err_malloc_stats;
+  }
+  stats_reset(s);
+  return s;
+err_malloc_stats:
+err_invalid_config:
+  free(s);
+err_malloc_sink:
+  return NULL;
+}
+
+static int stats_write(void *ctx, const struct ReadingRecord *r) {
+  struct StatsSink *s = (struct StatsSink *)ctx;
+  for (size_t i = 0; i < r->count; ++i) {
+    if (r->metric_ids[i] >= s->info->metric_count)
+      continue;
+    struct MetricStats *m = &s->stats[r->metric_ids[i]];
+    if (r->qualities[i] == READING_BAD) {
+      ++m->bad_count;
+      continue;
+    }
+    const double v = r->values[i];
+    ++m->count;
+    m->sum += v;
+    if (v < m->min)
+      m->min = v;
+    if (v > m->max)
+      m->max = v;
+  }
+  if ((uint64_t)(time(NULL) - s->window_start) >= s->interval_sec)
+    stats_flush(s);
+  return 0;
+}
+
+static void stats_destroy(void *ctx) {
+  struct StatsSink *s = (struct StatsSink *)ctx;
+  if (s == NULL)
+    return;
+  stats_flush(s);
+  free(s->stats);
+  free(s);
+}
+
+const struct Sink stats_sink = {.type = "stats",
+                                .init = stats_init,
+                                .write = stats_write,
+                                .destroy = stats_destroy};
@@ -0,0 +1,99 @@
+#include "../gorilla.h"
+#include "../payload.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Size and encode time of a batch as the JSON array ch publishes by default
+// versus gorilla_encode(). Not run by ctest, its numbers are only meaningful
+// on the target hardware.
+
+#define BENCH_ROWS 256
+#define BENCH_ITERATIONS 2000
+
+static const struct MetricDesc metrics[] = {
+    {.name = "temp_celsius", .unit = "°C", .decimals = 1},
+    {.name = "humidity_pct", .unit = "%", .decimals = 0},
+    {.name = "pressure_hpa", .unit = "hPa", .decimals = 2}};
+
+static const struct ModuleInfo info = {.abi_version = SDP_MODULE_ABI_VERSION,
+                                       .name = "bench",
+                                       .metric_count = 3,
+                                       .metrics = metrics};
+
+static struct ReadingRecord records[BENCH_ROWS];
+static struct GorillaBatch batch;
+static char json[BENCH_ROWS * 128];
+static uint8_t encoded[1 << 16];
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 * 1000 * 1000 + ts.tv_nsec;
+}
+
+// Same framing as ch's stream_topic: "[" + samples joined by "," + "]"
+static size_t render_json(const struct PayloadTemplate *tpl) {
+  size_t len = 0;
+  for (size_t i = 0; i < BENCH_ROWS; ++i) {
+    json[len++] = i == 0 ? '[' : ',';
+    const int n = payload_render(tpl, &records[i], NULL, json + len,
+                                 sizeof(json) - len - 1);
+    if (n < 0)
+      return 0;
+    len += n;
+  }
+  json[len++] = ']';
+  return len;
+}
+
+static size_t encode_gorilla() {
+  gorilla_batch_init(&batch, &info);
+  for (size_t i = 0; i < BENCH_ROWS; ++i)
+    gorilla_batch_append(&batch, &info, &records[i]);
+  return gorilla_encode(&batch, encoded, sizeof(encoded));
+}
+
+int main() {
+  struct PayloadTemplate tpl;
+  if (payload_template_init(&tpl, &info, "timestamp") != 0) {
+    fprintf(stderr, "payload_template_init() failed\n");
+    return EXIT_FAILURE;
+  }
+  // A minute-resolution day of slowly changing indoor readings
+  for (size_t i = 0; i < BENCH_ROWS; ++i) {
+    const int64_t ts_ms = 1700000000000 + (int64_t)i * 60000;
+    readings_reset(&records[i]);
+    readings_add(&records[i], 0, 22 + 1.5 * sin(i / 40.0), ts_ms,
+                 READING_GOOD);
+    readings_add(&records[i], 1, 55 + 5 * cos(i / 60.0), ts_ms,
+                 READING_GOOD);
+    readings_add(&records[i], 2, 1013 + 0.02 * (i % 17), ts_ms,
+                 READING_GOOD);
+  }
+
+  size_t json_len = 0, gorilla_len = 0;
+  uint64_t started_ns = now_ns();
+  for (int i = 0; i < BENCH_ITERATIONS; ++i)
+    json_len = render_json(&tpl);
+  const uint64_t json_ns = (now_ns() - started_ns) / BENCH_ITERATIONS;
+  started_ns = now_ns();
+  for (int i = 0; i < BENCH_ITERATIONS; ++i)
+    gorilla_len = encode_gorilla();
+  const uint64_t gorilla_ns = (now_ns() - started_ns) / BENCH_ITERATIONS;
+  payload_template_destroy(&tpl);
+  if (json_len == 0 || gorilla_len == 0) {
+    fprintf(stderr, "Encoding failed\n");
+    return EXIT_FAILURE;
+  }
+
+  printf("%d rows of %zu metrics\n", BENCH_ROWS, info.metric_count);
+  printf("json:    %6zu bytes, %8.1f us per batch\n", json_len,
+         json_ns / 1000.0);
+  printf("gorilla: %6zu bytes, %8.1f us per batch (%.1fx smaller)\n",
+         gorilla_len, gorilla_ns / 1000.0, (double)json_len / gorilla_len);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,128 @@
+#include "../gorilla.h"
+#include "../shm_layout.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Round trips of GorillaBatch through gorilla_encode()/gorilla_decode(),
+// run by ctest
+
+#define CHECK(cond)                                                            \
+  do {                                                                         \
+    if (!(cond)) {                                                             \
+      fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+      return 1;                                                                \
+    }                                                                          \
+  } while (0)
+
+static const struct MetricDesc metrics[] = {
+    {.name = "temp_celsius", .unit = "°C", .decimals = 1},
+    {.name = "humidity_pct", .unit = "%", .decimals = 0},
+    {.name = "pressure_hpa", .unit = "hPa", .decimals = 2}};
+
+static const struct ModuleInfo info = {.abi_version = SDP_MODULE_ABI_VERSION,
+                                       .name = "test",
+                                       .metric_count = 3,
+                                       .metrics = metrics};
+
+static struct GorillaBatch in, out;
+static uint8_t buf[1 << 20];
+
+// Cells are compared bit by bit, so NaNs of missing cells compare equal
+static int check_round_trip(const struct GorillaBatch *b) {
+  const size_t max = gorilla_encoded_max(b->columns, b->rows);
+  CHECK(max <= sizeof(buf));
+  const size_t len = gorilla_encode(b, buf, max);
+  CHECK(len > 0 && len <= max);
+  CHECK(gorilla_is_batch(buf, len));
+  memset(&out, 0xAB, sizeof(out));
+  CHECK(gorilla_decode(buf, len, &out) == 0);
+  CHECK(out.columns == b->columns && out.rows == b->rows);
+  CHECK(memcmp(out.name_hashes, b->name_hashes,
+               b->columns * sizeof(b->name_hashes[0])) == 0);
+  for (size_t row = 0; row < b->rows; ++row) {
+    CHECK(out.timestamps_ms[row] == b->timestamps_ms[row]);
+    for (size_t c = 0; c < b->columns; ++c) {
+      CHECK(memcmp(&out.values[row][c], &b->values[row][c],
+                   sizeof(double)) == 0);
+      CHECK(out.qualities[row][c] == b->qualities[row][c]);
+    }
+  }
+  // The last byte holds at least one bit, so losing it must be detected
+  // rather than decoded into garbage
+  CHECK(gorilla_decode(buf, len - 1, &out) != 0);
+  CHECK(gorilla_decode(buf, GORILLA_HEADER_LEN - 1, &out) != 0);
+  // Too small an output buffer fails instead of overflowing
+  CHECK(gorilla_encode(b, buf, GORILLA_HEADER_LEN + b->columns * 4 + 1) == 0);
+  return 0;
+}
+
+static void add_row(struct GorillaBatch *b, int64_t ts_ms, size_t i,
+                    bool skip_humidity, enum ReadingQuality temp_quality) {
+  struct ReadingRecord r;
+  readings_reset(&r);
+  readings_add(&r, 0, 21.5 + 0.1 * (i % 7), ts_ms, temp_quality);
+  if (!skip_humidity)
+    readings_add(&r, 1, 55 + (i / 10) % 3, ts_ms, READING_GOOD);
+  readings_add(&r, 2, 1013.25 - 0.01 * i, ts_ms, READING_GOOD);
+  gorilla_batch_append(b, &info, &r);
+}
+
+static int test_samples() {
+  CHECK(gorilla_batch_init(&in, &info) == 0);
+  CHECK(in.name_hashes[0] == sdp_fnv1a32("temp_celsius"));
+  for (size_t i = 0; i < 60; ++i)
+    add_row(&in, 1700000000000 + i * 1000 + (i % 5 == 0 ? 3 : 0), i,
+            i % 13 == 0, i >= 20 && i < 25 ? READING_STALE : READING_GOOD);
+  // A missing cell is NaN and READING_BAD
+  CHECK(isnan(in.values[0][1]) && in.qualities[0][1] == READING_BAD);
+  // Values are rounded to their metric's decimals
+  CHECK(in.values[1][0] == 21.6);
+  return check_round_trip(&in);
+}
+
+static int test_single_row() {
+  CHECK(gorilla_batch_init(&in, &info) == 0);
+  add_row(&in, 1700000000000, 0, false, READING_GOOD);
+  return check_round_trip(&in);
+}
+
+static int test_max_rows() {
+  CHECK(gorilla_batch_init(&in, &info) == 0);
+  // Deltas whose delta-of-deltas hit every width, with both signs
+  static const int64_t deltas_ms[] = {1000, 1000, 1030, 1000,   1200,
+                                      1000, 2000, 1000, 100000, 1000};
+  const size_t delta_count = sizeof(deltas_ms) / sizeof(deltas_ms[0]);
+  int64_t ts_ms = 1700000000000;
+  for (size_t i = 0; i < GORILLA_MAX_ROWS; ++i) {
+    ts_ms += deltas_ms[i % delta_count];
+    add_row(&in, ts_ms, i * 31, i % 2 == 0, (enum ReadingQuality)(i % 3));
+  }
+  struct ReadingRecord r;
+  readings_reset(&r);
+  CHECK(gorilla_batch_append(&in, &info, &r) == -1);
+  return check_round_trip(&in);
+}
+
+static int test_garbage() {
+  const char json[] = "[{\"temp_celsius\": 21.5}]";
+  CHECK(!gorilla_is_batch((const uint8_t *)json, sizeof(json) - 1));
+  CHECK(gorilla_decode((const uint8_t *)json, sizeof(json) - 1, &out) != 0);
+  return 0;
+}
+
+int main() {
+  int failed = 0;
+  failed += test_samples();
+  failed += test_single_row();
+  failed += test_max_rows();
+  failed += test_garbage();
+  if (failed > 0) {
+    fprintf(stderr, "%d test(s) failed\n", failed);
+    return EXIT_FAILURE;
+  }
+  printf("All tests passed\n");
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,218 @@
+#include "../archive.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Rows per chunk of a merged file; larger chunks compress better
+#define MERGE_CHUNK_ROWS 4096
+
+enum Command { CMD_CSV, CMD_NDJSON, CMD_MERGE };
+
+struct Options {
+  enum Command command;
+  const char *index;
+  const char *output;
+};
+
+static void print_usage(const char *binary_name) {
+  printf("Usage: %s COMMAND [OPTION] FILE...\n\n", binary_name);
+  printf("Commands:\n"
+         "  csv                 Print the rows as CSV\n"
+         "  ndjson              Print the rows as an Elasticsearch _bulk "
+         "body\n"
+         "  merge               Merge the files into one, in the given "
+         "order\n\n"
+         "Options:\n"
+         "  -i, --index=NAME    Index of the _bulk actions (ndjson)\n"
+         "  -o, --output=PATH   File to create (merge)\n"
+         "  -h, --help          Display this help and exit\n");
+}
+
+static void print_iso8601(int64_t timestamp_ms) {
+  const time_t t = timestamp_ms / 1000;
+  struct tm tm;
+  char buf[sizeof("1970-01-01T00:00:00")];
+  gmtime_r(&t, &tm);
+  strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%S", &tm);
+  printf("%s.%03dZ", buf, (int)(timestamp_ms % 1000));
+}
+
+static bool is_present(const struct ArchiveChunk *c, size_t m, size_t row) {
+  const uint8_t q = c->qualities[m * c->capacity + row];
+  return q != ARCHIVE_MISSING && q != READING_BAD &&
+         isfinite(c->values[m * c->capacity + row]);
+}
+
+static void print_csv_header(const struct ArchiveHeader *hdr) {
+  printf("timestamp");
+  for (size_t m = 0; m < hdr->metric_count; ++m)
+    printf(",%s", hdr->metrics[m].name);
+  printf("\n");
+}
+
+static void print_chunk(const struct Options *opts,
+                        const struct ArchiveHeader *hdr,
+                        const struct ArchiveChunk *c) {
+  for (size_t row = 0; row < c->rows; ++row) {
+    if (opts->command == CMD_NDJSON) {
+      if (opts->index != NULL)
+        printf("{\"index\":{\"_index\":\"%s\"}}\n", opts->index);
+      else
+        printf("{\"index\":{}}\n");
+      printf("{\"@timestamp\":\"");
+      print_iso8601(c->timestamps_ms[row]);
+      printf("\"");
+    } else {
+      print_iso8601(c->timestamps_ms[row]);
+    }
+    for (size_t m = 0; m < hdr->metric_count; ++m) {
+      const bool present = is_present(c, m, row);
+      if (opts->command == CMD_NDJSON && !present)
+        continue;
+      if (opts->command == CMD_NDJSON)
+        printf(",\"%s\":", hdr->metrics[m].name);
+      else
+        printf(",");
+      if (present)
+        printf("%.*f", hdr->metrics[m].decimals,
+               c->values[m * c->capacity + row]);
+    }
+    printf(opts->command == CMD_NDJSON ? "}\n" : "\n");
+  }
+}
+
+static bool same_metrics(const struct ArchiveHeader *a,
+                         const struct ArchiveHeader *b) {
+  if (a->metric_count != b->metric_count)
+    return false;
+  for (size_t m = 0; m < a->metric_count; ++m)
+    if (strcmp(a->metrics[m].name, b->metrics[m].name) != 0)
+      return false;
+  return true;
+}
+
+int main(int argc, char **argv) {
+  static struct option long_options[] = {
+      {"index", required_argument, 0, 'i'},
+      {"output", required_argument, 0, 'o'},
+      {"help", no_argument, 0, 'h'},
+      {0, 0, 0, 0}};
+  struct Options opts = {0};
+  int opt;
+  while ((opt = getopt_long(argc, argv, "i:o:h", long_options, NULL)) != -1) {
+    if (opt == 'i') {
+      opts.index = optarg;
+    } else if (opt == 'o') {
+      opts.output = optarg;
+    } else {
+      print_usage(argv[0]);
+      return opt == 'h' ? 0 : 1;
+    }
+  }
+  if (argc - optind < 2) {
+    print_usage(argv[0]);
+    return 1;
+  }
+  const char *command = argv[optind++];
+  if (strcmp(command, "csv") == 0) {
+    opts.command = CMD_CSV;
+  } else if (strcmp(command, "ndjson") == 0) {
+    opts.command = CMD_NDJSON;
+  } else if (strcmp(command, "merge") == 0 && opts.output != NULL) {
+    opts.command = CMD_MERGE;
+  } else {
+    print_usage(argv[0]);
+    return 1;
+  }
+
+  int ret = 0;
+  int out_fd = -1;
+  struct ArchiveHeader first;
+  const char *first_path = NULL;
+  struct ArchiveChunk merged = {0};
+  for (int i = optind; i < argc; ++i) {
+    struct ArchiveHeader hdr;
+    struct ArchiveChunk chunk = {0};
+    FILE *f = fopen(argv[i], "rb");
+    if (f == NULL) {
+      fprintf(stderr, "fopen(%s) failed: %s\n", argv[i], strerror(errno));
+      ret = 1;
+      continue;
+    }
+    if (archive_read_header(f, &hdr) != 0) {
+      fprintf(stderr, "%s is not an archive of version %d\n", argv[i],
+              ARCHIVE_VERSION);
+      fclose(f);
+      ret = 1;
+      continue;
+    }
+    if (first_path == NULL) {
+      first = hdr;
+      first_path = argv[i];
+      if (opts.command == CMD_CSV)
+        print_csv_header(&hdr);
+      if (opts.command == CMD_MERGE) {
+        out_fd = open(opts.output, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+                      0644);
+        if (out_fd < 0 || archive_write_header(out_fd, &hdr) != 0 ||
+            archive_chunk_init(&merged, hdr.metric_count, MERGE_CHUNK_ROWS) !=
+                0) {
+          fprintf(stderr, "Creating %s failed: %s\n", opts.output,
+                  strerror(errno));
+          fclose(f);
+          return 1;
+        }
+      }
+    } else if (!same_metrics(&first, &hdr)) {
+      // Columns are positional, so rows of other metrics can't be mixed in
+      fprintf(stderr, "%s has other metrics than %s, skipped\n", argv[i],
+              first_path);
+      fclose(f);
+      ret = 1;
+      continue;
+    }
+
+    int rc;
+    chunk.metric_count = hdr.metric_count;
+    while ((rc = archive_read_chunk(f, &chunk)) == 1) {
+      if (opts.command != CMD_MERGE) {
+        print_chunk(&opts, &hdr, &chunk);
+        continue;
+      }
+      for (size_t row = 0; row < chunk.rows; ++row) {
+        archive_chunk_copy_row(&merged, &chunk, row);
+        if (merged.rows == merged.capacity &&
+            archive_write_chunk(out_fd, &merged) != 0) {
+          fprintf(stderr, "Writing %s failed: %s\n", opts.output,
+                  strerror(errno));
+          return 1;
+        }
+      }
+    }
+    if (rc < 0) {
+      // Expected for the last chunk of a file whose writer died
+      fprintf(stderr, "%s: stopped at a truncated or corrupt chunk\n",
+              argv[i]);
+    }
+    archive_chunk_destroy(&chunk);
+    fclose(f);
+  }
+  if (out_fd >= 0) {
+    if (archive_write_chunk(out_fd, &merged) != 0 || fsync(out_fd) != 0) {
+      fprintf(stderr, "Writing %s failed: %s\n", opts.output,
+              strerror(errno));
+      ret = 1;
+    }
+    close(out_fd);
+    archive_chunk_destroy(&merged);
+  }
+  return ret;
+}
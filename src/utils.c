@@ -7,6 +7,7 @@
 #include <linux/limits.h>
 #include <string.h>
 #include <syslog.h>
+#include <time.h>
 #include <unistd.h>
 
 int load_values_from_json(const char *settings_path) {
@@ -30,6 +31,31 @@ int load_values_from_json(const char *settings_path) {
     retval = -2;
     goto err_invalid_config;
   }
+
+  // "event_loop" is optional, the sleep-based loop is the default
+  if (json_object_object_get_ex(root, "event_loop", &json_ele)) {
+    const char *event_loop = json_object_get_string(json_ele);
+    if (event_loop != NULL && strcmp(event_loop, "reactor") == 0) {
+      gv_reactor_enabled = true;
+    } else if (event_loop == NULL || strcmp(event_loop, "sleep") != 0) {
+      SYSLOG_ERR("Invalid event_loop [%s], valid values are sleep/reactor",
+                 event_loop);
+      retval = -3;
+      goto err_invalid_config;
+    }
+  }
+  // "device_cache" is optional, bus access is serialized but never cached by
+  // default
+  json_object *root_device_cache;
+  if (json_object_object_get_ex(root, "device_cache", &root_device_cache)) {
+    if (json_object_object_get_ex(root_device_cache, "ttl_ms", &json_ele))
+      gv_device_cache_ttl_ms = json_object_get_uint64(json_ele);
+    // The string is owned by root, which lives as long as the process
+    if (json_object_object_get_ex(root_device_cache, "dir", &json_ele) &&
+        json_object_get_string(json_ele) != NULL)
+      gv_device_cache_dir = json_object_get_string(json_ele);
+  }
+
   // Handle over the root to a global variable, it may be neeeded by callback
   // functions
   gv_config_root = root;
@@ -55,5 +81,22 @@ int interruptible_sleep_us(uint64_t us) {
       return 1;
     }
   }
+  // Intervals such as 1500 ms must not be truncated to whole seconds
+  usleep(us % (1000 * 1000));
   return 0;
 }
+
+int sleep_us(uint64_t us) {
+  if (us == 0)
+    return 0;
+  const struct timespec ts = {.tv_sec = us / (1000 * 1000),
+                              .tv_nsec = us % (1000 * 1000) * 1000};
+  return clock_nanosleep(CLOCK_MONOTONIC, 0, &ts, NULL) == 0 ? 0 : -1;
+}
+
+int sleep_until_us(uint64_t deadline_us) {
+  const struct timespec ts = {.tv_sec = deadline_us / (1000 * 1000),
+                              .tv_nsec = deadline_us % (1000 * 1000) * 1000};
+  return clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == 0 ? 0
+                                                                         : -1;
+}
@@ -1,7 +1,9 @@
 #ifndef UTILS_H
 #define UTILS_H
 
+#include <endian.h>
 #include <stdint.h>
+#include <string.h>
 #include <syslog.h>
 
 #define SYSLOG_ERR(format, ...)                                                \
@@ -16,4 +18,77 @@ int load_values_from_json(const char *settings_path);
  */
 int interruptible_sleep_us(uint64_t us);
 
+/**
+ * @brief Sleep for us microseconds. Unlike interruptible_sleep_us(), a signal
+ * (e.g., the one that stops sdp) cuts the sleep short right away, so that
+ * shutdown never waits out a simulated latency or an injected delay.
+ * @return 0 if the full time was slept, -1 if a signal cut it short
+ */
+int sleep_us(uint64_t us);
+
+/**
+ * @brief Same as sleep_us(), until the CLOCK_MONOTONIC time deadline_us
+ */
+int sleep_until_us(uint64_t deadline_us);
+
+/*
+ * Unaligned little- and big-endian loads and stores, for the binary formats
+ * written to files and the network (archive.h, device_trace.h, mcast.h)
+ */
+
+static inline void put_le16(uint8_t *p, uint16_t v) {
+  v = htole16(v);
+  memcpy(p, &v, sizeof(v));
+}
+
+static inline void put_le32(uint8_t *p, uint32_t v) {
+  v = htole32(v);
+  memcpy(p, &v, sizeof(v));
+}
+
+static inline void put_le64(uint8_t *p, uint64_t v) {
+  v = htole64(v);
+  memcpy(p, &v, sizeof(v));
+}
+
+static inline uint16_t get_le16(const uint8_t *p) {
+  uint16_t v;
+  memcpy(&v, p, sizeof(v));
+  return le16toh(v);
+}
+
+static inline uint32_t get_le32(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return le32toh(v);
+}
+
+static inline uint64_t get_le64(const uint8_t *p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return le64toh(v);
+}
+
+static inline void put_be32(uint8_t *p, uint32_t v) {
+  v = htobe32(v);
+  memcpy(p, &v, sizeof(v));
+}
+
+static inline void put_be64(uint8_t *p, uint64_t v) {
+  v = htobe64(v);
+  memcpy(p, &v, sizeof(v));
+}
+
+static inline uint32_t get_be32(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return be32toh(v);
+}
+
+static inline uint64_t get_be64(const uint8_t *p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return be64toh(v);
+}
+
 #endif // UTILS_H